@@ -66,6 +66,110 @@ int ldb_schema_attribute_fill_with_syntax(struct ldb_context *ldb,
 	return 0;
 }
 
+/*
+ * Build a new hash of the attribute handling table and swap it in,
+ * replacing the old one.  On failure the old hash is freed, so that
+ * lookups fall back to a binary search of the table.
+ */
+static void ldb_schema_attribute_hash_rebuild(struct ldb_context *ldb)
+{
+	struct ldb_schema *schema = &ldb->schema;
+	struct ldb_schema_attribute_hash *h = NULL;
+	unsigned int size = 16;
+	unsigned int i;
+
+	while (size < schema->num_attributes * 2) {
+		size *= 2;
+	}
+
+	h = talloc_zero(ldb, struct ldb_schema_attribute_hash);
+	if (h == NULL) {
+		goto failed;
+	}
+	h->size = size;
+	h->slots = talloc_zero_array(h,
+				     struct ldb_schema_attribute_hash_slot,
+				     size);
+	if (h->slots == NULL) {
+		goto failed;
+	}
+
+	for (i = 0; i < schema->num_attributes; i++) {
+		uint32_t hash;
+		unsigned int s;
+
+		if (!ldb_schema_attribute_name_hash(schema->attributes[i].name,
+						    &hash)) {
+			goto failed;
+		}
+		s = hash & (size - 1);
+		while (h->slots[s].idx != 0) {
+			s = (s + 1) & (size - 1);
+		}
+		h->slots[s].hash = hash;
+		h->slots[s].idx = i + 1;
+	}
+
+	/* as handlers are sorted, '*' must be the first if present */
+	if (schema->num_attributes > 0 &&
+	    strcmp(schema->attributes[0].name, "*") == 0) {
+		h->default_idx = 1;
+	}
+
+	TALLOC_FREE(schema->attribute_hash);
+	schema->attribute_hash = h;
+	return;
+
+failed:
+	TALLOC_FREE(h);
+	TALLOC_FREE(schema->attribute_hash);
+}
+
+/*
+ * Update the hash after a new attribute has been inserted at position
+ * i of the attribute handling table, shifting the later ones along.
+ * This avoids reallocating the hash for every attribute added.
+ */
+static void ldb_schema_attribute_hash_insert(struct ldb_context *ldb,
+					     unsigned int i)
+{
+	struct ldb_schema *schema = &ldb->schema;
+	struct ldb_schema_attribute_hash *h = schema->attribute_hash;
+	uint32_t hash;
+	unsigned int s;
+
+	if (h == NULL || schema->num_attributes * 2 > h->size) {
+		ldb_schema_attribute_hash_rebuild(ldb);
+		return;
+	}
+
+	if (!ldb_schema_attribute_name_hash(schema->attributes[i].name,
+					    &hash)) {
+		TALLOC_FREE(schema->attribute_hash);
+		return;
+	}
+
+	for (s = 0; s < h->size; s++) {
+		if (h->slots[s].idx > i) {
+			h->slots[s].idx++;
+		}
+	}
+	if (h->default_idx > i) {
+		h->default_idx++;
+	}
+
+	s = hash & (h->size - 1);
+	while (h->slots[s].idx != 0) {
+		s = (s + 1) & (h->size - 1);
+	}
+	h->slots[s].hash = hash;
+	h->slots[s].idx = i + 1;
+
+	if (i == 0 && strcmp(schema->attributes[0].name, "*") == 0) {
+		h->default_idx = 1;
+	}
+}
+
 /*
   add a attribute to the ldb_schema
 
@@ -86,6 +190,7 @@ int ldb_schema_attribute_add_with_syntax(struct ldb_context *ldb,
 {
 	unsigned int i, n;
 	struct ldb_schema_attribute *a;
+	bool replaced = false;
 
 	if (!syntax) {
 		return LDB_ERR_OPERATIONS_ERROR;
@@ -113,6 +218,7 @@ int ldb_schema_attribute_add_with_syntax(struct ldb_context *ldb,
 			}
 			/* To cancel out increment below */
 			ldb->schema.num_attributes--;
+			replaced = true;
 			break;
 		} else if (cmp < 0) {
 			memmove(a+i+1, a+i, sizeof(*a) * (ldb->schema.num_attributes-i));
@@ -128,11 +234,21 @@ int ldb_schema_attribute_add_with_syntax(struct ldb_context *ldb,
 	if (a[i].flags & LDB_ATTR_FLAG_ALLOCATED) {
 		a[i].name = talloc_strdup(a, a[i].name);
 		if (a[i].name == NULL) {
+			TALLOC_FREE(ldb->schema.attribute_hash);
 			ldb_oom(ldb);
 			return -1;
 		}
 	}
 
+	/*
+	 * The hash only records the position of each name, so replacing
+	 * the handlers of an existing attribute leaves it valid.
+	 */
+	if (!replaced) {
+		ldb_schema_attribute_hash_insert(ldb, i);
+	}
+	ldb_dn_casefold_cache_flush(ldb);
+
 	return 0;
 }
 
@@ -150,6 +266,44 @@ static const struct ldb_schema_attribute ldb_attribute_default = {
 	.syntax	= &ldb_syntax_default
 };
 
+/*
+ * Look up an attribute in the hash of the attribute handling table
+ *
+ * @return	The schema attribute, the '*' attribute or
+ *		ldb_attribute_default if not found, or NULL if name
+ *		could not be hashed.
+ */
+static const struct ldb_schema_attribute *ldb_schema_attribute_by_hash(
+	struct ldb_context *ldb,
+	const struct ldb_schema_attribute_hash *h,
+	const char *name)
+{
+	const struct ldb_schema_attribute *attributes = ldb->schema.attributes;
+	uint32_t hash;
+	unsigned int s;
+
+	if (!ldb_schema_attribute_name_hash(name, &hash)) {
+		return NULL;
+	}
+
+	for (s = hash & (h->size - 1);
+	     h->slots[s].idx != 0;
+	     s = (s + 1) & (h->size - 1)) {
+		const struct ldb_schema_attribute *a =
+			&attributes[h->slots[s].idx - 1];
+
+		if (h->slots[s].hash == hash &&
+		    ldb_attr_cmp(name, a->name) == 0) {
+			return a;
+		}
+	}
+
+	if (h->default_idx != 0) {
+		return &attributes[h->default_idx - 1];
+	}
+	return &ldb_attribute_default;
+}
+
 /*
  * Return the attribute handlers for a given attribute
  *
@@ -173,6 +327,16 @@ static const struct ldb_schema_attribute *ldb_schema_attribute_by_name_internal(
 		return def;
 	}
 
+	if (ldb->schema.attribute_hash != NULL) {
+		const struct ldb_schema_attribute *a =
+			ldb_schema_attribute_by_hash(ldb,
+						     ldb->schema.attribute_hash,
+						     name);
+		if (a != NULL) {
+			return a;
+		}
+	}
+
 	/* as handlers are sorted, '*' must be the first if present */
 	if (strcmp(ldb->schema.attributes[0].name, "*") == 0) {
 		def = &ldb->schema.attributes[0];
@@ -248,6 +412,9 @@ void ldb_schema_attribute_remove(struct ldb_context *ldb, const char *name)
 	}
 
 	ldb->schema.num_attributes--;
+
+	ldb_schema_attribute_hash_rebuild(ldb);
+	ldb_dn_casefold_cache_flush(ldb);
 }
 
 /*
@@ -258,6 +425,7 @@ void ldb_schema_attribute_remove(struct ldb_context *ldb, const char *name)
 void ldb_schema_attribute_remove_flagged(struct ldb_context *ldb, unsigned int flag)
 {
 	ptrdiff_t i;
+	bool removed = false;
 
 	for (i = 0; i < ldb->schema.num_attributes;) {
 		const struct ldb_schema_attribute *a
@@ -280,6 +448,12 @@ void ldb_schema_attribute_remove_flagged(struct ldb_context *ldb, unsigned int f
 		}
 
 		ldb->schema.num_attributes--;
+		removed = true;
+	}
+
+	if (removed) {
+		ldb_schema_attribute_hash_rebuild(ldb);
+		ldb_dn_casefold_cache_flush(ldb);
 	}
 }
 
@@ -382,6 +556,8 @@ void ldb_schema_attribute_set_override_handler(struct ldb_context *ldb,
 {
 	ldb->schema.attribute_handler_override_private = private_data;
 	ldb->schema.attribute_handler_override = override;
+	/* a schema reload may keep the same override function */
+	ldb_dn_casefold_cache_flush(ldb);
 }
 
 /*
@@ -432,6 +432,24 @@ char *ldb_control_to_string(TALLOC_CTX *mem_ctx, const struct ldb_control *contr
 		return res;
 	}
 
+	if (strcmp(control->oid, LDB_CONTROL_INDEX_PLAN_OID) == 0) {
+		struct ldb_index_plan_control *rep_control =
+			talloc_get_type(control->data,
+					struct ldb_index_plan_control);
+
+		if (rep_control == NULL || rep_control->plan == NULL) {
+			res = talloc_asprintf(mem_ctx, "%s:%d",
+					      LDB_CONTROL_INDEX_PLAN_NAME,
+					      control->critical);
+		} else {
+			res = talloc_asprintf(mem_ctx, "%s:%d:%s",
+					      LDB_CONTROL_INDEX_PLAN_NAME,
+					      control->critical,
+					      rep_control->plan);
+		}
+		return res;
+	}
+
 	/*
 	 * From here we don't know the control
 	 */
@@ -1178,6 +1196,28 @@ struct ldb_control *ldb_parse_control_from_string(struct ldb_context *ldb, TALLO
 		return ctrl;
 	}
 
+	if (LDB_CONTROL_CMP(control_strings, LDB_CONTROL_INDEX_PLAN_NAME) == 0) {
+		const char *p;
+		int crit, ret;
+
+		p = &(control_strings[sizeof(LDB_CONTROL_INDEX_PLAN_NAME)]);
+		ret = sscanf(p, "%d", &crit);
+		if ((ret != 1) || (crit < 0) || (crit > 1)) {
+			ldb_set_errstring(ldb,
+					  "invalid index_plan control syntax\n"
+					  " syntax: crit(b)\n"
+					  "   note: b = boolean");
+			talloc_free(ctrl);
+			return NULL;
+		}
+
+		ctrl->oid = LDB_CONTROL_INDEX_PLAN_OID;
+		ctrl->critical = crit;
+		ctrl->data = NULL;
+
+		return ctrl;
+	}
+
 	if (strncmp(control_strings, "local_oid:", 10) == 0) {
 		const char *p;
 		int crit = 0, ret = 0;
@@ -919,6 +919,129 @@ char *ldb_dn_alloc_linearized(TALLOC_CTX *mem_ctx, struct ldb_dn *dn)
 	return talloc_strdup(mem_ctx, ldb_dn_get_linearized(dn));
 }
 
+/*
+ * The parent components of the DNs returned by a search are nearly
+ * always the same handful of values (DC=example,DC=com, CN=Users, ...),
+ * so we remember how recently seen component values canonicalised.
+ *
+ * The cache is direct-mapped and keyed on the attribute name, the
+ * schema attribute and syntax used and the raw value.  As a syntax
+ * handler may depend on more of the schema than that, the cache is
+ * also flushed by every change to the schema.  The result is still
+ * copied into each DN, as the rest of this file owns and frees the
+ * cf_ fields of a component individually.
+ *
+ * The cache is not locked, so it is suspended while worker threads
+ * casefold DNs on the same LDB context.
+ */
+#define LDB_DN_CASEFOLD_CACHE_SIZE 1024
+
+struct ldb_dn_casefold_entry {
+	const struct ldb_schema_attribute *a;
+	const struct ldb_schema_syntax *syntax;
+	ldb_attr_handler_t canonicalise_fn;
+	char *cf_name;
+	struct ldb_val value;
+	struct ldb_val cf_value;
+};
+
+struct ldb_dn_casefold_cache {
+	struct ldb_dn_casefold_entry *entries[LDB_DN_CASEFOLD_CACHE_SIZE];
+};
+
+static unsigned int ldb_dn_casefold_cache_slot(const char *cf_name,
+					       const struct ldb_val *value)
+{
+	uint32_t h = 2166136261U;
+	size_t i;
+
+	for (i = 0; cf_name[i] != '\0'; i++) {
+		h = (h ^ (uint8_t)cf_name[i]) * 16777619U;
+	}
+	h = (h ^ '=') * 16777619U;
+	for (i = 0; i < value->length; i++) {
+		h = (h ^ value->data[i]) * 16777619U;
+	}
+	return h % LDB_DN_CASEFOLD_CACHE_SIZE;
+}
+
+static int ldb_dn_canonicalise_component(struct ldb_dn *dn,
+					 const struct ldb_schema_attribute *a,
+					 unsigned int i)
+{
+	struct ldb_context *ldb = dn->ldb;
+	struct ldb_dn_component *c = &dn->components[i];
+	struct ldb_dn_casefold_entry *e = NULL;
+	unsigned int slot;
+	int ret;
+
+	if (ldb->dn_casefold_cache_suspended > 0) {
+		return a->syntax->canonicalise_fn(ldb, dn->components,
+						  &c->value, &c->cf_value);
+	}
+
+	slot = ldb_dn_casefold_cache_slot(c->cf_name, &c->value);
+
+	if (ldb->dn_casefold_cache != NULL) {
+		e = ldb->dn_casefold_cache->entries[slot];
+	}
+	if (e != NULL &&
+	    e->a == a &&
+	    e->syntax == a->syntax &&
+	    e->canonicalise_fn == a->syntax->canonicalise_fn &&
+	    strcmp(e->cf_name, c->cf_name) == 0 &&
+	    ldb_val_equal_exact(&e->value, &c->value)) {
+		c->cf_value = ldb_val_dup(dn->components, &e->cf_value);
+		if (c->cf_value.data == NULL) {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+		return 0;
+	}
+
+	ret = a->syntax->canonicalise_fn(ldb, dn->components,
+					 &c->value, &c->cf_value);
+	if (ret != 0) {
+		return ret;
+	}
+
+	/*
+	 * The leaf RDN is usually unique, caching it would only push
+	 * out the shared parents.
+	 */
+	if (i == 0) {
+		return 0;
+	}
+
+	if (ldb->dn_casefold_cache == NULL) {
+		ldb->dn_casefold_cache =
+			talloc_zero(ldb, struct ldb_dn_casefold_cache);
+		if (ldb->dn_casefold_cache == NULL) {
+			return 0;
+		}
+	}
+
+	TALLOC_FREE(ldb->dn_casefold_cache->entries[slot]);
+	e = talloc(ldb->dn_casefold_cache, struct ldb_dn_casefold_entry);
+	if (e == NULL) {
+		return 0;
+	}
+	e->a = a;
+	e->syntax = a->syntax;
+	e->canonicalise_fn = a->syntax->canonicalise_fn;
+	e->cf_name = talloc_strdup(e, c->cf_name);
+	e->value = ldb_val_dup(e, &c->value);
+	e->cf_value = ldb_val_dup(e, &c->cf_value);
+	if (e->cf_name == NULL ||
+	    e->value.data == NULL ||
+	    e->cf_value.data == NULL) {
+		TALLOC_FREE(e);
+		return 0;
+	}
+	ldb->dn_casefold_cache->entries[slot] = e;
+
+	return 0;
+}
+
 /*
   casefold a dn. We need to casefold the attribute names, and canonicalize
   attribute values of case insensitive attributes.
@@ -950,9 +1073,7 @@ static bool ldb_dn_casefold_internal(struct ldb_dn *dn)
 		a = ldb_schema_attribute_by_name(dn->ldb,
 						 dn->components[i].cf_name);
 
-		ret = a->syntax->canonicalise_fn(dn->ldb, dn->components,
-						 &(dn->components[i].value),
-						 &(dn->components[i].cf_value));
+		ret = ldb_dn_canonicalise_component(dn, a, i);
 		if (ret != 0) {
 			goto failed;
 		}
@@ -507,6 +507,263 @@ static int ldb_pack_data_v2(struct ldb_context *ldb,
 	return 0;
 }
 
+/*
+ * The attribute directory of a LDB_PACKING_FORMAT_V3 record has one
+ * entry per attribute: the hash of the name (see ldb_pack_attr_hash()),
+ * the offset of the attribute from the start of the record, and its
+ * number of values.  The entries are sorted by hash then offset, so
+ * an attribute can be found by binary search, and the first attribute
+ * of a name is the first entry with that name.
+ */
+#define V3_DIR_ENTRY_LEN (U32_LEN * 3)
+
+static int ldb_pack_dir_entry_cmp(const void *a, const void *b)
+{
+	uint32_t ha = PULL_LE_U32(a, 0);
+	uint32_t hb = PULL_LE_U32(b, 0);
+
+	if (ha != hb) {
+		return NUMERIC_CMP(ha, hb);
+	}
+	return NUMERIC_CMP(PULL_LE_U32(a, U32_LEN),
+			   PULL_LE_U32(b, U32_LEN));
+}
+
+/*
+ * The V3 format is the V2 format with a directory of the attributes
+ * after the DNs, and with the values of each attribute stored
+ * immediately after its name and value lengths, rather than all
+ * together at the end.  One attribute can then be read without
+ * looking at any other.
+ */
+static int ldb_pack_data_v3(struct ldb_context *ldb,
+			    const struct ldb_message *message,
+			    struct ldb_val *data)
+{
+	unsigned int i, j, real_elements=0;
+	size_t size, dn_len, dn_canon_len, attr_len, value_len;
+	const char *dn, *dn_canon;
+	uint8_t *p, *dir;
+	size_t len;
+	size_t max_val_len;
+	uint8_t val_len_width;
+
+	/* version, num elements, dn len, canon dn len */
+	size = U32_LEN * 4;
+
+	dn = ldb_dn_get_linearized(message->dn);
+	if (dn == NULL) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	dn_len = strlen(dn) + NULL_PAD_BYTE_LEN;
+	if (size + dn_len < size) {
+		errno = ENOMEM;
+		return -1;
+	}
+	size += dn_len;
+
+	if (ldb_dn_is_special(message->dn)) {
+		dn_canon_len = NULL_PAD_BYTE_LEN;
+		dn_canon = discard_const_p(char, "\0");
+	} else {
+		dn_canon = ldb_dn_canonical_string(message->dn, message->dn);
+		if (dn_canon == NULL) {
+			errno = ENOMEM;
+			return -1;
+		}
+
+		dn_canon_len = strlen(dn_canon) + NULL_PAD_BYTE_LEN;
+		if (size + dn_canon_len < size) {
+			errno = ENOMEM;
+			return -1;
+		}
+	}
+	size += dn_canon_len;
+
+	/* Add the size required by each element */
+	for (i=0;i<message->num_elements;i++) {
+		if (attribute_storable_values(&message->elements[i]) == 0) {
+			continue;
+		}
+
+		real_elements++;
+
+		/*
+		 * Add length of element name + 21 for:
+		 * 12 for the directory entry
+		 * 4 for element name length field
+		 * 1 for null terminator
+		 * 4 for number of values field
+		 */
+		attr_len = strlen(message->elements[i].name);
+		if (size + attr_len + V3_DIR_ENTRY_LEN + U32_LEN * 2 +
+		    NULL_PAD_BYTE_LEN < size) {
+			errno = ENOMEM;
+			return -1;
+		}
+		size += attr_len + V3_DIR_ENTRY_LEN + U32_LEN * 2 +
+			NULL_PAD_BYTE_LEN;
+
+		max_val_len = 0;
+		for (j=0;j<message->elements[i].num_values;j++) {
+			value_len = message->elements[i].values[j].length;
+			if (value_len > max_val_len) {
+				max_val_len = value_len;
+			}
+
+			if (size + value_len + NULL_PAD_BYTE_LEN < size) {
+				errno = ENOMEM;
+				return -1;
+			}
+			size += value_len + NULL_PAD_BYTE_LEN;
+		}
+
+		if (max_val_len <= UCHAR_MAX) {
+			val_len_width = U8_LEN;
+		} else if (max_val_len <= USHRT_MAX) {
+			val_len_width = U16_LEN;
+		} else if (max_val_len <= UINT_MAX) {
+		        val_len_width = U32_LEN;
+		} else {
+			errno = EMSGSIZE;
+			return -1;
+		}
+
+		/* Total size required for val lengths (re-using variable) */
+		max_val_len = (val_len_width*message->elements[i].num_values);
+
+		/* Add one for storing the width */
+		max_val_len += U8_LEN;
+		if (size + max_val_len < size) {
+			errno = ENOMEM;
+			return -1;
+		}
+		size += max_val_len;
+	}
+
+	/* The directory holds offsets into the record */
+	if (size > UINT32_MAX) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+
+	/* Allocate */
+	data->data = talloc_array(ldb, uint8_t, size);
+	if (!data->data) {
+		errno = ENOMEM;
+		return -1;
+	}
+	data->length = size;
+
+	/* Packing format version and number of element */
+	p = data->data;
+	PUSH_LE_U32(p, 0, LDB_PACKING_FORMAT_V3);
+	p += U32_LEN;
+	PUSH_LE_U32(p, 0, real_elements);
+	p += U32_LEN;
+
+	/* Pack DN and Canonicalized DN */
+	PUSH_LE_U32(p, 0, dn_len-NULL_PAD_BYTE_LEN);
+	p += U32_LEN;
+	memcpy(p, dn, dn_len);
+	p += dn_len;
+
+	PUSH_LE_U32(p, 0, dn_canon_len-NULL_PAD_BYTE_LEN);
+	p += U32_LEN;
+	memcpy(p, dn_canon, dn_canon_len);
+	p += dn_canon_len;
+
+	/* Leave room for the directory, filled in as we go */
+	dir = p;
+	p += V3_DIR_ENTRY_LEN * real_elements;
+
+	for (i=0;i<message->num_elements;i++) {
+		const struct ldb_message_element *el = &message->elements[i];
+
+		if (attribute_storable_values(el) == 0) {
+			continue;
+		}
+
+		len = strlen(el->name);
+
+		PUSH_LE_U32(dir, 0, ldb_pack_attr_hash(el->name, len));
+		PUSH_LE_U32(dir, U32_LEN, p - data->data);
+		PUSH_LE_U32(dir, U32_LEN * 2, el->num_values);
+		dir += V3_DIR_ENTRY_LEN;
+
+		/* Length of el name, and the name with a null terminator */
+		PUSH_LE_U32(p, 0, len);
+		p += U32_LEN;
+		memcpy(p, el->name, len+NULL_PAD_BYTE_LEN);
+		p += len + NULL_PAD_BYTE_LEN;
+
+		/* Num values */
+		PUSH_LE_U32(p, 0, el->num_values);
+		p += U32_LEN;
+
+		max_val_len = 0;
+		for (j=0;j<el->num_values;j++) {
+			value_len = el->values[j].length;
+			if (value_len > max_val_len) {
+				max_val_len = value_len;
+			}
+		}
+
+		if (max_val_len <= UCHAR_MAX) {
+			val_len_width = U8_LEN;
+		} else if (max_val_len <= USHRT_MAX) {
+			val_len_width = U16_LEN;
+		} else {
+			val_len_width = U32_LEN;
+		}
+
+		/* Pack the width, then each value's length */
+		*p = val_len_width & 0xFF;
+		p += U8_LEN;
+
+		if (val_len_width == U8_LEN) {
+			for (j=0;j<el->num_values;j++) {
+				PUSH_LE_U8(p, 0, el->values[j].length);
+				p += U8_LEN;
+			}
+		} else if (val_len_width == U16_LEN) {
+			for (j=0;j<el->num_values;j++) {
+				PUSH_LE_U16(p, 0, el->values[j].length);
+				p += U16_LEN;
+			}
+		} else {
+			for (j=0;j<el->num_values;j++) {
+				PUSH_LE_U32(p, 0, el->values[j].length);
+				p += U32_LEN;
+			}
+		}
+
+		/* Then the values, each with a null terminator */
+		for (j=0;j<el->num_values;j++) {
+			memcpy(p, el->values[j].data, el->values[j].length);
+			p[el->values[j].length] = 0;
+			p += el->values[j].length + NULL_PAD_BYTE_LEN;
+		}
+	}
+
+	/*
+	 * If we didn't end up at the end of the data here, something has
+	 * gone very wrong.
+	 */
+	if (p != data->data + size) {
+		errno = ENOMEM;
+		return -1;
+	}
+
+	/* The entries were written in offset order, now sort by hash */
+	dir -= V3_DIR_ENTRY_LEN * real_elements;
+	qsort(dir, real_elements, V3_DIR_ENTRY_LEN, ldb_pack_dir_entry_cmp);
+
+	return 0;
+}
+
 /*
   pack a ldb message into a linear buffer in a ldb_val
 
@@ -524,6 +781,8 @@ int ldb_pack_data(struct ldb_context *ldb,
 		return ldb_pack_data_v1(ldb, message, data);
 	} else if (pack_format_version == LDB_PACKING_FORMAT_V2) {
 		return ldb_pack_data_v2(ldb, message, data);
+	} else if (pack_format_version == LDB_PACKING_FORMAT_V3) {
+		return ldb_pack_data_v3(ldb, message, data);
 	} else {
 		errno = EINVAL;
 		return -1;
@@ -1045,6 +1304,249 @@ failed:
 	return -1;
 }
 
+/*
+ * Unpack a ldb message from a linear buffer in ldb_val
+ */
+static int ldb_unpack_data_flags_v3(struct ldb_context *ldb,
+				    const struct ldb_val *data,
+				    struct ldb_message *message,
+				    unsigned int flags)
+{
+	uint8_t *p, *end_p;
+	unsigned int i, j;
+	unsigned int nelem = 0;
+	size_t len;
+	struct ldb_val *ldb_val_single_array = NULL;
+	uint8_t val_len_width;
+
+	message->elements = NULL;
+
+	p = data->data;
+	end_p = p + data->length;
+
+	/* Skip first 4 bytes, format already read */
+	p += U32_LEN;
+
+	/* First fields are fixed: num_elements, DN length */
+	if (U32_LEN * 2 > end_p - p) {
+		errno = EIO;
+		goto failed;
+	}
+
+	message->num_elements = PULL_LE_U32(p, 0);
+	p += U32_LEN;
+
+	len = PULL_LE_U32(p, 0);
+	p += U32_LEN;
+
+	if (len + NULL_PAD_BYTE_LEN > end_p - p) {
+		errno = EIO;
+		goto failed;
+	}
+
+	if (flags & LDB_UNPACK_DATA_FLAG_NO_DN) {
+		message->dn = NULL;
+	} else {
+		struct ldb_val blob;
+		blob.data = discard_const_p(uint8_t, p);
+		blob.length = len;
+		message->dn = ldb_dn_from_ldb_val(message, ldb, &blob);
+		if (message->dn == NULL) {
+			errno = ENOMEM;
+			goto failed;
+		}
+	}
+
+	p += len + NULL_PAD_BYTE_LEN;
+
+	if (*(p-NULL_PAD_BYTE_LEN) != '\0') {
+		errno = EINVAL;
+		goto failed;
+	}
+
+	/* Now skip the canonicalized DN and its length */
+	if (U32_LEN > end_p - p) {
+		errno = EIO;
+		goto failed;
+	}
+	len = PULL_LE_U32(p, 0) + NULL_PAD_BYTE_LEN;
+	p += U32_LEN;
+
+	if (len > end_p - p) {
+		errno = EIO;
+		goto failed;
+	}
+
+	p += len;
+
+	if (*(p-NULL_PAD_BYTE_LEN) != '\0') {
+		errno = EINVAL;
+		goto failed;
+	}
+
+	if (flags & LDB_UNPACK_DATA_FLAG_NO_ATTRS) {
+		message->num_elements = 0;
+		return 0;
+	}
+
+	if (message->num_elements == 0) {
+		return 0;
+	}
+
+	/*
+	 * Sanity check (25 bytes is the minimum element size, with
+	 * its directory entry), then skip the directory, which is only
+	 * needed to find single attributes.
+	 */
+	if (message->num_elements > (end_p - p) / 25) {
+		errno = EIO;
+		goto failed;
+	}
+	p += V3_DIR_ENTRY_LEN * message->num_elements;
+
+	message->elements = talloc_zero_array(message,
+					      struct ldb_message_element,
+					      message->num_elements);
+	if (!message->elements) {
+		errno = ENOMEM;
+		goto failed;
+	}
+
+	/* As in ldb_unpack_data_flags_v2() */
+	if (flags & LDB_UNPACK_DATA_FLAG_NO_VALUES_ALLOC) {
+		ldb_val_single_array = talloc_array(message->elements,
+						    struct ldb_val,
+						    message->num_elements);
+		if (ldb_val_single_array == NULL) {
+			errno = ENOMEM;
+			goto failed;
+		}
+	}
+
+	for (i=0;i<message->num_elements;i++) {
+		const char *attr = NULL;
+		size_t attr_len;
+		struct ldb_message_element *element = NULL;
+
+		/* Sanity check: minimum element size */
+		if ((U32_LEN * 2) + /* attr name len, num values */
+			(U8_LEN * 2) + /* value length width, one val length */
+			(NULL_PAD_BYTE_LEN * 2) /* null for attr name + val */
+			> end_p - p) {
+			errno = EIO;
+			goto failed;
+		}
+
+		attr_len = PULL_LE_U32(p, 0);
+		p += U32_LEN;
+
+		if (attr_len == 0) {
+			errno = EIO;
+			goto failed;
+		}
+		attr = (char *)p;
+
+		/* num_values, val_len_width */
+		if (attr_len + NULL_PAD_BYTE_LEN + U32_LEN + U8_LEN >
+		    end_p - p) {
+			errno = EIO;
+			goto failed;
+		}
+		p += attr_len + NULL_PAD_BYTE_LEN;
+
+		if (*(p-NULL_PAD_BYTE_LEN) != '\0') {
+			errno = EINVAL;
+			goto failed;
+		}
+
+		element = &message->elements[nelem];
+		element->name = attr;
+		element->flags = 0;
+
+		element->num_values = PULL_LE_U32(p, 0);
+		element->values = NULL;
+		p += U32_LEN;
+
+		val_len_width = *p;
+		p += U8_LEN;
+
+		if (val_len_width != U8_LEN &&
+		    val_len_width != U16_LEN &&
+		    val_len_width != U32_LEN) {
+			errno = ERANGE;
+			goto failed;
+		}
+		if ((size_t)val_len_width * element->num_values > end_p - p) {
+			errno = EIO;
+			goto failed;
+		}
+
+		if ((flags & LDB_UNPACK_DATA_FLAG_NO_VALUES_ALLOC) &&
+		    element->num_values == 1) {
+			element->values = &ldb_val_single_array[nelem];
+			element->flags |= LDB_FLAG_INTERNAL_SHARED_VALUES;
+		} else if (element->num_values != 0) {
+			element->values = talloc_array(message->elements,
+						       struct ldb_val,
+						       element->num_values);
+			if (!element->values) {
+				errno = ENOMEM;
+				goto failed;
+			}
+		}
+
+		if (val_len_width == U8_LEN) {
+			for (j = 0; j < element->num_values; j++) {
+				element->values[j].length = PULL_LE_U8(p, 0);
+				p += U8_LEN;
+			}
+		} else if (val_len_width == U16_LEN) {
+			for (j = 0; j < element->num_values; j++) {
+				element->values[j].length = PULL_LE_U16(p, 0);
+				p += U16_LEN;
+			}
+		} else {
+			for (j = 0; j < element->num_values; j++) {
+				element->values[j].length = PULL_LE_U32(p, 0);
+				p += U32_LEN;
+			}
+		}
+
+		/* The values follow their lengths */
+		for (j = 0; j < element->num_values; j++) {
+			len = element->values[j].length;
+			if (len + NULL_PAD_BYTE_LEN < len) {
+				errno = EIO;
+				goto failed;
+			}
+			if (len + NULL_PAD_BYTE_LEN > end_p - p) {
+				errno = EIO;
+				goto failed;
+			}
+
+			element->values[j].data = p;
+			p += len + NULL_PAD_BYTE_LEN;
+		}
+		nelem++;
+	}
+
+	message->num_elements = nelem;
+
+	if (p != end_p) {
+		ldb_debug(ldb, LDB_DEBUG_ERROR,
+			  "Error: %zu bytes unread in ldb_unpack_data_flags",
+			  end_p - p);
+		errno = EIO;
+		goto failed;
+	}
+
+	return 0;
+
+failed:
+	talloc_free(message->elements);
+	return -1;
+}
+
 int ldb_unpack_get_format(const struct ldb_val *data,
 			  uint32_t *pack_format_version)
 {
@@ -1074,6 +1576,9 @@ int ldb_unpack_data_flags(struct ldb_context *ldb,
 	if (format == LDB_PACKING_FORMAT_V2) {
 		return ldb_unpack_data_flags_v2(ldb, data, message, flags);
 	}
+	if (format == LDB_PACKING_FORMAT_V3) {
+		return ldb_unpack_data_flags_v3(ldb, data, message, flags);
+	}
 
 	/*
 	 * The v1 function we're about to call takes either LDB_PACKING_FORMAT
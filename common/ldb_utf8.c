@@ -54,6 +54,7 @@ void ldb_set_utf8_functions(struct ldb_context *ldb,
 	if (casecmp) {
 		ldb->utf8_fns.casecmp = casecmp;
 	}
+	ldb_dn_casefold_cache_flush(ldb);
 }
 
 /*
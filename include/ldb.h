@@ -563,6 +563,15 @@ typedef int (*ldb_qsort_cmp_fn_t) (void *v1, void *v2, void *opaque);
 #define LDB_CONTROL_PROVISION_OID "1.3.6.1.4.1.7165.4.3.16"
 #define LDB_CONTROL_PROVISION_NAME	"provision"
 
+/**
+   OID for the index plan control. When included in a search request
+   the key value backends attach a control with this OID to the
+   searchResultDone message, describing how the search was executed
+   (struct ldb_index_plan_control).  This is a debugging aid.
+*/
+#define LDB_CONTROL_INDEX_PLAN_OID "1.3.6.1.4.1.7165.4.3.50"
+#define LDB_CONTROL_INDEX_PLAN_NAME	"index_plan"
+
 /* AD controls */
 
 /**
@@ -906,6 +915,10 @@ struct ldb_verify_name_control {
 	char *gc;
 };
 
+struct ldb_index_plan_control {
+	char *plan;
+};
+
 struct ldb_control {
 	const char *oid;
 	int critical;
@@ -120,6 +120,42 @@ struct ldb_module;
  */
 #define LDAP_REFERRAL_SCHEME_OPAQUE "LDAP_REFERRAL_SCHEME"
 
+/*
+ * The index sort control, passed between modules only.  The
+ * server_sort module adds this to the search it passes down, where
+ * LDB_INDEX_SORT_BACKEND_OPAQUE says it may be used.  If the
+ * key value backend is answering that request itself, and the sort
+ * attribute has an ordered index, it may send the entries in order,
+ * marking the first entry with a control with this OID.  The entries
+ * then need no sorting.
+ */
+#define LDB_CONTROL_INDEX_SORT_OID "1.3.6.1.4.1.7165.4.3.51"
+
+struct ldb_index_sort_control {
+	const char *attributeName;
+	int reverse;
+	/* the request the entries may be sent in order for */
+	struct ldb_request *req;
+};
+
+/*
+ * The key value backend sets this opaque to a struct
+ * ldb_index_sort_backend, and the server_sort module only adds the
+ * index sort control to a search if it is set.
+ */
+#define LDB_INDEX_SORT_BACKEND_OPAQUE "LDB_INDEX_SORT_BACKEND"
+
+struct ldb_index_sort_backend {
+	/*
+	 * NULL if more than one backend has set the opaque (as
+	 * under the Samba partition module), when it is not known
+	 * which will answer the search
+	 */
+	struct ldb_module *module;
+	/* could the backend send the entries in order of attr */
+	bool (*can_sort)(struct ldb_module *module, const char *attr);
+};
+
 /*
    these function pointers define the operations that a ldb module can intercept
 */
@@ -603,7 +639,10 @@ enum ldb_pack_format {
 
 	/* In-use packing formats */
 	LDB_PACKING_FORMAT,
-	LDB_PACKING_FORMAT_V2
+	LDB_PACKING_FORMAT_V2,
+
+	/* As V2, with a directory of the attributes in the header */
+	LDB_PACKING_FORMAT_V3
 };
 
 /**
@@ -630,6 +669,16 @@ void ldb_handle_use_global_event_context(struct ldb_handle *handle);
  */
 const char **ldb_options_get(struct ldb_context *ldb);
 
+/**
+ * Find an option of the form NAME:value or NAME=value in a list of
+ * options, such as that returned by ldb_options_get().
+ *
+ * \return a pointer to the value, an empty string for a bare NAME, or
+ * NULL if the option is not found.
+ */
+const char *ldb_options_find(struct ldb_context *ldb, const char *options[],
+			     const char *option_name);
+
 struct ldb_dn *ldb_val_as_dn(struct ldb_context *ldb,
 			     TALLOC_CTX *mem_ctx,
 			     const struct ldb_val *v);
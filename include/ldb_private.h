@@ -78,6 +78,23 @@ struct ldb_module {
 	const struct ldb_module_ops *ops;
 };
 
+/*
+  an open-addressed hash of ldb_schema.attributes, keyed on the
+  case-folded attribute name.  It is only changed along with the table,
+  never by a lookup, so concurrent lookups are safe.
+*/
+struct ldb_schema_attribute_hash {
+	/* a power of two, at least twice the number of attributes */
+	unsigned int size;
+	/* index + 1 of the '*' attribute, or 0 */
+	unsigned int default_idx;
+	struct ldb_schema_attribute_hash_slot {
+		uint32_t hash;
+		/* index + 1 into ldb_schema.attributes, 0 if empty */
+		unsigned int idx;
+	} *slots;
+};
+
 /*
   schema related information needed for matching rules
 */
@@ -89,6 +106,15 @@ struct ldb_schema {
 	unsigned num_attributes;
 	struct ldb_schema_attribute *attributes;
 
+	/*
+	 * Kept up to date by ldb_schema_attribute_add_with_syntax()
+	 * and the ldb_schema_attribute_remove*() functions, which are
+	 * the only ways the attribute table may be changed.  If NULL (eg on allocation
+	 * failure, or a non-ASCII attribute name) lookups fall back to
+	 * a binary search of the table.
+	 */
+	struct ldb_schema_attribute_hash *attribute_hash;
+
 	unsigned num_dn_extended_syntax;
 	struct ldb_dn_extended_syntax *dn_extended_syntax;
 
@@ -157,6 +183,17 @@ struct ldb_context {
 
 	struct ldb_schema schema;
 
+	/*
+	 * Canonicalised values of the parent components of DNs we
+	 * have casefolded, see ldb_dn_casefold_internal()
+	 */
+	struct ldb_dn_casefold_cache *dn_casefold_cache;
+	/*
+	 * While non-zero the cache is neither read nor filled, see
+	 * ldb_dn_casefold_cache_suspend()
+	 */
+	unsigned int dn_casefold_cache_suspended;
+
 	char *err_string;
 
 	int transaction_active;
@@ -251,8 +288,6 @@ struct ldb_val ldb_binary_decode(TALLOC_CTX *mem_ctx, const char *str);
 
 /* The following definitions come from lib/ldb/common/ldb_options.c  */
 
-const char *ldb_options_find(struct ldb_context *ldb, const char *options[],
-			     const char *option_name);
 const char **ldb_options_copy(TALLOC_CTX *ctx, const char *options[]);
 
 /* The following definitions come from lib/ldb/common/ldb_ldif.c  */
@@ -276,6 +311,33 @@ char *ldb_ldif_write_redacted_trace_string(struct ldb_context *ldb, TALLOC_CTX *
  */
 struct ldb_context *ldb_dn_get_ldb_context(struct ldb_dn *dn);
 
+/*
+ * Forget the canonicalised DN component values cached on the LDB
+ * context, for when the schema or the casefold functions change.
+ */
+static inline void ldb_dn_casefold_cache_flush(struct ldb_context *ldb)
+{
+	TALLOC_FREE(ldb->dn_casefold_cache);
+}
+
+/*
+ * Stop using the DN casefold cache, so that DNs on this LDB context
+ * may be casefolded on several threads at once.  Called on the thread
+ * that owns the context, before the other threads start and (for
+ * ldb_dn_casefold_cache_resume()) after they have all finished.
+ */
+static inline void ldb_dn_casefold_cache_suspend(struct ldb_context *ldb)
+{
+	ldb->dn_casefold_cache_suspended++;
+}
+
+static inline void ldb_dn_casefold_cache_resume(struct ldb_context *ldb)
+{
+	if (ldb->dn_casefold_cache_suspended > 0) {
+		ldb->dn_casefold_cache_suspended--;
+	}
+}
+
 #define LDB_MSG_FIND_COMMON_REMOVE_DUPLICATES 1
 
 /**
@@ -375,4 +437,48 @@ int ldb_msg_add_distinguished_name(struct ldb_message *msg);
  */
 char ldb_ascii_toupper(char c);
 
+/*
+ * The hash of an attribute name kept in the attribute directory of a
+ * LDB_PACKING_FORMAT_V3 record (32 bit FNV-1a over the name with
+ * ASCII letters upper-cased, so that names which compare equal with
+ * ldb_attr_cmp() have the same hash).
+ *
+ * This is part of the packing format, and must never change.
+ */
+static inline uint32_t ldb_pack_attr_hash(const char *name, size_t len)
+{
+	uint32_t hash = 0x811c9dc5;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		uint8_t c = name[i];
+
+		if (c >= 'a' && c <= 'z') {
+			c -= 'a' - 'A';
+		}
+		hash ^= c;
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+/*
+ * Hash an attribute name for ldb_schema.attribute_hash.  Returns false
+ * for names which are not 7-bit ASCII, as strcasecmp() may fold those
+ * differently depending on the locale.
+ */
+static inline bool ldb_schema_attribute_name_hash(const char *name,
+						  uint32_t *hash)
+{
+	size_t len;
+
+	for (len = 0; name[len] != '\0'; len++) {
+		if ((uint8_t)name[len] & 0x80) {
+			return false;
+		}
+	}
+	*hash = ldb_pack_attr_hash(name, len);
+	return true;
+}
+
 #endif
@@ -354,7 +354,11 @@ static int ldb_kv_modified(struct ldb_module *module, struct ldb_dn *dn)
 				  ldb_kv->kv_ops->name(ldb_kv),
 				  ldb_dn_get_linearized(dn));
 		}
-		ret = ldb_kv_reindex(module);
+		if (ldb_dn_check_special(dn, LDB_KV_INDEXLIST)) {
+			ret = ldb_kv_reindex_indexlist(module);
+		} else {
+			ret = ldb_kv_reindex(module);
+		}
 	}
 
 	/* If the modify was to a normal record, or any special except @BASEINFO, update the seq number */
@@ -841,15 +845,131 @@ static int ldb_kv_delete(struct ldb_kv_context *ctx)
 }
 
 /*
-  find an element by attribute name. At the moment this does a linear search,
-  it should be re-coded to use a binary search once all places that modify
-  records guarantee sorted order
+ * A hash table of the attribute names of the record being modified,
+ * so that ldb_kv_modify_internal() finds each attribute it changes
+ * without comparing against every attribute of the record.  Users and
+ * schema objects often have 100 or more attributes.
+ *
+ * The table is built on the first lookup in a record of at least
+ * LDB_KV_MSG_INDEX_MIN_ELEMENTS elements, and kept up to date by
+ * ldb_kv_msg_add_element() and ldb_kv_msg_delete_attribute(), which
+ * must be the only way the elements of the record are changed.
+ */
+#define LDB_KV_MSG_INDEX_MIN_ELEMENTS 16
+#define LDB_KV_MSG_INDEX_DELETED UINT_MAX
+
+struct ldb_kv_msg_index {
+	/* 0 if empty, otherwise the index of the element plus one */
+	unsigned int *slots;
+	unsigned int size;
+	unsigned int used;
+	bool valid;
+	/* a name is not ASCII, so it may not hash as it compares */
+	bool disabled;
+};
+
+static bool ldb_kv_msg_index_hash(const char *name, uint32_t *hash)
+{
+	size_t len = strlen(name);
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		if ((uint8_t)name[i] >= 0x80) {
+			return false;
+		}
+	}
+	*hash = ldb_pack_attr_hash(name, len);
+	return true;
+}
+
+static void ldb_kv_msg_index_insert(struct ldb_kv_msg_index *idx,
+				    const struct ldb_message *msg,
+				    unsigned int i)
+{
+	unsigned int mask = idx->size - 1;
+	uint32_t hash;
+
+	if (!ldb_kv_msg_index_hash(msg->elements[i].name, &hash)) {
+		idx->valid = false;
+		idx->disabled = true;
+		return;
+	}
+
+	/*
+	 * Elements are inserted in order, so the first of several
+	 * with the same name is found first.
+	 */
+	hash &= mask;
+	while (idx->slots[hash] != 0) {
+		hash = (hash + 1) & mask;
+	}
+	idx->slots[hash] = i + 1;
+	idx->used++;
+}
+
+static void ldb_kv_msg_index_build(struct ldb_kv_msg_index *idx,
+				   struct ldb_message *msg)
+{
+	unsigned int size = 16;
+	unsigned int i;
+
+	/* keep the table at most half full, allowing for additions */
+	while (size < msg->num_elements * 4) {
+		size *= 2;
+	}
+
+	TALLOC_FREE(idx->slots);
+	idx->slots = talloc_zero_array(msg, unsigned int, size);
+	if (idx->slots == NULL) {
+		idx->valid = false;
+		return;
+	}
+	idx->size = size;
+	idx->used = 0;
+	idx->valid = true;
+
+	for (i = 0; i < msg->num_elements && idx->valid; i++) {
+		ldb_kv_msg_index_insert(idx, msg, i);
+	}
+}
+
+/*
+  find an element by attribute name, using the index of the record if
+  one is given and the record is large enough.
 
   return the index of the first matching element if found, otherwise -1
 */
-static int ldb_kv_find_element(const struct ldb_message *msg, const char *name)
+static int ldb_kv_find_element(struct ldb_message *msg,
+			       struct ldb_kv_msg_index *idx,
+			       const char *name)
 {
 	unsigned int i;
+	uint32_t hash;
+
+	if (idx != NULL && !idx->disabled &&
+	    msg->num_elements >= LDB_KV_MSG_INDEX_MIN_ELEMENTS) {
+		if (!idx->valid) {
+			ldb_kv_msg_index_build(idx, msg);
+		}
+		if (idx->valid && ldb_kv_msg_index_hash(name, &hash)) {
+			unsigned int mask = idx->size - 1;
+
+			for (hash &= mask;
+			     idx->slots[hash] != 0;
+			     hash = (hash + 1) & mask) {
+				i = idx->slots[hash];
+				if (i == LDB_KV_MSG_INDEX_DELETED) {
+					continue;
+				}
+				if (ldb_attr_cmp(msg->elements[i - 1].name,
+						 name) == 0) {
+					return i - 1;
+				}
+			}
+			return -1;
+		}
+	}
+
 	for (i=0;i<msg->num_elements;i++) {
 		if (ldb_attr_cmp(msg->elements[i].name, name) == 0) {
 			return i;
@@ -858,6 +978,50 @@ static int ldb_kv_find_element(const struct ldb_message *msg, const char *name)
 	return -1;
 }
 
+/*
+  update the index of a record after the element at index i was added
+*/
+static void ldb_kv_msg_index_added(struct ldb_kv_msg_index *idx,
+				   const struct ldb_message *msg,
+				   unsigned int i)
+{
+	if (idx == NULL || !idx->valid) {
+		return;
+	}
+	if ((idx->used + 1) * 2 > idx->size) {
+		/* rebuilt larger on the next lookup */
+		idx->valid = false;
+		return;
+	}
+	ldb_kv_msg_index_insert(idx, msg, i);
+}
+
+/*
+  update the index of a record after the element at index i was
+  removed, and those after it moved down
+*/
+static void ldb_kv_msg_index_removed(struct ldb_kv_msg_index *idx,
+				     unsigned int i)
+{
+	unsigned int j;
+
+	if (idx == NULL || !idx->valid) {
+		return;
+	}
+	for (j = 0; j < idx->size; j++) {
+		unsigned int v = idx->slots[j];
+
+		if (v == 0 || v == LDB_KV_MSG_INDEX_DELETED) {
+			continue;
+		}
+		if (v == i + 1) {
+			/* leave a marker, so later entries are still found */
+			idx->slots[j] = LDB_KV_MSG_INDEX_DELETED;
+		} else if (v > i + 1) {
+			idx->slots[j] = v - 1;
+		}
+	}
+}
 
 /*
   add an element to an existing record. Assumes a elements array that we
@@ -867,6 +1031,7 @@ static int ldb_kv_find_element(const struct ldb_message *msg, const char *name)
   returns 0 on success, -1 on failure (and sets errno)
 */
 static int ldb_kv_msg_add_element(struct ldb_message *msg,
+				  struct ldb_kv_msg_index *idx,
 				  struct ldb_message_element *el)
 {
 	struct ldb_message_element *e2;
@@ -903,6 +1068,8 @@ static int ldb_kv_msg_add_element(struct ldb_message *msg,
 
 	++msg->num_elements;
 
+	ldb_kv_msg_index_added(idx, msg, msg->num_elements - 1);
+
 	return 0;
 }
 
@@ -912,9 +1079,11 @@ static int ldb_kv_msg_add_element(struct ldb_message *msg,
 static int ldb_kv_msg_delete_attribute(struct ldb_module *module,
 				       struct ldb_kv_private *ldb_kv,
 				       struct ldb_message *msg,
+				       struct ldb_kv_msg_index *idx,
 				       const char *name)
 {
 	int ret;
+	int found;
 	struct ldb_message_element *el;
 	bool is_special = ldb_dn_is_special(msg->dn);
 
@@ -928,10 +1097,11 @@ static int ldb_kv_msg_delete_attribute(struct ldb_module *module,
 		return LDB_ERR_CONSTRAINT_VIOLATION;
 	}
 
-	el = ldb_msg_find_element(msg, name);
-	if (el == NULL) {
+	found = ldb_kv_find_element(msg, idx, name);
+	if (found == -1) {
 		return LDB_ERR_NO_SUCH_ATTRIBUTE;
 	}
+	el = &msg->elements[found];
 
 	ret = ldb_kv_index_del_element(module, ldb_kv, msg, el);
 	if (ret != LDB_SUCCESS) {
@@ -940,6 +1110,7 @@ static int ldb_kv_msg_delete_attribute(struct ldb_module *module,
 
 	talloc_free(el->values);
 	ldb_msg_remove_element(msg, el);
+	ldb_kv_msg_index_removed(idx, found);
 	msg->elements = talloc_realloc(msg, msg->elements,
 				       struct ldb_message_element,
 				       msg->num_elements);
@@ -954,6 +1125,7 @@ static int ldb_kv_msg_delete_attribute(struct ldb_module *module,
 static int ldb_kv_msg_delete_element(struct ldb_module *module,
 				     struct ldb_kv_private *ldb_kv,
 				     struct ldb_message *msg,
+				     struct ldb_kv_msg_index *idx,
 				     const char *name,
 				     const struct ldb_val *val)
 {
@@ -963,7 +1135,7 @@ static int ldb_kv_msg_delete_element(struct ldb_module *module,
 	struct ldb_message_element *el;
 	const struct ldb_schema_attribute *a;
 
-	found = ldb_kv_find_element(msg, name);
+	found = ldb_kv_find_element(msg, idx, name);
 	if (found == -1) {
 		return LDB_ERR_NO_SUCH_ATTRIBUTE;
 	}
@@ -986,7 +1158,7 @@ static int ldb_kv_msg_delete_element(struct ldb_module *module,
 		if (matched) {
 			if (el->num_values == 1) {
 				return ldb_kv_msg_delete_attribute(
-				    module, ldb_kv, msg, name);
+				    module, ldb_kv, msg, idx, name);
 			}
 
 			ret =
@@ -1011,9 +1183,9 @@ static int ldb_kv_msg_delete_element(struct ldb_module *module,
 /*
   modify a record - internal interface
 
-  yuck - this is O(n^2). Luckily n is usually small so we probably
-  get away with it, but if we ever have really large attribute lists
-  then we'll need to look at this again
+  The attributes of the stored record are found through a hash table
+  (struct ldb_kv_msg_index), so this is not O(n^2) for records with
+  many attributes.
 
   'req' is optional, and is used to specify controls if supplied
 */
@@ -1026,6 +1198,7 @@ int ldb_kv_modify_internal(struct ldb_module *module,
 	struct ldb_kv_private *ldb_kv =
 	    talloc_get_type(data, struct ldb_kv_private);
 	struct ldb_message *msg2;
+	struct ldb_kv_msg_index msg2_index = {};
 	unsigned int i, j;
 	int ret = LDB_SUCCESS, idx;
 	struct ldb_control *control_permissive = NULL;
@@ -1102,9 +1275,10 @@ int ldb_kv_modify_internal(struct ldb_module *module,
 			}
 
 			/* Checks if element already exists */
-			idx = ldb_kv_find_element(msg2, el->name);
+			idx = ldb_kv_find_element(msg2, &msg2_index, el->name);
 			if (idx == -1) {
-				if (ldb_kv_msg_add_element(msg2, el) != 0) {
+				if (ldb_kv_msg_add_element(msg2, &msg2_index,
+							   el) != 0) {
 					ret = LDB_ERR_OTHER;
 					goto done;
 				}
@@ -1237,7 +1411,7 @@ int ldb_kv_modify_internal(struct ldb_module *module,
 			}
 
 			/* Checks if element already exists */
-			idx = ldb_kv_find_element(msg2, el->name);
+			idx = ldb_kv_find_element(msg2, &msg2_index, el->name);
 			if (idx != -1) {
 				j = (unsigned int) idx;
 				el2 = &(msg2->elements[j]);
@@ -1255,14 +1429,16 @@ int ldb_kv_modify_internal(struct ldb_module *module,
 
 				/* Delete the attribute if it exists in the DB */
 				if (ldb_kv_msg_delete_attribute(
-					module, ldb_kv, msg2, el->name) != 0) {
+					module, ldb_kv, msg2, &msg2_index,
+					el->name) != 0) {
 					ret = LDB_ERR_OTHER;
 					goto done;
 				}
 			}
 
 			/* Recreate it with the new values */
-			if (ldb_kv_msg_add_element(msg2, el) != 0) {
+			if (ldb_kv_msg_add_element(msg2, &msg2_index,
+						   el) != 0) {
 				ret = LDB_ERR_OTHER;
 				goto done;
 			}
@@ -1288,6 +1464,7 @@ int ldb_kv_modify_internal(struct ldb_module *module,
 				    module,
 				    ldb_kv,
 				    msg2,
+				    &msg2_index,
 				    msg->elements[i].name);
 				if (ret == LDB_ERR_NO_SUCH_ATTRIBUTE) {
 					if (control_permissive) {
@@ -1308,6 +1485,7 @@ int ldb_kv_modify_internal(struct ldb_module *module,
 					    module,
 					    ldb_kv,
 					    msg2,
+					    &msg2_index,
 					    msg->elements[i].name,
 					    &msg->elements[i].values[j]);
 					if (ret == LDB_ERR_NO_SUCH_ATTRIBUTE &&
@@ -1883,6 +2061,37 @@ static void ldb_kv_request_done(struct ldb_kv_context *ctx, int error)
 	ares->type = LDB_REPLY_DONE;
 	ares->error = error;
 
+	if (ctx->index_plan != NULL) {
+		struct ldb_index_plan_control *plan = NULL;
+
+		ares->controls = talloc_array(ares, struct ldb_control *, 2);
+		if (ares->controls == NULL) {
+			ldb_oom(ldb);
+			req->callback(req, NULL);
+			return;
+		}
+		ares->controls[0] = talloc(ares->controls, struct ldb_control);
+		if (ares->controls[0] == NULL) {
+			ldb_oom(ldb);
+			req->callback(req, NULL);
+			return;
+		}
+		plan = talloc(ares->controls[0], struct ldb_index_plan_control);
+		if (plan == NULL) {
+			ldb_oom(ldb);
+			req->callback(req, NULL);
+			return;
+		}
+		plan->plan = talloc_steal(plan, ctx->index_plan);
+		ctx->index_plan = NULL;
+		*ares->controls[0] = (struct ldb_control) {
+			.oid = LDB_CONTROL_INDEX_PLAN_OID,
+			.critical = false,
+			.data = plan,
+		};
+		ares->controls[1] = NULL;
+	}
+
 	req->callback(req, ares);
 }
 
@@ -2023,6 +2232,7 @@ static int ldb_kv_handle_request(struct ldb_module *module,
 				 struct ldb_request *req)
 {
 	struct ldb_control *control_permissive;
+	struct ldb_control *control_index_plan;
 	struct ldb_context *ldb;
 	struct tevent_context *ev;
 	struct ldb_kv_context *ac;
@@ -2034,10 +2244,13 @@ static int ldb_kv_handle_request(struct ldb_module *module,
 
 	control_permissive = ldb_request_get_control(req,
 					LDB_CONTROL_PERMISSIVE_MODIFY_OID);
+	control_index_plan = ldb_request_get_control(req,
+					LDB_CONTROL_INDEX_PLAN_OID);
 
 	for (i = 0; req->controls && req->controls[i]; i++) {
 		if (req->controls[i]->critical &&
-		    req->controls[i] != control_permissive) {
+		    req->controls[i] != control_permissive &&
+		    req->controls[i] != control_index_plan) {
 			ldb_asprintf_errstring(ldb, "Unsupported critical extension %s",
 					       req->controls[i]->oid);
 			return LDB_ERR_UNSUPPORTED_CRITICAL_EXTENSION;
@@ -2099,6 +2312,7 @@ static int ldb_kv_init_rootdse(struct ldb_module *module)
 {
 	/* ignore errors on this - we expect it for non-sam databases */
 	ldb_mod_register_control(module, LDB_CONTROL_PERMISSIVE_MODIFY_OID);
+	ldb_mod_register_control(module, LDB_CONTROL_INDEX_PLAN_OID);
 
 	/* there can be no module beyond the backend, just return */
 	return LDB_SUCCESS;
@@ -2273,6 +2487,36 @@ int ldb_kv_init_store(struct ldb_kv_private *ldb_kv,
 			}
 		}
 	}
+
+	/*
+	 * Allow unindexed searches to be split across this many
+	 * threads.  This is only safe if the schema syntax handlers
+	 * can be called concurrently, so must be asked for.
+	 */
+	{
+		const char *workers = ldb_options_find(
+			ldb,
+			options,
+			"full_scan_workers");
+		if (workers != NULL) {
+			ldb_kv->full_scan_workers = strtoul(workers, NULL, 0);
+		}
+	}
+
+	/*
+	 * Allow the records to be unpacked and their index keys
+	 * worked out on this many threads during a re-index.  As for
+	 * full_scan_workers this must be asked for.
+	 */
+	{
+		const char *workers = ldb_options_find(
+			ldb,
+			options,
+			"reindex_workers");
+		if (workers != NULL) {
+			ldb_kv->reindex_workers = strtoul(workers, NULL, 0);
+		}
+	}
 	/*
 	 * Set batch mode operation.
 	 * This disables the nested sub transactions, and increases the
@@ -2286,6 +2530,50 @@ int ldb_kv_init_store(struct ldb_kv_private *ldb_kv,
 			ldb_kv->batch_mode = true;
 		}
 	}
+	/*
+	 * Set bulk load operation, for loading a large number of
+	 * records in one transaction.  This is batch mode, and in
+	 * addition defers ordering the GUID index lists until they
+	 * are needed.
+	 */
+	{
+		const char *bulk_load = ldb_options_find(
+			ldb, options, "bulk_load");
+		if (bulk_load != NULL) {
+			ldb_kv->batch_mode = true;
+			ldb_kv->bulk_load = true;
+		}
+	}
+
+	/*
+	 * Let the server_sort module know it may ask for the entries
+	 * in index order (see LDB_CONTROL_INDEX_SORT_OID)
+	 */
+	{
+		struct ldb_index_sort_backend *backend =
+			ldb_get_opaque(ldb, LDB_INDEX_SORT_BACKEND_OPAQUE);
+		if (backend == NULL) {
+			int ret;
+
+			backend = talloc_zero(ldb,
+					      struct ldb_index_sort_backend);
+			if (backend == NULL) {
+				talloc_free(ldb_kv->module);
+				return ldb_oom(ldb);
+			}
+			backend->module = ldb_kv->module;
+			backend->can_sort = ldb_kv_index_can_sort;
+			ret = ldb_set_opaque(ldb,
+					     LDB_INDEX_SORT_BACKEND_OPAQUE,
+					     backend);
+			if (ret != LDB_SUCCESS) {
+				talloc_free(ldb_kv->module);
+				return ret;
+			}
+		} else {
+			backend->module = NULL;
+		}
+	}
 
 	return LDB_SUCCESS;
 }
@@ -7,11 +7,25 @@
 #ifndef __LDB_KV_H__
 #define __LDB_KV_H__
 struct ldb_kv_private;
+struct ldb_kv_index_stats;
 typedef int (*ldb_kv_traverse_fn)(struct ldb_kv_private *ldb_kv,
 				  struct ldb_val key,
 				  struct ldb_val data,
 				  void *ctx);
 
+/*
+ * Called on a worker thread by iterate_parallel, so may only read
+ * shared state and must allocate on mem_ctx.  count is the number of
+ * records this worker has already seen.
+ */
+typedef int (*ldb_kv_parallel_filter_fn)(struct ldb_kv_private *ldb_kv,
+					 TALLOC_CTX *mem_ctx,
+					 size_t count,
+					 struct ldb_val key,
+					 struct ldb_val data,
+					 void *ctx,
+					 bool *matched);
+
 struct kv_db_ops {
 	uint32_t options;
 
@@ -54,6 +68,18 @@ struct kv_db_ops {
 	int (*begin_nested_write)(struct ldb_kv_private *);
 	int (*finish_nested_write)(struct ldb_kv_private *);
 	int (*abort_nested_write)(struct ldb_kv_private *);
+	/*
+	 * Optional.  Split the GUID keyed records between worker
+	 * threads that call filter() on each, then call fn() on the
+	 * calling thread, in key order, for each record filter()
+	 * matched.  Returns LDB_ERR_UNWILLING_TO_PERFORM, having done
+	 * nothing, if the records can't be scanned in parallel.
+	 */
+	int (*iterate_parallel)(struct ldb_kv_private *ldb_kv,
+				unsigned int workers,
+				ldb_kv_parallel_filter_fn filter,
+				ldb_kv_traverse_fn fn,
+				void *ctx);
 };
 
 /* this private structure is used by the key value backends in the
@@ -77,14 +103,54 @@ struct ldb_kv_private {
 	struct ldb_kv_cache {
 		struct ldb_message *indexlist;
 		bool one_level_indexes;
+		/*
+		 * keep a list of the descendants of each object, for
+		 * subtree searches
+		 */
+		bool subtree_indexes;
+		/*
+		 * from @IDX_NAMING_CONTEXT, no subtree index record
+		 * is kept for these or their ancestors
+		 */
+		struct ldb_dn **naming_contexts;
+		unsigned int num_naming_contexts;
 		bool attribute_indexes;
 		const char *GUID_index_attribute;
 		const char *GUID_index_dn_component;
+		/*
+		 * split GUID index records longer than this into
+		 * chunks, 0 disables chunking
+		 */
+		unsigned int index_chunk_size;
+		/*
+		 * put values in index keys as (escaped) bytes,
+		 * never base64 encoded
+		 */
+		bool binary_index_keys;
+		/*
+		 * keep @INDEXORDER records of the values of ordered
+		 * attributes, for range searches
+		 */
+		bool ordered_index;
+		/* some attributes are listed in @IDXSUBSTR */
+		bool substring_indexes;
+		/*
+		 * keep a list of the records with each indexed
+		 * attribute, for presence searches
+		 */
+		bool presence_index;
+		/*
+		 * index cardinality statistics from @INDEXSTATS, or
+		 * NULL if they are not available
+		 */
+		struct ldb_kv_index_stats *index_stats;
 	} *cache;
 
 
 	bool check_base;
 	bool disallow_dn_filter;
+	/* pack GUID indexed records with an attribute directory (V3) */
+	bool pack_attr_directory;
 	/*
 	 * To improve the performance of batch operations we maintain a cache
 	 * of index records, these entries get written to disk in the
@@ -110,6 +176,13 @@ struct ldb_kv_private {
 	 * the transaction commit will fail.
 	 */
 	bool operation_failed;
+	/*
+	 * If bulk load is set (which implies batch mode) GUIDs are
+	 * appended to the cached index lists as records are added,
+	 * and each list is only sorted once, before it is searched or
+	 * written to disk at commit.
+	 */
+	bool bulk_load;
 
 	bool prepared_commit;
 	int read_lock_count;
@@ -146,6 +219,20 @@ struct ldb_kv_private {
 	 * The size to be used for the index transaction cache
 	 */
 	size_t index_transaction_cache_size;
+
+	/*
+	 * The number of threads to use for an unindexed search, if
+	 * the backend supports iterate_parallel.  0 or 1 scans the
+	 * database on the calling thread.
+	 */
+	unsigned int full_scan_workers;
+
+	/*
+	 * The number of threads to unpack records and work out their
+	 * index keys on during a re-index.  0 or 1 re-indexes on the
+	 * calling thread.
+	 */
+	unsigned int reindex_workers;
 };
 
 struct ldb_kv_context {
@@ -167,6 +254,8 @@ struct ldb_kv_context {
 
 	/* search stuff */
 	const struct ldb_parse_tree *tree;
+	/* tree compiled by ldb_kv_match_compile(), if possible */
+	struct ldb_kv_match_program *match_program;
 	struct ldb_dn *base;
 	enum ldb_scope scope;
 	const char * const *attrs;
@@ -174,11 +263,41 @@ struct ldb_kv_context {
 
 	/* error handling */
 	int error;
+
+	/*
+	 * The index plan control was given, so describe how the
+	 * search was answered in index_plan.
+	 */
+	bool want_index_plan;
+	char *index_plan;
+	/* the index planner chose a full scan */
+	bool planned_full_scan;
+	/*
+	 * Every candidate from the index matches the search
+	 * expression, only the scope is left to check.
+	 */
+	bool index_exact;
+	/*
+	 * The server_sort module asked for the entries in the order
+	 * of an attribute (see ldb_kv_index_search_sorted()).
+	 */
+	const struct ldb_index_sort_control *sort;
+	/* the index key of the value being walked, when sending in order */
+	const char *sort_key;
+	/* entries to send after the walk, as redaction hid the value */
+	struct ldb_val *sort_deferred;
+	unsigned int num_sort_deferred;
+	/* controls to send with the next entry */
+	struct ldb_control **entry_controls;
 };
 
+struct ldb_kv_reindex_batch;
 struct ldb_kv_reindex_context {
 	int error;
 	uint32_t count;
+	struct timeval start;
+	/* records queued for the reindex workers, if any */
+	struct ldb_kv_reindex_batch *batch;
 };
 
 struct ldb_kv_repack_context {
@@ -196,9 +315,25 @@ struct ldb_kv_repack_context {
 #define LDB_KV_IDXVERSION "@IDXVERSION"
 #define LDB_KV_IDXATTR    "@IDXATTR"
 #define LDB_KV_IDXONE     "@IDXONE"
+#define LDB_KV_IDXSUBTREE "@IDXSUBTREE"
+#define LDB_KV_IDX_NAMING_CONTEXT "@IDX_NAMING_CONTEXT"
 #define LDB_KV_IDXDN     "@IDXDN"
 #define LDB_KV_IDXGUID    "@IDXGUID"
 #define LDB_KV_IDX_DN_GUID "@IDX_DN_GUID"
+#define LDB_KV_IDX_CHUNK_SIZE "@IDX_CHUNK_SIZE"
+#define LDB_KV_IDX_BINARY_KEYS "@IDX_BINARY_KEYS"
+#define LDB_KV_IDX_ORDERED "@IDX_ORDERED"
+#define LDB_KV_IDXSUBSTR  "@IDXSUBSTR"
+#define LDB_KV_IDX_PRESENCE "@IDX_PRESENCE"
+#define LDB_KV_IDXPRESENT "@IDXPRESENT"
+#define LDB_KV_IDXCHUNK   "@IDXCHUNK"
+#define LDB_KV_INDEX_CHUNK "@INDEXCHUNK"
+#define LDB_KV_INDEXSTATS "@INDEXSTATS"
+#define LDB_KV_IDXOBJECTS "@IDXOBJECTS"
+#define LDB_KV_IDXSTAT    "@IDXSTAT"
+#define LDB_KV_INDEX_ORDER "@INDEXORDER"
+#define LDB_KV_IDXVALUE   "@IDXVALUE"
+#define LDB_KV_IDXORDERCHUNK "@IDXORDERCHUNK"
 
 /*
  * This will be used to indicate when a new, yet to be developed
@@ -216,6 +351,7 @@ struct ldb_kv_repack_context {
 #define LDB_KV_SEQUENCE_NUMBER "sequenceNumber"
 #define LDB_KV_CHECK_BASE "checkBaseOnSearch"
 #define LDB_KV_DISALLOW_DN_FILTER "disallowDNFilter"
+#define LDB_KV_PACK_ATTR_DIRECTORY "packAttributeDirectory"
 #define LDB_KV_MOD_TIMESTAMP "whenChanged"
 #define LDB_KV_OBJECTCLASS "objectClass"
 
@@ -245,9 +381,8 @@ int ldb_kv_check_at_attributes_values(const struct ldb_val *value);
  */
 
 /*
- * The default size of the in memory TDB used to cache index records
- * The value chosen gives a prime modulo for the hash table and keeps the
- * tdb memory overhead under 4 kB
+ * The default number of index records the in memory index cache of a
+ * transaction is sized for.  The cache grows as needed.
  */
 #define DEFAULT_INDEX_CACHE_SIZE 491
 
@@ -273,18 +408,26 @@ int ldb_kv_index_del_value(struct ldb_module *module,
 			   struct ldb_message_element *el,
 			   unsigned int v_idx);
 int ldb_kv_reindex(struct ldb_module *module);
+int ldb_kv_reindex_indexlist(struct ldb_module *module);
 int ldb_kv_repack(struct ldb_module *module);
 int ldb_kv_index_transaction_start(
 	struct ldb_module *module,
 	size_t cache_size);
 int ldb_kv_index_transaction_commit(struct ldb_module *module);
 int ldb_kv_index_transaction_cancel(struct ldb_module *module);
+bool ldb_kv_index_can_sort(struct ldb_module *module, const char *attr);
 int ldb_kv_key_dn_from_idx(struct ldb_module *module,
 			   struct ldb_kv_private *ldb_kv,
 			   TALLOC_CTX *mem_ctx,
 			   struct ldb_dn *dn,
 			  struct ldb_val *key);
 
+/*
+ * The following definitions come from lib/ldb/ldb_key_value/ldb_kv_index_plan.c
+ */
+int ldb_kv_index_stats_load(struct ldb_module *module,
+			    struct ldb_kv_private *ldb_kv);
+
 /*
  * The following definitions come from lib/ldb/ldb_key_value/ldb_kv_search.c
  */
@@ -301,10 +444,93 @@ int ldb_kv_search_key(struct ldb_module *module,
 		      const struct ldb_val ldb_key,
 		      struct ldb_message *msg,
 		      unsigned int unpack_flags);
+int ldb_kv_search_key_match(struct ldb_kv_context *ac,
+			    struct ldb_kv_private *ldb_kv,
+			    const struct ldb_val ldb_key,
+			    struct ldb_message *msg,
+			    unsigned int unpack_flags,
+			    bool *checked,
+			    bool *matched);
 int ldb_kv_filter_attrs_in_place(struct ldb_message *msg,
 				 const char *const *attrs);
 int ldb_kv_search(struct ldb_kv_context *ctx);
 
+/*
+ * The following definitions come from lib/ldb/ldb_key_value/ldb_kv_match.c
+ */
+struct ldb_kv_match_program;
+
+int ldb_kv_match_compile(TALLOC_CTX *mem_ctx,
+			 struct ldb_context *ldb,
+			 const struct ldb_parse_tree *tree,
+			 struct ldb_kv_match_program **_prog);
+int ldb_kv_match_run(const struct ldb_kv_match_program *prog,
+		     TALLOC_CTX *mem_ctx,
+		     const struct ldb_message *msg,
+		     enum ldb_scope scope,
+		     bool *matched);
+int ldb_kv_match_message(const struct ldb_kv_context *ac,
+			 TALLOC_CTX *mem_ctx,
+			 const struct ldb_message *msg,
+			 bool *matched);
+int ldb_kv_match_packed(const struct ldb_kv_context *ac,
+			TALLOC_CTX *mem_ctx,
+			const struct ldb_val *data,
+			bool *matched);
+
+/*
+ * The following definitions come from lib/ldb/ldb_key_value/ldb_kv_packed.c
+ */
+
+/*
+ * A view of a packed record, see ldb_kv_packed_record_init().  The
+ * view points into the packed data and allocates nothing.
+ */
+struct ldb_kv_packed_record {
+	/* the linearized DN, which is NUL terminated */
+	struct ldb_val dn;
+	unsigned int num_elements;
+
+	/* LDB_PACKING_FORMAT_V2 or LDB_PACKING_FORMAT_V3 */
+	uint32_t format;
+
+	/* private to ldb_kv_packed.c */
+	unsigned int next_element;
+	const uint8_t *start;
+	const uint8_t *dir;
+	const uint8_t *p;
+	const uint8_t *q;
+	const uint8_t *values_start;
+	const uint8_t *end;
+};
+
+struct ldb_kv_packed_element {
+	/* NUL terminated, in the packed data */
+	const char *name;
+	unsigned int num_values;
+
+	/* private to ldb_kv_packed_element_*() */
+	uint8_t width;
+	const uint8_t *lengths;
+	const uint8_t *values;
+};
+
+int ldb_kv_packed_record_init(struct ldb_kv_packed_record *rec,
+			      const struct ldb_val *data);
+int ldb_kv_packed_record_next(struct ldb_kv_packed_record *rec,
+			      struct ldb_kv_packed_element *el);
+size_t ldb_kv_packed_element_length(const struct ldb_kv_packed_element *el,
+				    unsigned int i);
+void ldb_kv_packed_element_values(const struct ldb_kv_packed_element *el,
+				  struct ldb_val *values);
+int ldb_kv_packed_record_find(const struct ldb_kv_packed_record *rec,
+			      const char *name,
+			      struct ldb_kv_packed_element *el);
+int ldb_kv_packed_unpack_attrs(struct ldb_context *ldb,
+			       const struct ldb_val *data,
+			       struct ldb_message *msg,
+			       const char *const *attrs);
+
 /*
  * The following definitions come from lib/ldb/ldb_key_value/ldb_kv.c  */
 /*
@@ -88,24 +88,15 @@ static int ldb_kv_attributes_flags(struct ldb_message_element *el, unsigned *v)
 	return 0;
 }
 
-static int ldb_schema_attribute_compare(const void *p1, const void *p2)
-{
-	const struct ldb_schema_attribute *sa1 = (const struct ldb_schema_attribute *)p1;
-	const struct ldb_schema_attribute *sa2 = (const struct ldb_schema_attribute *)p2;
-	return ldb_attr_cmp(sa1->name, sa2->name);
-}
-
 /*
   register any special handlers from @ATTRIBUTES
 */
 static int ldb_kv_attributes_load(struct ldb_module *module)
 {
-	struct ldb_schema_attribute *attrs;
 	struct ldb_context *ldb;
 	struct ldb_message *attrs_msg = NULL;
 	struct ldb_dn *dn;
 	unsigned int i;
-	unsigned int num_loaded_attrs = 0;
 	int r;
 
 	ldb = ldb_module_get_ctx(module);
@@ -138,18 +129,6 @@ static int ldb_kv_attributes_load(struct ldb_module *module)
 		return 0;
 	}
 
-	attrs = talloc_array(attrs_msg,
-			     struct ldb_schema_attribute,
-			     attrs_msg->num_elements
-			     + ldb->schema.num_attributes);
-	if (attrs == NULL) {
-		goto failed;
-	}
-
-	memcpy(attrs,
-	       ldb->schema.attributes,
-	       sizeof(ldb->schema.attributes[0]) * ldb->schema.num_attributes);
-
 	/* mapping these flags onto ldap 'syntaxes' isn't strictly correct,
 	   but its close enough for now */
 	for (i=0;i<attrs_msg->num_elements;i++) {
@@ -205,28 +184,14 @@ static int ldb_kv_attributes_load(struct ldb_module *module)
 
 		attr_flags |= LDB_ATTR_FLAG_ALLOCATED | LDB_ATTR_FLAG_FROM_DB;
 
-		r = ldb_schema_attribute_fill_with_syntax(ldb,
-							  attrs,
-							  attrs_msg->elements[i].name,
-							  attr_flags, s,
-							  &attrs[num_loaded_attrs + ldb->schema.num_attributes]);
+		r = ldb_schema_attribute_add_with_syntax(ldb,
+							 attrs_msg->elements[i].name,
+							 attr_flags, s);
 		if (r != 0) {
 			goto failed;
 		}
-		num_loaded_attrs++;
 	}
 
-	attrs = talloc_realloc(attrs_msg,
-			       attrs, struct ldb_schema_attribute,
-			       num_loaded_attrs + ldb->schema.num_attributes);
-	if (attrs == NULL) {
-		goto failed;
-	}
-	TYPESAFE_QSORT(attrs, num_loaded_attrs + ldb->schema.num_attributes,
-		       ldb_schema_attribute_compare);
-	talloc_unlink(ldb, ldb->schema.attributes);
-	ldb->schema.attributes = talloc_steal(ldb, attrs);
-	ldb->schema.num_attributes = num_loaded_attrs + ldb->schema.num_attributes;
 	TALLOC_FREE(attrs_msg);
 
 	return 0;
@@ -243,6 +208,8 @@ static int ldb_kv_index_load(struct ldb_module *module,
 {
 	struct ldb_context *ldb = ldb_module_get_ctx(module);
 	struct ldb_dn *indexlist_dn;
+	struct ldb_message_element *el = NULL;
+	unsigned int i;
 	int r, lmdb_subdb_version;
 
 	if (ldb->schema.index_handler_override) {
@@ -267,7 +234,15 @@ static int ldb_kv_index_load(struct ldb_module *module,
 		return -1;
 	}
 	ldb_kv->cache->one_level_indexes = false;
+	ldb_kv->cache->subtree_indexes = false;
+	ldb_kv->cache->naming_contexts = NULL;
+	ldb_kv->cache->num_naming_contexts = 0;
 	ldb_kv->cache->attribute_indexes = false;
+	ldb_kv->cache->index_chunk_size = 0;
+	ldb_kv->cache->binary_index_keys = false;
+	ldb_kv->cache->ordered_index = false;
+	ldb_kv->cache->substring_indexes = false;
+	ldb_kv->cache->presence_index = false;
 
 	indexlist_dn = ldb_dn_new(ldb_kv, ldb, LDB_KV_INDEXLIST);
 	if (indexlist_dn == NULL) {
@@ -289,14 +264,59 @@ static int ldb_kv_index_load(struct ldb_module *module,
 	    NULL) {
 		ldb_kv->cache->one_level_indexes = true;
 	}
+	if (ldb_msg_find_element(ldb_kv->cache->indexlist,
+				 LDB_KV_IDXSUBTREE) != NULL) {
+		ldb_kv->cache->subtree_indexes = true;
+	}
+	el = ldb_msg_find_element(ldb_kv->cache->indexlist,
+				  LDB_KV_IDX_NAMING_CONTEXT);
+	if (el != NULL) {
+		ldb_kv->cache->naming_contexts = talloc_array(
+			ldb_kv->cache->indexlist,
+			struct ldb_dn *,
+			el->num_values);
+		if (ldb_kv->cache->naming_contexts == NULL) {
+			return -1;
+		}
+		for (i = 0; i < el->num_values; i++) {
+			struct ldb_dn *dn = ldb_dn_from_ldb_val(
+				ldb_kv->cache->naming_contexts,
+				ldb,
+				&el->values[i]);
+			if (dn == NULL || !ldb_dn_validate(dn)) {
+				ldb_asprintf_errstring(
+					ldb,
+					"Invalid " LDB_KV_IDX_NAMING_CONTEXT
+					" %.*s in " LDB_KV_INDEXLIST,
+					(int)el->values[i].length,
+					(const char *)el->values[i].data);
+				return -1;
+			}
+			ldb_kv->cache->naming_contexts[i] = dn;
+		}
+		ldb_kv->cache->num_naming_contexts = el->num_values;
+	}
 	if (ldb_msg_find_element(ldb_kv->cache->indexlist, LDB_KV_IDXATTR) !=
 	    NULL) {
 		ldb_kv->cache->attribute_indexes = true;
 	}
+	if (ldb_msg_find_element(ldb_kv->cache->indexlist, LDB_KV_IDXSUBSTR) !=
+	    NULL) {
+		ldb_kv->cache->attribute_indexes = true;
+		ldb_kv->cache->substring_indexes = true;
+	}
 	ldb_kv->cache->GUID_index_attribute = ldb_msg_find_attr_as_string(
 	    ldb_kv->cache->indexlist, LDB_KV_IDXGUID, NULL);
 	ldb_kv->cache->GUID_index_dn_component = ldb_msg_find_attr_as_string(
 	    ldb_kv->cache->indexlist, LDB_KV_IDX_DN_GUID, NULL);
+	ldb_kv->cache->index_chunk_size = ldb_msg_find_attr_as_uint(
+	    ldb_kv->cache->indexlist, LDB_KV_IDX_CHUNK_SIZE, 0);
+	ldb_kv->cache->binary_index_keys = ldb_msg_find_attr_as_bool(
+	    ldb_kv->cache->indexlist, LDB_KV_IDX_BINARY_KEYS, false);
+	ldb_kv->cache->ordered_index = ldb_msg_find_attr_as_bool(
+	    ldb_kv->cache->indexlist, LDB_KV_IDX_ORDERED, false);
+	ldb_kv->cache->presence_index = ldb_msg_find_attr_as_bool(
+	    ldb_kv->cache->indexlist, LDB_KV_IDX_PRESENCE, false);
 
 	lmdb_subdb_version = ldb_msg_find_attr_as_int(
 	    ldb_kv->cache->indexlist, LDB_KV_IDX_LMDB_SUBDB, 0);
@@ -521,9 +541,12 @@ int ldb_kv_cache_load(struct ldb_module *module)
 		    ldb_msg_find_attr_as_bool(options, LDB_KV_CHECK_BASE, false);
 		ldb_kv->disallow_dn_filter = ldb_msg_find_attr_as_bool(
 		    options, LDB_KV_DISALLOW_DN_FILTER, false);
+		ldb_kv->pack_attr_directory = ldb_msg_find_attr_as_bool(
+		    options, LDB_KV_PACK_ATTR_DIRECTORY, false);
 	} else {
 		ldb_kv->check_base = false;
 		ldb_kv->disallow_dn_filter = false;
+		ldb_kv->pack_attr_directory = false;
 	}
 
 	/*
@@ -540,6 +563,10 @@ int ldb_kv_cache_load(struct ldb_module *module)
 		goto failed_and_unlock;
 	}
 
+	if (ldb_kv_index_stats_load(module, ldb_kv) != LDB_SUCCESS) {
+		goto failed_and_unlock;
+	}
+
 	/*
 	 * NOTE WELL: This is per-ldb, not per module, so overwrites
 	 * the handlers across all databases when used under Samba's
@@ -553,10 +580,20 @@ int ldb_kv_cache_load(struct ldb_module *module)
 	 * Initialise packing version and GUID index syntax, and force the
 	 * two to travel together, ie a GUID indexed database must use V2
 	 * packing format and a DN indexed database must use V1.
+	 *
+	 * A GUID indexed database may instead use V3, which adds a
+	 * directory of the attributes to each record, if
+	 * packAttributeDirectory is set in @OPTIONS.
 	 */
 	ldb_kv->GUID_index_syntax = NULL;
 	if (ldb_kv->cache->GUID_index_attribute != NULL) {
-		ldb_kv->target_pack_format_version = LDB_PACKING_FORMAT_V2;
+		if (ldb_kv->pack_attr_directory) {
+			ldb_kv->target_pack_format_version =
+				LDB_PACKING_FORMAT_V3;
+		} else {
+			ldb_kv->target_pack_format_version =
+				LDB_PACKING_FORMAT_V2;
+		}
 
 		/*
 		 * Now the attributes are loaded, set the guid_index_syntax.
@@ -111,6 +111,86 @@ dn: @INDEXLIST
 
 By default, the original DN format is used.
 
+In GUID index mode, index records with more than a given number
+of GUIDs may be split into chunks (see
+ldb_kv_dn_list_store_chunked()), so that adding to a large index
+record does not rewrite all of it:
+
+dn: @INDEXLIST
+@IDX_CHUNK_SIZE: 4096
+
+Values that are not printable are base64 encoded in the index key
+by default.  The bytes of the value may instead be used as they are,
+with 0x00 and 0x01 escaped as 0x01 0x01 and 0x01 0x02, by setting:
+
+dn: @INDEXLIST
+@IDX_BINARY_KEYS: TRUE
+
+These keys are shorter, and sort in the memcmp() order of the values,
+as the >= and <= searches (see ldb_kv_index_dn_ordered()) need.
+
+The >= and <= searches iterate over a range of index keys, which a
+TDB database can't do.  Setting:
+
+dn: @INDEXLIST
+@IDX_ORDERED: TRUE
+
+keeps a record of the indexed values, in order, of each attribute
+with an index_format_fn (such as ORDERED_INTEGER):
+
+dn: @INDEXORDER:USNCHANGED
+@IDXVALUE: <value>
+@IDXVALUE: <value>
+
+and these searches then look up each value in the range.  The
+record is updated in the transaction commit.  A record with many
+values is split into chunks (see ldb_kv_index_order_store1()), so
+that an attribute changed by every write, such as uSNChanged, does
+not have every value rewritten by each commit.
+
+Also in GUID index mode, a subtree search may be limited to the
+objects below its base, rather than to every object matching the
+filter, by setting:
+
+dn: @INDEXLIST
+@IDXSUBTREE: 1
+
+Each object is then listed in an index record for each of its
+ancestors, other than the root:
+
+dn: @INDEX:@IDXSUBTREE:OU=SALES,DC=EXAMPLE,DC=COM
+
+This costs one index entry per level of each DN, so is only worth
+setting where searches are often made below a small part of a large
+tree.  The record for a naming context lists the whole partition, and
+so would be rewritten on every add and delete.  No record is kept for
+the DNs listed as
+
+dn: @INDEXLIST
+@IDX_NAMING_CONTEXT: DC=EXAMPLE,DC=COM
+
+or for their ancestors, and searches below those bases use the index
+of the filter.  Elsewhere the subtree record is only read if the
+filter's own index is not expected to be smaller (see
+ldb_kv_index_use_subtree()).
+
+
+Index statistics
+----------------
+
+Each transaction commit keeps a summary of the index records up to
+date, for use by the search planner:
+
+dn: @INDEXSTATS
+@IDXOBJECTS: 1234
+@IDXSTAT: NAME 1200 1234
+
+@IDXOBJECTS is the number of indexed objects, and each @IDXSTAT
+value gives, for one (case-folded) attribute, the number of index
+records and the total number of entries in those records.  The
+record is rebuilt by a re-index, and until then it is not written
+into a database that does not already have one.
+
 
 Control points for choosing indexed attributes
 ----------------------------------------------
@@ -121,6 +201,32 @@ dn: @INDEXLIST
 @IDXATTR: samAccountName
 @IDXATTR: nETBIOSName
 
+@IDXSUBSTR gives an attribute a substring index, for (attr=*foo*)
+and (attr=foo*) searches:
+
+dn: @INDEXLIST
+@IDXSUBSTR: samAccountName
+
+Each distinct trigram of each canonicalised value of the attribute
+has an index record:
+
+dn: @INDEX:@IDXSUBSTR:SAMACCOUNTNAME:FOO
+
+and a search intersects the records of the trigrams in the filter.
+The result only narrows the search, every candidate is still checked
+against the filter, and a filter with no chunk of three or more
+bytes is not indexed.
+
+Setting:
+
+dn: @INDEXLIST
+@IDX_PRESENCE: TRUE
+
+also keeps, for each attribute listed in @IDXATTR, an index record of
+the objects that have the attribute, for (attr=*) searches:
+
+dn: @INDEX:@IDXPRESENT:SAMACCOUNTNAME
+
 
 C Override functions
 --------------------
@@ -145,36 +251,66 @@ ldb_schema_set_override_GUID_index() must be called.
 */
 
 #include "ldb_kv.h"
+#include "ldb_kv_index.h"
 #include "../ldb_tdb/ldb_tdb.h"
 #include "ldb_private.h"
 #include "lib/util/binsearch.h"
 #include "lib/util/attr.h"
+#include <pthread.h>
 
-struct dn_list {
-	unsigned int count;
-	struct ldb_val *dn;
-	/*
-	 * Do not optimise the intersection of this list,
-	 * we must never return an entry not in this
-	 * list.  This allows the index for
-	 * SCOPE_ONELEVEL to be trusted.
-	 */
-	bool strict;
+
+/*
+ * The changes to the @INDEXORDER record of an attribute, made in
+ * the transaction commit
+ */
+struct ldb_kv_index_order {
+	/* case-folded, as in the index keys */
+	char *attr;
+	/* does the attribute have an index_format_fn */
+	bool ordered;
+	struct ldb_val *added;
+	unsigned int num_added;
+	struct ldb_val *removed;
+	unsigned int num_removed;
 };
 
 struct ldb_kv_idxptr {
 	/*
-	 * In memory tdb to cache the index updates performed during a
-	 * transaction.  This improves the performance of operations like
-	 * re-index and join
+	 * In memory hash table (open addressing, with linear probing)
+	 * of the index updates performed during a transaction, keyed
+	 * on the index DN.  This improves the performance of
+	 * operations like re-index and join
 	 */
-	struct tdb_context *itdb;
+	struct ldb_kv_idxptr_entry **entries;
+	size_t num_slots;
+	size_t num_entries;
 	int error;
-};
-
-enum key_truncation {
-	KEY_NOT_TRUNCATED,
-	KEY_TRUNCATED,
+	/*
+	 * Set during a re-index when chunked index records were seen, so
+	 * that any old chunks are removed even if chunking is now off.
+	 */
+	bool chunk_cleanup;
+	/*
+	 * Set by a re-index, when the index statistics are rebuilt
+	 * from the index records written at commit, rather than
+	 * updated.
+	 */
+	bool stats_reset;
+	/*
+	 * Set for a bulk load or a re-index, when GUIDs are appended
+	 * to the index lists, which are sorted when next needed.
+	 */
+	bool append;
+	/* objects added less objects deleted in this transaction */
+	int64_t objects_delta;
+	/* the statistics being updated by the commit */
+	struct ldb_kv_index_stats *stats;
+	/* the @INDEXORDER records being updated by the commit */
+	struct ldb_kv_index_order *orders;
+	unsigned int num_orders;
+	/* @INDEXORDER records seen by a re-index, removed at commit */
+	struct ldb_dn **stale_orders;
+	unsigned int num_stale_orders;
 };
 
 static int ldb_kv_write_index_dn_guid(struct ldb_module *module,
@@ -186,263 +322,640 @@ static int ldb_kv_index_dn_base_dn(struct ldb_module *module,
 				   struct dn_list *dn_list,
 				   enum key_truncation *truncation);
 
-static void ldb_kv_dn_list_sort(struct ldb_kv_private *ldb_kv,
-				struct dn_list *list);
+/*
+  the number of hash table slots for an index cache expected to hold
+  num_entries entries: a power of two, keeping the table at most half
+  full.  A very large estimate is capped, the table grows if needed.
+ */
+#define LDB_KV_IDXPTR_MAX_INITIAL_SLOTS (1 << 24)
+static size_t ldb_kv_idxptr_slots_for(size_t num_entries)
+{
+	size_t num_slots = 16;
 
-/* we put a @IDXVERSION attribute on index entries. This
-   allows us to tell if it was written by an older version
-*/
-#define LDB_KV_INDEXING_VERSION 2
+	while (num_slots < num_entries * 2 &&
+	       num_slots < LDB_KV_IDXPTR_MAX_INITIAL_SLOTS) {
+		num_slots *= 2;
+	}
+	return num_slots;
+}
+
+static int ldb_kv_idxptr_init(struct ldb_kv_idxptr *idxptr,
+			      size_t num_entries)
+{
+	idxptr->num_slots = ldb_kv_idxptr_slots_for(num_entries);
+	idxptr->num_entries = 0;
+	idxptr->entries = talloc_zero_array(idxptr,
+					    struct ldb_kv_idxptr_entry *,
+					    idxptr->num_slots);
+	if (idxptr->entries == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	return LDB_SUCCESS;
+}
+
+/* 32 bit FNV-1a */
+static uint32_t ldb_kv_idxptr_hash(const struct ldb_val *key)
+{
+	uint32_t hash = 0x811c9dc5;
+	size_t i;
+
+	for (i = 0; i < key->length; i++) {
+		hash ^= key->data[i];
+		hash *= 0x01000193;
+	}
+	return hash;
+}
+
+static struct ldb_kv_idxptr_entry *ldb_kv_idxptr_find(
+	const struct ldb_kv_idxptr *idxptr,
+	const struct ldb_val *key,
+	uint32_t hash)
+{
+	size_t mask = idxptr->num_slots - 1;
+	size_t i;
+
+	for (i = hash & mask;
+	     idxptr->entries[i] != NULL;
+	     i = (i + 1) & mask) {
+		struct ldb_kv_idxptr_entry *e = idxptr->entries[i];
+
+		if (e->hash == hash &&
+		    e->key.length == key->length &&
+		    memcmp(e->key.data, key->data, key->length) == 0) {
+			return e;
+		}
+	}
+	return NULL;
+}
+
+static void ldb_kv_idxptr_place(struct ldb_kv_idxptr_entry **entries,
+				size_t num_slots,
+				struct ldb_kv_idxptr_entry *entry)
+{
+	size_t mask = num_slots - 1;
+	size_t i;
 
-#define LDB_KV_GUID_INDEXING_VERSION 3
+	for (i = entry->hash & mask;
+	     entries[i] != NULL;
+	     i = (i + 1) & mask) {
+		;
+	}
+	entries[i] = entry;
+}
 
-static unsigned ldb_kv_max_key_length(struct ldb_kv_private *ldb_kv)
+/*
+  add a new entry (not already present) to the index cache, doubling
+  the size of the hash table if it would become more than half full
+ */
+static int ldb_kv_idxptr_insert(struct ldb_kv_idxptr *idxptr,
+				struct ldb_kv_idxptr_entry *entry)
 {
-	if (ldb_kv->max_key_length == 0) {
-		return UINT_MAX;
+	if ((idxptr->num_entries + 1) * 2 > idxptr->num_slots) {
+		size_t num_slots = idxptr->num_slots * 2;
+		struct ldb_kv_idxptr_entry **entries = NULL;
+		size_t i;
+
+		entries = talloc_zero_array(idxptr,
+					    struct ldb_kv_idxptr_entry *,
+					    num_slots);
+		if (entries == NULL) {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+		for (i = 0; i < idxptr->num_slots; i++) {
+			if (idxptr->entries[i] != NULL) {
+				ldb_kv_idxptr_place(entries,
+						    num_slots,
+						    idxptr->entries[i]);
+			}
+		}
+		TALLOC_FREE(idxptr->entries);
+		idxptr->entries = entries;
+		idxptr->num_slots = num_slots;
 	}
-	return ldb_kv->max_key_length;
+
+	ldb_kv_idxptr_place(idxptr->entries, idxptr->num_slots, entry);
+	idxptr->num_entries++;
+	return LDB_SUCCESS;
 }
 
-/* enable the idxptr mode when transactions start */
+/*
+  enable the idxptr mode when transactions start
+
+  cache_size is the number of index records expected to be changed,
+  the index cache grows as needed if there are more.
+ */
 int ldb_kv_index_transaction_start(
 	struct ldb_module *module,
 	size_t cache_size)
 {
 	struct ldb_kv_private *ldb_kv = talloc_get_type(
 	    ldb_module_get_private(module), struct ldb_kv_private);
+	int ret;
+
 	ldb_kv->idxptr = talloc_zero(ldb_kv, struct ldb_kv_idxptr);
 	if (ldb_kv->idxptr == NULL) {
 		return ldb_oom(ldb_module_get_ctx(module));
 	}
 
-	ldb_kv->idxptr->itdb = tdb_open(
-		NULL,
-		cache_size,
-		TDB_INTERNAL,
-		O_RDWR,
-		0);
-	if (ldb_kv->idxptr->itdb == NULL) {
-		return LDB_ERR_OPERATIONS_ERROR;
+	ret = ldb_kv_idxptr_init(ldb_kv->idxptr, cache_size);
+	if (ret != LDB_SUCCESS) {
+		return ldb_oom(ldb_module_get_ctx(module));
 	}
+	ldb_kv->idxptr->append = ldb_kv->bulk_load;
 
 	return LDB_SUCCESS;
 }
 
 /*
-  see if two ldb_val structures contain exactly the same data
-  return -1 or 1 for a mismatch, 0 for match
-*/
-static int ldb_val_equal_exact_for_qsort(const struct ldb_val *v1,
-					 const struct ldb_val *v2)
+  return the flat GUID array held in the @IDX element of a GUID index
+  record.  This points into the record, nothing is copied.
+ */
+int ldb_kv_guid_index_values(const struct ldb_message_element *el,
+			     struct ldb_val *guids)
 {
-	if (v1->length > v2->length) {
-		return -1;
+	if (el->num_values == 0) {
+		return LDB_ERR_OPERATIONS_ERROR;
 	}
-	if (v1->length < v2->length) {
-		return 1;
+
+	if ((el->values[0].length % LDB_KV_GUID_SIZE) != 0
+	    || el->values[0].length == 0) {
+		return LDB_ERR_OPERATIONS_ERROR;
 	}
-	return memcmp(v1->data, v2->data, v1->length);
+	*guids = el->values[0];
+	return LDB_SUCCESS;
 }
 
 /*
-  see if two ldb_val structures contain exactly the same data
-  return -1 or 1 for a mismatch, 0 for match
-*/
-static int ldb_val_equal_exact_ordered(const struct ldb_val v1,
-				       const struct ldb_val *v2)
+ * Chunked GUID index records (@IDXVERSION 4)
+ *
+ * When @IDX_CHUNK_SIZE is set on @INDEXLIST, a GUID index record
+ * holding more than that many GUIDs is split over a number of chunk
+ * records, each an ordinary version 3 record.  The index record
+ * itself becomes a directory, with one @IDXCHUNK value per chunk:
+ *
+ * First GUID in the chunk (16 bytes)
+ * Chunk id (4 bytes, little endian)
+ * Number of GUIDs in the chunk (4 bytes, little endian)
+ *
+ * The chunk with id N of @INDEX:ATTR:VALUE is stored as
+ * @INDEXCHUNK:ATTR:VALUE#N.  As the chunks cover disjoint, ordered
+ * ranges of GUIDs, adding or removing a GUID only rewrites the one
+ * chunk covering it and the small directory record.  The chunk is
+ * found from the directory when the GUID is added or removed, so
+ * the other chunks are neither read nor written at commit.
+ */
+#define LDB_KV_INDEX_CHUNK_ENTRY_LEN (LDB_KV_GUID_SIZE + 8)
+
+static void ldb_kv_index_chunk_push(uint8_t *p,
+				    const struct ldb_kv_index_chunk *chunk)
 {
-	if (v1.length > v2->length) {
-		return -1;
-	}
-	if (v1.length < v2->length) {
-		return 1;
-	}
-	return memcmp(v1.data, v2->data, v1.length);
+	memcpy(p, chunk->first, LDB_KV_GUID_SIZE);
+	p += LDB_KV_GUID_SIZE;
+	p[0] = chunk->id & 0xFF;
+	p[1] = (chunk->id >> 8) & 0xFF;
+	p[2] = (chunk->id >> 16) & 0xFF;
+	p[3] = (chunk->id >> 24) & 0xFF;
+	p[4] = chunk->count & 0xFF;
+	p[5] = (chunk->count >> 8) & 0xFF;
+	p[6] = (chunk->count >> 16) & 0xFF;
+	p[7] = (chunk->count >> 24) & 0xFF;
 }
 
+static void ldb_kv_index_chunk_pull(const uint8_t *p,
+				    struct ldb_kv_index_chunk *chunk)
+{
+	memcpy(chunk->first, p, LDB_KV_GUID_SIZE);
+	p += LDB_KV_GUID_SIZE;
+	chunk->id = (uint32_t)p[0] |
+		((uint32_t)p[1] << 8) |
+		((uint32_t)p[2] << 16) |
+		((uint32_t)p[3] << 24);
+	chunk->count = (uint32_t)p[4] |
+		((uint32_t)p[5] << 8) |
+		((uint32_t)p[6] << 16) |
+		((uint32_t)p[7] << 24);
+}
 
 /*
-  find a entry in a dn_list, using a ldb_val. Uses a case sensitive
-  binary-safe comparison for the 'dn' returns -1 if not found
-
-  This is therefore safe when the value is a GUID in the future
+  parse the @IDXCHUNK values of a chunk directory record
  */
-static int ldb_kv_dn_list_find_val(struct ldb_kv_private *ldb_kv,
-				   const struct dn_list *list,
-				   const struct ldb_val *v)
+int ldb_kv_index_chunk_dir_parse(TALLOC_CTX *mem_ctx,
+				 const struct ldb_message *msg,
+				 struct ldb_kv_index_chunk **chunks,
+				 unsigned int *num_chunks)
 {
+	struct ldb_message_element *el = NULL;
+	struct ldb_kv_index_chunk *c = NULL;
 	unsigned int i;
-	struct ldb_val *exact = NULL, *next = NULL;
 
-	if (unlikely(list->count > INT_MAX)) {
-		return -1;
+	el = ldb_msg_find_element(msg, LDB_KV_IDXCHUNK);
+	if (el == NULL || el->num_values == 0) {
+		return LDB_ERR_OPERATIONS_ERROR;
 	}
 
-	if (ldb_kv->cache->GUID_index_attribute == NULL) {
-		for (i=0; i<list->count; i++) {
-			if (ldb_val_equal_exact(&list->dn[i], v) == 1) {
-				return i;
-			}
+	c = talloc_array(mem_ctx, struct ldb_kv_index_chunk, el->num_values);
+	if (c == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	for (i = 0; i < el->num_values; i++) {
+		if (el->values[i].length != LDB_KV_INDEX_CHUNK_ENTRY_LEN) {
+			TALLOC_FREE(c);
+			return LDB_ERR_OPERATIONS_ERROR;
 		}
-		return -1;
+		ldb_kv_index_chunk_pull(el->values[i].data, &c[i]);
 	}
 
-	BINARY_ARRAY_SEARCH_GTE(list->dn, list->count,
-				*v, ldb_val_equal_exact_ordered,
-				exact, next);
-	if (exact == NULL) {
-		return -1;
+	*chunks = c;
+	*num_chunks = el->num_values;
+	return LDB_SUCCESS;
+}
+
+struct ldb_kv_index_chunk_dir {
+	struct ldb_kv_index_chunk *chunks;
+	unsigned int num_chunks;
+	/* the chunk holds different GUIDs to those stored */
+	bool *dirty;
+};
+
+/*
+  build the chunk directory of a dn_list from the chunk directory
+  record msg, with every chunk clean
+ */
+static struct ldb_kv_index_chunk_dir *ldb_kv_index_chunk_dir_new(
+	TALLOC_CTX *mem_ctx,
+	const struct ldb_message *msg)
+{
+	struct ldb_kv_index_chunk_dir *dir = NULL;
+	int ret;
+
+	dir = talloc_zero(mem_ctx, struct ldb_kv_index_chunk_dir);
+	if (dir == NULL) {
+		return NULL;
 	}
-	/* Not required, but keeps the compiler quiet */
-	if (next != NULL) {
-		return -1;
+	ret = ldb_kv_index_chunk_dir_parse(dir,
+					   msg,
+					   &dir->chunks,
+					   &dir->num_chunks);
+	if (ret != LDB_SUCCESS) {
+		TALLOC_FREE(dir);
+		return NULL;
+	}
+	dir->dirty = talloc_zero_array(dir, bool, dir->num_chunks);
+	if (dir->dirty == NULL) {
+		TALLOC_FREE(dir);
+		return NULL;
 	}
+	return dir;
+}
+
+static struct ldb_kv_index_chunk_dir *ldb_kv_index_chunk_dir_copy(
+	TALLOC_CTX *mem_ctx,
+	const struct ldb_kv_index_chunk_dir *dir)
+{
+	struct ldb_kv_index_chunk_dir *copy = NULL;
 
-	i = exact - list->dn;
-	return i;
+	copy = talloc_zero(mem_ctx, struct ldb_kv_index_chunk_dir);
+	if (copy == NULL) {
+		return NULL;
+	}
+	copy->num_chunks = dir->num_chunks;
+	copy->chunks = talloc_memdup(copy,
+				     dir->chunks,
+				     sizeof(*dir->chunks) * dir->num_chunks);
+	copy->dirty = talloc_memdup(copy,
+				    dir->dirty,
+				    sizeof(*dir->dirty) * dir->num_chunks);
+	if (copy->chunks == NULL || copy->dirty == NULL) {
+		TALLOC_FREE(copy);
+		return NULL;
+	}
+	return copy;
 }
 
 /*
-  find a entry in a dn_list. Uses a case sensitive comparison with the dn
-  returns -1 if not found
+  fold the changes recorded in the chunk directory from into those of
+  to.  Both were read from the same stored record, so only differ in
+  which chunks are dirty.  A list with no chunk directory has been
+  replaced as a whole, so every chunk becomes dirty.
  */
-static int ldb_kv_dn_list_find_msg(struct ldb_kv_private *ldb_kv,
-				   struct dn_list *list,
-				   const struct ldb_message *msg)
+static void ldb_kv_index_chunk_dir_merge(struct ldb_kv_index_chunk_dir *to,
+					 const struct ldb_kv_index_chunk_dir *from)
 {
-	struct ldb_val v;
-	const struct ldb_val *key_val;
-	if (ldb_kv->cache->GUID_index_attribute == NULL) {
-		const char *dn_str = ldb_dn_get_linearized(msg->dn);
-		v.data = discard_const_p(unsigned char, dn_str);
-		v.length = strlen(dn_str);
-	} else {
-		key_val = ldb_msg_find_ldb_val(
-		    msg, ldb_kv->cache->GUID_index_attribute);
-		if (key_val == NULL) {
-			return -1;
+	unsigned int i;
+
+	if (to == NULL || to == from) {
+		return;
+	}
+	for (i = 0; i < to->num_chunks; i++) {
+		if (from == NULL || from->num_chunks != to->num_chunks) {
+			to->dirty[i] = true;
+		} else {
+			to->dirty[i] |= from->dirty[i];
 		}
-		v = *key_val;
 	}
-	return ldb_kv_dn_list_find_val(ldb_kv, list, &v);
 }
 
 /*
-  this is effectively a cast function, but with lots of paranoia
-  checks and also copes with CPUs that are fussy about pointer
-  alignment
+  mark the chunk of list whose range covers guid as dirty, as guid is
+  being added to or removed from the list
  */
-static struct dn_list *ldb_kv_index_idxptr(struct ldb_module *module,
-					   TDB_DATA rec)
+static void ldb_kv_dn_list_chunk_touch(struct dn_list *list,
+				       const struct ldb_val *guid)
 {
-	struct dn_list *list;
-	if (rec.dsize != sizeof(void *)) {
-		ldb_asprintf_errstring(ldb_module_get_ctx(module),
-				       "Bad data size for idxptr %u", (unsigned)rec.dsize);
-		return NULL;
+	struct ldb_kv_index_chunk_dir *dir = list->chunk_dir;
+	unsigned int lo = 0;
+	unsigned int hi;
+
+	if (dir == NULL) {
+		return;
 	}
-	/* note that we can't just use a cast here, as rec.dptr may
-	   not be aligned sufficiently for a pointer. A cast would cause
-	   platforms like some ARM CPUs to crash */
-	memcpy(&list, rec.dptr, sizeof(void *));
-	list = talloc_get_type(list, struct dn_list);
-	if (list == NULL) {
-		ldb_asprintf_errstring(ldb_module_get_ctx(module),
-				       "Bad type '%s' for idxptr",
-				       talloc_get_name(list));
-		return NULL;
+	if (guid->length != LDB_KV_GUID_SIZE) {
+		ldb_kv_index_chunk_dir_merge(dir, NULL);
+		return;
+	}
+
+	/*
+	 * The last chunk starting at or before guid, a GUID before the
+	 * first chunk joins that chunk
+	 */
+	hi = dir->num_chunks;
+	while (hi - lo > 1) {
+		unsigned int mid = lo + (hi - lo) / 2;
+		if (memcmp(dir->chunks[mid].first,
+			   guid->data,
+			   LDB_KV_GUID_SIZE) <= 0) {
+			lo = mid;
+		} else {
+			hi = mid;
+		}
 	}
-	return list;
+	dir->dirty[lo] = true;
 }
 
-enum dn_list_will_be_read_only {
-	DN_LIST_MUTABLE = 0,
-	DN_LIST_WILL_BE_READ_ONLY = 1,
-};
+/*
+  return the DN of chunk id of the index record dir_str
+ */
+static struct ldb_dn *ldb_kv_index_chunk_dn(TALLOC_CTX *mem_ctx,
+					    struct ldb_context *ldb,
+					    const char *dir_str,
+					    uint32_t id)
+{
+	size_t prefix_len = strlen(LDB_KV_INDEX);
 
-struct ldb_dn_list_state {
-	struct ldb_module *module;
-	struct dn_list *list;
-};
+	if (strncmp(dir_str, LDB_KV_INDEX, prefix_len) != 0) {
+		return NULL;
+	}
+	return ldb_dn_new_fmt(mem_ctx, ldb, "%s%s#%u",
+			      LDB_KV_INDEX_CHUNK,
+			      dir_str + prefix_len,
+			      (unsigned)id);
+}
 
-static int ldb_kv_index_idxptr_wrapper(TDB_DATA tdb_key,
-				       TDB_DATA tdb_data,
-				       void *private_data)
+/*
+  can the chunks of the index record dir_str be stored within the
+  maximum key length?
+ */
+static bool ldb_kv_index_chunk_key_fits(struct ldb_kv_private *ldb_kv,
+					const char *dir_str)
 {
-	struct ldb_dn_list_state *state = private_data;
-
-	/* The caller will check for NULL */
-	state->list = ldb_kv_index_idxptr(state->module, tdb_data);
+	/* "DN=", the longest possible "#<id>" and the trailing NUL */
+	size_t len = 3 + strlen(dir_str) + 11 + 1;
 
-	return 0;
+	len += strlen(LDB_KV_INDEX_CHUNK) - strlen(LDB_KV_INDEX);
+	return len <= ldb_kv_max_key_length(ldb_kv);
 }
 
 /*
-  return the @IDX list in an index entry for a dn as a
-  struct dn_list
+  read chunk of the index record dir_str, returning the chunk record
+  (allocated on mem_ctx) and the flat GUID array it holds
  */
-static int ldb_kv_dn_list_load(struct ldb_module *module,
-			       struct ldb_kv_private *ldb_kv,
-			       struct ldb_dn *dn,
-			       struct dn_list *list,
-			       enum dn_list_will_be_read_only read_only)
+int ldb_kv_index_chunk_read(struct ldb_module *module,
+			    const char *dir_str,
+			    const struct ldb_kv_index_chunk *chunk,
+			    TALLOC_CTX *mem_ctx,
+			    struct ldb_message **_msg,
+			    struct ldb_val *guids)
 {
-	struct ldb_message *msg;
-	int ret = -1, version;
-	struct ldb_message_element *el;
-	bool from_primary_cache = false;
-	TDB_DATA key = {0};
-	struct ldb_dn_list_state state = {
-		.module = module,
-	};
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	struct ldb_message *msg = NULL;
+	struct ldb_message_element *el = NULL;
+	struct ldb_dn *dn = NULL;
+	int version;
+	int ret;
 
-	*list = (struct dn_list){};
-	/*
-	 * See if we have an in memory index cache
-	 */
-	if (ldb_kv->idxptr == NULL) {
-		goto normal_index;
+	msg = ldb_msg_new(mem_ctx);
+	if (msg == NULL) {
+		return ldb_module_oom(module);
+	}
+	dn = ldb_kv_index_chunk_dn(msg, ldb, dir_str, chunk->id);
+	if (dn == NULL) {
+		TALLOC_FREE(msg);
+		return ldb_module_oom(module);
 	}
 
-	key.dptr = discard_const_p(unsigned char, ldb_dn_get_linearized(dn));
-	key.dsize = strlen((char *)key.dptr);
+	ret = ldb_kv_search_dn1(module,
+				dn,
+				msg,
+				LDB_UNPACK_DATA_FLAG_NO_DN |
+				LDB_UNPACK_DATA_FLAG_READ_LOCKED);
+	if (ret != LDB_SUCCESS) {
+		goto corrupt;
+	}
 
-	/*
-	 * Have we cached this index record?
-	 * If we have a nested transaction cache try that first.
-	 * then try the transaction cache.
-	 * if the record is not cached it will need to be read from disk.
-	 */
-	if (ldb_kv->nested_idx_ptr != NULL) {
-		ret = tdb_parse_record(ldb_kv->nested_idx_ptr->itdb,
-				       key,
-				       ldb_kv_index_idxptr_wrapper,
-				       &state);
+	el = ldb_msg_find_element(msg, LDB_KV_IDX);
+	if (el == NULL) {
+		goto corrupt;
 	}
-	if (ret == -1 /* not found */) {
-		from_primary_cache = true;
-		ret = tdb_parse_record(ldb_kv->idxptr->itdb,
-				       key,
-				       ldb_kv_index_idxptr_wrapper,
-				       &state);
+	version = ldb_msg_find_attr_as_int(msg, LDB_KV_IDXVERSION, 0);
+	if (version != LDB_KV_GUID_INDEXING_VERSION) {
+		goto corrupt;
 	}
-	if (ret == -1 /* not found */) {
-		goto normal_index;
+	ret = ldb_kv_guid_index_values(el, guids);
+	if (ret != LDB_SUCCESS ||
+	    guids->length != (size_t)chunk->count * LDB_KV_GUID_SIZE) {
+		goto corrupt;
 	}
 
-	if (ret != 0 || state.list == NULL) {
-		return LDB_ERR_OPERATIONS_ERROR;
-	}
+	*_msg = msg;
+	return LDB_SUCCESS;
 
-	/*
-	 * If this is a read only transaction the indexes will not be
-	 * changed so we don't need a copy in the event of a rollback
-	 *
-	 * In this case make an early return
-	 */
+corrupt:
+	ldb_asprintf_errstring(ldb,
+			       __location__
+			       ": Failed to load index chunk %u of %s",
+			       (unsigned)chunk->id,
+			       dir_str);
+	TALLOC_FREE(msg);
+	return LDB_ERR_OPERATIONS_ERROR;
+}
+
+/*
+  read and join the chunks of a chunked index record msg, returning
+  the flat GUID array allocated on mem_ctx
+ */
+static int ldb_kv_index_chunks_load(struct ldb_module *module,
+				    const char *dir_str,
+				    const struct ldb_message *msg,
+				    TALLOC_CTX *mem_ctx,
+				    struct ldb_val *guids)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	struct ldb_kv_index_chunk *chunks = NULL;
+	unsigned int num_chunks = 0;
+	TALLOC_CTX *tmp_ctx = NULL;
+	size_t total = 0;
+	size_t offset = 0;
+	unsigned int i;
+	int ret;
+
+	tmp_ctx = talloc_new(mem_ctx);
+	if (tmp_ctx == NULL) {
+		return ldb_module_oom(module);
+	}
+
+	ret = ldb_kv_index_chunk_dir_parse(tmp_ctx, msg, &chunks, &num_chunks);
+	if (ret != LDB_SUCCESS) {
+		goto corrupt;
+	}
+
+	for (i = 0; i < num_chunks; i++) {
+		if (total + chunks[i].count < total) {
+			goto corrupt;
+		}
+		total += chunks[i].count;
+	}
+	if (total > SIZE_MAX / LDB_KV_GUID_SIZE) {
+		goto corrupt;
+	}
+
+	guids->data = talloc_array(mem_ctx, uint8_t, total * LDB_KV_GUID_SIZE);
+	if (guids->data == NULL) {
+		TALLOC_FREE(tmp_ctx);
+		return ldb_module_oom(module);
+	}
+	guids->length = total * LDB_KV_GUID_SIZE;
+
+	for (i = 0; i < num_chunks; i++) {
+		struct ldb_message *chunk = NULL;
+		struct ldb_val v;
+
+		ret = ldb_kv_index_chunk_read(module,
+					      dir_str,
+					      &chunks[i],
+					      tmp_ctx,
+					      &chunk,
+					      &v);
+		if (ret != LDB_SUCCESS) {
+			TALLOC_FREE(tmp_ctx);
+			return ret;
+		}
+
+		memcpy(&guids->data[offset], v.data, v.length);
+		offset += v.length;
+		TALLOC_FREE(chunk);
+	}
+
+	TALLOC_FREE(tmp_ctx);
+	return LDB_SUCCESS;
+
+corrupt:
+	ldb_asprintf_errstring(ldb,
+			       __location__
+			       ": Failed to load index chunks for %s",
+			       dir_str);
+	TALLOC_FREE(tmp_ctx);
+	return LDB_ERR_OPERATIONS_ERROR;
+}
+
+enum dn_list_will_be_read_only {
+	DN_LIST_MUTABLE = 0,
+	DN_LIST_WILL_BE_READ_ONLY = 1,
+	/*
+	 * The list will only be appended to by a bulk load, so may
+	 * be returned without first being sorted
+	 */
+	DN_LIST_APPEND = 2,
+};
+
+/*
+  find the entry for an index DN in a transaction index cache
+ */
+struct ldb_kv_idxptr_entry *ldb_kv_idxptr_find_dn(
+	const struct ldb_kv_idxptr *idxptr,
+	struct ldb_dn *dn)
+{
+	struct ldb_val key;
+
+	key.data = discard_const_p(uint8_t, ldb_dn_get_linearized(dn));
+	if (key.data == NULL) {
+		return NULL;
+	}
+	key.length = strlen((char *)key.data);
+
+	return ldb_kv_idxptr_find(idxptr, &key, ldb_kv_idxptr_hash(&key));
+}
+
+/*
+  return the @IDX list in an index entry for a dn as a
+  struct dn_list
+ */
+static int ldb_kv_dn_list_load(struct ldb_module *module,
+			       struct ldb_kv_private *ldb_kv,
+			       struct ldb_dn *dn,
+			       struct dn_list *list,
+			       enum dn_list_will_be_read_only read_only)
+{
+	struct ldb_message *msg;
+	int ret = -1, version;
+	struct ldb_message_element *el;
+	struct ldb_kv_idxptr_entry *entry = NULL;
+	bool from_primary_cache = false;
+
+	*list = (struct dn_list){};
+	/*
+	 * See if we have an in memory index cache
+	 */
+	if (ldb_kv->idxptr == NULL) {
+		goto normal_index;
+	}
+
+	/*
+	 * Have we cached this index record?
+	 * If we have a nested transaction cache try that first.
+	 * then try the transaction cache.
+	 * if the record is not cached it will need to be read from disk.
+	 */
+	if (ldb_kv->nested_idx_ptr != NULL) {
+		entry = ldb_kv_idxptr_find_dn(ldb_kv->nested_idx_ptr, dn);
+	}
+	if (entry == NULL) {
+		from_primary_cache = true;
+		entry = ldb_kv_idxptr_find_dn(ldb_kv->idxptr, dn);
+	}
+	if (entry == NULL) {
+		goto normal_index;
+	}
+
+	if ((entry->list->unsorted || entry->list->check_duplicates) &&
+	    read_only != DN_LIST_APPEND) {
+		ldb_kv_dn_list_order(module, ldb_kv, entry);
+	}
+
+	list->dn = entry->list->dn;
+	list->count = entry->list->count;
+	list->stored_count = entry->list->stored_count;
+	list->unsorted = entry->list->unsorted;
+	list->check_duplicates = entry->list->check_duplicates;
+	list->chunk_dir = entry->list->chunk_dir;
+
+	/*
+	 * If this is a read only transaction the indexes will not be
+	 * changed so we don't need a copy in the event of a rollback
+	 *
+	 * In this case make an early return
+	 */
 	if (read_only == DN_LIST_WILL_BE_READ_ONLY) {
-		*list = *state.list;
 		return LDB_SUCCESS;
 	}
 
@@ -451,7 +964,6 @@ static int ldb_kv_dn_list_load(struct ldb_module *module,
 	 * already copied the primary cache record
 	 */
 	if (!from_primary_cache) {
-		*list = *state.list;
 		return LDB_SUCCESS;
 	}
 
@@ -459,47 +971,39 @@ static int ldb_kv_dn_list_load(struct ldb_module *module,
 	 * No index sub transaction active, so no need to cache a copy
 	 */
 	if (ldb_kv->nested_idx_ptr == NULL) {
-		*list = *state.list;
 		return LDB_SUCCESS;
 	}
 
 	/*
 	 * There is an active index sub transaction, and the record was
-	 * found in the primary index transaction cache.  A copy of the
-	 * record needs be taken to prevent the original entry being
-	 * altered, until the index sub transaction is committed, but we
-	 * don't copy the actual values, just the array of struct ldb_val
-	 * that points to the values (which are offsets into a GUID array).
+	 * found in the primary index transaction cache.  The original
+	 * entry must not be altered until the index sub transaction is
+	 * committed, so the list is marked as borrowing the array of
+	 * struct ldb_val, and the caller copies it (but not the actual
+	 * values, which are offsets into a GUID array) only if it goes
+	 * on to change the list.  The copy is then stored in the
+	 * sub-transaction cache, which masks the primary cache for the
+	 * duration of the sub-transaction.
 	 *
-	 * As a reminder, our primary cache is an in-memory tdb that
-	 * maps attributes to struct dn_list objects, which point to
-	 * the actual index, which is an array of struct ldb_val, the
-	 * contents of which are {.data = <binary GUID>, .length =
+	 * As a reminder, our primary cache is an in-memory hash table
+	 * that maps index DNs to struct dn_list objects, which point
+	 * to the actual index, which is an array of struct ldb_val,
+	 * the contents of which are {.data = <binary GUID>, .length =
 	 * 16}. The array is sorted by GUID data, and these GUIDs are
 	 * used to look up index entries in the main database. There
 	 * are more layers of indirection than necessary, but what
 	 * makes the index useful is we can use a binary search to
 	 * find if the array contains a GUID.
 	 *
-	 * What we do in a sub-transaction is make a copy of the struct
-	 * dn_list and the array of struct ldb_val, but *not* of the
-	 * .data that they point to. This copy is put into a new
-	 * in-memory tdb which masks the primary cache for the duration
-	 * of the sub-transaction.
-	 *
 	 * In an add operation in a sub-transaction, the new ldb_val
 	 * is a child of the sub-transaction dn_list, which will
 	 * become the main dn_list if the transaction succeeds.
 	 *
-	 * These acrobatics do not affect read-only operations.
+	 * These acrobatics do not affect read-only operations, or
+	 * lookups (like a duplicate check) which do not change the
+	 * list.
 	 */
-	list->dn = talloc_memdup(list,
-				 state.list->dn,
-				 talloc_get_size(state.list->dn));
-	if (list->dn == NULL) {
-		return LDB_ERR_OPERATIONS_ERROR;
-	}
-	list->count = state.list->count;
+	list->borrowed = true;
 	return LDB_SUCCESS;
 
 	/*
@@ -527,14 +1031,15 @@ normal_index:
 		return ret;
 	}
 
+	version = ldb_msg_find_attr_as_int(msg, LDB_KV_IDXVERSION, 0);
+
 	el = ldb_msg_find_element(msg, LDB_KV_IDX);
-	if (!el) {
+	if (!el && (ldb_kv->cache->GUID_index_attribute == NULL ||
+		    version != LDB_KV_GUID_CHUNKED_INDEXING_VERSION)) {
 		talloc_free(msg);
 		return LDB_SUCCESS;
 	}
 
-	version = ldb_msg_find_attr_as_int(msg, LDB_KV_IDXVERSION, 0);
-
 	/*
 	 * we avoid copying the strings by stealing the list.  We have
 	 * to steal msg onto el->values (which looks odd) because
@@ -558,7 +1063,9 @@ normal_index:
 		list->count = el->num_values;
 	} else {
 		unsigned int i;
-		if (version != LDB_KV_GUID_INDEXING_VERSION) {
+		struct ldb_val guids;
+		if (version != LDB_KV_GUID_INDEXING_VERSION &&
+		    version != LDB_KV_GUID_CHUNKED_INDEXING_VERSION) {
 			/* This is quite likely during the DB startup
 			   on first upgrade to using a GUID index */
 			ldb_debug_set(ldb_module_get_ctx(module),
@@ -571,17 +1078,32 @@ normal_index:
 			return LDB_ERR_OPERATIONS_ERROR;
 		}
 
-		if (el->num_values == 0) {
+		if (el != NULL) {
+			ret = ldb_kv_guid_index_values(el, &guids);
+		} else {
+			ret = ldb_kv_index_chunks_load(
+				module, ldb_dn_get_linearized(dn),
+				msg, msg, &guids);
+		}
+		if (ret != LDB_SUCCESS) {
 			talloc_free(msg);
-			return LDB_ERR_OPERATIONS_ERROR;
+			return ret;
 		}
 
-		if ((el->values[0].length % LDB_KV_GUID_SIZE) != 0) {
-			talloc_free(msg);
-			return LDB_ERR_OPERATIONS_ERROR;
+		/*
+		 * Keep the chunk directory of a list that may be
+		 * changed, so only the chunks changed are written
+		 */
+		if (el == NULL && read_only != DN_LIST_WILL_BE_READ_ONLY) {
+			list->chunk_dir = ldb_kv_index_chunk_dir_new(list,
+								     msg);
+			if (list->chunk_dir == NULL) {
+				talloc_free(msg);
+				return LDB_ERR_OPERATIONS_ERROR;
+			}
 		}
 
-		list->count = el->values[0].length / LDB_KV_GUID_SIZE;
+		list->count = guids.length / LDB_KV_GUID_SIZE;
 		list->dn = talloc_array(list, struct ldb_val, list->count);
 		if (list->dn == NULL) {
 			talloc_free(msg);
@@ -594,11 +1116,13 @@ normal_index:
 		talloc_steal(list->dn, msg);
 		for (i = 0; i < list->count; i++) {
 			list->dn[i].data
-				= &el->values[0].data[i * LDB_KV_GUID_SIZE];
+				= &guids.data[i * LDB_KV_GUID_SIZE];
 			list->dn[i].length = LDB_KV_GUID_SIZE;
 		}
 	}
 
+	list->stored_count = list->count;
+
 	/* We don't need msg->elements any more */
 	talloc_free(msg->elements);
 	return LDB_SUCCESS;
@@ -732,2948 +1256,7047 @@ int ldb_kv_key_dn_from_idx(struct ldb_module *module,
 
 
 /*
-  save a dn_list into a full @IDX style record
+  add the @IDXVERSION and @IDX elements describing a GUID list to msg
  */
-static int ldb_kv_dn_list_store_full(struct ldb_module *module,
-				     struct ldb_kv_private *ldb_kv,
-				     struct ldb_dn *dn,
-				     struct dn_list *list)
+static int ldb_kv_guid_index_msg_fill(struct ldb_module *module,
+				      struct ldb_message *msg,
+				      const struct dn_list *list)
 {
-	struct ldb_message *msg;
+	struct ldb_message_element *el;
+	struct ldb_val v;
+	unsigned int i;
 	int ret;
 
-	msg = ldb_msg_new(module);
-	if (!msg) {
+	ret = ldb_msg_add_fmt(msg, LDB_KV_IDXVERSION, "%u",
+			      LDB_KV_GUID_INDEXING_VERSION);
+	if (ret != LDB_SUCCESS) {
 		return ldb_module_oom(module);
 	}
 
-	msg->dn = dn;
+	ret = ldb_msg_add_empty(msg, LDB_KV_IDX, LDB_FLAG_MOD_ADD, &el);
+	if (ret != LDB_SUCCESS) {
+		return ldb_module_oom(module);
+	}
 
-	if (list->count == 0) {
-		ret = ldb_kv_delete_noindex(module, msg);
-		if (ret == LDB_ERR_NO_SUCH_OBJECT) {
-			ret = LDB_SUCCESS;
-		}
-		TALLOC_FREE(msg);
-		return ret;
+	el->values = talloc_array(msg, struct ldb_val, 1);
+	if (el->values == NULL) {
+		return ldb_module_oom(module);
 	}
 
-	if (ldb_kv->cache->GUID_index_attribute == NULL) {
-		ret = ldb_msg_add_fmt(msg, LDB_KV_IDXVERSION, "%u",
-				      LDB_KV_INDEXING_VERSION);
-		if (ret != LDB_SUCCESS) {
-			TALLOC_FREE(msg);
-			return ldb_module_oom(module);
-		}
-	} else {
-		ret = ldb_msg_add_fmt(msg, LDB_KV_IDXVERSION, "%u",
-				      LDB_KV_GUID_INDEXING_VERSION);
-		if (ret != LDB_SUCCESS) {
-			TALLOC_FREE(msg);
-			return ldb_module_oom(module);
-		}
+	v.data = talloc_array_size(el->values,
+				   list->count,
+				   LDB_KV_GUID_SIZE);
+	if (v.data == NULL) {
+		return ldb_module_oom(module);
 	}
 
-	if (list->count > 0) {
-		struct ldb_message_element *el;
+	v.length = talloc_get_size(v.data);
 
-		ret = ldb_msg_add_empty(msg, LDB_KV_IDX, LDB_FLAG_MOD_ADD, &el);
-		if (ret != LDB_SUCCESS) {
-			TALLOC_FREE(msg);
-			return ldb_module_oom(module);
+	for (i = 0; i < list->count; i++) {
+		if (list->dn[i].length != LDB_KV_GUID_SIZE) {
+			return ldb_module_operr(module);
 		}
+		memcpy(&v.data[LDB_KV_GUID_SIZE*i],
+		       list->dn[i].data,
+		       LDB_KV_GUID_SIZE);
+	}
+	el->values[0] = v;
+	el->num_values = 1;
 
-		if (ldb_kv->cache->GUID_index_attribute == NULL) {
-			el->values = list->dn;
-			el->num_values = list->count;
-		} else {
-			struct ldb_val v;
-			unsigned int i;
-			el->values = talloc_array(msg,
-						  struct ldb_val, 1);
-			if (el->values == NULL) {
-				TALLOC_FREE(msg);
-				return ldb_module_oom(module);
-			}
-
-			v.data = talloc_array_size(el->values,
-						   list->count,
-						   LDB_KV_GUID_SIZE);
-			if (v.data == NULL) {
-				TALLOC_FREE(msg);
-				return ldb_module_oom(module);
-			}
+	return LDB_SUCCESS;
+}
 
-			v.length = talloc_get_size(v.data);
+/*
+  delete a single index chunk record
+ */
+static int ldb_kv_index_chunk_delete(struct ldb_module *module,
+				     const char *dir_str,
+				     uint32_t id)
+{
+	struct ldb_message *msg = NULL;
+	int ret;
 
-			for (i = 0; i < list->count; i++) {
-				if (list->dn[i].length !=
-				    LDB_KV_GUID_SIZE) {
-					TALLOC_FREE(msg);
-					return ldb_module_operr(module);
-				}
-				memcpy(&v.data[LDB_KV_GUID_SIZE*i],
-				       list->dn[i].data,
-				       LDB_KV_GUID_SIZE);
-			}
-			el->values[0] = v;
-			el->num_values = 1;
-		}
+	msg = ldb_msg_new(module);
+	if (msg == NULL) {
+		return ldb_module_oom(module);
+	}
+	msg->dn = ldb_kv_index_chunk_dn(msg,
+					ldb_module_get_ctx(module),
+					dir_str,
+					id);
+	if (msg->dn == NULL) {
+		TALLOC_FREE(msg);
+		return ldb_module_oom(module);
 	}
 
-	ret = ldb_kv_store(module, msg, TDB_REPLACE);
+	ret = ldb_kv_delete_noindex(module, msg);
+	if (ret == LDB_ERR_NO_SUCH_OBJECT) {
+		ret = LDB_SUCCESS;
+	}
 	TALLOC_FREE(msg);
 	return ret;
 }
 
 /*
-  save a dn_list into the database, in either @IDX or internal format
+  write GUIDs [start, start + count) of list as the index chunk id
  */
-static int ldb_kv_dn_list_store(struct ldb_module *module,
-				struct ldb_dn *dn,
-				struct dn_list *list)
+static int ldb_kv_index_chunk_store(struct ldb_module *module,
+				    struct ldb_kv_private *ldb_kv,
+				    const char *dir_str,
+				    uint32_t id,
+				    const struct dn_list *list,
+				    unsigned int start,
+				    unsigned int count)
 {
-	struct ldb_kv_private *ldb_kv = talloc_get_type(
-	    ldb_module_get_private(module), struct ldb_kv_private);
-	TDB_DATA rec = {0};
-	TDB_DATA key = {0};
-
-	int ret = LDB_SUCCESS;
-	struct dn_list *list2 = NULL;
-	struct ldb_kv_idxptr *idxptr = NULL;
-	struct ldb_dn_list_state state = {
-		.module = module,
+	struct ldb_message *msg = NULL;
+	struct dn_list sub = {
+		.count = count,
+		.dn = &list->dn[start],
 	};
+	int ret;
 
-	key.dptr = discard_const_p(unsigned char, ldb_dn_get_linearized(dn));
-	if (key.dptr == NULL) {
-		return LDB_ERR_OPERATIONS_ERROR;
-	}
-	key.dsize = strlen((char *)key.dptr);
-
-	/*
-	 * If there is an index sub transaction active, update the
-	 * sub transaction index cache.  Otherwise update the
-	 * primary index cache
-	 */
-	if (ldb_kv->nested_idx_ptr != NULL) {
-		idxptr = ldb_kv->nested_idx_ptr;
-	} else {
-		idxptr = ldb_kv->idxptr;
+	msg = ldb_msg_new(module);
+	if (msg == NULL) {
+		return ldb_module_oom(module);
 	}
-	/*
-	 * Get the cache entry for the index
-	 *
-	 * As the value in the cache is a pointer to a dn_list we update
-	 * the dn_list directly.
-	 *
-	 */
-	ret = tdb_parse_record(idxptr->itdb,
-			       key,
-			       ldb_kv_index_idxptr_wrapper,
-			       &state);
-	if (ret == 0) {
-		list2 = state.list;
-		if (list2 == NULL) {
-			free(rec.dptr);
-			return LDB_ERR_OPERATIONS_ERROR;
-		}
-		/* Now put the updated pointer back in the cache */
-		if (list->dn == NULL) {
-			list2->dn = NULL;
-			list2->count = 0;
-		} else {
-			list2->dn = talloc_steal(list2, list->dn);
-			list2->count = list->count;
-		}
-		return LDB_SUCCESS;
+	msg->dn = ldb_kv_index_chunk_dn(msg,
+					ldb_module_get_ctx(module),
+					dir_str,
+					id);
+	if (msg->dn == NULL) {
+		TALLOC_FREE(msg);
+		return ldb_module_oom(module);
 	}
 
-	list2 = talloc(idxptr, struct dn_list);
-	if (list2 == NULL) {
-		return LDB_ERR_OPERATIONS_ERROR;
+	ret = ldb_kv_guid_index_msg_fill(module, msg, &sub);
+	if (ret != LDB_SUCCESS) {
+		TALLOC_FREE(msg);
+		return ret;
 	}
-	list2->dn = talloc_steal(list2, list->dn);
-	list2->count = list->count;
-	list2->strict = false;
-
-	rec.dptr = (uint8_t *)&list2;
-	rec.dsize = sizeof(void *);
-
 
-	/*
-	 * This is not a store into the main DB, but into an in-memory
-	 * TDB, so we don't need a guard on ltdb->read_only
-	 *
-	 * Also as we directly update the in memory dn_list for existing
-	 * cache entries we must be adding a new entry to the cache.
-	 */
-	ret = tdb_store(idxptr->itdb, key, rec, TDB_INSERT);
-	if (ret != 0) {
-		return ltdb_err_map( tdb_error(idxptr->itdb));
-	}
-	return LDB_SUCCESS;
+	ret = ldb_kv_store(module, msg, TDB_REPLACE);
+	TALLOC_FREE(msg);
+	return ret;
 }
 
 /*
-  traverse function for storing the in-memory index entries on disk
+  read the chunk directory of the index record dn as currently
+  stored, if it is a chunked record.  *num_chunks is set to zero
+  otherwise.
  */
-static int ldb_kv_index_traverse_store(_UNUSED_ struct tdb_context *tdb,
-				       TDB_DATA key,
-				       TDB_DATA data,
-				       void *state)
+static int ldb_kv_index_chunk_dir_read(struct ldb_module *module,
+				       struct ldb_dn *dn,
+				       TALLOC_CTX *mem_ctx,
+				       struct ldb_kv_index_chunk **chunks,
+				       unsigned int *num_chunks)
 {
-	struct ldb_module *module = state;
-	struct ldb_kv_private *ldb_kv = talloc_get_type(
-	    ldb_module_get_private(module), struct ldb_kv_private);
-	struct ldb_dn *dn;
-	struct ldb_context *ldb = ldb_module_get_ctx(module);
-	struct ldb_val v;
-	struct dn_list *list;
+	struct ldb_message *msg = NULL;
+	int ret;
 
-	list = ldb_kv_index_idxptr(module, data);
-	if (list == NULL) {
-		ldb_kv->idxptr->error = LDB_ERR_OPERATIONS_ERROR;
-		return -1;
+	*chunks = NULL;
+	*num_chunks = 0;
+
+	msg = ldb_msg_new(mem_ctx);
+	if (msg == NULL) {
+		return ldb_module_oom(module);
 	}
 
-	v.data = key.dptr;
-	v.length = strnlen((char *)key.dptr, key.dsize);
+	ret = ldb_kv_search_dn1(module, dn, msg, LDB_UNPACK_DATA_FLAG_NO_DN);
+	if (ret == LDB_ERR_NO_SUCH_OBJECT) {
+		TALLOC_FREE(msg);
+		return LDB_SUCCESS;
+	}
+	if (ret != LDB_SUCCESS) {
+		TALLOC_FREE(msg);
+		return ret;
+	}
 
-	dn = ldb_dn_from_ldb_val(module, ldb, &v);
-	if (dn == NULL) {
-		ldb_asprintf_errstring(ldb, "Failed to parse index key %*.*s as an LDB DN", (int)v.length, (int)v.length, (const char *)v.data);
-		ldb_kv->idxptr->error = LDB_ERR_OPERATIONS_ERROR;
-		return -1;
+	if (ldb_msg_find_attr_as_int(msg, LDB_KV_IDXVERSION, 0) !=
+	    LDB_KV_GUID_CHUNKED_INDEXING_VERSION) {
+		TALLOC_FREE(msg);
+		return LDB_SUCCESS;
 	}
 
-	ldb_kv->idxptr->error =
-	    ldb_kv_dn_list_store_full(module, ldb_kv, dn, list);
-	talloc_free(dn);
-	if (ldb_kv->idxptr->error != 0) {
-		return -1;
+	ret = ldb_kv_index_chunk_dir_parse(mem_ctx, msg, chunks, num_chunks);
+	TALLOC_FREE(msg);
+	if (ret != LDB_SUCCESS) {
+		ldb_asprintf_errstring(ldb_module_get_ctx(module),
+				       __location__
+				       ": Corrupt index chunk directory %s",
+				       ldb_dn_get_linearized(dn));
 	}
-	return 0;
+	return ret;
 }
 
-/* cleanup the idxptr mode when transaction commits */
-int ldb_kv_index_transaction_commit(struct ldb_module *module)
+/*
+  save a GUID dn_list as a chunk directory and a set of chunks.
+
+  The existing chunk boundaries (the first GUID of each chunk) are
+  kept, so that an add or delete only rewrites the one chunk covering
+  that GUID.  Only the chunks marked dirty are written (all of them if
+  dirty is NULL), chunks that have grown past twice the chunk size
+  are split and chunks that have become empty are removed.
+ */
+static int ldb_kv_dn_list_store_chunked(struct ldb_module *module,
+					struct ldb_kv_private *ldb_kv,
+					struct ldb_dn *dn,
+					const char *dir_str,
+					const struct dn_list *list,
+					const struct ldb_kv_index_chunk *old,
+					const bool *dirty,
+					unsigned int num_old)
 {
-	struct ldb_kv_private *ldb_kv = talloc_get_type(
-	    ldb_module_get_private(module), struct ldb_kv_private);
+	unsigned int chunk_size = ldb_kv->cache->index_chunk_size;
+	TALLOC_CTX *tmp_ctx = NULL;
+	struct ldb_kv_index_chunk *chunks = NULL;
+	struct ldb_message *msg = NULL;
+	struct ldb_message_element *el = NULL;
+	unsigned int num_chunks = 0;
+	unsigned int pos = 0;
+	unsigned int i, j;
+	uint32_t next_id = 1;
 	int ret;
 
-	struct ldb_context *ldb = ldb_module_get_ctx(module);
-
-	ldb_reset_err_string(ldb);
-
-	if (ldb_kv->idxptr->itdb) {
-		tdb_traverse(
-		    ldb_kv->idxptr->itdb, ldb_kv_index_traverse_store, module);
-		tdb_close(ldb_kv->idxptr->itdb);
+	tmp_ctx = talloc_new(module);
+	if (tmp_ctx == NULL) {
+		return ldb_module_oom(module);
 	}
 
-	ret = ldb_kv->idxptr->error;
-	if (ret != LDB_SUCCESS) {
-		if (!ldb_errstring(ldb)) {
-			ldb_set_errstring(ldb, ldb_strerror(ret));
+	for (i = 0; i < num_old; i++) {
+		if (old[i].id >= next_id) {
+			next_id = old[i].id + 1;
 		}
-		ldb_asprintf_errstring(ldb, "Failed to store index records in transaction commit: %s", ldb_errstring(ldb));
 	}
 
-	talloc_free(ldb_kv->idxptr);
-	ldb_kv->idxptr = NULL;
-	return ret;
-}
-
-/* cleanup the idxptr mode when transaction cancels */
-int ldb_kv_index_transaction_cancel(struct ldb_module *module)
-{
-	struct ldb_kv_private *ldb_kv = talloc_get_type(
-	    ldb_module_get_private(module), struct ldb_kv_private);
-	if (ldb_kv->idxptr && ldb_kv->idxptr->itdb) {
-		tdb_close(ldb_kv->idxptr->itdb);
+	/*
+	 * Every chunk we keep or write is at least chunk_size long,
+	 * except at most one per old chunk.
+	 */
+	chunks = talloc_array(tmp_ctx,
+			      struct ldb_kv_index_chunk,
+			      num_old + list->count / chunk_size + 1);
+	if (chunks == NULL) {
+		TALLOC_FREE(tmp_ctx);
+		return ldb_module_oom(module);
 	}
-	TALLOC_FREE(ldb_kv->idxptr);
-	ldb_kv_index_sub_transaction_cancel(ldb_kv);
-	return LDB_SUCCESS;
-}
 
+	for (j = 0; j < MAX(num_old, 1); j++) {
+		unsigned int end = list->count;
+		unsigned int len;
+		uint32_t id;
 
-/*
-  return the dn key to be used for an index
-  the caller is responsible for freeing
-*/
-static struct ldb_dn *ldb_kv_index_key(struct ldb_context *ldb,
-				       TALLOC_CTX *mem_ctx,
-				       struct ldb_kv_private *ldb_kv,
-				       const char *attr,
-				       const struct ldb_val *value,
-				       const struct ldb_schema_attribute **ap,
-				       enum key_truncation *truncation)
-{
-	struct ldb_dn *ret;
-	struct ldb_val v;
-	const struct ldb_schema_attribute *a = NULL;
-	char *attr_folded = NULL;
-	const char *attr_for_dn = NULL;
-	int r;
-	bool should_b64_encode;
-
-	unsigned int max_key_length = ldb_kv_max_key_length(ldb_kv);
-	size_t key_len = 0;
-	size_t attr_len = 0;
-	const size_t indx_len = sizeof(LDB_KV_INDEX) - 1;
-	unsigned frmt_len = 0;
-	const size_t additional_key_length = 4;
-	unsigned int num_separators = 3; /* Estimate for overflow check */
-	const size_t min_data = 1;
-	const size_t min_key_length = additional_key_length
-		+ indx_len + num_separators + min_data;
-	struct ldb_val empty;
-
-	/*
-	 * Accept a NULL value as a request for a key with no value.  This is
-	 * different from passing an empty value, which might be given
-	 * significance by some canonicalise functions.
-	 */
-	bool empty_val = value == NULL;
-	if (empty_val) {
-		empty.length = 0;
-		empty.data = discard_const_p(unsigned char, "");
-		value = &empty;
-	}
-
-	if (attr[0] == '@') {
-		attr_for_dn = attr;
-		v = *value;
-		if (ap != NULL) {
-			*ap = NULL;
-		}
-	} else {
-		attr_folded = ldb_attr_casefold(ldb, attr);
-		if (!attr_folded) {
-			return NULL;
+		/*
+		 * A clean chunk holds the same GUIDs as when it was
+		 * read, so is kept without looking at them
+		 */
+		if (num_old != 0 && dirty != NULL && !dirty[j]) {
+			if (old[j].count > list->count - pos) {
+				TALLOC_FREE(tmp_ctx);
+				return ldb_module_operr(module);
+			}
+			chunks[num_chunks] = old[j];
+			num_chunks++;
+			pos += old[j].count;
+			continue;
 		}
 
-		attr_for_dn = attr_folded;
+		if (j + 1 < num_old) {
+			end = pos;
+			while (end < list->count &&
+			       memcmp(list->dn[end].data,
+				      old[j + 1].first,
+				      LDB_KV_GUID_SIZE) < 0) {
+				end++;
+			}
+		}
+		len = end - pos;
 
-		a = ldb_schema_attribute_by_name(ldb, attr);
-		if (ap) {
-			*ap = a;
+		if (len == 0) {
+			/* The chunk is now empty, deleted below */
+			continue;
 		}
 
-		if (empty_val) {
-			v = *value;
-		} else {
-			ldb_attr_handler_t fn;
-			if (a->syntax->index_format_fn &&
-			    ldb_kv->cache->GUID_index_attribute != NULL) {
-				fn = a->syntax->index_format_fn;
-			} else {
-				fn = a->syntax->canonicalise_fn;
+		/*
+		 * Rewrite this chunk in place, splitting it if it has
+		 * become too large (or if this is the first time the
+		 * record is being chunked)
+		 */
+		id = num_old != 0 ? old[j].id : next_id++;
+		while (len > 0) {
+			unsigned int n = len;
+			if (num_old == 0 || len > chunk_size * 2) {
+				n = MIN(len, chunk_size);
 			}
-			r = fn(ldb, ldb, value, &v);
-			if (r != LDB_SUCCESS) {
-				const char *errstr = ldb_errstring(ldb);
-				/* canonicalisation can be refused. For
-				   example, a attribute that takes wildcards
-				   will refuse to canonicalise if the value
-				   contains a wildcard */
-				ldb_asprintf_errstring(ldb,
-						       "Failed to create "
-						       "index key for "
-						       "attribute '%s':%s%s%s",
-						       attr, ldb_strerror(r),
-						       (errstr?":":""),
-						       (errstr?errstr:""));
-				talloc_free(attr_folded);
-				return NULL;
+
+			ret = ldb_kv_index_chunk_store(module, ldb_kv,
+						       dir_str, id,
+						       list, pos, n);
+			if (ret != LDB_SUCCESS) {
+				TALLOC_FREE(tmp_ctx);
+				return ret;
 			}
+
+			memcpy(chunks[num_chunks].first,
+			       list->dn[pos].data,
+			       LDB_KV_GUID_SIZE);
+			chunks[num_chunks].id = id;
+			chunks[num_chunks].count = n;
+			num_chunks++;
+
+			pos += n;
+			len -= n;
+			id = next_id++;
 		}
 	}
-	attr_len = strlen(attr_for_dn);
 
-	/*
-	 * Check if there is any hope this will fit into the DB.
-	 * Overflow here is not actually critical the code below
-	 * checks again to make the printf and the DB does another
-	 * check for too long keys
-	 */
-	if (max_key_length - attr_len < min_key_length) {
-		ldb_asprintf_errstring(
-			ldb,
-			__location__ ": max_key_length "
-			"is too small (%u) < (%u)",
-			max_key_length,
-			(unsigned)(min_key_length + attr_len));
-		talloc_free(attr_folded);
-		return NULL;
+	if (pos != list->count) {
+		TALLOC_FREE(tmp_ctx);
+		return ldb_module_operr(module);
 	}
 
-	/*
-	 * ltdb_key_dn() makes something 4 bytes longer, it adds a leading
-	 * "DN=" and a trailing string terminator
-	 */
-	max_key_length -= additional_key_length;
-
-	/*
-	 * We do not base 64 encode a DN in a key, it has already been
-	 * casefolded and linearized, that is good enough.  That already
-	 * avoids embedded NUL etc.
-	 */
-	if (ldb_kv->cache->GUID_index_attribute != NULL) {
-		if (strcmp(attr, LDB_KV_IDXDN) == 0) {
-			should_b64_encode = false;
-		} else if (strcmp(attr, LDB_KV_IDXONE) == 0) {
-			/*
-			 * We can only change the behaviour for IDXONE
-			 * when the GUID index is enabled
-			 */
-			should_b64_encode = false;
-		} else {
-			should_b64_encode
-				= ldb_should_b64_encode(ldb, &v);
+	/* Remove any old chunks no longer referenced */
+	for (i = 0; i < num_old; i++) {
+		bool found = false;
+		for (j = 0; j < num_chunks; j++) {
+			if (chunks[j].id == old[i].id) {
+				found = true;
+				break;
+			}
 		}
-	} else {
-		should_b64_encode = ldb_should_b64_encode(ldb, &v);
-	}
-
-	if (should_b64_encode) {
-		size_t vstr_len = 0;
-		char *vstr = ldb_base64_encode(mem_ctx, (char *)v.data, v.length);
-		if (!vstr) {
-			talloc_free(attr_folded);
-			return NULL;
+		if (found) {
+			continue;
 		}
-		vstr_len = strlen(vstr);
-		/*
-		 * Overflow here is not critical as we only use this
-		 * to choose the printf truncation
-		 */
-		key_len = num_separators + indx_len + attr_len + vstr_len;
-		if (key_len > max_key_length) {
-			size_t excess = key_len - max_key_length;
-			frmt_len = vstr_len - excess;
-			*truncation = KEY_TRUNCATED;
-			/*
-			* Truncated keys are placed in a separate key space
-			* from the non truncated keys
-			* Note: the double hash "##" is not a typo and
-			* indicates that the following value is base64 encoded
-			*/
-			ret = ldb_dn_new_fmt(mem_ctx, ldb, "%s#%s##%.*s",
-					     LDB_KV_INDEX, attr_for_dn,
-					     frmt_len, vstr);
-		} else {
-			frmt_len = vstr_len;
-			*truncation = KEY_NOT_TRUNCATED;
-			/*
-			 * Note: the double colon "::" is not a typo and
-			 * indicates that the following value is base64 encoded
-			 */
-			ret = ldb_dn_new_fmt(mem_ctx, ldb, "%s:%s::%.*s",
-					     LDB_KV_INDEX, attr_for_dn,
-					     frmt_len, vstr);
+		ret = ldb_kv_index_chunk_delete(module, dir_str, old[i].id);
+		if (ret != LDB_SUCCESS) {
+			TALLOC_FREE(tmp_ctx);
+			return ret;
 		}
-		talloc_free(vstr);
-	} else {
-		/* Only need two separators */
-		num_separators = 2;
+	}
 
-		/*
-		 * Overflow here is not critical as we only use this
-		 * to choose the printf truncation
-		 */
-		key_len = num_separators + indx_len + attr_len + (int)v.length;
-		if (key_len > max_key_length) {
-			size_t excess = key_len - max_key_length;
-			frmt_len = v.length - excess;
-			*truncation = KEY_TRUNCATED;
-			/*
-			 * Truncated keys are placed in a separate key space
-			 * from the non truncated keys
-			 */
-			ret = ldb_dn_new_fmt(mem_ctx, ldb, "%s#%s#%.*s",
-					     LDB_KV_INDEX, attr_for_dn,
-					     frmt_len, (char *)v.data);
-		} else {
-			frmt_len = v.length;
-			*truncation = KEY_NOT_TRUNCATED;
-			ret = ldb_dn_new_fmt(mem_ctx, ldb, "%s:%s:%.*s",
-					     LDB_KV_INDEX, attr_for_dn,
-					     frmt_len, (char *)v.data);
-		}
+	msg = ldb_msg_new(tmp_ctx);
+	if (msg == NULL) {
+		TALLOC_FREE(tmp_ctx);
+		return ldb_module_oom(module);
+	}
+	msg->dn = dn;
+
+	ret = ldb_msg_add_fmt(msg, LDB_KV_IDXVERSION, "%u",
+			      LDB_KV_GUID_CHUNKED_INDEXING_VERSION);
+	if (ret != LDB_SUCCESS) {
+		TALLOC_FREE(tmp_ctx);
+		return ldb_module_oom(module);
 	}
 
-	if (value != NULL && v.data != value->data && !empty_val) {
-		talloc_free(v.data);
+	ret = ldb_msg_add_empty(msg, LDB_KV_IDXCHUNK, LDB_FLAG_MOD_ADD, &el);
+	if (ret != LDB_SUCCESS) {
+		TALLOC_FREE(tmp_ctx);
+		return ldb_module_oom(module);
+	}
+	el->values = talloc_array(msg, struct ldb_val, num_chunks);
+	if (el->values == NULL) {
+		TALLOC_FREE(tmp_ctx);
+		return ldb_module_oom(module);
+	}
+	for (i = 0; i < num_chunks; i++) {
+		uint8_t *p = talloc_array(el->values,
+					  uint8_t,
+					  LDB_KV_INDEX_CHUNK_ENTRY_LEN);
+		if (p == NULL) {
+			TALLOC_FREE(tmp_ctx);
+			return ldb_module_oom(module);
+		}
+		ldb_kv_index_chunk_push(p, &chunks[i]);
+		el->values[i].data = p;
+		el->values[i].length = LDB_KV_INDEX_CHUNK_ENTRY_LEN;
 	}
-	talloc_free(attr_folded);
+	el->num_values = num_chunks;
 
+	ret = ldb_kv_store(module, msg, TDB_REPLACE);
+	TALLOC_FREE(tmp_ctx);
 	return ret;
 }
 
 /*
-  see if a attribute value is in the list of indexed attributes
-*/
-static bool ldb_kv_is_indexed(struct ldb_module *module,
-			      struct ldb_kv_private *ldb_kv,
-			      const char *attr)
+  save a dn_list into a full @IDX style record
+ */
+static int ldb_kv_dn_list_store_full(struct ldb_module *module,
+				     struct ldb_kv_private *ldb_kv,
+				     struct ldb_dn *dn,
+				     struct dn_list *list)
 {
-	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	struct ldb_message *msg;
+	struct ldb_kv_index_chunk *old_chunks = NULL;
+	const bool *dirty = NULL;
+	unsigned int num_old_chunks = 0;
+	const char *dir_str = NULL;
 	unsigned int i;
-	struct ldb_message_element *el;
+	int ret;
 
-	if ((ldb_kv->cache->GUID_index_attribute != NULL) &&
-	    (ldb_attr_cmp(attr, ldb_kv->cache->GUID_index_attribute) == 0)) {
-		/* Implicitly covered, this is the index key */
-		return false;
+	msg = ldb_msg_new(module);
+	if (!msg) {
+		return ldb_module_oom(module);
 	}
-	if (ldb->schema.index_handler_override) {
-		const struct ldb_schema_attribute *a
-			= ldb_schema_attribute_by_name(ldb, attr);
 
-		if (a == NULL) {
-			return false;
-		}
+	msg->dn = dn;
 
-		if (a->flags & LDB_ATTR_FLAG_INDEXED) {
-			return true;
-		} else {
-			return false;
+	/*
+	 * If the list was read from a chunked record, its chunk
+	 * directory says which chunks have changed.  Otherwise, if
+	 * this record may be (or may have been) split into chunks,
+	 * find the existing chunks so they can be replaced or removed.
+	 */
+	if (list->chunk_dir != NULL) {
+		dir_str = ldb_dn_get_linearized(dn);
+		if (dir_str == NULL) {
+			TALLOC_FREE(msg);
+			return ldb_module_oom(module);
+		}
+		old_chunks = list->chunk_dir->chunks;
+		num_old_chunks = list->chunk_dir->num_chunks;
+		dirty = list->chunk_dir->dirty;
+	} else if (ldb_kv->cache->GUID_index_attribute != NULL &&
+		   (ldb_kv->cache->index_chunk_size != 0 ||
+		    ldb_kv->idxptr->chunk_cleanup)) {
+		dir_str = ldb_dn_get_linearized(dn);
+		if (dir_str == NULL) {
+			TALLOC_FREE(msg);
+			return ldb_module_oom(module);
+		}
+		ret = ldb_kv_index_chunk_dir_read(module, dn, msg,
+						  &old_chunks,
+						  &num_old_chunks);
+		if (ret != LDB_SUCCESS) {
+			TALLOC_FREE(msg);
+			return ret;
 		}
 	}
 
-	if (!ldb_kv->cache->attribute_indexes) {
-		return false;
+	if (list->count == 0) {
+		ret = ldb_kv_delete_noindex(module, msg);
+		if (ret == LDB_ERR_NO_SUCH_OBJECT) {
+			ret = LDB_SUCCESS;
+		}
+		goto remove_chunks;
 	}
 
-	el = ldb_msg_find_element(ldb_kv->cache->indexlist, LDB_KV_IDXATTR);
-	if (el == NULL) {
-		return false;
-	}
+	if (ldb_kv->cache->GUID_index_attribute == NULL) {
+		struct ldb_message_element *el;
 
-	/* TODO: this is too expensive! At least use a binary search */
-	for (i=0; i<el->num_values; i++) {
-		if (ldb_attr_cmp((char *)el->values[i].data, attr) == 0) {
-			return true;
+		ret = ldb_msg_add_fmt(msg, LDB_KV_IDXVERSION, "%u",
+				      LDB_KV_INDEXING_VERSION);
+		if (ret != LDB_SUCCESS) {
+			TALLOC_FREE(msg);
+			return ldb_module_oom(module);
 		}
-	}
-	return false;
-}
 
-/*
-  in the following logic functions, the return value is treated as
-  follows:
+		ret = ldb_msg_add_empty(msg, LDB_KV_IDX, LDB_FLAG_MOD_ADD, &el);
+		if (ret != LDB_SUCCESS) {
+			TALLOC_FREE(msg);
+			return ldb_module_oom(module);
+		}
+		el->values = list->dn;
+		el->num_values = list->count;
+	} else {
+		if (ldb_kv->cache->index_chunk_size != 0 &&
+		    list->count > ldb_kv->cache->index_chunk_size &&
+		    ldb_kv_index_chunk_key_fits(ldb_kv, dir_str)) {
+			ret = ldb_kv_dn_list_store_chunked(module,
+							   ldb_kv,
+							   dn,
+							   dir_str,
+							   list,
+							   old_chunks,
+							   dirty,
+							   num_old_chunks);
+			TALLOC_FREE(msg);
+			return ret;
+		}
 
-     LDB_SUCCESS: we found some matching index values
+		ret = ldb_kv_guid_index_msg_fill(module, msg, list);
+		if (ret != LDB_SUCCESS) {
+			TALLOC_FREE(msg);
+			return ret;
+		}
+	}
 
-     LDB_ERR_NO_SUCH_OBJECT: we know for sure that no object matches
-
-     LDB_ERR_OPERATIONS_ERROR: indexing could not answer the call,
-                               we'll need a full search
- */
-
-/*
-  return a list of dn's that might match a simple indexed search (an
-  equality search only)
- */
-static int ldb_kv_index_dn_simple(struct ldb_module *module,
-				  struct ldb_kv_private *ldb_kv,
-				  const struct ldb_parse_tree *tree,
-				  struct dn_list *list)
-{
-	struct ldb_context *ldb;
-	struct ldb_dn *dn;
-	int ret;
-	enum key_truncation truncation = KEY_NOT_TRUNCATED;
-
-	ldb = ldb_module_get_ctx(module);
-
-	*list = (struct dn_list){};
-
-	/* if the attribute isn't in the list of indexed attributes then
-	   this node needs a full search */
-	if (!ldb_kv_is_indexed(module, ldb_kv, tree->u.equality.attr)) {
-		return LDB_ERR_OPERATIONS_ERROR;
-	}
+	ret = ldb_kv_store(module, msg, TDB_REPLACE);
 
+remove_chunks:
 	/*
-	 * the attribute is indexed. Pull the list of DNs that match the
-	 * search criterion
-	 *
-	 * list is used as a memory context as it has a shorter life
-	 * than 'ldb'.  Regardless we talloc_free() 'dn' below.
-	 */
-	dn = ldb_kv_index_key(ldb,
-			      list,
-			      ldb_kv,
-			      tree->u.equality.attr,
-			      &tree->u.equality.value,
-			      NULL,
-			      &truncation);
-	/*
-	 * We ignore truncation here and allow multi-valued matches
-	 * as ltdb_search_indexed will filter out the wrong one in
-	 * ltdb_index_filter() which calls ldb_match_message().
+	 * The record is no longer chunked (it was deleted, or is small
+	 * enough to be stored in one record), so remove any old chunks
 	 */
-	if (!dn) {
-		return LDB_ERR_OPERATIONS_ERROR;
+	for (i = 0; ret == LDB_SUCCESS && i < num_old_chunks; i++) {
+		ret = ldb_kv_index_chunk_delete(module,
+						dir_str,
+						old_chunks[i].id);
 	}
-
-	ret = ldb_kv_dn_list_load(module, ldb_kv, dn, list,
-				  DN_LIST_WILL_BE_READ_ONLY);
-	talloc_free(dn);
+	TALLOC_FREE(msg);
 	return ret;
 }
 
-static bool list_union(struct ldb_context *ldb,
-		       struct ldb_kv_private *ldb_kv,
-		       struct dn_list *list,
-		       struct dn_list *list2);
-
 /*
-  return a list of dn's that might match a leaf indexed search
+  give a list borrowing the dn array of the transaction index cache
+  its own copy, with room for at least alloc_len entries
  */
-static int ldb_kv_index_dn_leaf(struct ldb_module *module,
-				struct ldb_kv_private *ldb_kv,
-				const struct ldb_parse_tree *tree,
-				struct dn_list *list)
+static int ldb_kv_dn_list_unborrow(struct dn_list *list,
+				   unsigned int alloc_len)
 {
-	*list = (struct dn_list){};
-	if (ldb_kv->disallow_dn_filter &&
-	    (ldb_attr_cmp(tree->u.equality.attr, "dn") == 0)) {
-		/* in AD mode we do not support "(dn=...)" search filters */
-		return LDB_SUCCESS;
-	}
-	if (tree->u.equality.attr[0] == '@') {
-		/* Do not allow a indexed search against an @ */
+	struct ldb_val *dn = NULL;
+
+	if (!list->borrowed) {
 		return LDB_SUCCESS;
 	}
-	if (ldb_attr_dn(tree->u.equality.attr) == 0) {
-		enum key_truncation truncation = KEY_NOT_TRUNCATED;
-		bool valid_dn = false;
-		struct ldb_dn *dn
-			= ldb_dn_from_ldb_val(list,
-					      ldb_module_get_ctx(module),
-					      &tree->u.equality.value);
-		if (dn == NULL) {
-			/* If we can't parse it, no match */
-			return LDB_SUCCESS;
-		}
-
-		valid_dn = ldb_dn_validate(dn);
-		if (valid_dn == false) {
-			/* If we can't parse it, no match */
-			return LDB_SUCCESS;
-		}
-
-		/*
-		 * Re-use the same code we use for a SCOPE_BASE
-		 * search
-		 *
-		 * We can't call TALLOC_FREE(dn) as this must belong
-		 * to list for the memory to remain valid.
-		 */
-		return ldb_kv_index_dn_base_dn(
-		    module, ldb_kv, dn, list, &truncation);
-		/*
-		 * We ignore truncation here and allow multi-valued matches
-		 * as ltdb_search_indexed will filter out the wrong one in
-		 * ltdb_index_filter() which calls ldb_match_message().
-		 */
 
-	} else if ((ldb_kv->cache->GUID_index_attribute != NULL) &&
-		   (ldb_attr_cmp(tree->u.equality.attr,
-				 ldb_kv->cache->GUID_index_attribute) == 0)) {
-		int ret;
-		struct ldb_context *ldb = ldb_module_get_ctx(module);
-		list->dn = talloc_array(list, struct ldb_val, 1);
-		if (list->dn == NULL) {
-			ldb_module_oom(module);
-			return LDB_ERR_OPERATIONS_ERROR;
-		}
-		/*
-		 * We need to go via the canonicalise_fn() to
-		 * ensure we get the index in binary, rather
-		 * than a string
-		 */
-		ret = ldb_kv->GUID_index_syntax->canonicalise_fn(
-		    ldb, list->dn, &tree->u.equality.value, &list->dn[0]);
-		if (ret != LDB_SUCCESS) {
-			return LDB_ERR_OPERATIONS_ERROR;
-		}
-		list->count = 1;
+	alloc_len = MAX(alloc_len, list->count);
+	if (alloc_len == 0) {
+		list->dn = NULL;
+		list->borrowed = false;
 		return LDB_SUCCESS;
 	}
 
-	return ldb_kv_index_dn_simple(module, ldb_kv, tree, list);
+	dn = talloc_array(list, struct ldb_val, alloc_len);
+	if (dn == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	if (list->count > 0) {
+		memcpy(dn, list->dn, sizeof(*dn) * list->count);
+	}
+	list->dn = dn;
+	list->borrowed = false;
+	return LDB_SUCCESS;
 }
 
-
 /*
-  list intersection
-  list = list & list2
-*/
-static bool list_intersect(struct ldb_kv_private *ldb_kv,
-			   struct dn_list *list,
-			   const struct dn_list *list2)
+  save a dn_list into the database, in either @IDX or internal format
+ */
+static int ldb_kv_dn_list_store(struct ldb_module *module,
+				struct ldb_dn *dn,
+				struct dn_list *list)
 {
-	const struct dn_list *short_list, *long_list;
-	struct dn_list *list3;
-	unsigned int i;
+	struct ldb_kv_private *ldb_kv = talloc_get_type(
+	    ldb_module_get_private(module), struct ldb_kv_private);
+	struct ldb_val key = {};
+	uint32_t hash;
+	int ret = LDB_SUCCESS;
+	struct dn_list *list2 = NULL;
+	struct ldb_kv_idxptr *idxptr = NULL;
+	struct ldb_kv_idxptr_entry *entry = NULL;
 
-	if (list->count == 0) {
-		/* 0 & X == 0 */
-		return true;
+	key.data = discard_const_p(uint8_t, ldb_dn_get_linearized(dn));
+	if (key.data == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
 	}
-	if (list2->count == 0) {
-		/* X & 0 == 0 */
-		list->count = 0;
-		list->dn = NULL;
-		return true;
+	key.length = strlen((char *)key.data);
+	hash = ldb_kv_idxptr_hash(&key);
+
+	/* the list is stored as it is, so can not borrow its values */
+	ret = ldb_kv_dn_list_unborrow(list, list->count);
+	if (ret != LDB_SUCCESS) {
+		return ret;
 	}
 
 	/*
-	 * In both of the below we check for strict and in that
-	 * case do not optimise the intersection of this list,
-	 * we must never return an entry not in this
-	 * list.  This allows the index for
-	 * SCOPE_ONELEVEL to be trusted.
+	 * If there is an index sub transaction active, update the
+	 * sub transaction index cache.  Otherwise update the
+	 * primary index cache
 	 */
-
-	/* the indexing code is allowed to return a longer list than
-	   what really matches, as all results are filtered by the
-	   full expression at the end - this shortcut avoids a lot of
-	   work in some cases */
-	if (list->count < 2 && list2->count > 10 && list2->strict == false) {
-		return true;
+	if (ldb_kv->nested_idx_ptr != NULL) {
+		idxptr = ldb_kv->nested_idx_ptr;
+	} else {
+		idxptr = ldb_kv->idxptr;
 	}
-	if (list2->count < 2 && list->count > 10 && list->strict == false) {
-		list->count = list2->count;
-		list->dn = list2->dn;
-		/* note that list2 may not be the parent of list2->dn,
-		   as list2->dn may be owned by ltdb->idxptr. In that
-		   case we expect this reparent call to fail, which is
-		   OK */
-		talloc_reparent(list2, list, list2->dn);
-		return true;
+	/*
+	 * Get the cache entry for the index
+	 *
+	 * As the value in the cache is a pointer to a dn_list we update
+	 * the dn_list directly.
+	 *
+	 */
+	entry = ldb_kv_idxptr_find(idxptr, &key, hash);
+	if (entry != NULL) {
+		list2 = entry->list;
+		ldb_kv_index_chunk_dir_merge(list2->chunk_dir,
+					     list->chunk_dir);
+		/* Now put the updated pointer back in the cache */
+		if (list->dn == NULL) {
+			list2->dn = NULL;
+			list2->count = 0;
+		} else {
+			list2->dn = talloc_steal(list2, list->dn);
+			list2->count = list->count;
+		}
+		list2->unsorted = list->unsorted;
+		list2->check_duplicates = list->check_duplicates;
+		return LDB_SUCCESS;
 	}
 
-	if (list->count > list2->count) {
-		short_list = list2;
-		long_list = list;
-	} else {
-		short_list = list;
-		long_list = list2;
+	entry = talloc_zero(idxptr, struct ldb_kv_idxptr_entry);
+	if (entry == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
 	}
-
-	list3 = talloc_zero(list, struct dn_list);
-	if (list3 == NULL) {
-		return false;
+	entry->hash = hash;
+	entry->dn = ldb_dn_copy(entry, dn);
+	if (entry->dn == NULL) {
+		TALLOC_FREE(entry);
+		return LDB_ERR_OPERATIONS_ERROR;
 	}
+	entry->key.data = talloc_memdup(entry, key.data, key.length + 1);
+	if (entry->key.data == NULL) {
+		TALLOC_FREE(entry);
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	entry->key.length = key.length;
 
-	list3->dn = talloc_array(list3, struct ldb_val, short_list->count);
-	if (!list3->dn) {
-		talloc_free(list3);
-		return false;
+	list2 = talloc(entry, struct dn_list);
+	if (list2 == NULL) {
+		TALLOC_FREE(entry);
+		return LDB_ERR_OPERATIONS_ERROR;
 	}
-	list3->count = 0;
+	*list2 = (struct dn_list) {
+		.stored_count = list->stored_count,
+		.unsorted = list->unsorted,
+		.check_duplicates = list->check_duplicates,
+	};
+	entry->list = list2;
 
-	for (i=0;i<short_list->count;i++) {
-		/* For the GUID index case, this is a binary search */
-		if (ldb_kv_dn_list_find_val(
-			ldb_kv, long_list, &short_list->dn[i]) != -1) {
-			list3->dn[list3->count] = short_list->dn[i];
-			list3->count++;
+	/*
+	 * The chunk directory may belong to the primary cache, which
+	 * must not change until a sub transaction commits
+	 */
+	if (list->chunk_dir != NULL) {
+		list2->chunk_dir = ldb_kv_index_chunk_dir_copy(
+		    list2, list->chunk_dir);
+		if (list2->chunk_dir == NULL) {
+			TALLOC_FREE(entry);
+			return LDB_ERR_OPERATIONS_ERROR;
 		}
 	}
 
-	list->strict |= list2->strict;
-	list->dn = talloc_steal(list, list3->dn);
-	list->count = list3->count;
-	talloc_free(list3);
+	/*
+	 * This is not a store into the main DB, but into an in-memory
+	 * hash table, so we don't need a guard on ltdb->read_only
+	 *
+	 * Also as we directly update the in memory dn_list for existing
+	 * cache entries we must be adding a new entry to the cache.
+	 */
+	ret = ldb_kv_idxptr_insert(idxptr, entry);
+	if (ret != LDB_SUCCESS) {
+		TALLOC_FREE(entry);
+		return ret;
+	}
 
-	return true;
+	list2->dn = talloc_steal(list2, list->dn);
+	list2->count = list->count;
+	return LDB_SUCCESS;
 }
 
-
 /*
-  list union
-  list = list | list2
-*/
-static bool list_union(struct ldb_context *ldb,
-		       struct ldb_kv_private *ldb_kv,
-		       struct dn_list *list,
-		       struct dn_list *list2)
+  count objects added to or deleted from the index
+ */
+static void ldb_kv_index_stats_objects(struct ldb_kv_private *ldb_kv,
+				       int delta)
 {
-	struct ldb_val *dn3;
-	unsigned int i = 0, j = 0, k = 0;
+	struct ldb_kv_idxptr *idxptr = ldb_kv->nested_idx_ptr;
 
-	if (list2->count == 0) {
-		/* X | 0 == X */
-		return true;
+	if (idxptr == NULL) {
+		idxptr = ldb_kv->idxptr;
 	}
-
-	if (list->count == 0) {
-		/* 0 | X == X */
-		list->count = list2->count;
-		list->dn = list2->dn;
-		/* note that list2 may not be the parent of list2->dn,
-		   as list2->dn may be owned by ltdb->idxptr. In that
-		   case we expect this reparent call to fail, which is
-		   OK */
-		talloc_reparent(list2, list, list2->dn);
-		return true;
+	if (idxptr != NULL) {
+		idxptr->objects_delta += delta;
 	}
+}
 
-	/*
-	 * Sort the lists (if not in GUID DN mode) so we can do
-	 * the de-duplication during the merge
-	 *
-	 * NOTE: This can sort the in-memory index values, as list or
-	 * list2 might not be a copy!
-	 */
-	ldb_kv_dn_list_sort(ldb_kv, list);
-	ldb_kv_dn_list_sort(ldb_kv, list2);
+/*
+  prepare the statistics to be updated by the transaction commit
+ */
+static int ldb_kv_index_stats_begin(struct ldb_module *module,
+				    struct ldb_kv_private *ldb_kv)
+{
+	struct ldb_kv_idxptr *idxptr = ldb_kv->idxptr;
+	int ret;
 
-	dn3 = talloc_array(list, struct ldb_val, list->count + list2->count);
-	if (!dn3) {
-		ldb_oom(ldb);
-		return false;
-	}
+	idxptr->stats = NULL;
 
-	while (i < list->count || j < list2->count) {
-		int cmp;
-		if (i >= list->count) {
-			cmp = 1;
-		} else if (j >= list2->count) {
-			cmp = -1;
-		} else {
-			cmp = ldb_val_equal_exact_ordered(list->dn[i],
-							  &list2->dn[j]);
+	if (!ldb_kv->cache->attribute_indexes &&
+	    !ldb_kv->cache->one_level_indexes) {
+		struct ldb_message *msg = NULL;
+
+		if (!idxptr->stats_reset) {
+			return LDB_SUCCESS;
 		}
 
-		if (cmp < 0) {
-			/* Take list */
-			dn3[k] = list->dn[i];
-			i++;
-			k++;
-		} else if (cmp > 0) {
-			/* Take list2 */
-			dn3[k] = list2->dn[j];
-			j++;
-			k++;
-		} else {
-			/* Equal, take list */
-			dn3[k] = list->dn[i];
-			i++;
-			j++;
-			k++;
+		/* nothing is indexed any more, remove stale statistics */
+		msg = ldb_msg_new(module);
+		if (msg == NULL) {
+			return ldb_module_oom(module);
+		}
+		msg->dn = ldb_dn_new(msg,
+				     ldb_module_get_ctx(module),
+				     LDB_KV_INDEXSTATS);
+		if (msg->dn == NULL) {
+			TALLOC_FREE(msg);
+			return ldb_module_oom(module);
+		}
+		ret = ldb_kv_delete_noindex(module, msg);
+		TALLOC_FREE(msg);
+		if (ret == LDB_ERR_NO_SUCH_OBJECT) {
+			ret = LDB_SUCCESS;
+		}
+		if (ret == LDB_SUCCESS) {
+			TALLOC_FREE(ldb_kv->cache->index_stats);
 		}
+		return ret;
 	}
 
-	list->dn = dn3;
-	list->count = k;
+	if (idxptr->stats_reset) {
+		idxptr->stats = talloc_zero(idxptr,
+					    struct ldb_kv_index_stats);
+		if (idxptr->stats == NULL) {
+			return ldb_module_oom(module);
+		}
+		idxptr->stats->changed = true;
+		return LDB_SUCCESS;
+	}
 
-	return true;
+	/*
+	 * Without existing statistics to update we don't know the
+	 * totals, these are only established by a re-index.
+	 */
+	ret = ldb_kv_index_stats_read(module, idxptr, &idxptr->stats);
+	if (ret == LDB_ERR_NO_SUCH_OBJECT) {
+		return LDB_SUCCESS;
+	}
+	return ret;
 }
 
-static int ldb_kv_index_dn(struct ldb_module *module,
-			   struct ldb_kv_private *ldb_kv,
-			   const struct ldb_parse_tree *tree,
-			   struct dn_list *list);
-
 /*
-  process an OR list (a union)
+  account for the index record key being written from list
  */
-static int ldb_kv_index_dn_or(struct ldb_module *module,
-			      struct ldb_kv_private *ldb_kv,
-			      const struct ldb_parse_tree *tree,
-			      struct dn_list *list)
+static int ldb_kv_index_stats_update(struct ldb_kv_idxptr *idxptr,
+				     const struct ldb_val *key,
+				     const struct dn_list *list)
 {
-	struct ldb_context *ldb;
-	unsigned int i;
+	struct ldb_kv_index_stats *stats = idxptr->stats;
+	struct ldb_kv_index_stat *st = NULL;
+	size_t prefix_len = strlen(LDB_KV_INDEX);
+	unsigned int old_count = list->stored_count;
+	const char *attr = NULL;
+	const char *end = NULL;
+	size_t key_len;
+
+	if (stats == NULL) {
+		return LDB_SUCCESS;
+	}
+	if (idxptr->stats_reset) {
+		old_count = 0;
+	}
 
-	ldb = ldb_module_get_ctx(module);
+	/* @INDEX:ATTR:value, or @INDEX#ATTR#value if truncated */
+	key_len = strnlen((const char *)key->data, key->length);
+	if (key_len <= prefix_len + 1 ||
+	    strncmp((const char *)key->data, LDB_KV_INDEX, prefix_len) != 0) {
+		return LDB_SUCCESS;
+	}
+	attr = (const char *)key->data + prefix_len + 1;
+	end = memchr(attr, key->data[prefix_len], key_len - prefix_len - 1);
+	if (end == NULL || end == attr) {
+		return LDB_SUCCESS;
+	}
 
-	list->dn = NULL;
-	list->count = 0;
+	if (old_count == list->count) {
+		return LDB_SUCCESS;
+	}
 
-	for (i=0; i<tree->u.list.num_elements; i++) {
-		struct dn_list *list2;
-		int ret;
+	st = ldb_kv_index_stats_find(stats, attr, end - attr);
+	if (st == NULL) {
+		struct ldb_kv_index_stat *attrs = NULL;
 
-		list2 = talloc_zero(list, struct dn_list);
-		if (list2 == NULL) {
+		attrs = talloc_realloc(stats,
+				       stats->attrs,
+				       struct ldb_kv_index_stat,
+				       stats->num_attrs + 1);
+		if (attrs == NULL) {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+		stats->attrs = attrs;
+		st = &stats->attrs[stats->num_attrs];
+		*st = (struct ldb_kv_index_stat) {
+			.attr = talloc_strndup(stats->attrs,
+					       attr,
+					       end - attr),
+		};
+		if (st->attr == NULL) {
 			return LDB_ERR_OPERATIONS_ERROR;
 		}
+		stats->num_attrs++;
+	}
 
-		ret = ldb_kv_index_dn(
-		    module, ldb_kv, tree->u.list.elements[i], list2);
+	/* The statistics are only a guide, never let them wrap */
+	st->entries -= MIN(st->entries, old_count);
+	st->entries += list->count;
+	if (old_count != 0 && st->records != 0) {
+		st->records--;
+	}
+	if (list->count != 0) {
+		st->records++;
+	}
+	stats->changed = true;
+	return LDB_SUCCESS;
+}
 
-		if (ret == LDB_ERR_NO_SUCH_OBJECT) {
-			/* X || 0 == X */
-			talloc_free(list2);
+/*
+  write the updated statistics at the end of the transaction commit
+ */
+static int ldb_kv_index_stats_store(struct ldb_module *module,
+				    struct ldb_kv_private *ldb_kv)
+{
+	struct ldb_kv_idxptr *idxptr = ldb_kv->idxptr;
+	struct ldb_kv_index_stats *stats = idxptr->stats;
+	struct ldb_message *msg = NULL;
+	unsigned int i;
+	int ret;
+
+	if (stats == NULL ||
+	    (!stats->changed && idxptr->objects_delta == 0)) {
+		return LDB_SUCCESS;
+	}
+
+	if (idxptr->objects_delta < 0 &&
+	    (uint64_t)-idxptr->objects_delta > stats->objects) {
+		stats->objects = 0;
+	} else {
+		stats->objects += idxptr->objects_delta;
+	}
+
+	msg = ldb_msg_new(module);
+	if (msg == NULL) {
+		return ldb_module_oom(module);
+	}
+	msg->dn = ldb_dn_new(msg, ldb_module_get_ctx(module), LDB_KV_INDEXSTATS);
+	if (msg->dn == NULL) {
+		TALLOC_FREE(msg);
+		return ldb_module_oom(module);
+	}
+
+	ret = ldb_msg_add_fmt(msg, LDB_KV_IDXOBJECTS, "%llu",
+			      (unsigned long long)stats->objects);
+	if (ret != LDB_SUCCESS) {
+		TALLOC_FREE(msg);
+		return ldb_module_oom(module);
+	}
+	for (i = 0; i < stats->num_attrs; i++) {
+		const struct ldb_kv_index_stat *st = &stats->attrs[i];
+
+		if (st->records == 0) {
 			continue;
 		}
-
+		ret = ldb_msg_add_fmt(msg, LDB_KV_IDXSTAT, "%s %llu %llu",
+				      st->attr,
+				      (unsigned long long)st->records,
+				      (unsigned long long)st->entries);
 		if (ret != LDB_SUCCESS) {
-			/* X || * == * */
-			talloc_free(list2);
-			return ret;
-		}
-
-		if (!list_union(ldb, ldb_kv, list, list2)) {
-			talloc_free(list2);
-			return LDB_ERR_OPERATIONS_ERROR;
+			TALLOC_FREE(msg);
+			return ldb_module_oom(module);
 		}
 	}
 
-	if (list->count == 0) {
-		return LDB_ERR_NO_SUCH_OBJECT;
+	ret = ldb_kv_store(module, msg, TDB_REPLACE);
+	TALLOC_FREE(msg);
+	if (ret != LDB_SUCCESS) {
+		return ret;
 	}
 
+	/*
+	 * Our own writes don't cause a cache reload, so keep the
+	 * cached copy used by the planner current
+	 */
+	stats->changed = false;
+	TALLOC_FREE(ldb_kv->cache->index_stats);
+	ldb_kv->cache->index_stats = talloc_steal(ldb_kv->cache, stats);
+	idxptr->stats = NULL;
 	return LDB_SUCCESS;
 }
 
-
 /*
-  NOT an index results
+  compare two values in the order of their index keys
  */
-static int ldb_kv_index_dn_not(_UNUSED_ struct ldb_module *module,
-			       _UNUSED_ struct ldb_kv_private *ldb_kv,
-			       _UNUSED_ const struct ldb_parse_tree *tree,
-			       _UNUSED_ struct dn_list *list)
+static int ldb_kv_index_order_cmp(const struct ldb_val *v1,
+				  const struct ldb_val *v2)
 {
-	/* the only way to do an indexed not would be if we could
-	   negate the not via another not or if we knew the total
-	   number of database elements so we could know that the
-	   existing expression covered the whole database.
+	int ret;
 
-	   instead, we just give up, and rely on a full index scan
-	   (unless an outer & manages to reduce the list)
-	*/
-	return LDB_ERR_OPERATIONS_ERROR;
+	ret = memcmp(v1->data, v2->data, MIN(v1->length, v2->length));
+	if (ret != 0) {
+		return ret;
+	}
+	return NUMERIC_CMP(v1->length, v2->length);
 }
 
-/*
- * These things are unique, so avoid a full scan if this is a search
- * by GUID, DN or a unique attribute
- */
-static bool ldb_kv_index_unique(struct ldb_context *ldb,
-				struct ldb_kv_private *ldb_kv,
-				const char *attr)
+static int ldb_kv_index_order_append(struct ldb_kv_index_order *order,
+				     struct ldb_val **vals,
+				     unsigned int *num_vals,
+				     struct ldb_val v)
 {
-	const struct ldb_schema_attribute *a;
-	if (ldb_kv->cache->GUID_index_attribute != NULL) {
-		if (ldb_attr_cmp(attr, ldb_kv->cache->GUID_index_attribute) ==
-		    0) {
-			return true;
+	size_t len = talloc_array_length(*vals);
+
+	if (*num_vals == len) {
+		struct ldb_val *v2 = talloc_realloc(order,
+						    *vals,
+						    struct ldb_val,
+						    MAX(len * 2, 16));
+		if (v2 == NULL) {
+			return LDB_ERR_OPERATIONS_ERROR;
 		}
+		*vals = v2;
 	}
-	if (ldb_attr_dn(attr) == 0) {
-		return true;
-	}
-
-	a = ldb_schema_attribute_by_name(ldb, attr);
-	if (a->flags & LDB_ATTR_FLAG_UNIQUE_INDEX) {
-		return true;
-	}
-	return false;
+	(*vals)[(*num_vals)++] = v;
+	return LDB_SUCCESS;
 }
 
 /*
-  process an AND expression (intersection)
+  note an index record key being written from list, if that adds a
+  value to or removes a value from an @INDEXORDER record
  */
-static int ldb_kv_index_dn_and(struct ldb_module *module,
-			       struct ldb_kv_private *ldb_kv,
-			       const struct ldb_parse_tree *tree,
-			       struct dn_list *list)
+static int ldb_kv_index_order_note(struct ldb_module *module,
+				   struct ldb_kv_idxptr *idxptr,
+				   const struct ldb_val *key,
+				   const struct dn_list *list)
 {
-	struct ldb_context *ldb;
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	struct ldb_kv_index_order *order = NULL;
+	size_t prefix_len = strlen(LDB_KV_INDEX ":");
+	bool stored = list->stored_count != 0 && !idxptr->stats_reset;
+	const char *attr = NULL;
+	const char *end = NULL;
+	struct ldb_val v;
+	size_t key_len;
 	unsigned int i;
-	bool found;
-
-	ldb = ldb_module_get_ctx(module);
 
-	list->dn = NULL;
-	list->count = 0;
+	if (stored == (list->count != 0)) {
+		return LDB_SUCCESS;
+	}
 
-	/* in the first pass we only look for unique simple
-	   equality tests, in the hope of avoiding having to look
-	   at any others */
-	for (i=0; i<tree->u.list.num_elements; i++) {
-		const struct ldb_parse_tree *subtree = tree->u.list.elements[i];
-		int ret;
+	/* Only @INDEX:ATTR:value, truncated keys are not in order */
+	key_len = strnlen((const char *)key->data, key->length);
+	if (key_len <= prefix_len ||
+	    strncmp((const char *)key->data,
+		    LDB_KV_INDEX ":",
+		    prefix_len) != 0) {
+		return LDB_SUCCESS;
+	}
+	attr = (const char *)key->data + prefix_len;
+	end = memchr(attr, ':', key_len - prefix_len);
+	if (end == NULL || end == attr || attr[0] == '@') {
+		return LDB_SUCCESS;
+	}
 
-		if (subtree->operation != LDB_OP_EQUALITY ||
-		    !ldb_kv_index_unique(
-			ldb, ldb_kv, subtree->u.equality.attr)) {
-			continue;
+	for (i = 0; i < idxptr->num_orders; i++) {
+		order = &idxptr->orders[i];
+		if (strlen(order->attr) == (size_t)(end - attr) &&
+		    strncmp(order->attr, attr, end - attr) == 0) {
+			break;
 		}
+	}
+	if (i == idxptr->num_orders) {
+		const struct ldb_schema_attribute *a = NULL;
+		struct ldb_kv_index_order *orders = NULL;
 
-		ret = ldb_kv_index_dn(module, ldb_kv, subtree, list);
-		if (ret == LDB_ERR_NO_SUCH_OBJECT) {
-			/* 0 && X == 0 */
-			return LDB_ERR_NO_SUCH_OBJECT;
+		orders = talloc_realloc(idxptr,
+					idxptr->orders,
+					struct ldb_kv_index_order,
+					idxptr->num_orders + 1);
+		if (orders == NULL) {
+			return LDB_ERR_OPERATIONS_ERROR;
 		}
-		if (ret == LDB_SUCCESS) {
-			/* a unique index match means we can
-			 * stop. Note that we don't care if we return
-			 * a few too many objects, due to later
-			 * filtering */
-			return LDB_SUCCESS;
+		idxptr->orders = orders;
+		order = &orders[idxptr->num_orders];
+		*order = (struct ldb_kv_index_order) {
+			.attr = talloc_strndup(orders, attr, end - attr),
+		};
+		if (order->attr == NULL) {
+			return LDB_ERR_OPERATIONS_ERROR;
 		}
-	}
+		idxptr->num_orders++;
 
-	/* now do a full intersection */
-	found = false;
+		/* The key holds the value from the index_format_fn */
+		a = ldb_schema_attribute_by_name(ldb, order->attr);
+		order->ordered = a != NULL &&
+				 a->syntax->index_format_fn != NULL;
+	}
+	if (!order->ordered) {
+		return LDB_SUCCESS;
+	}
 
-	for (i=0; i<tree->u.list.num_elements; i++) {
-		const struct ldb_parse_tree *subtree = tree->u.list.elements[i];
-		struct dn_list *list2;
-		int ret;
+	/*
+	 * The index cache is written in key order, so the values are
+	 * noted in order too.  The key outlives the index cache store.
+	 */
+	v.data = discard_const_p(uint8_t, end + 1);
+	v.length = key_len - (end + 1 - (const char *)key->data);
+	if (list->count != 0) {
+		return ldb_kv_index_order_append(order,
+						 &order->added,
+						 &order->num_added,
+						 v);
+	}
+	return ldb_kv_index_order_append(order,
+					 &order->removed,
+					 &order->num_removed,
+					 v);
+}
 
-		list2 = talloc_zero(list, struct dn_list);
-		if (list2 == NULL) {
-			return ldb_module_oom(module);
-		}
+/*
+ * An @INDEXORDER record with more than LDB_KV_INDEX_ORDER_CHUNK_VALUES
+ * values is split into chunks, so that a commit adding or removing a
+ * value of an attribute changed by every write (such as uSNChanged)
+ * rewrites one chunk rather than every value.  The record then
+ * becomes a directory, with one @IDXORDERCHUNK value per chunk:
+ *
+ * Chunk id (4 bytes, little endian)
+ * First value in the chunk
+ *
+ * Chunk N of @INDEXORDER:ATTR is stored as @INDEXORDER:ATTR#N, with
+ * @IDXVALUE values as in an unsplit record.  A chunk holds the values
+ * from its first up to the first of the next chunk, and a chunk that
+ * grows too large is split in halves.
+ */
+#define LDB_KV_INDEX_ORDER_CHUNK_VALUES 1024
+
+/* the id of the values of an unsplit record */
+#define LDB_KV_INDEX_ORDER_UNSPLIT UINT32_MAX
+
+struct ldb_kv_index_order_chunk {
+	uint32_t id;
+	struct ldb_val first;
+	/* the values are only loaded for a chunk being changed */
+	bool loaded;
+	struct ldb_val *values;
+	unsigned int num_values;
+	/* the changes to the chunk, from order->added and order->removed */
+	unsigned int added;
+	unsigned int num_added;
+	unsigned int removed;
+	unsigned int num_removed;
+};
 
-		ret = ldb_kv_index_dn(module, ldb_kv, subtree, list2);
+static struct ldb_dn *ldb_kv_index_order_chunk_dn(TALLOC_CTX *mem_ctx,
+						  struct ldb_context *ldb,
+						  const char *attr,
+						  int attr_len,
+						  uint32_t id)
+{
+	return ldb_dn_new_fmt(mem_ctx, ldb, "%s:%.*s#%u",
+			      LDB_KV_INDEX_ORDER, attr_len, attr,
+			      (unsigned int)id);
+}
 
-		if (ret == LDB_ERR_NO_SUCH_OBJECT) {
-			/* X && 0 == 0 */
-			list->dn = NULL;
-			list->count = 0;
-			talloc_free(list2);
-			return LDB_ERR_NO_SUCH_OBJECT;
-		}
+/*
+  parse the @IDXORDERCHUNK values of a split @INDEXORDER record
+ */
+static int ldb_kv_index_order_dir_parse(
+	TALLOC_CTX *mem_ctx,
+	const struct ldb_message_element *el,
+	struct ldb_kv_index_order_chunk **chunks,
+	unsigned int *num_chunks)
+{
+	struct ldb_kv_index_order_chunk *c = NULL;
+	unsigned int i;
 
-		if (ret != LDB_SUCCESS) {
-			/* this didn't adding anything */
-			talloc_free(list2);
-			continue;
-		}
+	c = talloc_zero_array(mem_ctx,
+			      struct ldb_kv_index_order_chunk,
+			      el->num_values);
+	if (c == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	for (i = 0; i < el->num_values; i++) {
+		const uint8_t *p = el->values[i].data;
 
-		if (!found) {
-			talloc_reparent(list2, list, list->dn);
-			list->dn = list2->dn;
-			list->count = list2->count;
-			found = true;
-		} else if (!list_intersect(ldb_kv, list, list2)) {
-			talloc_free(list2);
+		if (el->values[i].length < 4) {
+			TALLOC_FREE(c);
 			return LDB_ERR_OPERATIONS_ERROR;
 		}
+		c[i].id = (uint32_t)p[0] |
+			  ((uint32_t)p[1] << 8) |
+			  ((uint32_t)p[2] << 16) |
+			  ((uint32_t)p[3] << 24);
+		c[i].first.data = discard_const_p(uint8_t, p + 4);
+		c[i].first.length = el->values[i].length - 4;
+	}
+	*chunks = c;
+	*num_chunks = el->num_values;
+	return LDB_SUCCESS;
+}
 
-		if (list->count == 0) {
-			list->dn = NULL;
-			return LDB_ERR_NO_SUCH_OBJECT;
-		}
+/*
+  load the values of a chunk of an @INDEXORDER record
+ */
+static int ldb_kv_index_order_chunk_load(struct ldb_module *module,
+					 TALLOC_CTX *mem_ctx,
+					 const char *attr,
+					 int attr_len,
+					 struct ldb_kv_index_order_chunk *chunk,
+					 unsigned int unpack_flags)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	struct ldb_message *msg = NULL;
+	struct ldb_message_element *el = NULL;
+	struct ldb_dn *dn = NULL;
+	int ret;
 
-		if (list->count < 2) {
-			/* it isn't worth loading the next part of the tree */
-			return LDB_SUCCESS;
-		}
+	msg = ldb_msg_new(mem_ctx);
+	if (msg == NULL) {
+		return ldb_module_oom(module);
 	}
-
-	if (!found) {
-		/* none of the attributes were indexed */
+	dn = ldb_kv_index_order_chunk_dn(msg, ldb, attr, attr_len, chunk->id);
+	if (dn == NULL) {
+		return ldb_module_oom(module);
+	}
+	ret = ldb_kv_search_dn1(module,
+				dn,
+				msg,
+				LDB_UNPACK_DATA_FLAG_NO_DN | unpack_flags);
+	if (ret == LDB_ERR_NO_SUCH_OBJECT) {
+		ldb_asprintf_errstring(ldb,
+				       __location__ ": Missing chunk %s",
+				       ldb_dn_get_linearized(dn));
 		return LDB_ERR_OPERATIONS_ERROR;
 	}
-
+	if (ret != LDB_SUCCESS) {
+		return ret;
+	}
+	el = ldb_msg_find_element(msg, LDB_KV_IDXVALUE);
+	if (el != NULL) {
+		chunk->values = el->values;
+		chunk->num_values = el->num_values;
+	}
+	chunk->loaded = true;
 	return LDB_SUCCESS;
 }
 
-struct ldb_kv_ordered_index_context {
-	struct ldb_module *module;
-	int error;
-	struct dn_list *dn_list;
-};
-
-static int traverse_range_index(_UNUSED_ struct ldb_kv_private *ldb_kv,
-				_UNUSED_ struct ldb_val key,
-				struct ldb_val data,
-				void *state)
+/*
+  load the values of the @INDEXORDER record of an attribute, in
+  order, from its chunks if it has been split
+ */
+static int ldb_kv_index_order_load(struct ldb_module *module,
+				   TALLOC_CTX *mem_ctx,
+				   const char *attr,
+				   int attr_len,
+				   struct ldb_val **values,
+				   unsigned int *num_values)
 {
-
-	struct ldb_context *ldb;
-	struct ldb_kv_ordered_index_context *ctx =
-	    (struct ldb_kv_ordered_index_context *)state;
-	struct ldb_module *module = ctx->module;
-	struct ldb_message_element *el = NULL;
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
 	struct ldb_message *msg = NULL;
-	int version;
-	size_t dn_array_size, additional_length;
-	unsigned int i;
-
-	ldb = ldb_module_get_ctx(module);
-
-	msg = ldb_msg_new(module);
+	struct ldb_message_element *el = NULL;
+	struct ldb_kv_index_order_chunk *chunks = NULL;
+	struct ldb_dn *dn = NULL;
+	struct ldb_val *v = NULL;
+	unsigned int num_chunks = 0;
+	unsigned int i, n = 0;
+	int ret;
 
-	ctx->error = ldb_unpack_data_flags(ldb, &data, msg,
-					   LDB_UNPACK_DATA_FLAG_NO_DN);
+	*values = NULL;
+	*num_values = 0;
 
-	if (ctx->error != LDB_SUCCESS) {
-		talloc_free(msg);
-		return ctx->error;
+	msg = ldb_msg_new(mem_ctx);
+	if (msg == NULL) {
+		return ldb_module_oom(module);
 	}
-
-	el = ldb_msg_find_element(msg, LDB_KV_IDX);
-	if (!el) {
-		talloc_free(msg);
+	dn = ldb_dn_new_fmt(msg, ldb, "%s:%.*s",
+			    LDB_KV_INDEX_ORDER, attr_len, attr);
+	if (dn == NULL) {
+		return ldb_module_oom(module);
+	}
+	ret = ldb_kv_search_dn1(module,
+				dn,
+				msg,
+				LDB_UNPACK_DATA_FLAG_NO_DN |
+				LDB_UNPACK_DATA_FLAG_READ_LOCKED);
+	if (ret == LDB_ERR_NO_SUCH_OBJECT) {
+		/* no values are indexed */
 		return LDB_SUCCESS;
 	}
-
-	version = ldb_msg_find_attr_as_int(msg, LDB_KV_IDXVERSION, 0);
-
-	/*
-	 * we avoid copying the strings by stealing the list.  We have
-	 * to steal msg onto el->values (which looks odd) because
-	 * the memory is allocated on msg, not on each value.
-	 */
-	if (version != LDB_KV_GUID_INDEXING_VERSION) {
-		/* This is quite likely during the DB startup
-		   on first upgrade to using a GUID index */
-		ldb_debug_set(ldb_module_get_ctx(module),
-			      LDB_DEBUG_ERROR, __location__
-			      ": Wrong GUID index version %d expected %d",
-			      version, LDB_KV_GUID_INDEXING_VERSION);
-		talloc_free(msg);
-		ctx->error = LDB_ERR_OPERATIONS_ERROR;
-		return ctx->error;
+	if (ret != LDB_SUCCESS) {
+		return ret;
 	}
 
-	if (el->num_values == 0) {
-		talloc_free(msg);
-		ctx->error = LDB_ERR_OPERATIONS_ERROR;
-		return ctx->error;
+	el = ldb_msg_find_element(msg, LDB_KV_IDXVALUE);
+	if (el != NULL) {
+		*values = el->values;
+		*num_values = el->num_values;
+		return LDB_SUCCESS;
+	}
+	el = ldb_msg_find_element(msg, LDB_KV_IDXORDERCHUNK);
+	if (el == NULL) {
+		return LDB_SUCCESS;
 	}
 
-	if ((el->values[0].length % LDB_KV_GUID_SIZE) != 0
-	    || el->values[0].length == 0) {
-		talloc_free(msg);
-		ctx->error = LDB_ERR_OPERATIONS_ERROR;
-		return ctx->error;
+	ret = ldb_kv_index_order_dir_parse(msg, el, &chunks, &num_chunks);
+	if (ret != LDB_SUCCESS) {
+		return ldb_module_operr(module);
+	}
+	for (i = 0; i < num_chunks; i++) {
+		ret = ldb_kv_index_order_chunk_load(
+			module,
+			msg,
+			attr,
+			attr_len,
+			&chunks[i],
+			LDB_UNPACK_DATA_FLAG_READ_LOCKED);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+		n += chunks[i].num_values;
 	}
 
-	dn_array_size = talloc_array_length(ctx->dn_list->dn);
+	v = talloc_array(msg, struct ldb_val, n);
+	if (v == NULL) {
+		return ldb_module_oom(module);
+	}
+	n = 0;
+	for (i = 0; i < num_chunks; i++) {
+		memcpy(&v[n],
+		       chunks[i].values,
+		       chunks[i].num_values * sizeof(struct ldb_val));
+		n += chunks[i].num_values;
+	}
+	*values = v;
+	*num_values = n;
+	return LDB_SUCCESS;
+}
 
-	additional_length = el->values[0].length / LDB_KV_GUID_SIZE;
+/*
+  merge the values of (part of) an @INDEXORDER record with changes,
+  into out, which has room for num_old + num_added values
+ */
+static unsigned int ldb_kv_index_order_merge(const struct ldb_val *old_vals,
+					     unsigned int num_old,
+					     const struct ldb_val *added,
+					     unsigned int num_added,
+					     const struct ldb_val *removed,
+					     unsigned int num_removed,
+					     struct ldb_val *out)
+{
+	unsigned int i = 0, j = 0, k = 0, n = 0;
 
-	if (ctx->dn_list->count + additional_length < ctx->dn_list->count) {
-		talloc_free(msg);
-		ctx->error = LDB_ERR_OPERATIONS_ERROR;
-		return ctx->error;
-	}
+	while (i < num_old || j < num_added) {
+		struct ldb_val v;
+		int cmp;
 
-	if ((ctx->dn_list->count + additional_length) >= dn_array_size) {
-		size_t new_array_length;
+		if (i == num_old) {
+			cmp = 1;
+		} else if (j == num_added) {
+			cmp = -1;
+		} else {
+			cmp = ldb_kv_index_order_cmp(&old_vals[i], &added[j]);
+		}
 
-		if (dn_array_size * 2 < dn_array_size) {
-			talloc_free(msg);
-			ctx->error = LDB_ERR_OPERATIONS_ERROR;
-			return ctx->error;
+		if (cmp > 0) {
+			out[n++] = added[j++];
+			continue;
+		}
+		v = old_vals[i++];
+		if (cmp == 0) {
+			j++;
+		}
+		while (k < num_removed &&
+		       ldb_kv_index_order_cmp(&removed[k], &v) < 0) {
+			k++;
 		}
+		if (cmp != 0 &&
+		    k < num_removed &&
+		    ldb_kv_index_order_cmp(&removed[k], &v) == 0) {
+			continue;
+		}
+		out[n++] = v;
+	}
+	return n;
+}
 
-		new_array_length = MAX(ctx->dn_list->count + additional_length,
-				       dn_array_size * 2);
+static int ldb_kv_index_order_write(struct ldb_module *module,
+				    TALLOC_CTX *mem_ctx,
+				    struct ldb_dn *dn,
+				    const char *name,
+				    struct ldb_val *values,
+				    unsigned int num_values)
+{
+	struct ldb_message *msg = NULL;
+	struct ldb_message_element *el = NULL;
+	int ret;
 
-		ctx->dn_list->dn = talloc_realloc(ctx->dn_list,
-						  ctx->dn_list->dn,
-						  struct ldb_val,
-						  new_array_length);
+	msg = ldb_msg_new(mem_ctx);
+	if (msg == NULL) {
+		return ldb_module_oom(module);
 	}
-
-	if (ctx->dn_list->dn == NULL) {
-		talloc_free(msg);
-		ctx->error = LDB_ERR_OPERATIONS_ERROR;
-		return ctx->error;
+	msg->dn = dn;
+	ret = ldb_msg_add_empty(msg, name, 0, &el);
+	if (ret != LDB_SUCCESS) {
+		TALLOC_FREE(msg);
+		return ret;
 	}
+	el->values = values;
+	el->num_values = num_values;
+	ret = ldb_kv_store(module, msg, TDB_REPLACE);
+	TALLOC_FREE(msg);
+	return ret;
+}
 
-	/*
-	 * The actual data is on msg.
-	 */
-	talloc_steal(ctx->dn_list->dn, msg);
-	for (i = 0; i < additional_length; i++) {
-		ctx->dn_list->dn[i + ctx->dn_list->count].data
-			= &el->values[0].data[i * LDB_KV_GUID_SIZE];
-		ctx->dn_list->dn[i + ctx->dn_list->count].length = LDB_KV_GUID_SIZE;
+static int ldb_kv_index_order_delete(struct ldb_module *module,
+				     TALLOC_CTX *mem_ctx,
+				     struct ldb_dn *dn)
+{
+	struct ldb_message *msg = NULL;
+	int ret;
 
+	msg = ldb_msg_new(mem_ctx);
+	if (msg == NULL) {
+		return ldb_module_oom(module);
 	}
-
-	ctx->dn_list->count += additional_length;
-
-	talloc_free(msg->elements);
-
-	return LDB_SUCCESS;
+	msg->dn = dn;
+	ret = ldb_kv_delete_noindex(module, msg);
+	TALLOC_FREE(msg);
+	if (ret == LDB_ERR_NO_SUCH_OBJECT) {
+		ret = LDB_SUCCESS;
+	}
+	return ret;
 }
 
 /*
- * >= and <= indexing implemented using lexicographically sorted keys
- *
- * We only run this in GUID indexing mode and when there is no write
- * transaction (only implicit read locks are being held). Otherwise, we would
- * have to deal with the in-memory index cache.
- *
- * We rely on the implementation of index_format_fn on a schema syntax which
- * will can help us to construct keys which can be ordered correctly, and we
- * terminate using schema agnostic start and end keys.
- *
- * index_format_fn must output values which can be memcmp-able to produce the
- * correct ordering as defined by the schema syntax class.
+  write the @INDEXORDER record of an attribute: the values it had,
+  less those removed, with those added.  Only the chunks with changes
+  are read and written, and the directory of a split record.
  */
-static int ldb_kv_index_dn_ordered(struct ldb_module *module,
-				   struct ldb_kv_private *ldb_kv,
-				   const struct ldb_parse_tree *tree,
-				   struct dn_list *list, bool ascending)
+static int ldb_kv_index_order_store1(struct ldb_module *module,
+				     struct ldb_kv_private *ldb_kv,
+				     struct ldb_kv_index_order *order)
 {
-	enum key_truncation truncation = KEY_NOT_TRUNCATED;
 	struct ldb_context *ldb = ldb_module_get_ctx(module);
-
-	struct ldb_val ldb_key = { 0 }, ldb_key2 = { 0 };
-	struct ldb_val start_key, end_key;
-	struct ldb_dn *key_dn = NULL;
-	const struct ldb_schema_attribute *a = NULL;
-
-	struct ldb_kv_ordered_index_context ctx;
-	int ret;
-
+	const unsigned int half = LDB_KV_INDEX_ORDER_CHUNK_VALUES / 2;
+	int attr_len = strlen(order->attr);
 	TALLOC_CTX *tmp_ctx = NULL;
+	struct ldb_message *old = NULL;
+	struct ldb_message_element *el = NULL;
+	struct ldb_kv_index_order_chunk *chunks = NULL;
+	struct ldb_kv_index_order_chunk *out = NULL;
+	struct ldb_val *dir = NULL;
+	struct ldb_dn *dn = NULL;
+	unsigned int num_chunks = 0;
+	unsigned int num_out = 0;
+	unsigned int i, p, a = 0, r = 0;
+	uint32_t next_id = 0;
+	int ret;
 
-	if (!ldb_kv_is_indexed(module, ldb_kv, tree->u.comparison.attr)) {
-		return LDB_ERR_OPERATIONS_ERROR;
-	}
-
-	if (ldb_kv->cache->GUID_index_attribute == NULL) {
-		return LDB_ERR_OPERATIONS_ERROR;
+	tmp_ctx = talloc_new(order);
+	if (tmp_ctx == NULL) {
+		return ldb_module_oom(module);
 	}
-
-	/* bail out if we're in a transaction, full search instead. */
-	if (ldb_kv->kv_ops->transaction_active(ldb_kv)) {
-		return LDB_ERR_OPERATIONS_ERROR;
+	dn = ldb_dn_new_fmt(tmp_ctx, ldb, "%s:%s",
+			    LDB_KV_INDEX_ORDER, order->attr);
+	if (dn == NULL) {
+		TALLOC_FREE(tmp_ctx);
+		return ldb_module_oom(module);
 	}
 
-	if (ldb_kv->disallow_dn_filter &&
-	    (ldb_attr_cmp(tree->u.comparison.attr, "dn") == 0)) {
-		/* in AD mode we do not support "(dn=...)" search filters */
-		list->dn = NULL;
-		list->count = 0;
-		return LDB_SUCCESS;
+	/* A re-index writes all the values */
+	if (!ldb_kv->idxptr->stats_reset) {
+		old = ldb_msg_new(tmp_ctx);
+		if (old == NULL) {
+			TALLOC_FREE(tmp_ctx);
+			return ldb_module_oom(module);
+		}
+		ret = ldb_kv_search_dn1(module,
+					dn,
+					old,
+					LDB_UNPACK_DATA_FLAG_NO_DN);
+		if (ret != LDB_SUCCESS && ret != LDB_ERR_NO_SUCH_OBJECT) {
+			TALLOC_FREE(tmp_ctx);
+			return ret;
+		}
+		el = ldb_msg_find_element(old, LDB_KV_IDXORDERCHUNK);
+		if (el != NULL) {
+			ret = ldb_kv_index_order_dir_parse(tmp_ctx,
+							   el,
+							   &chunks,
+							   &num_chunks);
+			if (ret != LDB_SUCCESS) {
+				TALLOC_FREE(tmp_ctx);
+				return ldb_module_operr(module);
+			}
+		}
 	}
-	if (tree->u.comparison.attr[0] == '@') {
-		/* Do not allow a indexed search against an @ */
-		list->dn = NULL;
-		list->count = 0;
-		return LDB_SUCCESS;
+	if (num_chunks == 0) {
+		chunks = talloc_zero(tmp_ctx, struct ldb_kv_index_order_chunk);
+		if (chunks == NULL) {
+			TALLOC_FREE(tmp_ctx);
+			return ldb_module_oom(module);
+		}
+		chunks->id = LDB_KV_INDEX_ORDER_UNSPLIT;
+		chunks->loaded = true;
+		el = NULL;
+		if (old != NULL) {
+			el = ldb_msg_find_element(old, LDB_KV_IDXVALUE);
+		}
+		if (el != NULL) {
+			chunks->values = el->values;
+			chunks->num_values = el->num_values;
+		}
+		num_chunks = 1;
 	}
 
-	a = ldb_schema_attribute_by_name(ldb, tree->u.comparison.attr);
-
 	/*
-	 * If there's no index format function defined for this attr, then
-	 * the lexicographic order in the database doesn't correspond to the
-	 * attr's ordering, so we can't use the iterate_range op.
+	 * Share out the changes, which are in order.  The first chunk
+	 * also takes any values before its first.
 	 */
-	if (a->syntax->index_format_fn == NULL) {
-		return LDB_ERR_OPERATIONS_ERROR;
-	}
+	for (i = 0; i < num_chunks; i++) {
+		struct ldb_kv_index_order_chunk *c = &chunks[i];
+		const struct ldb_val *next = NULL;
 
-	tmp_ctx = talloc_new(NULL);
-	if (tmp_ctx == NULL) {
-		return ldb_module_oom(module);
+		if (i + 1 < num_chunks) {
+			next = &chunks[i + 1].first;
+		}
+		c->added = a;
+		while (a < order->num_added &&
+		       (next == NULL ||
+			ldb_kv_index_order_cmp(&order->added[a], next) < 0)) {
+			a++;
+		}
+		c->num_added = a - c->added;
+		c->removed = r;
+		while (r < order->num_removed &&
+		       (next == NULL ||
+			ldb_kv_index_order_cmp(&order->removed[r], next) < 0)) {
+			r++;
+		}
+		c->num_removed = r - c->removed;
+
+		if (c->id != LDB_KV_INDEX_ORDER_UNSPLIT) {
+			next_id = MAX(next_id, c->id + 1);
+		}
 	}
 
-	key_dn = ldb_kv_index_key(ldb, tmp_ctx, ldb_kv, tree->u.comparison.attr,
-				  &tree->u.comparison.value,
-				  NULL, &truncation);
-	if (!key_dn) {
-		TALLOC_FREE(tmp_ctx);
-		return LDB_ERR_OPERATIONS_ERROR;
-	} else if (truncation == KEY_TRUNCATED) {
-		ldb_debug(ldb, LDB_DEBUG_WARNING,
-			  __location__
-			  ": ordered index violation: key dn truncated: %s\n",
-			  ldb_dn_get_linearized(key_dn));
-		TALLOC_FREE(tmp_ctx);
-		return LDB_ERR_OPERATIONS_ERROR;
-	}
-	ldb_key = ldb_kv_key_dn(tmp_ctx, key_dn);
-	talloc_free(key_dn);
-	if (ldb_key.data == NULL) {
-		TALLOC_FREE(tmp_ctx);
-		return LDB_ERR_OPERATIONS_ERROR;
-	}
+	/* Merge the changed chunks, and count the chunks there will be */
+	for (i = 0; i < num_chunks; i++) {
+		struct ldb_kv_index_order_chunk *c = &chunks[i];
+		struct ldb_val *v = NULL;
 
-	key_dn = ldb_kv_index_key(ldb, tmp_ctx,
-				  ldb_kv, tree->u.comparison.attr,
-				  NULL, NULL, &truncation);
-	if (!key_dn) {
-		TALLOC_FREE(tmp_ctx);
-		return LDB_ERR_OPERATIONS_ERROR;
-	} else if (truncation == KEY_TRUNCATED) {
-		ldb_debug(ldb, LDB_DEBUG_WARNING,
-			  __location__
-			  ": ordered index violation: key dn truncated: %s\n",
-			  ldb_dn_get_linearized(key_dn));
-		TALLOC_FREE(tmp_ctx);
-		return LDB_ERR_OPERATIONS_ERROR;
+		if (c->num_added == 0 && c->num_removed == 0 && !c->loaded) {
+			num_out++;
+			continue;
+		}
+		if (!c->loaded) {
+			ret = ldb_kv_index_order_chunk_load(module,
+							    tmp_ctx,
+							    order->attr,
+							    attr_len,
+							    c,
+							    0);
+			if (ret != LDB_SUCCESS) {
+				TALLOC_FREE(tmp_ctx);
+				return ret;
+			}
+		}
+		v = talloc_array(tmp_ctx,
+				 struct ldb_val,
+				 c->num_values + c->num_added);
+		if (v == NULL) {
+			TALLOC_FREE(tmp_ctx);
+			return ldb_module_oom(module);
+		}
+		c->num_values = ldb_kv_index_order_merge(
+			c->values,
+			c->num_values,
+			&order->added[c->added],
+			c->num_added,
+			&order->removed[c->removed],
+			c->num_removed,
+			v);
+		c->values = v;
+
+		if (c->num_values > LDB_KV_INDEX_ORDER_CHUNK_VALUES) {
+			num_out += (c->num_values + half - 1) / half;
+		} else if (c->num_values > 0) {
+			num_out++;
+		}
 	}
 
-	ldb_key2 = ldb_kv_key_dn(tmp_ctx, key_dn);
-	talloc_free(key_dn);
-	if (ldb_key2.data == NULL) {
+	out = talloc_zero_array(tmp_ctx,
+				struct ldb_kv_index_order_chunk,
+				MAX(num_out, 1));
+	if (out == NULL) {
 		TALLOC_FREE(tmp_ctx);
-		return LDB_ERR_OPERATIONS_ERROR;
+		return ldb_module_oom(module);
 	}
+	p = 0;
+	for (i = 0; i < num_chunks; i++) {
+		struct ldb_kv_index_order_chunk *c = &chunks[i];
+		unsigned int n = c->num_values;
+		unsigned int done = 0;
 
-	/*
-	 * In order to avoid defining a start and end key for the search, we
-	 * notice that each index key is of the form:
-	 *
-	 *     DN=@INDEX:<ATTRIBUTE>:<VALUE>\0.
-	 *
-	 * We can simply make our start key DN=@INDEX:<ATTRIBUTE>: and our end
-	 * key DN=@INDEX:<ATTRIBUTE>; to return all index entries for a
-	 * particular attribute.
-	 *
-	 * Our LMDB backend uses the default memcmp for key comparison.
-	 */
+		if (!c->loaded) {
+			out[p++] = *c;
+			continue;
+		}
+		if (n == 0 && c->id != LDB_KV_INDEX_ORDER_UNSPLIT) {
+			struct ldb_dn *cdn = ldb_kv_index_order_chunk_dn(
+				tmp_ctx, ldb, order->attr, attr_len, c->id);
+			if (cdn == NULL) {
+				TALLOC_FREE(tmp_ctx);
+				return ldb_module_oom(module);
+			}
+			ret = ldb_kv_index_order_delete(module, tmp_ctx, cdn);
+			if (ret != LDB_SUCCESS) {
+				TALLOC_FREE(tmp_ctx);
+				return ret;
+			}
+		}
+		while (done < n) {
+			unsigned int len = n - done;
 
-	/* Eliminate NUL byte at the end of the empty key */
-	ldb_key2.length--;
+			if (n > LDB_KV_INDEX_ORDER_CHUNK_VALUES) {
+				len = MIN(len, half);
+			}
+			out[p] = (struct ldb_kv_index_order_chunk) {
+				.id = c->id,
+				.first = c->values[done],
+				.loaded = true,
+				.values = &c->values[done],
+				.num_values = len,
+			};
+			if (done > 0 || c->id == LDB_KV_INDEX_ORDER_UNSPLIT) {
+				out[p].id = next_id++;
+			}
+			p++;
+			done += len;
+		}
+	}
 
-	if (ascending) {
-		/* : becomes ; for pseudo end-key */
-		ldb_key2.data[ldb_key2.length-1]++;
-		start_key = ldb_key;
-		end_key = ldb_key2;
-	} else {
-		start_key = ldb_key2;
-		end_key = ldb_key;
+	if (num_out == 0) {
+		ret = ldb_kv_index_order_delete(module, tmp_ctx, dn);
+		TALLOC_FREE(tmp_ctx);
+		return ret;
 	}
 
-	ctx.module = module;
-	ctx.error = 0;
-	ctx.dn_list = list;
-	ctx.dn_list->count = 0;
-	ctx.dn_list->dn = talloc_zero_array(ctx.dn_list, struct ldb_val, 2);
+	/* A single chunk is written back as an unsplit record */
+	if (num_out == 1) {
+		struct ldb_kv_index_order_chunk *c = &out[0];
 
-	ret = ldb_kv->kv_ops->iterate_range(ldb_kv, start_key, end_key,
-					    traverse_range_index, &ctx);
+		if (!c->loaded) {
+			ret = ldb_kv_index_order_chunk_load(module,
+							    tmp_ctx,
+							    order->attr,
+							    attr_len,
+							    c,
+							    0);
+			if (ret != LDB_SUCCESS) {
+				TALLOC_FREE(tmp_ctx);
+				return ret;
+			}
+		}
+		ret = ldb_kv_index_order_write(module,
+					       tmp_ctx,
+					       dn,
+					       LDB_KV_IDXVALUE,
+					       c->values,
+					       c->num_values);
+		if (chunks[0].id == LDB_KV_INDEX_ORDER_UNSPLIT) {
+			TALLOC_FREE(tmp_ctx);
+			return ret;
+		}
+		for (i = 0; i < num_chunks && ret == LDB_SUCCESS; i++) {
+			struct ldb_dn *cdn = ldb_kv_index_order_chunk_dn(
+				tmp_ctx, ldb, order->attr, attr_len,
+				chunks[i].id);
+			if (cdn == NULL) {
+				ret = ldb_module_oom(module);
+				break;
+			}
+			ret = ldb_kv_index_order_delete(module, tmp_ctx, cdn);
+		}
+		TALLOC_FREE(tmp_ctx);
+		return ret;
+	}
 
-	if (ret != LDB_SUCCESS || ctx.error != LDB_SUCCESS) {
+	dir = talloc_array(tmp_ctx, struct ldb_val, num_out);
+	if (dir == NULL) {
 		TALLOC_FREE(tmp_ctx);
-		return LDB_ERR_OPERATIONS_ERROR;
+		return ldb_module_oom(module);
 	}
+	for (p = 0; p < num_out; p++) {
+		struct ldb_kv_index_order_chunk *c = &out[p];
+		uint8_t *d = NULL;
 
-	TYPESAFE_QSORT(ctx.dn_list->dn, ctx.dn_list->count,
-		       ldb_val_equal_exact_for_qsort);
+		if (c->loaded) {
+			struct ldb_dn *cdn = ldb_kv_index_order_chunk_dn(
+				tmp_ctx, ldb, order->attr, attr_len, c->id);
+			if (cdn == NULL) {
+				TALLOC_FREE(tmp_ctx);
+				return ldb_module_oom(module);
+			}
+			ret = ldb_kv_index_order_write(module,
+						       tmp_ctx,
+						       cdn,
+						       LDB_KV_IDXVALUE,
+						       c->values,
+						       c->num_values);
+			if (ret != LDB_SUCCESS) {
+				TALLOC_FREE(tmp_ctx);
+				return ret;
+			}
+		}
 
+		d = talloc_size(dir, 4 + c->first.length);
+		if (d == NULL) {
+			TALLOC_FREE(tmp_ctx);
+			return ldb_module_oom(module);
+		}
+		d[0] = c->id & 0xFF;
+		d[1] = (c->id >> 8) & 0xFF;
+		d[2] = (c->id >> 16) & 0xFF;
+		d[3] = (c->id >> 24) & 0xFF;
+		memcpy(d + 4, c->first.data, c->first.length);
+		dir[p].data = d;
+		dir[p].length = 4 + c->first.length;
+	}
+
+	ret = ldb_kv_index_order_write(module,
+				       tmp_ctx,
+				       dn,
+				       LDB_KV_IDXORDERCHUNK,
+				       dir,
+				       num_out);
 	TALLOC_FREE(tmp_ctx);
-
-	return LDB_SUCCESS;
-}
-
-static int ldb_kv_index_dn_greater(struct ldb_module *module,
-				   struct ldb_kv_private *ldb_kv,
-				   const struct ldb_parse_tree *tree,
-				   struct dn_list *list)
-{
-	return ldb_kv_index_dn_ordered(module,
-				       ldb_kv,
-				       tree,
-				       list, true);
-}
-
-static int ldb_kv_index_dn_less(struct ldb_module *module,
-				   struct ldb_kv_private *ldb_kv,
-				   const struct ldb_parse_tree *tree,
-				   struct dn_list *list)
-{
-	return ldb_kv_index_dn_ordered(module,
-				       ldb_kv,
-				       tree,
-				       list, false);
+	return ret;
 }
 
 /*
-  return a list of matching objects using a one-level index
+  remove the @INDEXORDER records found by a re-index, and write the
+  changed ones
  */
-static int ldb_kv_index_dn_attr(struct ldb_module *module,
-				struct ldb_kv_private *ldb_kv,
-				const char *attr,
-				struct ldb_dn *dn,
-				struct dn_list *list,
-				enum key_truncation *truncation)
+static int ldb_kv_index_order_store(struct ldb_module *module,
+				    struct ldb_kv_private *ldb_kv)
 {
-	struct ldb_context *ldb;
-	struct ldb_dn *key;
-	struct ldb_val val;
+	struct ldb_kv_idxptr *idxptr = ldb_kv->idxptr;
+	unsigned int i;
 	int ret;
 
-	ldb = ldb_module_get_ctx(module);
-
-	/* work out the index key from the parent DN */
-	val.data = (uint8_t *)((uintptr_t)ldb_dn_get_casefold(dn));
-	if (val.data == NULL) {
-		const char *dn_str = ldb_dn_get_linearized(dn);
-		ldb_asprintf_errstring(ldb_module_get_ctx(module),
-				       __location__
-				       ": Failed to get casefold DN "
-				       "from: %s",
-				       dn_str);
-		return LDB_ERR_OPERATIONS_ERROR;
-	}
-	val.length = strlen((char *)val.data);
-
-	/*
-	 * We use list as a TALLOC_CTX to provide a shorter-lived
-	 * memory context than ldb, even as the result is freed with
-	 * the talloc_free(key) below.
-	 */
-	key = ldb_kv_index_key(ldb, list, ldb_kv, attr, &val, NULL, truncation);
-	if (!key) {
-		ldb_oom(ldb);
-		return LDB_ERR_OPERATIONS_ERROR;
+	for (i = 0; i < idxptr->num_stale_orders; i++) {
+		struct ldb_message *msg = ldb_msg_new(idxptr);
+		if (msg == NULL) {
+			return ldb_module_oom(module);
+		}
+		msg->dn = idxptr->stale_orders[i];
+		ret = ldb_kv_delete_noindex(module, msg);
+		TALLOC_FREE(msg);
+		if (ret != LDB_SUCCESS && ret != LDB_ERR_NO_SUCH_OBJECT) {
+			return ret;
+		}
 	}
 
-	ret = ldb_kv_dn_list_load(module, ldb_kv, key, list,
-				  DN_LIST_WILL_BE_READ_ONLY);
-	talloc_free(key);
-	if (ret != LDB_SUCCESS) {
-		return ret;
-	}
+	for (i = 0; i < idxptr->num_orders; i++) {
+		struct ldb_kv_index_order *order = &idxptr->orders[i];
 
-	if (list->count == 0) {
-		return LDB_ERR_NO_SUCH_OBJECT;
+		if (order->num_added == 0 && order->num_removed == 0) {
+			continue;
+		}
+		ret = ldb_kv_index_order_store1(module, ldb_kv, order);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
 	}
-
 	return LDB_SUCCESS;
 }
 
-/*
-  return a list of matching objects using a one-level index
- */
-static int ldb_kv_index_dn_one(struct ldb_module *module,
-			       struct ldb_kv_private *ldb_kv,
-			       struct ldb_dn *parent_dn,
-			       struct dn_list *list,
-			       enum key_truncation *truncation)
+static int ldb_kv_idxptr_entry_cmp(struct ldb_kv_idxptr_entry **e1,
+				   struct ldb_kv_idxptr_entry **e2)
 {
-	int ret = ldb_kv_index_dn_attr(
-	    module, ldb_kv, LDB_KV_IDXONE, parent_dn, list, truncation);
-	if (ret == LDB_SUCCESS) {
-		/*
-		 * Ensure we do not shortcut on intersection for this
-		 * list.  We must never be lazy and return an entry
-		 * not in this list.  This allows the index for
-		 * SCOPE_ONELEVEL to be trusted.
-		 */
+	const struct ldb_val *k1 = &(*e1)->key;
+	const struct ldb_val *k2 = &(*e2)->key;
+	int ret;
 
-		list->strict = true;
+	ret = memcmp(k1->data, k2->data, MIN(k1->length, k2->length));
+	if (ret != 0) {
+		return ret;
 	}
-	return ret;
+	return NUMERIC_CMP(k1->length, k2->length);
 }
 
 /*
-  return a list of matching objects using the DN index
+  store the in-memory index entries on disk, in key order so that
+  neighbouring records are written together
  */
-static int ldb_kv_index_dn_base_dn(struct ldb_module *module,
-				   struct ldb_kv_private *ldb_kv,
-				   struct ldb_dn *base_dn,
-				   struct dn_list *dn_list,
-				   enum key_truncation *truncation)
+static int ldb_kv_index_cache_store(struct ldb_module *module,
+				    struct ldb_kv_private *ldb_kv)
 {
-	const struct ldb_val *guid_val = NULL;
-	if (ldb_kv->cache->GUID_index_attribute == NULL) {
-		dn_list->dn = talloc_array(dn_list, struct ldb_val, 1);
-		if (dn_list->dn == NULL) {
-			return ldb_module_oom(module);
-		}
-		dn_list->dn[0].data = discard_const_p(unsigned char,
-						      ldb_dn_get_linearized(base_dn));
-		if (dn_list->dn[0].data == NULL) {
-			talloc_free(dn_list->dn);
-			return ldb_module_oom(module);
-		}
-		dn_list->dn[0].length = strlen((char *)dn_list->dn[0].data);
-		dn_list->count = 1;
+	struct ldb_kv_idxptr *idxptr = ldb_kv->idxptr;
+	struct ldb_kv_idxptr_entry **sorted = NULL;
+	size_t i, n = 0;
+	int ret = LDB_SUCCESS;
 
+	if (idxptr->num_entries == 0) {
 		return LDB_SUCCESS;
 	}
 
-	if (ldb_kv->cache->GUID_index_dn_component != NULL) {
-		guid_val = ldb_dn_get_extended_component(
-		    base_dn, ldb_kv->cache->GUID_index_dn_component);
+	sorted = talloc_array(idxptr,
+			      struct ldb_kv_idxptr_entry *,
+			      idxptr->num_entries);
+	if (sorted == NULL) {
+		return ldb_module_oom(module);
+	}
+	for (i = 0; i < idxptr->num_slots; i++) {
+		if (idxptr->entries[i] != NULL) {
+			sorted[n++] = idxptr->entries[i];
+		}
 	}
+	TYPESAFE_QSORT(sorted, n, ldb_kv_idxptr_entry_cmp);
 
-	if (guid_val != NULL) {
-		dn_list->dn = talloc_array(dn_list, struct ldb_val, 1);
-		if (dn_list->dn == NULL) {
-			return ldb_module_oom(module);
+	for (i = 0; i < n; i++) {
+		if (sorted[i]->list->unsorted ||
+		    sorted[i]->list->check_duplicates) {
+			ldb_kv_dn_list_order(module, ldb_kv, sorted[i]);
 		}
-		dn_list->dn[0].data = guid_val->data;
-		dn_list->dn[0].length = guid_val->length;
-		dn_list->count = 1;
 
-		return LDB_SUCCESS;
-	}
+		ret = ldb_kv_index_stats_update(idxptr,
+						&sorted[i]->key,
+						sorted[i]->list);
+		if (ret != LDB_SUCCESS) {
+			break;
+		}
 
-	return ldb_kv_index_dn_attr(
-	    module, ldb_kv, LDB_KV_IDXDN, base_dn, dn_list, truncation);
-}
+		if (ldb_kv->cache->ordered_index &&
+		    ldb_kv->cache->GUID_index_attribute != NULL) {
+			ret = ldb_kv_index_order_note(module,
+						      idxptr,
+						      &sorted[i]->key,
+						      sorted[i]->list);
+			if (ret != LDB_SUCCESS) {
+				break;
+			}
+		}
 
-/*
-  return a list of dn's that might match a indexed search or
-  an error. return LDB_ERR_NO_SUCH_OBJECT for no matches, or LDB_SUCCESS for matches
- */
-static int ldb_kv_index_dn(struct ldb_module *module,
-			   struct ldb_kv_private *ldb_kv,
-			   const struct ldb_parse_tree *tree,
-			   struct dn_list *list)
-{
-	int ret = LDB_ERR_OPERATIONS_ERROR;
-
-	switch (tree->operation) {
-	case LDB_OP_AND:
-		ret = ldb_kv_index_dn_and(module, ldb_kv, tree, list);
-		break;
+		ret = ldb_kv_dn_list_store_full(module,
+						ldb_kv,
+						sorted[i]->dn,
+						sorted[i]->list);
+		if (ret != LDB_SUCCESS) {
+			break;
+		}
+	}
 
-	case LDB_OP_OR:
-		ret = ldb_kv_index_dn_or(module, ldb_kv, tree, list);
-		break;
+	TALLOC_FREE(sorted);
+	return ret;
+}
 
-	case LDB_OP_NOT:
-		ret = ldb_kv_index_dn_not(module, ldb_kv, tree, list);
-		break;
+/* cleanup the idxptr mode when transaction commits */
+int ldb_kv_index_transaction_commit(struct ldb_module *module)
+{
+	struct ldb_kv_private *ldb_kv = talloc_get_type(
+	    ldb_module_get_private(module), struct ldb_kv_private);
+	int ret;
 
-	case LDB_OP_EQUALITY:
-		ret = ldb_kv_index_dn_leaf(module, ldb_kv, tree, list);
-		break;
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
 
-	case LDB_OP_GREATER:
-		ret = ldb_kv_index_dn_greater(module, ldb_kv, tree, list);
-		break;
+	ldb_reset_err_string(ldb);
 
-	case LDB_OP_LESS:
-		ret = ldb_kv_index_dn_less(module, ldb_kv, tree, list);
-		break;
+	ldb_kv->idxptr->error = ldb_kv_index_stats_begin(module, ldb_kv);
+	if (ldb_kv->idxptr->error == LDB_SUCCESS) {
+		ldb_kv->idxptr->error = ldb_kv_index_cache_store(module, ldb_kv);
+	}
 
-	case LDB_OP_SUBSTRING:
-	case LDB_OP_PRESENT:
-	case LDB_OP_APPROX:
-	case LDB_OP_EXTENDED:
-		/* we can't index with fancy bitops yet */
-		ret = LDB_ERR_OPERATIONS_ERROR;
-		break;
+	ret = ldb_kv->idxptr->error;
+	if (ret == LDB_SUCCESS) {
+		ret = ldb_kv_index_order_store(module, ldb_kv);
+	}
+	if (ret == LDB_SUCCESS) {
+		ret = ldb_kv_index_stats_store(module, ldb_kv);
+	}
+	if (ret != LDB_SUCCESS) {
+		if (!ldb_errstring(ldb)) {
+			ldb_set_errstring(ldb, ldb_strerror(ret));
+		}
+		ldb_asprintf_errstring(ldb, "Failed to store index records in transaction commit: %s", ldb_errstring(ldb));
 	}
 
+	talloc_free(ldb_kv->idxptr);
+	ldb_kv->idxptr = NULL;
 	return ret;
 }
 
+/* cleanup the idxptr mode when transaction cancels */
+int ldb_kv_index_transaction_cancel(struct ldb_module *module)
+{
+	struct ldb_kv_private *ldb_kv = talloc_get_type(
+	    ldb_module_get_private(module), struct ldb_kv_private);
+	TALLOC_FREE(ldb_kv->idxptr);
+	ldb_kv_index_sub_transaction_cancel(ldb_kv);
+	return LDB_SUCCESS;
+}
+
+
 /*
-  filter a candidate dn_list from an indexed search into a set of results
-  extracting just the given attributes
+  see if a attribute value is in the list of indexed attributes
 */
-static int ldb_kv_index_filter(struct ldb_kv_private *ldb_kv,
-			       const struct dn_list *dn_list,
-			       struct ldb_kv_context *ac,
-			       uint32_t *match_count,
-			       enum key_truncation scope_one_truncation)
+bool ldb_kv_is_indexed(struct ldb_module *module,
+		       struct ldb_kv_private *ldb_kv,
+		       const char *attr)
 {
-	struct ldb_context *ldb = ldb_module_get_ctx(ac->module);
-	struct ldb_message *msg;
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
 	unsigned int i;
-	unsigned int num_keys = 0;
-	uint8_t previous_guid_key[LDB_KV_GUID_KEY_SIZE] = {0};
-	struct ldb_val *keys = NULL;
+	struct ldb_message_element *el;
 
-	/*
-	 * We have to allocate the key list (rather than just walk the
-	 * caller supplied list) as the callback could change the list
-	 * (by modifying an indexed attribute hosted in the in-memory
-	 * index cache!)
-	 */
-	keys = talloc_array(ac, struct ldb_val, dn_list->count);
-	if (keys == NULL) {
-		return ldb_module_oom(ac->module);
+	if ((ldb_kv->cache->GUID_index_attribute != NULL) &&
+	    (ldb_attr_cmp(attr, ldb_kv->cache->GUID_index_attribute) == 0)) {
+		/* Implicitly covered, this is the index key */
+		return false;
 	}
+	if (ldb->schema.index_handler_override) {
+		const struct ldb_schema_attribute *a
+			= ldb_schema_attribute_by_name(ldb, attr);
 
-	if (ldb_kv->cache->GUID_index_attribute != NULL) {
-		/*
-		 * We speculate that the keys will be GUID based and so
-		 * pre-fill in enough space for a GUID (avoiding a pile of
-		 * small allocations)
-		 */
-		struct guid_tdb_key {
-			uint8_t guid_key[LDB_KV_GUID_KEY_SIZE];
-		} *key_values = NULL;
-
-		key_values = talloc_array(keys,
-					  struct guid_tdb_key,
-					  dn_list->count);
-
-		if (key_values == NULL) {
-			talloc_free(keys);
-			return ldb_module_oom(ac->module);
-		}
-		for (i = 0; i < dn_list->count; i++) {
-			keys[i].data = key_values[i].guid_key;
-			keys[i].length = sizeof(key_values[i].guid_key);
+		if (a == NULL) {
+			return false;
 		}
-	} else {
-		for (i = 0; i < dn_list->count; i++) {
-			keys[i].data = NULL;
-			keys[i].length = 0;
+
+		if (a->flags & LDB_ATTR_FLAG_INDEXED) {
+			return true;
+		} else {
+			return false;
 		}
 	}
 
-	for (i = 0; i < dn_list->count; i++) {
-		int ret;
+	if (!ldb_kv->cache->attribute_indexes) {
+		return false;
+	}
 
-		ret = ldb_kv_idx_to_key(
-		    ac->module, ldb_kv, keys, &dn_list->dn[i], &keys[num_keys]);
-		if (ret != LDB_SUCCESS) {
-			talloc_free(keys);
-			return ret;
+	el = ldb_msg_find_element(ldb_kv->cache->indexlist, LDB_KV_IDXATTR);
+	if (el == NULL) {
+		return false;
+	}
+
+	/* TODO: this is too expensive! At least use a binary search */
+	for (i=0; i<el->num_values; i++) {
+		if (ldb_attr_cmp((char *)el->values[i].data, attr) == 0) {
+			return true;
 		}
+	}
+	return false;
+}
 
-		if (ldb_kv->cache->GUID_index_attribute != NULL) {
-			/*
-			 * If we are in GUID index mode, then the dn_list is
-			 * sorted.  If we got a duplicate, forget about it, as
-			 * otherwise we would send the same entry back more
-			 * than once.
-			 *
-			 * This is needed in the truncated DN case, or if a
-			 * duplicate was forced in via
-			 * LDB_FLAG_INTERNAL_DISABLE_SINGLE_VALUE_CHECK
-			 */
+/*
+  see if an attribute is in the list of attributes with a substring
+  index
+*/
+static bool ldb_kv_is_substr_indexed(struct ldb_kv_private *ldb_kv,
+				     const char *attr)
+{
+	unsigned int i;
+	struct ldb_message_element *el;
 
-			if (memcmp(previous_guid_key,
-				   keys[num_keys].data,
-				   sizeof(previous_guid_key)) == 0) {
-				continue;
-			}
+	if (!ldb_kv->cache->substring_indexes) {
+		return false;
+	}
 
-			memcpy(previous_guid_key,
-			       keys[num_keys].data,
-			       sizeof(previous_guid_key));
+	el = ldb_msg_find_element(ldb_kv->cache->indexlist, LDB_KV_IDXSUBSTR);
+	if (el == NULL) {
+		return false;
+	}
+
+	for (i=0; i<el->num_values; i++) {
+		if (ldb_attr_cmp((char *)el->values[i].data, attr) == 0) {
+			return true;
 		}
-		num_keys++;
 	}
+	return false;
+}
 
+/*
+  The substring index keys of an attribute are
 
-	/*
-	 * Now that the list is a safe copy, send the callbacks
-	 */
-	for (i = 0; i < num_keys; i++) {
-		int ret;
-		bool matched;
+  @INDEX:@IDXSUBSTR:ATTR:<trigram>
 
-		/*
-		 * Check the time every 64 records, to reduce calls to
-		 * gettimeofday().  This is a compromise, not all
-		 * calls to ldb_match_message() will take the same
-		 * time, most will run quickly but by luck it might be
-		 * possible to have 64 records that are slow, doing a
-		 * recursive search via LDAP_MATCHING_RULE_IN_CHAIN.
-		 *
-		 * Thankfully this is after index processing so only
-		 * on the subset that matches some index (but still
-		 * possibly a big one like objectclass=user)
-		 */
-		if (i % 64 == 0) {
-			struct timeval now = tevent_timeval_current();
-			int timeval_cmp = tevent_timeval_compare(&ac->timeout_timeval,
-								 &now);
+  one for each distinct trigram (three bytes) of each canonicalised
+  value.  Work out the value for the key of a trigram in val, which
+  must already hold "ATTR:" and room for the trigram.
+ */
+#define LDB_KV_SUBSTR_GRAM_LEN 3
 
-			/*
-			 * The search has taken too long.  This is the
-			 * most likely place for our time to expire,
-			 * as we are checking the records after the
-			 * index set intersection.  This is now the
-			 * slow process of checking if the records
-			 * actually match.
-			 *
-			 * The tevent based timeout is not likely to
-			 * be hit, sadly, as we don't run an event
-			 * loop.
-			 *
-			 * While we are indexed and most of the work
-			 * should have been done already, the
-			 * ldb_match_* calls can be quite expensive if
-			 * the caller uses LDAP_MATCHING_RULE_IN_CHAIN
-			 */
-			if (timeval_cmp <= 0) {
-				talloc_free(keys);
-				return LDB_ERR_TIME_LIMIT_EXCEEDED;
-			}
-		}
+static void ldb_kv_index_substr_val(struct ldb_val *val, const uint8_t *gram)
+{
+	memcpy(val->data + val->length - LDB_KV_SUBSTR_GRAM_LEN,
+	       gram,
+	       LDB_KV_SUBSTR_GRAM_LEN);
+}
 
-		msg = ldb_msg_new(ac);
-		if (!msg) {
-			talloc_free(keys);
-			return LDB_ERR_OPERATIONS_ERROR;
-		}
+static int ldb_kv_index_substr_val_init(TALLOC_CTX *mem_ctx,
+					const char *attr,
+					struct ldb_val *val)
+{
+	char *attr_folded = ldb_attr_casefold(mem_ctx, attr);
+	size_t attr_len;
 
-		ret =
-		    ldb_kv_search_key(ac->module,
-				      ldb_kv,
-				      keys[i],
-				      msg,
-				      LDB_UNPACK_DATA_FLAG_NO_VALUES_ALLOC |
-				      /*
-				       * The entry point ldb_kv_search_indexed is
-				       * only called from the read-locked
-				       * ldb_kv_search.
-				       */
-				      LDB_UNPACK_DATA_FLAG_READ_LOCKED);
-		if (ret == LDB_ERR_NO_SUCH_OBJECT) {
-			/*
-			 * the record has disappeared? yes, this can
-			 * happen if the entry is deleted by something
-			 * operating in the callback (not another
-			 * process, as we have a read lock)
-			 */
-			talloc_free(msg);
-			continue;
-		}
+	if (attr_folded == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	attr_len = strlen(attr_folded);
 
-		if (ret != LDB_SUCCESS && ret != LDB_ERR_NO_SUCH_OBJECT) {
-			/* an internal error */
-			talloc_free(keys);
-			talloc_free(msg);
-			return LDB_ERR_OPERATIONS_ERROR;
-		}
+	val->length = attr_len + 1 + LDB_KV_SUBSTR_GRAM_LEN;
+	val->data = talloc_realloc(mem_ctx,
+				   (uint8_t *)attr_folded,
+				   uint8_t,
+				   val->length);
+	if (val->data == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	val->data[attr_len] = ':';
+	return LDB_SUCCESS;
+}
 
-		/*
-		 * We trust the index for LDB_SCOPE_ONELEVEL
-		 * unless the index key has been truncated.
-		 *
-		 * LDB_SCOPE_BASE is not passed in by our only caller.
-		 */
-		if (ac->scope != LDB_SCOPE_ONELEVEL ||
-		    !ldb_kv->cache->one_level_indexes ||
-		    scope_one_truncation != KEY_NOT_TRUNCATED)
-		{
-			/*
-			 * The redaction callback may be expensive to call if it
-			 * fetches a security descriptor. Check the DN early and
-			 * bail out if it doesn't match the base.
-			 */
-			if (!ldb_match_scope(ldb, ac->base, msg->dn, ac->scope)) {
-				talloc_free(msg);
-				continue;
-			}
-		}
+/*
+  in the following logic functions, the return value is treated as
+  follows:
 
-		if (ldb->redact.callback != NULL) {
-			ret = ldb->redact.callback(ldb->redact.module, ac->req, msg);
-			if (ret != LDB_SUCCESS) {
-				talloc_free(msg);
-				return ret;
-			}
-		}
+     LDB_SUCCESS: we found some matching index values
 
-		ret = ldb_match_message(ldb, msg, ac->tree,
-					ac->scope, &matched);
-		if (ret != LDB_SUCCESS) {
-			talloc_free(keys);
-			talloc_free(msg);
-			return ret;
-		}
-		if (!matched) {
-			talloc_free(msg);
-			continue;
-		}
-
-		ret = ldb_msg_add_distinguished_name(msg);
-		if (ret == -1) {
-			talloc_free(msg);
-			return LDB_ERR_OPERATIONS_ERROR;
-		}
-
-		/* filter the attributes that the user wants */
-		ret = ldb_kv_filter_attrs_in_place(msg, ac->attrs);
-		if (ret != LDB_SUCCESS) {
-			talloc_free(keys);
-			talloc_free(msg);
-			return LDB_ERR_OPERATIONS_ERROR;
-		}
+     LDB_ERR_NO_SUCH_OBJECT: we know for sure that no object matches
 
-		ldb_msg_shrink_to_fit(msg);
+     LDB_ERR_OPERATIONS_ERROR: indexing could not answer the call,
+                               we'll need a full search
+ */
 
-		/* Ensure the message elements are all talloc'd. */
-		ret = ldb_msg_elements_take_ownership(msg);
-		if (ret != LDB_SUCCESS) {
-			talloc_free(keys);
-			talloc_free(msg);
-			return LDB_ERR_OPERATIONS_ERROR;
-		}
+/*
+  return a list of dn's that might match a simple indexed search (an
+  equality search only)
+ */
+/*
+  does the index record for an attribute hold exactly the objects that
+  match a simple test of it, rather than a superset?
 
-		ret = ldb_module_send_entry(ac->req, msg, NULL);
-		if (ret != LDB_SUCCESS) {
-			/* Regardless of success or failure, the msg
-			 * is the callbacks responsibility, and should
-			 * not be talloc_free()'ed */
-			ac->request_terminated = true;
-			talloc_free(keys);
-			return ret;
-		}
+  Only if the key was not truncated, and the attribute is handled as
+  in one of the standard syntaxes, whose comparison_fn agrees with the
+  canonicalise_fn (or index_format_fn) used for the index key.
+*/
+bool ldb_kv_index_attr_exact(struct ldb_context *ldb,
+			     const char *attr,
+			     enum key_truncation truncation)
+{
+	const struct ldb_schema_attribute *a = NULL;
+	const struct ldb_schema_syntax *s = NULL;
 
-		(*match_count)++;
+	if (truncation != KEY_NOT_TRUNCATED || ldb_attr_dn(attr) == 0) {
+		return false;
 	}
 
-	TALLOC_FREE(keys);
-	return LDB_SUCCESS;
+	a = ldb_schema_attribute_by_name(ldb, attr);
+	if (a == NULL || a->syntax == NULL || a->syntax->name == NULL) {
+		return false;
+	}
+	s = ldb_standard_syntax_by_name(ldb, a->syntax->name);
+	if (s == NULL) {
+		return false;
+	}
+	return a->syntax->canonicalise_fn == s->canonicalise_fn &&
+	       a->syntax->index_format_fn == s->index_format_fn &&
+	       a->syntax->comparison_fn == s->comparison_fn &&
+	       a->syntax->operator_fn == s->operator_fn;
 }
 
-/*
-  sort a DN list
- */
-static void ldb_kv_dn_list_sort(struct ldb_kv_private *ltdb,
-				struct dn_list *list)
+static int ldb_kv_index_dn_simple(struct ldb_module *module,
+				  struct ldb_kv_private *ldb_kv,
+				  const struct ldb_parse_tree *tree,
+				  struct dn_list *list)
 {
-	if (list->count < 2) {
-		return;
+	struct ldb_context *ldb;
+	struct ldb_dn *dn;
+	int ret;
+	enum key_truncation truncation = KEY_NOT_TRUNCATED;
+
+	ldb = ldb_module_get_ctx(module);
+
+	*list = (struct dn_list){};
+
+	/* if the attribute isn't in the list of indexed attributes then
+	   this node needs a full search */
+	if (!ldb_kv_is_indexed(module, ldb_kv, tree->u.equality.attr)) {
+		return LDB_ERR_OPERATIONS_ERROR;
 	}
 
-	/* We know the list is sorted when using the GUID index */
-	if (ltdb->cache->GUID_index_attribute != NULL) {
-		return;
+	/*
+	 * the attribute is indexed. Pull the list of DNs that match the
+	 * search criterion
+	 *
+	 * list is used as a memory context as it has a shorter life
+	 * than 'ldb'.  Regardless we talloc_free() 'dn' below.
+	 */
+	dn = ldb_kv_index_key(ldb,
+			      list,
+			      ldb_kv,
+			      tree->u.equality.attr,
+			      &tree->u.equality.value,
+			      NULL,
+			      &truncation);
+	/*
+	 * We ignore truncation here and allow multi-valued matches
+	 * as ltdb_search_indexed will filter out the wrong one in
+	 * ltdb_index_filter() which calls ldb_match_message().
+	 */
+	if (!dn) {
+		return LDB_ERR_OPERATIONS_ERROR;
 	}
 
-	TYPESAFE_QSORT(list->dn, list->count,
-		       ldb_val_equal_exact_for_qsort);
+	ret = ldb_kv_dn_list_load(module, ldb_kv, dn, list,
+				  DN_LIST_WILL_BE_READ_ONLY);
+	talloc_free(dn);
+	if (ret == LDB_SUCCESS) {
+		list->exact = ldb_kv_index_attr_exact(
+		    ldb, tree->u.equality.attr, truncation);
+	}
+	return ret;
 }
 
 /*
-  search the database with a LDAP-like expression using indexes
-  returns -1 if an indexed search is not possible, in which
-  case the caller should call ltdb_search_full()
-*/
-int ldb_kv_search_indexed(struct ldb_kv_context *ac, uint32_t *match_count)
+  return a list of dn's that might match a leaf indexed search
+ */
+static int ldb_kv_index_dn_leaf(struct ldb_module *module,
+				struct ldb_kv_private *ldb_kv,
+				const struct ldb_parse_tree *tree,
+				struct dn_list *list)
 {
-	struct ldb_context *ldb = ldb_module_get_ctx(ac->module);
-	struct ldb_kv_private *ldb_kv = talloc_get_type(
-	    ldb_module_get_private(ac->module), struct ldb_kv_private);
-	struct dn_list *dn_list;
-	int ret;
-	enum ldb_scope index_scope;
-	enum key_truncation scope_one_truncation = KEY_NOT_TRUNCATED;
-
-	/* see if indexing is enabled */
-	if (!ldb_kv->cache->attribute_indexes &&
-	    !ldb_kv->cache->one_level_indexes && ac->scope != LDB_SCOPE_BASE) {
-		/* fallback to a full search */
-		return LDB_ERR_OPERATIONS_ERROR;
+	*list = (struct dn_list){};
+	if (ldb_kv->disallow_dn_filter &&
+	    (ldb_attr_cmp(tree->u.equality.attr, "dn") == 0)) {
+		/* in AD mode we do not support "(dn=...)" search filters */
+		return LDB_SUCCESS;
 	}
-
-	dn_list = talloc_zero(ac, struct dn_list);
-	if (dn_list == NULL) {
-		return ldb_module_oom(ac->module);
+	if (tree->u.equality.attr[0] == '@') {
+		/* Do not allow a indexed search against an @ */
+		return LDB_SUCCESS;
 	}
+	if (ldb_attr_dn(tree->u.equality.attr) == 0) {
+		enum key_truncation truncation = KEY_NOT_TRUNCATED;
+		bool valid_dn = false;
+		struct ldb_dn *dn
+			= ldb_dn_from_ldb_val(list,
+					      ldb_module_get_ctx(module),
+					      &tree->u.equality.value);
+		if (dn == NULL) {
+			/* If we can't parse it, no match */
+			return LDB_SUCCESS;
+		}
 
-	/*
-	 * For the purposes of selecting the switch arm below, if we
-	 * don't have a one-level index then treat it like a subtree
-	 * search
-	 */
-	if (ac->scope == LDB_SCOPE_ONELEVEL &&
-	    !ldb_kv->cache->one_level_indexes) {
-		index_scope = LDB_SCOPE_SUBTREE;
-	} else {
-		index_scope = ac->scope;
-	}
+		valid_dn = ldb_dn_validate(dn);
+		if (valid_dn == false) {
+			/* If we can't parse it, no match */
+			return LDB_SUCCESS;
+		}
 
-	switch (index_scope) {
-	case LDB_SCOPE_BASE:
 		/*
-		 * The only caller will have filtered the operation out
-		 * so we should never get here
+		 * Re-use the same code we use for a SCOPE_BASE
+		 * search
+		 *
+		 * We can't call TALLOC_FREE(dn) as this must belong
+		 * to list for the memory to remain valid.
+		 */
+		return ldb_kv_index_dn_base_dn(
+		    module, ldb_kv, dn, list, &truncation);
+		/*
+		 * We ignore truncation here and allow multi-valued matches
+		 * as ltdb_search_indexed will filter out the wrong one in
+		 * ltdb_index_filter() which calls ldb_match_message().
 		 */
-		return ldb_operr(ldb);
-
-	case LDB_SCOPE_ONELEVEL:
 
+	} else if ((ldb_kv->cache->GUID_index_attribute != NULL) &&
+		   (ldb_attr_cmp(tree->u.equality.attr,
+				 ldb_kv->cache->GUID_index_attribute) == 0)) {
+		int ret;
+		struct ldb_context *ldb = ldb_module_get_ctx(module);
+		list->dn = talloc_array(list, struct ldb_val, 1);
+		if (list->dn == NULL) {
+			ldb_module_oom(module);
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
 		/*
-		 * First, load all the one-level child objects (regardless of
-		 * whether they match the search filter or not). The database
-		 * maintains a one-level index, so retrieving this is quick.
+		 * We need to go via the canonicalise_fn() to
+		 * ensure we get the index in binary, rather
+		 * than a string
 		 */
-		ret = ldb_kv_index_dn_one(ac->module,
-					  ldb_kv,
-					  ac->base,
-					  dn_list,
-					  &scope_one_truncation);
+		ret = ldb_kv->GUID_index_syntax->canonicalise_fn(
+		    ldb, list->dn, &tree->u.equality.value, &list->dn[0]);
 		if (ret != LDB_SUCCESS) {
-			talloc_free(dn_list);
-			return ret;
+			return LDB_ERR_OPERATIONS_ERROR;
 		}
+		list->count = 1;
+		return LDB_SUCCESS;
+	}
 
-		/*
-		 * If we have too many children, running ldb_kv_index_filter()
-		 * over all the child objects can be quite expensive. So next
-		 * we do a separate indexed query using the search filter.
-		 *
-		 * This should be quick, but it may return objects that are not
-		 * the direct one-level child objects we're interested in.
-		 *
-		 * We only do this in the GUID index mode, which is
-		 * O(n*log(m)) otherwise the intersection below will
-		 * be too costly at O(n*m).
-		 *
-		 * We don't set a heuristic for 'too many' but instead
-		 * do it always and rely on the index lookup being
-		 * fast enough in the small case.
-		 */
-		if (ldb_kv->cache->GUID_index_attribute != NULL) {
-			struct dn_list *indexed_search_result
-				= talloc_zero(ac, struct dn_list);
-			if (indexed_search_result == NULL) {
-				talloc_free(dn_list);
-				return ldb_module_oom(ac->module);
-			}
+	return ldb_kv_index_dn_simple(module, ldb_kv, tree, list);
+}
 
-			if (!ldb_kv->cache->attribute_indexes) {
-				talloc_free(indexed_search_result);
-				talloc_free(dn_list);
-				return LDB_ERR_OPERATIONS_ERROR;
-			}
 
-			/*
-			 * Try to do an indexed database search
-			 */
-			ret = ldb_kv_index_dn(
-			    ac->module, ldb_kv, ac->tree,
-			    indexed_search_result);
+/*
+  process an OR list (a union)
+ */
+static int ldb_kv_index_dn_or(struct ldb_module *module,
+			      struct ldb_kv_private *ldb_kv,
+			      const struct ldb_parse_tree *tree,
+			      struct dn_list *list)
+{
+	struct ldb_context *ldb;
+	unsigned int i;
 
-			/*
-			 * We can stop if we're sure the object doesn't exist
-			 */
-			if (ret == LDB_ERR_NO_SUCH_OBJECT) {
-				talloc_free(indexed_search_result);
-				talloc_free(dn_list);
-				return LDB_ERR_NO_SUCH_OBJECT;
-			}
+	ldb = ldb_module_get_ctx(module);
 
-			/*
-			 * Once we have a successful search result, we
-			 * intersect it with the one-level children (dn_list).
-			 * This should give us exactly the result we're after
-			 * (we still need to run ldb_kv_index_filter() to
-			 * handle potential index truncation cases).
-			 *
-			 * The indexed search may fail because we don't support
-			 * indexing on that type of search operation, e.g.
-			 * matching against '*'. In which case we fall through
-			 * and run ldb_kv_index_filter() over all the one-level
-			 * children (which is still better than bailing out here
-			 * and falling back to a full DB scan).
-			 */
-			if (ret == LDB_SUCCESS) {
-				if (!list_intersect(ldb_kv,
-						    dn_list,
-						    indexed_search_result)) {
-					talloc_free(indexed_search_result);
-					talloc_free(dn_list);
-					return LDB_ERR_OPERATIONS_ERROR;
-				}
-			}
-		}
-		break;
+	list->dn = NULL;
+	list->count = 0;
+	list->exact = true;
 
-	case LDB_SCOPE_SUBTREE:
-	case LDB_SCOPE_DEFAULT:
-		if (!ldb_kv->cache->attribute_indexes) {
-			talloc_free(dn_list);
+	for (i=0; i<tree->u.list.num_elements; i++) {
+		struct dn_list *list2;
+		int ret;
+
+		list2 = talloc_zero(list, struct dn_list);
+		if (list2 == NULL) {
 			return LDB_ERR_OPERATIONS_ERROR;
 		}
-		/*
-		 * Here we load the index for the tree.  We have no
-		 * index for the subtree.
-		 */
-		ret = ldb_kv_index_dn(ac->module, ldb_kv, ac->tree, dn_list);
+
+		ret = ldb_kv_index_dn(
+		    module, ldb_kv, tree->u.list.elements[i], list2);
+
+		if (ret == LDB_ERR_NO_SUCH_OBJECT) {
+			/* X || 0 == X */
+			talloc_free(list2);
+			continue;
+		}
+
 		if (ret != LDB_SUCCESS) {
-			talloc_free(dn_list);
+			/* X || * == * */
+			talloc_free(list2);
 			return ret;
 		}
-		break;
+
+		list->exact = list->exact && list2->exact;
+		if (!ldb_kv_dn_list_union(ldb, ldb_kv, list, list2)) {
+			talloc_free(list2);
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
 	}
 
-	/*
-	 * It is critical that this function do the re-filter even
-	 * on things found by the index as the index can over-match
-	 * in cases of truncation (as well as when it decides it is
-	 * not worth further filtering)
-	 *
-	 * If this changes, then the index code above would need to
-	 * pass up a flag to say if any index was truncated during
-	 * processing as the truncation here refers only to the
-	 * SCOPE_ONELEVEL index.
-	 */
-	ret = ldb_kv_index_filter(
-	    ldb_kv, dn_list, ac, match_count, scope_one_truncation);
-	talloc_free(dn_list);
-	return ret;
+	if (list->count == 0) {
+		return LDB_ERR_NO_SUCH_OBJECT;
+	}
+
+	return LDB_SUCCESS;
 }
 
-/**
- * @brief Add a DN in the index list of a given attribute name/value pair
- *
- * This function will add the DN in the index list for the index for
- * the given attribute name and value.
- *
- * @param[in]  module       A ldb_module structure
- *
- * @param[in]  dn           The string representation of the DN as it
- *                          will be stored in the index entry
- *
- * @param[in]  el           A ldb_message_element array, one of the entry
- *                          referred by the v_idx is the attribute name and
- *                          value pair which will be used to construct the
- *                          index name
- *
- * @param[in]  v_idx        The index of element in the el array to use
- *
- * @return                  An ldb error code
+
+/*
+  NOT an index results
  */
-static int ldb_kv_index_add1(struct ldb_module *module,
-			     struct ldb_kv_private *ldb_kv,
-			     const struct ldb_message *msg,
-			     struct ldb_message_element *el,
-			     int v_idx)
+static int ldb_kv_index_dn_not(_UNUSED_ struct ldb_module *module,
+			       _UNUSED_ struct ldb_kv_private *ldb_kv,
+			       _UNUSED_ const struct ldb_parse_tree *tree,
+			       _UNUSED_ struct dn_list *list)
+{
+	/* the only way to do an indexed not would be if we could
+	   negate the not via another not or if we knew the total
+	   number of database elements so we could know that the
+	   existing expression covered the whole database.
+
+	   instead, we just give up, and rely on a full index scan
+	   (unless an outer & manages to reduce the list)
+	*/
+	return LDB_ERR_OPERATIONS_ERROR;
+}
+
+/*
+ * These things are unique, so avoid a full scan if this is a search
+ * by GUID, DN or a unique attribute
+ */
+bool ldb_kv_index_unique(struct ldb_context *ldb,
+			 struct ldb_kv_private *ldb_kv,
+			 const char *attr)
 {
-	struct ldb_context *ldb;
-	struct ldb_dn *dn_key;
-	int ret;
 	const struct ldb_schema_attribute *a;
-	struct dn_list *list;
-	unsigned alloc_len;
-	enum key_truncation truncation = KEY_TRUNCATED;
+	if (ldb_kv->cache->GUID_index_attribute != NULL) {
+		if (ldb_attr_cmp(attr, ldb_kv->cache->GUID_index_attribute) ==
+		    0) {
+			return true;
+		}
+	}
+	if (ldb_attr_dn(attr) == 0) {
+		return true;
+	}
+
+	a = ldb_schema_attribute_by_name(ldb, attr);
+	if (a->flags & LDB_ATTR_FLAG_UNIQUE_INDEX) {
+		return true;
+	}
+	return false;
+}
 
+/*
+  process an AND expression (intersection)
+ */
+static int ldb_kv_index_dn_and(struct ldb_module *module,
+			       struct ldb_kv_private *ldb_kv,
+			       const struct ldb_parse_tree *tree,
+			       struct dn_list *list)
+{
+	struct ldb_context *ldb;
+	struct ldb_kv_index_plan_term *terms = NULL;
+	unsigned int i;
+	bool found;
+	bool exact = true;
 
 	ldb = ldb_module_get_ctx(module);
 
-	list = talloc_zero(module, struct dn_list);
-	if (list == NULL) {
-		return LDB_ERR_OPERATIONS_ERROR;
-	}
+	list->dn = NULL;
+	list->count = 0;
 
-	dn_key = ldb_kv_index_key(ldb,
-				  list,
-				  ldb_kv,
-				  el->name,
-				  &el->values[v_idx],
-				  &a,
-				  &truncation);
-	if (!dn_key) {
-		talloc_free(list);
-		return LDB_ERR_OPERATIONS_ERROR;
+	/* in the first pass we only look for unique simple
+	   equality tests, in the hope of avoiding having to look
+	   at any others */
+	for (i=0; i<tree->u.list.num_elements; i++) {
+		const struct ldb_parse_tree *subtree = tree->u.list.elements[i];
+		int ret;
+
+		if (subtree->operation != LDB_OP_EQUALITY ||
+		    !ldb_kv_index_unique(
+			ldb, ldb_kv, subtree->u.equality.attr)) {
+			continue;
+		}
+
+		ret = ldb_kv_index_dn(module, ldb_kv, subtree, list);
+		if (ret == LDB_ERR_NO_SUCH_OBJECT) {
+			/* 0 && X == 0 */
+			return LDB_ERR_NO_SUCH_OBJECT;
+		}
+		if (ret == LDB_SUCCESS) {
+			/* a unique index match means we can
+			 * stop. Note that we don't care if we return
+			 * a few too many objects, due to later
+			 * filtering */
+			list->exact = list->exact &&
+				tree->u.list.num_elements == 1;
+			return LDB_SUCCESS;
+		}
 	}
+
 	/*
-	 * Samba only maintains unique indexes on the objectSID and objectGUID
-	 * so if a unique index key exceeds the maximum length there is a
-	 * problem.
+	 * now do a full intersection, starting with the terms
+	 * expected to return the fewest candidates
 	 */
-	if ((truncation == KEY_TRUNCATED) && (a != NULL &&
-		(a->flags & LDB_ATTR_FLAG_UNIQUE_INDEX ||
-		(el->flags & LDB_FLAG_INTERNAL_FORCE_UNIQUE_INDEX)))) {
+	terms = ldb_kv_index_plan_and(list, module, ldb_kv, tree);
+	if (terms == NULL) {
+		return ldb_module_oom(module);
+	}
+	found = false;
 
-		ldb_asprintf_errstring(
-		    ldb,
-		    __location__ ": unique index key on %s in %s, "
-				 "exceeds maximum key length of %u (encoded).",
-		    el->name,
-		    ldb_dn_get_linearized(msg->dn),
-		    ldb_kv->max_key_length);
-		talloc_free(list);
-		return LDB_ERR_CONSTRAINT_VIOLATION;
+	for (i=0; i<tree->u.list.num_elements; i++) {
+		const struct ldb_parse_tree *subtree
+			= tree->u.list.elements[terms[i].idx];
+		struct dn_list *list2;
+		int ret;
+
+		list2 = talloc_zero(list, struct dn_list);
+		if (list2 == NULL) {
+			TALLOC_FREE(terms);
+			return ldb_module_oom(module);
+		}
+
+		ret = ldb_kv_index_dn(module, ldb_kv, subtree, list2);
+
+		if (ret == LDB_ERR_NO_SUCH_OBJECT) {
+			/* X && 0 == 0 */
+			list->dn = NULL;
+			list->count = 0;
+			talloc_free(list2);
+			TALLOC_FREE(terms);
+			return LDB_ERR_NO_SUCH_OBJECT;
+		}
+
+		if (ret != LDB_SUCCESS) {
+			/* this didn't adding anything */
+			talloc_free(list2);
+			exact = false;
+			continue;
+		}
+
+		exact = exact && list2->exact;
+
+		if (!found) {
+			talloc_reparent(list2, list, list->dn);
+			list->dn = list2->dn;
+			list->count = list2->count;
+			found = true;
+		} else {
+			list->exact = true;
+			if (!ldb_kv_dn_list_intersect(ldb_kv, list, list2)) {
+				talloc_free(list2);
+				TALLOC_FREE(terms);
+				return LDB_ERR_OPERATIONS_ERROR;
+			}
+			exact = exact && list->exact;
+		}
+
+		/*
+		 * The result is only exact if every term is, and
+		 * none are left to the filter.
+		 */
+		list->exact = exact &&
+			i + 1 == tree->u.list.num_elements;
+
+		if (list->count == 0) {
+			list->dn = NULL;
+			TALLOC_FREE(terms);
+			return LDB_ERR_NO_SUCH_OBJECT;
+		}
+
+		if (list->count < 2) {
+			/* it isn't worth loading the next part of the tree */
+			TALLOC_FREE(terms);
+			return LDB_SUCCESS;
+		}
+
+		/*
+		 * Nor is it if filtering what we have is expected to
+		 * be cheaper than loading the next index record.
+		 */
+		if (i + 1 < tree->u.list.num_elements &&
+		    terms[i + 1].cost != LDB_KV_PLAN_UNKNOWN &&
+		    (uint64_t)list->count * LDB_KV_PLAN_FETCH_COST
+		    < terms[i + 1].cost) {
+			TALLOC_FREE(terms);
+			return LDB_SUCCESS;
+		}
+	}
+
+	TALLOC_FREE(terms);
+
+	if (!found) {
+		/* none of the attributes were indexed */
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	return LDB_SUCCESS;
+}
+
+struct ldb_kv_ordered_index_context {
+	struct ldb_module *module;
+	int error;
+	struct dn_list *dn_list;
+};
+
+static int traverse_range_index(_UNUSED_ struct ldb_kv_private *ldb_kv,
+				struct ldb_val key,
+				struct ldb_val data,
+				void *state)
+{
+
+	struct ldb_context *ldb;
+	struct ldb_kv_ordered_index_context *ctx =
+	    (struct ldb_kv_ordered_index_context *)state;
+	struct ldb_module *module = ctx->module;
+	struct ldb_message_element *el = NULL;
+	struct ldb_message *msg = NULL;
+	struct ldb_val guids;
+	int version;
+	size_t dn_array_size, additional_length;
+	unsigned int i;
+
+	ldb = ldb_module_get_ctx(module);
+
+	msg = ldb_msg_new(module);
+
+	ctx->error = ldb_unpack_data_flags(ldb, &data, msg,
+					   LDB_UNPACK_DATA_FLAG_NO_DN);
+
+	if (ctx->error != LDB_SUCCESS) {
+		talloc_free(msg);
+		return ctx->error;
+	}
+
+	version = ldb_msg_find_attr_as_int(msg, LDB_KV_IDXVERSION, 0);
+
+	el = ldb_msg_find_element(msg, LDB_KV_IDX);
+	if (!el && version != LDB_KV_GUID_CHUNKED_INDEXING_VERSION) {
+		talloc_free(msg);
+		return LDB_SUCCESS;
+	}
+
+	/*
+	 * we avoid copying the strings by stealing the list.  We have
+	 * to steal msg onto el->values (which looks odd) because
+	 * the memory is allocated on msg, not on each value.
+	 */
+	if (version != LDB_KV_GUID_INDEXING_VERSION &&
+	    version != LDB_KV_GUID_CHUNKED_INDEXING_VERSION) {
+		/* This is quite likely during the DB startup
+		   on first upgrade to using a GUID index */
+		ldb_debug_set(ldb_module_get_ctx(module),
+			      LDB_DEBUG_ERROR, __location__
+			      ": Wrong GUID index version %d expected %d",
+			      version, LDB_KV_GUID_INDEXING_VERSION);
+		talloc_free(msg);
+		ctx->error = LDB_ERR_OPERATIONS_ERROR;
+		return ctx->error;
+	}
+
+	if (el != NULL) {
+		ctx->error = ldb_kv_guid_index_values(el, &guids);
+	} else if (key.length > 3) {
+		/* Skip the DN= prefix to find the index record DN */
+		const char *dir_str = talloc_strndup(msg,
+						     (char *)key.data + 3,
+						     key.length - 3);
+		if (dir_str == NULL) {
+			ctx->error = LDB_ERR_OPERATIONS_ERROR;
+		} else {
+			ctx->error = ldb_kv_index_chunks_load(module,
+							      dir_str,
+							      msg,
+							      msg,
+							      &guids);
+		}
+	} else {
+		ctx->error = LDB_ERR_OPERATIONS_ERROR;
+	}
+	if (ctx->error != LDB_SUCCESS) {
+		talloc_free(msg);
+		return ctx->error;
+	}
+
+	dn_array_size = talloc_array_length(ctx->dn_list->dn);
+
+	additional_length = guids.length / LDB_KV_GUID_SIZE;
+
+	if (ctx->dn_list->count + additional_length < ctx->dn_list->count) {
+		talloc_free(msg);
+		ctx->error = LDB_ERR_OPERATIONS_ERROR;
+		return ctx->error;
+	}
+
+	if ((ctx->dn_list->count + additional_length) >= dn_array_size) {
+		size_t new_array_length;
+
+		if (dn_array_size * 2 < dn_array_size) {
+			talloc_free(msg);
+			ctx->error = LDB_ERR_OPERATIONS_ERROR;
+			return ctx->error;
+		}
+
+		new_array_length = MAX(ctx->dn_list->count + additional_length,
+				       dn_array_size * 2);
+
+		ctx->dn_list->dn = talloc_realloc(ctx->dn_list,
+						  ctx->dn_list->dn,
+						  struct ldb_val,
+						  new_array_length);
+	}
+
+	if (ctx->dn_list->dn == NULL) {
+		talloc_free(msg);
+		ctx->error = LDB_ERR_OPERATIONS_ERROR;
+		return ctx->error;
+	}
+
+	/*
+	 * The actual data is on msg.
+	 */
+	talloc_steal(ctx->dn_list->dn, msg);
+	for (i = 0; i < additional_length; i++) {
+		ctx->dn_list->dn[i + ctx->dn_list->count].data
+			= &guids.data[i * LDB_KV_GUID_SIZE];
+		ctx->dn_list->dn[i + ctx->dn_list->count].length = LDB_KV_GUID_SIZE;
+
+	}
+
+	ctx->dn_list->count += additional_length;
+
+	talloc_free(msg->elements);
+
+	return LDB_SUCCESS;
+}
+
+/*
+  find the records with a value of an attribute from key_dn (an
+  @INDEX:ATTR:value DN) onwards, or up to it, using the @INDEXORDER
+  record of the attribute, when it is kept for a backend that can't
+  iterate over a range of keys
+ */
+static int ldb_kv_index_order_range(struct ldb_module *module,
+				    struct ldb_kv_private *ldb_kv,
+				    struct ldb_dn *key_dn,
+				    struct dn_list *list,
+				    bool ascending)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	size_t prefix_len = strlen(LDB_KV_INDEX ":");
+	const char *key_str = NULL;
+	const char *end = NULL;
+	TALLOC_CTX *msg = NULL;
+	struct ldb_val *vals = NULL;
+	unsigned int num_vals = 0;
+	struct ldb_dn *dn = NULL;
+	struct ldb_val bound;
+	unsigned int first, last, i;
+	int attr_len;
+	int ret;
+
+	key_str = ldb_dn_get_linearized(key_dn);
+	if (key_str == NULL || strlen(key_str) <= prefix_len) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	end = strchr(key_str + prefix_len, ':');
+	if (end == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	attr_len = end - (key_str + prefix_len);
+	bound.data = discard_const_p(uint8_t, end + 1);
+	bound.length = strlen(end + 1);
+
+	list->count = 0;
+	list->dn = talloc_zero_array(list, struct ldb_val, 2);
+	if (list->dn == NULL) {
+		return ldb_module_oom(module);
+	}
+
+	msg = talloc_new(list);
+	if (msg == NULL) {
+		return ldb_module_oom(module);
+	}
+	ret = ldb_kv_index_order_load(module,
+				      msg,
+				      key_str + prefix_len,
+				      attr_len,
+				      &vals,
+				      &num_vals);
+	if (ret != LDB_SUCCESS) {
+		TALLOC_FREE(msg);
+		return ret;
+	}
+
+	/* the first value not less than (or, if descending, above) bound */
+	first = 0;
+	last = num_vals;
+	while (first < last) {
+		unsigned int mid = first + (last - first) / 2;
+		int cmp = ldb_kv_index_order_cmp(&vals[mid], &bound);
+
+		if (cmp < 0 || (!ascending && cmp == 0)) {
+			first = mid + 1;
+		} else {
+			last = mid;
+		}
+	}
+	if (ascending) {
+		last = num_vals;
+	} else {
+		last = first;
+		first = 0;
+	}
+
+	for (i = first; i < last; i++) {
+		struct ldb_val *v = &vals[i];
+		struct dn_list *values = NULL;
+		struct ldb_val *dns = NULL;
+
+		values = talloc_zero(list, struct dn_list);
+		if (values == NULL) {
+			TALLOC_FREE(msg);
+			return ldb_module_oom(module);
+		}
+		dn = ldb_dn_new_fmt(values, ldb, "%s:%.*s:%.*s",
+				    LDB_KV_INDEX,
+				    attr_len, key_str + prefix_len,
+				    (int)v->length, (const char *)v->data);
+		if (dn == NULL) {
+			TALLOC_FREE(msg);
+			return ldb_module_oom(module);
+		}
+		ret = ldb_kv_dn_list_load(module, ldb_kv, dn, values,
+					  DN_LIST_WILL_BE_READ_ONLY);
+		if (ret == LDB_ERR_NO_SUCH_OBJECT) {
+			continue;
+		}
+		if (ret != LDB_SUCCESS) {
+			TALLOC_FREE(msg);
+			return ret;
+		}
+		if (values->count == 0) {
+			continue;
+		}
+
+		dns = talloc_realloc(list,
+				     list->dn,
+				     struct ldb_val,
+				     list->count + values->count);
+		if (dns == NULL) {
+			TALLOC_FREE(msg);
+			return ldb_module_oom(module);
+		}
+		memcpy(&dns[list->count],
+		       values->dn,
+		       values->count * sizeof(struct ldb_val));
+		list->dn = dns;
+		list->count += values->count;
+	}
+	TALLOC_FREE(msg);
+
+	TYPESAFE_QSORT(list->dn, list->count,
+		       ldb_val_equal_exact_for_qsort);
+
+	return LDB_SUCCESS;
+}
+
+/*
+ * >= and <= indexing implemented using lexicographically sorted keys
+ *
+ * We only run this in GUID indexing mode and when there is no write
+ * transaction (only implicit read locks are being held). Otherwise, we would
+ * have to deal with the in-memory index cache.
+ *
+ * We rely on the implementation of index_format_fn on a schema syntax which
+ * will can help us to construct keys which can be ordered correctly, and we
+ * terminate using schema agnostic start and end keys.
+ *
+ * index_format_fn must output values which can be memcmp-able to produce the
+ * correct ordering as defined by the schema syntax class.
+ *
+ * With @IDX_ORDERED set on @INDEXLIST the values are instead found in
+ * the @INDEXORDER record of the attribute, which works for a backend
+ * (like TDB) that can't iterate over a range of keys.
+ */
+static int ldb_kv_index_dn_ordered(struct ldb_module *module,
+				   struct ldb_kv_private *ldb_kv,
+				   const struct ldb_parse_tree *tree,
+				   struct dn_list *list, bool ascending)
+{
+	enum key_truncation truncation = KEY_NOT_TRUNCATED;
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+
+	struct ldb_val ldb_key = { 0 }, ldb_key2 = { 0 };
+	struct ldb_val start_key, end_key;
+	struct ldb_dn *key_dn = NULL;
+	const struct ldb_schema_attribute *a = NULL;
+
+	struct ldb_kv_ordered_index_context ctx;
+	int ret;
+
+	TALLOC_CTX *tmp_ctx = NULL;
+
+	if (!ldb_kv_is_indexed(module, ldb_kv, tree->u.comparison.attr)) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	if (ldb_kv->cache->GUID_index_attribute == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	/* bail out if we're in a transaction, full search instead. */
+	if (ldb_kv->kv_ops->transaction_active(ldb_kv)) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	if (ldb_kv->disallow_dn_filter &&
+	    (ldb_attr_cmp(tree->u.comparison.attr, "dn") == 0)) {
+		/* in AD mode we do not support "(dn=...)" search filters */
+		list->dn = NULL;
+		list->count = 0;
+		return LDB_SUCCESS;
+	}
+	if (tree->u.comparison.attr[0] == '@') {
+		/* Do not allow a indexed search against an @ */
+		list->dn = NULL;
+		list->count = 0;
+		return LDB_SUCCESS;
+	}
+
+	a = ldb_schema_attribute_by_name(ldb, tree->u.comparison.attr);
+
+	/*
+	 * If there's no index format function defined for this attr, then
+	 * the lexicographic order in the database doesn't correspond to the
+	 * attr's ordering, so we can't use the iterate_range op.
+	 */
+	if (a->syntax->index_format_fn == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	tmp_ctx = talloc_new(NULL);
+	if (tmp_ctx == NULL) {
+		return ldb_module_oom(module);
+	}
+
+	key_dn = ldb_kv_index_key(ldb, tmp_ctx, ldb_kv, tree->u.comparison.attr,
+				  &tree->u.comparison.value,
+				  NULL, &truncation);
+	if (!key_dn) {
+		TALLOC_FREE(tmp_ctx);
+		return LDB_ERR_OPERATIONS_ERROR;
+	} else if (truncation == KEY_TRUNCATED) {
+		ldb_debug(ldb, LDB_DEBUG_WARNING,
+			  __location__
+			  ": ordered index violation: key dn truncated: %s\n",
+			  ldb_dn_get_linearized(key_dn));
+		TALLOC_FREE(tmp_ctx);
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	if (ldb_kv->cache->ordered_index) {
+		ret = ldb_kv_index_order_range(module,
+					       ldb_kv,
+					       key_dn,
+					       list,
+					       ascending);
+		TALLOC_FREE(tmp_ctx);
+		return ret;
+	}
+
+	ldb_key = ldb_kv_key_dn(tmp_ctx, key_dn);
+	talloc_free(key_dn);
+	if (ldb_key.data == NULL) {
+		TALLOC_FREE(tmp_ctx);
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	key_dn = ldb_kv_index_key(ldb, tmp_ctx,
+				  ldb_kv, tree->u.comparison.attr,
+				  NULL, NULL, &truncation);
+	if (!key_dn) {
+		TALLOC_FREE(tmp_ctx);
+		return LDB_ERR_OPERATIONS_ERROR;
+	} else if (truncation == KEY_TRUNCATED) {
+		ldb_debug(ldb, LDB_DEBUG_WARNING,
+			  __location__
+			  ": ordered index violation: key dn truncated: %s\n",
+			  ldb_dn_get_linearized(key_dn));
+		TALLOC_FREE(tmp_ctx);
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	ldb_key2 = ldb_kv_key_dn(tmp_ctx, key_dn);
+	talloc_free(key_dn);
+	if (ldb_key2.data == NULL) {
+		TALLOC_FREE(tmp_ctx);
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	/*
+	 * In order to avoid defining a start and end key for the search, we
+	 * notice that each index key is of the form:
+	 *
+	 *     DN=@INDEX:<ATTRIBUTE>:<VALUE>\0.
+	 *
+	 * We can simply make our start key DN=@INDEX:<ATTRIBUTE>: and our end
+	 * key DN=@INDEX:<ATTRIBUTE>; to return all index entries for a
+	 * particular attribute.
+	 *
+	 * Our LMDB backend uses the default memcmp for key comparison.
+	 */
+
+	/* Eliminate NUL byte at the end of the empty key */
+	ldb_key2.length--;
+
+	if (ascending) {
+		/* : becomes ; for pseudo end-key */
+		ldb_key2.data[ldb_key2.length-1]++;
+		start_key = ldb_key;
+		end_key = ldb_key2;
+	} else {
+		start_key = ldb_key2;
+		end_key = ldb_key;
+	}
+
+	ctx.module = module;
+	ctx.error = 0;
+	ctx.dn_list = list;
+	ctx.dn_list->count = 0;
+	ctx.dn_list->dn = talloc_zero_array(ctx.dn_list, struct ldb_val, 2);
+
+	ret = ldb_kv->kv_ops->iterate_range(ldb_kv, start_key, end_key,
+					    traverse_range_index, &ctx);
+
+	if (ret != LDB_SUCCESS || ctx.error != LDB_SUCCESS) {
+		TALLOC_FREE(tmp_ctx);
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	TYPESAFE_QSORT(ctx.dn_list->dn, ctx.dn_list->count,
+		       ldb_val_equal_exact_for_qsort);
+
+	TALLOC_FREE(tmp_ctx);
+
+	return LDB_SUCCESS;
+}
+
+static int ldb_kv_index_dn_greater(struct ldb_module *module,
+				   struct ldb_kv_private *ldb_kv,
+				   const struct ldb_parse_tree *tree,
+				   struct dn_list *list)
+{
+	return ldb_kv_index_dn_ordered(module,
+				       ldb_kv,
+				       tree,
+				       list, true);
+}
+
+static int ldb_kv_index_dn_less(struct ldb_module *module,
+				   struct ldb_kv_private *ldb_kv,
+				   const struct ldb_parse_tree *tree,
+				   struct dn_list *list)
+{
+	return ldb_kv_index_dn_ordered(module,
+				       ldb_kv,
+				       tree,
+				       list, false);
+}
+
+/*
+  return a list of matching objects using a one-level index
+ */
+static int ldb_kv_index_dn_attr(struct ldb_module *module,
+				struct ldb_kv_private *ldb_kv,
+				const char *attr,
+				struct ldb_dn *dn,
+				struct dn_list *list,
+				enum key_truncation *truncation)
+{
+	struct ldb_context *ldb;
+	struct ldb_dn *key;
+	struct ldb_val val;
+	int ret;
+
+	ldb = ldb_module_get_ctx(module);
+
+	/* work out the index key from the parent DN */
+	val.data = (uint8_t *)((uintptr_t)ldb_dn_get_casefold(dn));
+	if (val.data == NULL) {
+		const char *dn_str = ldb_dn_get_linearized(dn);
+		ldb_asprintf_errstring(ldb_module_get_ctx(module),
+				       __location__
+				       ": Failed to get casefold DN "
+				       "from: %s",
+				       dn_str);
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	val.length = strlen((char *)val.data);
+
+	/*
+	 * We use list as a TALLOC_CTX to provide a shorter-lived
+	 * memory context than ldb, even as the result is freed with
+	 * the talloc_free(key) below.
+	 */
+	key = ldb_kv_index_key(ldb, list, ldb_kv, attr, &val, NULL, truncation);
+	if (!key) {
+		ldb_oom(ldb);
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	ret = ldb_kv_dn_list_load(module, ldb_kv, key, list,
+				  DN_LIST_WILL_BE_READ_ONLY);
+	talloc_free(key);
+	if (ret != LDB_SUCCESS) {
+		return ret;
+	}
+
+	if (list->count == 0) {
+		return LDB_ERR_NO_SUCH_OBJECT;
+	}
+
+	return LDB_SUCCESS;
+}
+
+/*
+  return a list of matching objects using a one-level index
+ */
+static int ldb_kv_index_dn_one(struct ldb_module *module,
+			       struct ldb_kv_private *ldb_kv,
+			       struct ldb_dn *parent_dn,
+			       struct dn_list *list,
+			       enum key_truncation *truncation)
+{
+	int ret = ldb_kv_index_dn_attr(
+	    module, ldb_kv, LDB_KV_IDXONE, parent_dn, list, truncation);
+	if (ret == LDB_SUCCESS) {
+		/*
+		 * Ensure we do not shortcut on intersection for this
+		 * list.  We must never be lazy and return an entry
+		 * not in this list.  This allows the index for
+		 * SCOPE_ONELEVEL to be trusted.
+		 */
+
+		list->strict = true;
+	}
+	return ret;
+}
+
+/*
+  is a subtree index record kept for dn?  Not for a naming context
+  or an ancestor of one.
+ */
+static bool ldb_kv_subtree_indexed(struct ldb_kv_private *ldb_kv,
+				   struct ldb_dn *dn)
+{
+	unsigned int i;
+
+	if (ldb_dn_get_comp_num(dn) == 0) {
+		return false;
+	}
+	for (i = 0; i < ldb_kv->cache->num_naming_contexts; i++) {
+		if (ldb_dn_compare_base(dn,
+					ldb_kv->cache->naming_contexts[i]) == 0) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/*
+  return the objects in a subtree, the base and its descendants from
+  the subtree index
+ */
+static int ldb_kv_index_dn_subtree(struct ldb_module *module,
+				   struct ldb_kv_private *ldb_kv,
+				   struct ldb_dn *base_dn,
+				   struct dn_list *list)
+{
+	struct dn_list *base_list = NULL;
+	enum key_truncation truncation = KEY_NOT_TRUNCATED;
+	int ret;
+
+	ret = ldb_kv_index_dn_attr(module,
+				   ldb_kv,
+				   LDB_KV_IDXSUBTREE,
+				   base_dn,
+				   list,
+				   &truncation);
+	if (ret == LDB_ERR_NO_SUCH_OBJECT) {
+		/* A leaf, but the base itself is still in scope */
+		*list = (struct dn_list){};
+	} else if (ret != LDB_SUCCESS) {
+		return ret;
+	}
+
+	base_list = talloc_zero(list, struct dn_list);
+	if (base_list == NULL) {
+		return ldb_module_oom(module);
+	}
+	ret = ldb_kv_index_dn_base_dn(module,
+				      ldb_kv,
+				      base_dn,
+				      base_list,
+				      &truncation);
+	if (ret != LDB_SUCCESS && ret != LDB_ERR_NO_SUCH_OBJECT) {
+		return ret;
+	}
+
+	if (!ldb_kv_dn_list_union(
+		ldb_module_get_ctx(module), ldb_kv, list, base_list)) {
+		return ldb_module_oom(module);
+	}
+	if (list->count == 0) {
+		return LDB_ERR_NO_SUCH_OBJECT;
+	}
+
+	/* As for the one-level index, never shortcut an intersection */
+	list->strict = true;
+	return LDB_SUCCESS;
+}
+
+/*
+  return a list of matching objects using the DN index
+ */
+static int ldb_kv_index_dn_base_dn(struct ldb_module *module,
+				   struct ldb_kv_private *ldb_kv,
+				   struct ldb_dn *base_dn,
+				   struct dn_list *dn_list,
+				   enum key_truncation *truncation)
+{
+	const struct ldb_val *guid_val = NULL;
+	if (ldb_kv->cache->GUID_index_attribute == NULL) {
+		dn_list->dn = talloc_array(dn_list, struct ldb_val, 1);
+		if (dn_list->dn == NULL) {
+			return ldb_module_oom(module);
+		}
+		dn_list->dn[0].data = discard_const_p(unsigned char,
+						      ldb_dn_get_linearized(base_dn));
+		if (dn_list->dn[0].data == NULL) {
+			talloc_free(dn_list->dn);
+			return ldb_module_oom(module);
+		}
+		dn_list->dn[0].length = strlen((char *)dn_list->dn[0].data);
+		dn_list->count = 1;
+
+		return LDB_SUCCESS;
+	}
+
+	if (ldb_kv->cache->GUID_index_dn_component != NULL) {
+		guid_val = ldb_dn_get_extended_component(
+		    base_dn, ldb_kv->cache->GUID_index_dn_component);
+	}
+
+	if (guid_val != NULL) {
+		dn_list->dn = talloc_array(dn_list, struct ldb_val, 1);
+		if (dn_list->dn == NULL) {
+			return ldb_module_oom(module);
+		}
+		dn_list->dn[0].data = guid_val->data;
+		dn_list->dn[0].length = guid_val->length;
+		dn_list->count = 1;
+
+		return LDB_SUCCESS;
+	}
+
+	return ldb_kv_index_dn_attr(
+	    module, ldb_kv, LDB_KV_IDXDN, base_dn, dn_list, truncation);
+}
+
+/*
+  return a list of dn's that might match a presence search, from the
+  @IDXPRESENT index record of the attribute
+ */
+static int ldb_kv_index_dn_present(struct ldb_module *module,
+				   struct ldb_kv_private *ldb_kv,
+				   const struct ldb_parse_tree *tree,
+				   struct dn_list *list)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	const char *attr = tree->u.present.attr;
+	enum key_truncation truncation = KEY_NOT_TRUNCATED;
+	struct ldb_dn *dn = NULL;
+	struct ldb_val val;
+	int ret;
+
+	*list = (struct dn_list){};
+
+	if (attr[0] == '@') {
+		/* As in ldb_kv_index_dn_leaf() */
+		return LDB_SUCCESS;
+	}
+	if (!ldb_kv->cache->presence_index ||
+	    !ldb_kv_is_indexed(module, ldb_kv, attr)) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	val.data = (uint8_t *)ldb_attr_casefold(list, attr);
+	if (val.data == NULL) {
+		return ldb_module_oom(module);
+	}
+	val.length = strlen((char *)val.data);
+
+	dn = ldb_kv_index_key(ldb,
+			      list,
+			      ldb_kv,
+			      LDB_KV_IDXPRESENT,
+			      &val,
+			      NULL,
+			      &truncation);
+	talloc_free(val.data);
+	if (dn == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	ret = ldb_kv_dn_list_load(module, ldb_kv, dn, list,
+				  DN_LIST_WILL_BE_READ_ONLY);
+	talloc_free(dn);
+	if (ret == LDB_SUCCESS) {
+		list->exact = ldb_kv_index_attr_exact(ldb, attr, truncation);
+	}
+	return ret;
+}
+
+/*
+  return a list of dn's that might match a substring search, the
+  intersection of the substring index records of every trigram in
+  the chunks of the filter.
+
+  The list is only of candidates, as the index does not know where
+  in the value each trigram was, so every entry is checked against
+  the filter by ldb_kv_index_filter().
+ */
+static int ldb_kv_index_dn_substring(struct ldb_module *module,
+				     struct ldb_kv_private *ldb_kv,
+				     const struct ldb_parse_tree *tree,
+				     struct dn_list *list)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	const char *attr = tree->u.substring.attr;
+	const struct ldb_schema_attribute *a = NULL;
+	struct ldb_val **chunks = tree->u.substring.chunks;
+	TALLOC_CTX *tmp_ctx = NULL;
+	struct ldb_val val;
+	unsigned int c;
+	bool found = false;
+	int ret;
+
+	*list = (struct dn_list){};
+
+	if (!ldb_kv_is_substr_indexed(ldb_kv, attr) || chunks == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	tmp_ctx = talloc_new(list);
+	if (tmp_ctx == NULL) {
+		return ldb_module_oom(module);
+	}
+
+	ret = ldb_kv_index_substr_val_init(tmp_ctx, attr, &val);
+	if (ret != LDB_SUCCESS) {
+		TALLOC_FREE(tmp_ctx);
+		return ret;
+	}
+
+	a = ldb_schema_attribute_by_name(ldb, attr);
+
+	for (c = 0; chunks[c] != NULL; c++) {
+		struct ldb_val cnk;
+		size_t i;
+
+		/* As in ldb_wildcard_compare() */
+		ret = a->syntax->canonicalise_fn(ldb, tmp_ctx, chunks[c], &cnk);
+		if (ret != LDB_SUCCESS) {
+			TALLOC_FREE(tmp_ctx);
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+
+		for (i = 0; i + LDB_KV_SUBSTR_GRAM_LEN <= cnk.length; i++) {
+			enum key_truncation truncation = KEY_NOT_TRUNCATED;
+			struct dn_list *list2 = NULL;
+			struct ldb_dn *dn = NULL;
+
+			/*
+			 * The intersection refers to the GUIDs in
+			 * list2, so it belongs to list, as in
+			 * ldb_kv_index_dn_and()
+			 */
+			list2 = talloc_zero(list, struct dn_list);
+			if (list2 == NULL) {
+				TALLOC_FREE(tmp_ctx);
+				return ldb_module_oom(module);
+			}
+
+			ldb_kv_index_substr_val(&val, &cnk.data[i]);
+			dn = ldb_kv_index_key(ldb,
+					      list2,
+					      ldb_kv,
+					      LDB_KV_IDXSUBSTR,
+					      &val,
+					      NULL,
+					      &truncation);
+			if (dn == NULL) {
+				TALLOC_FREE(tmp_ctx);
+				return LDB_ERR_OPERATIONS_ERROR;
+			}
+
+			ret = ldb_kv_dn_list_load(module, ldb_kv, dn, list2,
+						  DN_LIST_WILL_BE_READ_ONLY);
+			talloc_free(dn);
+			if (ret == LDB_ERR_NO_SUCH_OBJECT ||
+			    (ret == LDB_SUCCESS && list2->count == 0)) {
+				/* no value has this trigram */
+				*list = (struct dn_list){};
+				TALLOC_FREE(tmp_ctx);
+				return LDB_ERR_NO_SUCH_OBJECT;
+			}
+			if (ret != LDB_SUCCESS) {
+				TALLOC_FREE(tmp_ctx);
+				return ret;
+			}
+
+			if (!found) {
+				talloc_reparent(list2, list, list2->dn);
+				list->dn = list2->dn;
+				list->count = list2->count;
+				found = true;
+			} else if (!ldb_kv_dn_list_intersect(ldb_kv, list, list2)) {
+				TALLOC_FREE(tmp_ctx);
+				return LDB_ERR_OPERATIONS_ERROR;
+			}
+
+			if (list->count == 0) {
+				list->dn = NULL;
+				TALLOC_FREE(tmp_ctx);
+				return LDB_ERR_NO_SUCH_OBJECT;
+			}
+		}
+	}
+
+	TALLOC_FREE(tmp_ctx);
+
+	if (!found) {
+		/* no chunk is long enough to have a trigram */
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	return LDB_SUCCESS;
+}
+
+/*
+  return a list of dn's that might match a indexed search or
+  an error. return LDB_ERR_NO_SUCH_OBJECT for no matches, or LDB_SUCCESS for matches
+ */
+int ldb_kv_index_dn(struct ldb_module *module,
+		    struct ldb_kv_private *ldb_kv,
+		    const struct ldb_parse_tree *tree,
+		    struct dn_list *list)
+{
+	int ret = LDB_ERR_OPERATIONS_ERROR;
+
+	switch (tree->operation) {
+	case LDB_OP_AND:
+		ret = ldb_kv_index_dn_and(module, ldb_kv, tree, list);
+		break;
+
+	case LDB_OP_OR:
+		ret = ldb_kv_index_dn_or(module, ldb_kv, tree, list);
+		break;
+
+	case LDB_OP_NOT:
+		ret = ldb_kv_index_dn_not(module, ldb_kv, tree, list);
+		break;
+
+	case LDB_OP_EQUALITY:
+		ret = ldb_kv_index_dn_leaf(module, ldb_kv, tree, list);
+		break;
+
+	case LDB_OP_GREATER:
+		ret = ldb_kv_index_dn_greater(module, ldb_kv, tree, list);
+		break;
+
+	case LDB_OP_LESS:
+		ret = ldb_kv_index_dn_less(module, ldb_kv, tree, list);
+		break;
+
+	case LDB_OP_SUBSTRING:
+		ret = ldb_kv_index_dn_substring(module, ldb_kv, tree, list);
+		break;
+
+	case LDB_OP_PRESENT:
+		ret = ldb_kv_index_dn_present(module, ldb_kv, tree, list);
+		break;
+
+	case LDB_OP_APPROX:
+	case LDB_OP_EXTENDED:
+		/* we can't index with fancy bitops yet */
+		ret = LDB_ERR_OPERATIONS_ERROR;
+		break;
+	}
+
+	return ret;
+}
+
+/*
+  does a search for these attributes need nothing of each record but
+  its DN?
+*/
+static bool ldb_kv_attrs_dn_only(const char * const *attrs)
+{
+	unsigned int i;
+
+	if (attrs == NULL) {
+		return false;
+	}
+	for (i = 0; attrs[i] != NULL; i++) {
+		if (strcmp(attrs[i], "1.1") == 0 ||
+		    ldb_attr_cmp(attrs[i], "distinguishedName") == 0) {
+			continue;
+		}
+		return false;
+	}
+	return true;
+}
+
+/*
+  is the walk of the sort attribute index at the first value of the
+  sort attribute of msg?  Only the first value is used to sort the
+  entry, as the server_sort module does, and the index key of that
+  value is compared with the key being walked.
+*/
+static bool ldb_kv_index_sort_position(struct ldb_kv_private *ldb_kv,
+				       struct ldb_kv_context *ac,
+				       const struct ldb_message *msg)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(ac->module);
+	enum key_truncation truncation = KEY_NOT_TRUNCATED;
+	struct ldb_message_element *el = NULL;
+	struct ldb_dn *key_dn = NULL;
+	const char *key_str = NULL;
+	bool ret;
+
+	el = ldb_msg_find_element(msg, ac->sort->attributeName);
+	if (el == NULL || el->num_values == 0) {
+		return false;
+	}
+
+	key_dn = ldb_kv_index_key_internal(ldb,
+					   ac,
+					   ldb_kv,
+					   ac->sort->attributeName,
+					   &el->values[0],
+					   NULL,
+					   &truncation,
+					   false);
+	if (key_dn == NULL) {
+		return false;
+	}
+	key_str = ldb_dn_get_linearized(key_dn);
+	ret = key_str != NULL && strcmp(key_str, ac->sort_key) == 0;
+	talloc_free(key_dn);
+	return ret;
+}
+
+/*
+  note the key of an entry to send once the walk of the sort attribute
+  index is over
+*/
+static int ldb_kv_index_sort_defer(struct ldb_kv_context *ac,
+				   struct ldb_val key)
+{
+	struct ldb_val *deferred = NULL;
+
+	deferred = talloc_realloc(ac,
+				  ac->sort_deferred,
+				  struct ldb_val,
+				  ac->num_sort_deferred + 1);
+	if (deferred == NULL) {
+		return ldb_module_oom(ac->module);
+	}
+	ac->sort_deferred = deferred;
+
+	deferred[ac->num_sort_deferred] = ldb_val_dup(deferred, &key);
+	if (deferred[ac->num_sort_deferred].data == NULL) {
+		return ldb_module_oom(ac->module);
+	}
+	ac->num_sort_deferred++;
+	return LDB_SUCCESS;
+}
+
+/*
+  check a single candidate record (by key) from an indexed search,
+  sending it to the caller if it matches.  idx is the position of the
+  record in the candidate set, used to rate-limit the time checks.
+*/
+int ldb_kv_index_filter_key(struct ldb_kv_private *ldb_kv,
+			    struct ldb_kv_context *ac,
+			    struct ldb_val key,
+			    unsigned int idx,
+			    uint32_t *match_count,
+			    enum key_truncation scope_one_truncation)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(ac->module);
+	struct ldb_message *msg;
+	int ret;
+	bool checked = false;
+	bool matched;
+
+	/*
+	 * Check the time every 64 records, to reduce calls to
+	 * gettimeofday().  This is a compromise, not all
+	 * calls to ldb_match_message() will take the same
+	 * time, most will run quickly but by luck it might be
+	 * possible to have 64 records that are slow, doing a
+	 * recursive search via LDAP_MATCHING_RULE_IN_CHAIN.
+	 *
+	 * Thankfully this is after index processing so only
+	 * on the subset that matches some index (but still
+	 * possibly a big one like objectclass=user)
+	 */
+	if (idx % 64 == 0) {
+		struct timeval now = tevent_timeval_current();
+		int timeval_cmp = tevent_timeval_compare(&ac->timeout_timeval,
+							 &now);
+
+		/*
+		 * The search has taken too long.  This is the
+		 * most likely place for our time to expire,
+		 * as we are checking the records after the
+		 * index set intersection.  This is now the
+		 * slow process of checking if the records
+		 * actually match.
+		 *
+		 * The tevent based timeout is not likely to
+		 * be hit, sadly, as we don't run an event
+		 * loop.
+		 *
+		 * While we are indexed and most of the work
+		 * should have been done already, the
+		 * ldb_match_* calls can be quite expensive if
+		 * the caller uses LDAP_MATCHING_RULE_IN_CHAIN
+		 */
+		if (timeval_cmp <= 0) {
+			return LDB_ERR_TIME_LIMIT_EXCEEDED;
+		}
+	}
+
+	msg = ldb_msg_new(ac);
+	if (!msg) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	/*
+	 * If the index has already answered the search expression
+	 * and only the DN is wanted, the attributes of the record
+	 * are neither unpacked nor matched.  The redaction callback
+	 * needs the whole record.
+	 */
+	if (ac->index_exact &&
+	    ac->sort_key == NULL &&
+	    ldb->redact.callback == NULL &&
+	    ldb_kv_attrs_dn_only(ac->attrs)) {
+		ret = ldb_kv_search_key(ac->module,
+					ldb_kv,
+					key,
+					msg,
+					LDB_UNPACK_DATA_FLAG_NO_ATTRS |
+					LDB_UNPACK_DATA_FLAG_READ_LOCKED);
+		checked = true;
+		matched = true;
+	} else {
+		ret = ldb_kv_search_key_match(
+		    ac,
+		    ldb_kv,
+		    key,
+		    msg,
+		    LDB_UNPACK_DATA_FLAG_NO_VALUES_ALLOC |
+		    /*
+		     * The entry point ldb_kv_search_indexed is
+		     * only called from the read-locked
+		     * ldb_kv_search.
+		     */
+		    LDB_UNPACK_DATA_FLAG_READ_LOCKED,
+		    &checked,
+		    &matched);
+	}
+	if (ret == LDB_ERR_NO_SUCH_OBJECT) {
+		/*
+		 * the record has disappeared? yes, this can
+		 * happen if the entry is deleted by something
+		 * operating in the callback (not another
+		 * process, as we have a read lock)
+		 */
+		talloc_free(msg);
+		return LDB_SUCCESS;
+	}
+
+	if (ret != LDB_SUCCESS) {
+		/* an internal error */
+		talloc_free(msg);
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	if (checked && !matched) {
+		/* rejected without being unpacked */
+		talloc_free(msg);
+		return LDB_SUCCESS;
+	}
+
+	/*
+	 * We trust the index for LDB_SCOPE_ONELEVEL
+	 * unless the index key has been truncated.
+	 *
+	 * LDB_SCOPE_BASE is not passed in by our only caller.
+	 */
+	if (ac->scope != LDB_SCOPE_ONELEVEL ||
+	    !ldb_kv->cache->one_level_indexes ||
+	    scope_one_truncation != KEY_NOT_TRUNCATED)
+	{
+		/*
+		 * The redaction callback may be expensive to call if it
+		 * fetches a security descriptor. Check the DN early and
+		 * bail out if it doesn't match the base.
+		 */
+		if (!ldb_match_scope(ldb, ac->base, msg->dn, ac->scope)) {
+			talloc_free(msg);
+			return LDB_SUCCESS;
+		}
+	}
+
+	/*
+	 * When sending in order, a record is sent when the walk
+	 * reaches the first value of its sort attribute.
+	 */
+	if (ac->sort_key != NULL &&
+	    !ldb_kv_index_sort_position(ldb_kv, ac, msg)) {
+		talloc_free(msg);
+		return LDB_SUCCESS;
+	}
+
+	if (ldb->redact.callback != NULL) {
+		ret = ldb->redact.callback(ldb->redact.module, ac->req, msg);
+		if (ret != LDB_SUCCESS) {
+			talloc_free(msg);
+			return ret;
+		}
+	}
+
+	if (!checked) {
+		ret = ldb_kv_match_message(ac, msg, msg, &matched);
+		if (ret != LDB_SUCCESS) {
+			talloc_free(msg);
+			return ret;
+		}
+	}
+	if (!matched) {
+		talloc_free(msg);
+		return LDB_SUCCESS;
+	}
+
+	/*
+	 * If the redaction callback hid the sort attribute, the
+	 * entry sorts after all those with a value, so is sent once
+	 * the walk is over.
+	 */
+	if (ac->sort_key != NULL && ldb->redact.callback != NULL) {
+		struct ldb_message_element *el =
+			ldb_msg_find_element(msg, ac->sort->attributeName);
+
+		if (el == NULL || el->num_values == 0) {
+			talloc_free(msg);
+			return ldb_kv_index_sort_defer(ac, key);
+		}
+	}
+
+	ret = ldb_msg_add_distinguished_name(msg);
+	if (ret == -1) {
+		talloc_free(msg);
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	/* filter the attributes that the user wants */
+	ret = ldb_kv_filter_attrs_in_place(msg, ac->attrs);
+	if (ret != LDB_SUCCESS) {
+		talloc_free(msg);
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	ldb_msg_shrink_to_fit(msg);
+
+	/* Ensure the message elements are all talloc'd. */
+	ret = ldb_msg_elements_take_ownership(msg);
+	if (ret != LDB_SUCCESS) {
+		talloc_free(msg);
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	ret = ldb_module_send_entry(ac->req, msg, ac->entry_controls);
+	ac->entry_controls = NULL;
+	if (ret != LDB_SUCCESS) {
+		/* Regardless of success or failure, the msg
+		 * is the callbacks responsibility, and should
+		 * not be talloc_free()'ed */
+		ac->request_terminated = true;
+		return ret;
+	}
+
+	(*match_count)++;
+	return LDB_SUCCESS;
+}
+
+/*
+  filter a candidate dn_list from an indexed search into a set of results
+  extracting just the given attributes
+*/
+static int ldb_kv_index_filter(struct ldb_kv_private *ldb_kv,
+			       const struct dn_list *dn_list,
+			       struct ldb_kv_context *ac,
+			       uint32_t *match_count,
+			       enum key_truncation scope_one_truncation)
+{
+	unsigned int i;
+	unsigned int num_keys = 0;
+	uint8_t previous_guid_key[LDB_KV_GUID_KEY_SIZE] = {0};
+	struct ldb_val *keys = NULL;
+
+	/*
+	 * We have to allocate the key list (rather than just walk the
+	 * caller supplied list) as the callback could change the list
+	 * (by modifying an indexed attribute hosted in the in-memory
+	 * index cache!)
+	 */
+	keys = talloc_array(ac, struct ldb_val, dn_list->count);
+	if (keys == NULL) {
+		return ldb_module_oom(ac->module);
+	}
+
+	if (ldb_kv->cache->GUID_index_attribute != NULL) {
+		/*
+		 * We speculate that the keys will be GUID based and so
+		 * pre-fill in enough space for a GUID (avoiding a pile of
+		 * small allocations)
+		 */
+		struct guid_tdb_key {
+			uint8_t guid_key[LDB_KV_GUID_KEY_SIZE];
+		} *key_values = NULL;
+
+		key_values = talloc_array(keys,
+					  struct guid_tdb_key,
+					  dn_list->count);
+
+		if (key_values == NULL) {
+			talloc_free(keys);
+			return ldb_module_oom(ac->module);
+		}
+		for (i = 0; i < dn_list->count; i++) {
+			keys[i].data = key_values[i].guid_key;
+			keys[i].length = sizeof(key_values[i].guid_key);
+		}
+	} else {
+		for (i = 0; i < dn_list->count; i++) {
+			keys[i].data = NULL;
+			keys[i].length = 0;
+		}
+	}
+
+	for (i = 0; i < dn_list->count; i++) {
+		int ret;
+
+		ret = ldb_kv_idx_to_key(
+		    ac->module, ldb_kv, keys, &dn_list->dn[i], &keys[num_keys]);
+		if (ret != LDB_SUCCESS) {
+			talloc_free(keys);
+			return ret;
+		}
+
+		if (ldb_kv->cache->GUID_index_attribute != NULL) {
+			/*
+			 * If we are in GUID index mode, then the dn_list is
+			 * sorted.  If we got a duplicate, forget about it, as
+			 * otherwise we would send the same entry back more
+			 * than once.
+			 *
+			 * This is needed in the truncated DN case, or if a
+			 * duplicate was forced in via
+			 * LDB_FLAG_INTERNAL_DISABLE_SINGLE_VALUE_CHECK
+			 */
+
+			if (memcmp(previous_guid_key,
+				   keys[num_keys].data,
+				   sizeof(previous_guid_key)) == 0) {
+				continue;
+			}
+
+			memcpy(previous_guid_key,
+			       keys[num_keys].data,
+			       sizeof(previous_guid_key));
+		}
+		num_keys++;
+	}
+
+	/*
+	 * Now that the list is a safe copy, send the callbacks
+	 */
+	for (i = 0; i < num_keys; i++) {
+		int ret;
+
+		ret = ldb_kv_index_filter_key(ldb_kv,
+					      ac,
+					      keys[i],
+					      i,
+					      match_count,
+					      scope_one_truncation);
+		if (ret != LDB_SUCCESS) {
+			talloc_free(keys);
+			return ret;
+		}
+	}
+
+	TALLOC_FREE(keys);
+	return LDB_SUCCESS;
+}
+
+/*
+  should a subtree search start from the subtree index record of the
+  base?  Only if one is kept for the base, and the filter's own index
+  is unavailable or expected to be larger than an average subtree.
+*/
+static bool ldb_kv_index_use_subtree(struct ldb_kv_context *ac,
+				     struct ldb_kv_private *ldb_kv)
+{
+	const struct ldb_kv_index_stats *stats = ldb_kv->cache->index_stats;
+	const struct ldb_kv_index_stat *st = NULL;
+	uint64_t est;
+	uint64_t subtree;
+
+	if (!ldb_kv->cache->subtree_indexes ||
+	    ldb_kv->cache->GUID_index_attribute == NULL ||
+	    !ldb_kv_subtree_indexed(ldb_kv, ac->base)) {
+		return false;
+	}
+	if (!ldb_kv->cache->attribute_indexes || stats == NULL) {
+		return true;
+	}
+
+	est = ldb_kv_index_plan_estimate(ac->module, ldb_kv, ac->tree, true);
+	if (est == LDB_KV_PLAN_UNKNOWN) {
+		return true;
+	}
+
+	st = ldb_kv_index_stats_find(stats,
+				     LDB_KV_IDXSUBTREE,
+				     strlen(LDB_KV_IDXSUBTREE));
+	if (st == NULL || st->records == 0) {
+		subtree = stats->objects;
+	} else {
+		subtree = st->entries / st->records;
+	}
+	return est > subtree;
+}
+
+/*
+  find the candidates for a subtree search from the subtree index and
+  (where the filter can be indexed) the index of the filter
+*/
+static int ldb_kv_index_search_subtree(struct ldb_kv_context *ac,
+				       struct ldb_kv_private *ldb_kv,
+				       struct dn_list *dn_list)
+{
+	struct dn_list *indexed_search_result = NULL;
+	int ret;
+
+	ret = ldb_kv_index_dn_subtree(ac->module, ldb_kv, ac->base, dn_list);
+	if (ret != LDB_SUCCESS) {
+		return ret;
+	}
+
+	if (ac->want_index_plan) {
+		ac->index_plan = talloc_strdup(ac, "subtree index");
+	}
+
+	if (!ldb_kv->cache->attribute_indexes) {
+		return LDB_SUCCESS;
+	}
+
+	indexed_search_result = talloc_zero(dn_list, struct dn_list);
+	if (indexed_search_result == NULL) {
+		return ldb_module_oom(ac->module);
+	}
+
+	if (ac->want_index_plan) {
+		char *plan = ldb_kv_index_plan_describe(
+			ac, ac->module, ldb_kv, ac->tree);
+		TALLOC_FREE(ac->index_plan);
+		ac->index_plan = talloc_asprintf(
+			ac, "subtree index: %s", plan);
+		TALLOC_FREE(plan);
+	}
+
+	ret = ldb_kv_index_dn(ac->module, ldb_kv, ac->tree,
+			      indexed_search_result);
+	if (ret == LDB_ERR_NO_SUCH_OBJECT) {
+		return ret;
+	}
+
+	/*
+	 * If the filter can't be indexed, every object in the
+	 * subtree is a candidate, as in the one-level case.
+	 */
+	if (ret == LDB_SUCCESS) {
+		dn_list->exact = indexed_search_result->exact;
+		if (!ldb_kv_dn_list_intersect(
+			ldb_kv, dn_list, indexed_search_result)) {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+	}
+	return LDB_SUCCESS;
+}
+
+/*
+  does every entry matching the tree have a value of attr?
+*/
+static bool ldb_kv_index_tree_needs_attr(const struct ldb_parse_tree *tree,
+					 const char *attr)
+{
+	unsigned int i;
+
+	switch (tree->operation) {
+	case LDB_OP_AND:
+		for (i = 0; i < tree->u.list.num_elements; i++) {
+			if (ldb_kv_index_tree_needs_attr(
+				    tree->u.list.elements[i], attr)) {
+				return true;
+			}
+		}
+		return false;
+
+	case LDB_OP_OR:
+		if (tree->u.list.num_elements == 0) {
+			return false;
+		}
+		for (i = 0; i < tree->u.list.num_elements; i++) {
+			if (!ldb_kv_index_tree_needs_attr(
+				    tree->u.list.elements[i], attr)) {
+				return false;
+			}
+		}
+		return true;
+
+	case LDB_OP_EQUALITY:
+		return ldb_attr_cmp(tree->u.equality.attr, attr) == 0;
+
+	case LDB_OP_GREATER:
+	case LDB_OP_LESS:
+	case LDB_OP_APPROX:
+		return ldb_attr_cmp(tree->u.comparison.attr, attr) == 0;
+
+	case LDB_OP_SUBSTRING:
+		return ldb_attr_cmp(tree->u.substring.attr, attr) == 0;
+
+	case LDB_OP_PRESENT:
+		return ldb_attr_cmp(tree->u.present.attr, attr) == 0;
+
+	case LDB_OP_NOT:
+	case LDB_OP_EXTENDED:
+		break;
+	}
+
+	return false;
+}
+
+/*
+  find an (attr>=value) term that every entry matching the tree must
+  match, so the walk can start at that value
+*/
+static const struct ldb_val *ldb_kv_index_tree_lower_bound(
+	const struct ldb_parse_tree *tree,
+	const char *attr)
+{
+	const struct ldb_val *bound = NULL;
+	unsigned int i;
+
+	switch (tree->operation) {
+	case LDB_OP_AND:
+		for (i = 0; i < tree->u.list.num_elements; i++) {
+			bound = ldb_kv_index_tree_lower_bound(
+				tree->u.list.elements[i], attr);
+			if (bound != NULL) {
+				return bound;
+			}
+		}
+		return NULL;
+
+	case LDB_OP_GREATER:
+		if (ldb_attr_cmp(tree->u.comparison.attr, attr) == 0) {
+			return &tree->u.comparison.value;
+		}
+		return NULL;
+
+	default:
+		return NULL;
+	}
+}
+
+struct ldb_kv_index_sort_walk {
+	struct ldb_kv_context *ac;
+	struct ldb_kv_private *ldb_kv;
+	uint32_t *match_count;
+	unsigned int idx;
+	int error;
+};
+
+/*
+  send the entries listed in the index record of one value of the sort
+  attribute, key_str being the index key
+*/
+static int ldb_kv_index_sort_send_list(struct ldb_kv_index_sort_walk *walk,
+				       const char *key_str,
+				       const struct dn_list *list)
+{
+	uint8_t key_buf[LDB_KV_GUID_KEY_SIZE];
+	struct ldb_val key = {
+		.data = key_buf,
+		.length = sizeof(key_buf),
+	};
+	unsigned int i;
+	int ret;
+
+	walk->ac->sort_key = key_str;
+
+	for (i = 0; i < list->count; i++) {
+		/* The list is sorted, skip duplicates */
+		if (i > 0 &&
+		    ldb_val_equal_exact(&list->dn[i], &list->dn[i - 1])) {
+			continue;
+		}
+		ret = ldb_kv_guid_to_key(&list->dn[i], &key);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+		/*
+		 * The candidates are not from the one-level index, so
+		 * have the scope of each checked.
+		 */
+		ret = ldb_kv_index_filter_key(walk->ldb_kv,
+					      walk->ac,
+					      key,
+					      walk->idx++,
+					      walk->match_count,
+					      KEY_TRUNCATED);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+	}
+
+	walk->ac->sort_key = NULL;
+	return LDB_SUCCESS;
+}
+
+/*
+  iterate_range callback for each index record of the sort attribute
+*/
+static int ldb_kv_index_sort_traverse(struct ldb_kv_private *ldb_kv,
+				      struct ldb_val key,
+				      struct ldb_val data,
+				      void *state)
+{
+	struct ldb_kv_index_sort_walk *walk =
+		(struct ldb_kv_index_sort_walk *)state;
+	struct ldb_kv_ordered_index_context ctx = {
+		.module = walk->ac->module,
+	};
+	struct dn_list *list = NULL;
+	const char *key_str = NULL;
+
+	if (key.length <= 3) {
+		walk->error = LDB_ERR_OPERATIONS_ERROR;
+		return -1;
+	}
+
+	list = talloc_zero(walk->ac, struct dn_list);
+	if (list == NULL) {
+		walk->error = ldb_module_oom(walk->ac->module);
+		return -1;
+	}
+	list->dn = talloc_zero_array(list, struct ldb_val, 2);
+	if (list->dn == NULL) {
+		TALLOC_FREE(list);
+		walk->error = ldb_module_oom(walk->ac->module);
+		return -1;
+	}
+	ctx.dn_list = list;
+
+	traverse_range_index(ldb_kv, key, data, &ctx);
+	if (ctx.error != LDB_SUCCESS) {
+		TALLOC_FREE(list);
+		walk->error = ctx.error;
+		return -1;
+	}
+
+	/* Skip the DN= prefix */
+	key_str = talloc_strndup(list, (char *)key.data + 3, key.length - 3);
+	if (key_str == NULL) {
+		TALLOC_FREE(list);
+		walk->error = ldb_module_oom(walk->ac->module);
+		return -1;
+	}
+
+	walk->error = ldb_kv_index_sort_send_list(walk, key_str, list);
+	TALLOC_FREE(list);
+	if (walk->error != LDB_SUCCESS) {
+		return -1;
+	}
+	return 0;
+}
+
+static int ldb_kv_index_sort_probe_fn(_UNUSED_ struct ldb_kv_private *ldb_kv,
+				      _UNUSED_ struct ldb_val key,
+				      _UNUSED_ struct ldb_val data,
+				      void *state)
+{
+	bool *found = (bool *)state;
+
+	*found = true;
+	return -1;
+}
+
+/*
+  are there any keys from start up to end?
+*/
+static int ldb_kv_index_sort_probe(struct ldb_kv_private *ldb_kv,
+				   const char *start,
+				   const char *end,
+				   bool *found)
+{
+	struct ldb_val start_key, end_key;
+
+	*found = false;
+	if (start == NULL || end == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	start_key.data = discard_const_p(uint8_t, start);
+	start_key.length = strlen(start);
+	end_key.data = discard_const_p(uint8_t, end);
+	end_key.length = strlen(end);
+
+	return ldb_kv->kv_ops->iterate_range(ldb_kv,
+					     start_key,
+					     end_key,
+					     ldb_kv_index_sort_probe_fn,
+					     found);
+}
+
+/*
+  walk the values of the sort attribute in the @INDEXORDER record,
+  from bound (if given) onwards, or back from the end to bound
+*/
+static int ldb_kv_index_sort_walk_order(struct ldb_kv_index_sort_walk *walk,
+					TALLOC_CTX *mem_ctx,
+					const char *attr,
+					const struct ldb_val *bound,
+					bool reverse)
+{
+	struct ldb_module *module = walk->ac->module;
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	TALLOC_CTX *msg = NULL;
+	struct ldb_val *vals = NULL;
+	unsigned int num_vals = 0;
+	struct ldb_dn *dn = NULL;
+	unsigned int first, last, i, n;
+	int ret;
+
+	msg = talloc_new(mem_ctx);
+	if (msg == NULL) {
+		return ldb_module_oom(module);
+	}
+	ret = ldb_kv_index_order_load(module,
+				      msg,
+				      attr,
+				      strlen(attr),
+				      &vals,
+				      &num_vals);
+	if (ret != LDB_SUCCESS) {
+		return ret;
+	}
+
+	/* Base64 encoded values are not in the order of the values */
+	for (i = 0; i < num_vals; i++) {
+		if (vals[i].length > 0 && vals[i].data[0] == ':') {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+	}
+
+	first = 0;
+	last = num_vals;
+	if (bound != NULL) {
+		while (first < last) {
+			unsigned int mid = first + (last - first) / 2;
+
+			if (ldb_kv_index_order_cmp(&vals[mid], bound) < 0) {
+				first = mid + 1;
+			} else {
+				last = mid;
+			}
+		}
+		last = num_vals;
+	}
+
+	for (n = 0; n < last - first; n++) {
+		struct ldb_val *v = NULL;
+		struct dn_list *values = NULL;
+
+		i = reverse ? last - 1 - n : first + n;
+		v = &vals[i];
+
+		values = talloc_zero(msg, struct dn_list);
+		if (values == NULL) {
+			return ldb_module_oom(module);
+		}
+		dn = ldb_dn_new_fmt(values, ldb, "%s:%s:%.*s",
+				    LDB_KV_INDEX, attr,
+				    (int)v->length, (const char *)v->data);
+		if (dn == NULL) {
+			return ldb_module_oom(module);
+		}
+		ret = ldb_kv_dn_list_load(module, walk->ldb_kv, dn, values,
+					  DN_LIST_WILL_BE_READ_ONLY);
+		if (ret == LDB_ERR_NO_SUCH_OBJECT) {
+			TALLOC_FREE(values);
+			continue;
+		}
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+
+		ret = ldb_kv_index_sort_send_list(walk,
+						  ldb_dn_get_linearized(dn),
+						  values);
+		TALLOC_FREE(values);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+	}
+
+	return LDB_SUCCESS;
+}
+
+/*
+  answer a search the server_sort module passed down with the index
+  sort control by walking the index of the sort attribute in order,
+  checking each entry against the search as it is reached.  The
+  entries are sent in the order server_sort would put them in, so it
+  need not gather and sort them, and the first arrive at once.
+
+  This is only done if the walk will reach every entry the search can
+  return: the expression must need a value of the attribute, and no
+  value may have a truncated or base64 encoded index key, which are
+  not in the order of the values.  As the walk reads the index of
+  every value of the attribute, the filter's own index must also be
+  unavailable or expected to return more entries than that.
+  Otherwise, having sent nothing, LDB_ERR_OPERATIONS_ERROR is returned
+  for an unsorted search.
+*/
+/*
+  could a search be sent in the order of this attribute, see struct
+  ldb_index_sort_backend.  This is checked again, under the read
+  lock, by ldb_kv_index_search_sorted().
+ */
+bool ldb_kv_index_can_sort(struct ldb_module *module, const char *attr)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	struct ldb_kv_private *ldb_kv = talloc_get_type(
+	    ldb_module_get_private(module), struct ldb_kv_private);
+	const struct ldb_schema_attribute *a = NULL;
+
+	if (ldb_kv == NULL ||
+	    ldb_kv->cache == NULL ||
+	    attr == NULL ||
+	    attr[0] == '@' ||
+	    ldb_kv->cache->GUID_index_attribute == NULL ||
+	    !ldb_kv->cache->attribute_indexes) {
+		return false;
+	}
+	if (!ldb_kv_is_indexed(module, ldb_kv, attr)) {
+		return false;
+	}
+
+	/* As in ldb_kv_index_dn_ordered() */
+	a = ldb_schema_attribute_by_name(ldb, attr);
+	return a->syntax->index_format_fn != NULL;
+}
+
+static int ldb_kv_index_search_sorted(struct ldb_kv_context *ac,
+				      struct ldb_kv_private *ldb_kv,
+				      uint32_t *match_count)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(ac->module);
+	const struct ldb_index_sort_control *sort = ac->sort;
+	const struct ldb_val *bound = NULL;
+	struct ldb_val bound_value = { .data = NULL };
+	struct ldb_kv_index_sort_walk walk = {
+		.ac = ac,
+		.ldb_kv = ldb_kv,
+		.match_count = match_count,
+	};
+	struct ldb_control **controls = NULL;
+	TALLOC_CTX *tmp_ctx = NULL;
+	char *attr = NULL;
+	const char *prefix = NULL;
+	bool found = false;
+	unsigned int i;
+	int ret;
+
+	if (ldb_kv->idxptr != NULL ||
+	    ldb_kv->kv_ops->transaction_active(ldb_kv)) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	if (!ldb_kv_index_can_sort(ac->module, sort->attributeName)) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	/* Entries without a value are not in the index */
+	if (!ldb_kv_index_tree_needs_attr(ac->tree, sort->attributeName)) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	/* Only the @INDEXORDER record can be walked backwards */
+	if (sort->reverse && !ldb_kv->cache->ordered_index) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	if (ldb_kv->cache->index_stats != NULL) {
+		const struct ldb_kv_index_stat *st = NULL;
+		uint64_t est;
+
+		est = ldb_kv_index_plan_estimate(ac->module,
+						 ldb_kv,
+						 ac->tree,
+						 true);
+		st = ldb_kv_index_stats_find(ldb_kv->cache->index_stats,
+					     sort->attributeName,
+					     strlen(sort->attributeName));
+		if (est != LDB_KV_PLAN_UNKNOWN &&
+		    st != NULL &&
+		    est <= st->entries) {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+	}
+
+	tmp_ctx = talloc_new(ac);
+	if (tmp_ctx == NULL) {
+		return ldb_module_oom(ac->module);
+	}
+	attr = ldb_attr_casefold(tmp_ctx, sort->attributeName);
+	if (attr == NULL) {
+		TALLOC_FREE(tmp_ctx);
+		return ldb_module_oom(ac->module);
+	}
+	prefix = talloc_asprintf(tmp_ctx, "%s:%s:", LDB_KV_INDEX, attr);
+	if (prefix == NULL) {
+		TALLOC_FREE(tmp_ctx);
+		return ldb_module_oom(ac->module);
+	}
+
+	/*
+	 * Truncated keys are apart from the others, as
+	 * @INDEX#ATTR#value.  With a limit on the key length, look for
+	 * any, which TDB can't do.
+	 */
+	if (ldb_kv->max_key_length != 0) {
+		ret = ldb_kv_index_sort_probe(
+			ldb_kv,
+			talloc_asprintf(tmp_ctx, "DN=%s#%s#", LDB_KV_INDEX, attr),
+			talloc_asprintf(tmp_ctx, "DN=%s#%s$", LDB_KV_INDEX, attr),
+			&found);
+		if (ret != LDB_SUCCESS || found) {
+			TALLOC_FREE(tmp_ctx);
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+	}
+
+	/* Base64 encoded keys are @INDEX:ATTR::value */
+	if (!ldb_kv->cache->ordered_index) {
+		ret = ldb_kv_index_sort_probe(
+			ldb_kv,
+			talloc_asprintf(tmp_ctx, "DN=%s:", prefix),
+			talloc_asprintf(tmp_ctx, "DN=%s;", prefix),
+			&found);
+		if (ret != LDB_SUCCESS || found) {
+			TALLOC_FREE(tmp_ctx);
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+	}
+
+	/*
+	 * Start the walk at an (attr>=value) the search needs, if the
+	 * index key of the value is in order.
+	 */
+	bound = ldb_kv_index_tree_lower_bound(ac->tree, sort->attributeName);
+	if (bound != NULL) {
+		enum key_truncation truncation = KEY_NOT_TRUNCATED;
+		struct ldb_dn *key_dn = NULL;
+		const char *key_str = NULL;
+		size_t prefix_len = strlen(prefix);
+
+		key_dn = ldb_kv_index_key_internal(ldb,
+						   tmp_ctx,
+						   ldb_kv,
+						   sort->attributeName,
+						   bound,
+						   NULL,
+						   &truncation,
+						   false);
+		if (key_dn != NULL) {
+			key_str = ldb_dn_get_linearized(key_dn);
+		}
+		bound = NULL;
+		if (key_str != NULL &&
+		    truncation == KEY_NOT_TRUNCATED &&
+		    strncmp(key_str, prefix, prefix_len) == 0 &&
+		    key_str[prefix_len] != ':') {
+			bound_value.data = discard_const_p(uint8_t,
+							   key_str + prefix_len);
+			bound_value.length = strlen(key_str + prefix_len);
+			bound = &bound_value;
+		}
+	}
+
+	/* The first entry tells server_sort the entries are in order */
+	controls = talloc_array(ac, struct ldb_control *, 2);
+	if (controls == NULL) {
+		TALLOC_FREE(tmp_ctx);
+		return ldb_module_oom(ac->module);
+	}
+	controls[0] = talloc(controls, struct ldb_control);
+	if (controls[0] == NULL) {
+		TALLOC_FREE(controls);
+		TALLOC_FREE(tmp_ctx);
+		return ldb_module_oom(ac->module);
+	}
+	*controls[0] = (struct ldb_control) {
+		.oid = LDB_CONTROL_INDEX_SORT_OID,
+		.critical = false,
+		.data = NULL,
+	};
+	controls[1] = NULL;
+	ac->entry_controls = controls;
+
+	if (ldb_kv->cache->ordered_index) {
+		ret = ldb_kv_index_sort_walk_order(&walk,
+						   tmp_ctx,
+						   attr,
+						   bound,
+						   sort->reverse);
+	} else {
+		struct ldb_val start_key, end_key;
+		const char *start = NULL;
+		const char *end = NULL;
+
+		if (bound != NULL) {
+			start = talloc_asprintf(tmp_ctx, "DN=%s%.*s",
+						prefix,
+						(int)bound->length,
+						(const char *)bound->data);
+		} else {
+			start = talloc_asprintf(tmp_ctx, "DN=%s", prefix);
+		}
+		/* : becomes ; for the end key, as in ldb_kv_index_dn_ordered() */
+		end = talloc_asprintf(tmp_ctx, "DN=%s:%s;", LDB_KV_INDEX, attr);
+		if (start == NULL || end == NULL) {
+			ret = ldb_module_oom(ac->module);
+		} else {
+			start_key.data = discard_const_p(uint8_t, start);
+			start_key.length = strlen(start);
+			end_key.data = discard_const_p(uint8_t, end);
+			end_key.length = strlen(end);
+
+			ret = ldb_kv->kv_ops->iterate_range(
+				ldb_kv,
+				start_key,
+				end_key,
+				ldb_kv_index_sort_traverse,
+				&walk);
+			if (ret == LDB_SUCCESS) {
+				ret = walk.error;
+			}
+		}
+	}
+	ac->sort_key = NULL;
+
+	/* Those without a visible value go last */
+	for (i = 0; ret == LDB_SUCCESS && i < ac->num_sort_deferred; i++) {
+		ret = ldb_kv_index_filter_key(ldb_kv,
+					      ac,
+					      ac->sort_deferred[i],
+					      walk.idx++,
+					      match_count,
+					      KEY_TRUNCATED);
+	}
+
+	TALLOC_FREE(ac->sort_deferred);
+	ac->num_sort_deferred = 0;
+	TALLOC_FREE(ac->entry_controls);
+	TALLOC_FREE(tmp_ctx);
+	return ret;
+}
+
+/*
+  search the database with a LDAP-like expression using indexes
+  returns -1 if an indexed search is not possible, in which
+  case the caller should call ltdb_search_full()
+*/
+int ldb_kv_search_indexed(struct ldb_kv_context *ac, uint32_t *match_count)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(ac->module);
+	struct ldb_kv_private *ldb_kv = talloc_get_type(
+	    ldb_module_get_private(ac->module), struct ldb_kv_private);
+	struct dn_list *dn_list;
+	int ret;
+	enum ldb_scope index_scope;
+	enum key_truncation scope_one_truncation = KEY_NOT_TRUNCATED;
+	uint64_t estimate = 0;
+
+	/* see if indexing is enabled */
+	if (!ldb_kv->cache->attribute_indexes &&
+	    !ldb_kv->cache->one_level_indexes &&
+	    !ldb_kv->cache->subtree_indexes && ac->scope != LDB_SCOPE_BASE) {
+		/* fallback to a full search */
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	if (ac->sort != NULL) {
+		ret = ldb_kv_index_search_sorted(ac, ldb_kv, match_count);
+		if (ret != LDB_ERR_OPERATIONS_ERROR ||
+		    *match_count != 0 ||
+		    ac->request_terminated) {
+			if (ret == LDB_SUCCESS && ac->want_index_plan) {
+				ac->index_plan = talloc_asprintf(
+					ac,
+					"sorted index: %s",
+					ac->sort->attributeName);
+			}
+			return ret;
+		}
+	}
+
+	dn_list = talloc_zero(ac, struct dn_list);
+	if (dn_list == NULL) {
+		return ldb_module_oom(ac->module);
+	}
+
+	/*
+	 * For the purposes of selecting the switch arm below, if we
+	 * don't have a one-level index then treat it like a subtree
+	 * search
+	 */
+	if (ac->scope == LDB_SCOPE_ONELEVEL &&
+	    !ldb_kv->cache->one_level_indexes) {
+		index_scope = LDB_SCOPE_SUBTREE;
+	} else {
+		index_scope = ac->scope;
+	}
+
+	switch (index_scope) {
+	case LDB_SCOPE_BASE:
+		/*
+		 * The only caller will have filtered the operation out
+		 * so we should never get here
+		 */
+		return ldb_operr(ldb);
+
+	case LDB_SCOPE_ONELEVEL:
+
+		/*
+		 * First, load all the one-level child objects (regardless of
+		 * whether they match the search filter or not). The database
+		 * maintains a one-level index, so retrieving this is quick.
+		 */
+		ret = ldb_kv_index_dn_one(ac->module,
+					  ldb_kv,
+					  ac->base,
+					  dn_list,
+					  &scope_one_truncation);
+		if (ret != LDB_SUCCESS) {
+			talloc_free(dn_list);
+			return ret;
+		}
+
+		if (ac->want_index_plan) {
+			ac->index_plan = talloc_strdup(ac, "one-level index");
+		}
+
+		/*
+		 * If we have too many children, running ldb_kv_index_filter()
+		 * over all the child objects can be quite expensive. So next
+		 * we do a separate indexed query using the search filter.
+		 *
+		 * This should be quick, but it may return objects that are not
+		 * the direct one-level child objects we're interested in.
+		 *
+		 * We only do this in the GUID index mode, which is
+		 * O(n*log(m)) otherwise the intersection below will
+		 * be too costly at O(n*m).
+		 *
+		 * We don't set a heuristic for 'too many' but instead
+		 * do it always and rely on the index lookup being
+		 * fast enough in the small case.
+		 */
+		if (ldb_kv->cache->GUID_index_attribute != NULL) {
+			struct dn_list *indexed_search_result
+				= talloc_zero(ac, struct dn_list);
+			if (indexed_search_result == NULL) {
+				talloc_free(dn_list);
+				return ldb_module_oom(ac->module);
+			}
+
+			if (!ldb_kv->cache->attribute_indexes) {
+				talloc_free(indexed_search_result);
+				talloc_free(dn_list);
+				return LDB_ERR_OPERATIONS_ERROR;
+			}
+
+			if (ac->want_index_plan) {
+				char *plan = ldb_kv_index_plan_describe(
+					ac, ac->module, ldb_kv, ac->tree);
+				TALLOC_FREE(ac->index_plan);
+				ac->index_plan = talloc_asprintf(
+					ac, "one-level index: %s", plan);
+				TALLOC_FREE(plan);
+			}
+
+			/*
+			 * Try to do an indexed database search
+			 */
+			ret = ldb_kv_index_dn(
+			    ac->module, ldb_kv, ac->tree,
+			    indexed_search_result);
+
+			/*
+			 * We can stop if we're sure the object doesn't exist
+			 */
+			if (ret == LDB_ERR_NO_SUCH_OBJECT) {
+				talloc_free(indexed_search_result);
+				talloc_free(dn_list);
+				return LDB_ERR_NO_SUCH_OBJECT;
+			}
+
+			/*
+			 * Once we have a successful search result, we
+			 * intersect it with the one-level children (dn_list).
+			 * This should give us exactly the result we're after
+			 * (we still need to run ldb_kv_index_filter() to
+			 * handle potential index truncation cases).
+			 *
+			 * The indexed search may fail because we don't support
+			 * indexing on that type of search operation, e.g.
+			 * matching against '*'. In which case we fall through
+			 * and run ldb_kv_index_filter() over all the one-level
+			 * children (which is still better than bailing out here
+			 * and falling back to a full DB scan).
+			 */
+			if (ret == LDB_SUCCESS) {
+				dn_list->exact = indexed_search_result->exact;
+				if (!ldb_kv_dn_list_intersect(
+					ldb_kv,
+					dn_list,
+					indexed_search_result)) {
+					talloc_free(indexed_search_result);
+					talloc_free(dn_list);
+					return LDB_ERR_OPERATIONS_ERROR;
+				}
+			}
+		}
+		break;
+
+	case LDB_SCOPE_SUBTREE:
+	case LDB_SCOPE_DEFAULT:
+		/*
+		 * With a subtree index, load the objects below the
+		 * base and intersect them with the indexed search
+		 * result, as is done for the one-level index above,
+		 * unless the filter's index is the cheaper start.
+		 */
+		if (ldb_kv_index_use_subtree(ac, ldb_kv)) {
+			ret = ldb_kv_index_search_subtree(ac,
+							  ldb_kv,
+							  dn_list);
+			if (ret != LDB_SUCCESS) {
+				talloc_free(dn_list);
+				return ret;
+			}
+			break;
+		}
+
+		if (!ldb_kv->cache->attribute_indexes) {
+			talloc_free(dn_list);
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+
+		/*
+		 * If the index would return most of the database
+		 * anyway, reading it as well is just extra work.
+		 */
+		if (ldb_kv_index_plan_full_scan(ac->module,
+						ldb_kv,
+						ac->tree,
+						&estimate)) {
+			ac->planned_full_scan = true;
+			if (ac->want_index_plan) {
+				char *filter = ldb_filter_from_tree(ac,
+								    ac->tree);
+				ac->index_plan = talloc_asprintf(
+					ac,
+					"full scan: %s[~%llu] of %llu objects",
+					filter,
+					(unsigned long long)estimate,
+					(unsigned long long)
+					ldb_kv->cache->index_stats->objects);
+				TALLOC_FREE(filter);
+			}
+			talloc_free(dn_list);
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+		if (ac->want_index_plan) {
+			char *plan = ldb_kv_index_plan_describe(
+				ac, ac->module, ldb_kv, ac->tree);
+			ac->index_plan = talloc_asprintf(ac, "index: %s", plan);
+			TALLOC_FREE(plan);
+		}
+
+		/*
+		 * Outside a transaction, in the GUID index mode, walk
+		 * the candidates with a cursor rather than loading
+		 * the full list for the tree.
+		 */
+		if (ldb_kv->cache->GUID_index_attribute != NULL &&
+		    ldb_kv->idxptr == NULL) {
+			talloc_free(dn_list);
+			return ldb_kv_index_search_cursor(ac,
+							  ldb_kv,
+							  match_count);
+		}
+
+		/*
+		 * Here we load the index for the tree.  We have no
+		 * index for the subtree.
+		 */
+		ret = ldb_kv_index_dn(ac->module, ldb_kv, ac->tree, dn_list);
+		if (ret != LDB_SUCCESS) {
+			talloc_free(dn_list);
+			return ret;
+		}
+		break;
+	}
+
+	/*
+	 * It is critical that this function do the re-filter even
+	 * on things found by the index as the index can over-match
+	 * in cases of truncation (as well as when it decides it is
+	 * not worth further filtering)
+	 *
+	 * If this changes, then the index code above would need to
+	 * pass up a flag to say if any index was truncated during
+	 * processing as the truncation here refers only to the
+	 * SCOPE_ONELEVEL index.
+	 */
+	ac->index_exact = dn_list->exact;
+	ret = ldb_kv_index_filter(
+	    ldb_kv, dn_list, ac, match_count, scope_one_truncation);
+	talloc_free(dn_list);
+	return ret;
+}
+
+/**
+ * @brief Add a DN in the index list of a given attribute name/value pair
+ *
+ * This function will add the DN in the index list for the index for
+ * the given attribute name and value.
+ *
+ * @param[in]  module       A ldb_module structure
+ *
+ * @param[in]  dn           The string representation of the DN as it
+ *                          will be stored in the index entry
+ *
+ * @param[in]  el           The ldb_message_element that the index key
+ *                          was constructed from
+ *
+ * @param[in]  dn_key       The index key, from ldb_kv_index_key()
+ *
+ * @param[in]  a            The schema attribute for the index key
+ *
+ * @param[in]  truncation   If the index key was truncated
+ *
+ * @return                  An ldb error code
+ */
+static int ldb_kv_index_add1_key(struct ldb_module *module,
+				 struct ldb_kv_private *ldb_kv,
+				 const struct ldb_message *msg,
+				 struct ldb_message_element *el,
+				 struct ldb_dn *dn_key,
+				 const struct ldb_schema_attribute *a,
+				 enum key_truncation truncation)
+{
+	struct ldb_context *ldb;
+	int ret;
+	struct dn_list *list;
+	unsigned alloc_len;
+	bool append = ldb_kv->idxptr != NULL && ldb_kv->idxptr->append;
+
+	ldb = ldb_module_get_ctx(module);
+
+	list = talloc_zero(module, struct dn_list);
+	if (list == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	/*
+	 * Samba only maintains unique indexes on the objectSID and objectGUID
+	 * so if a unique index key exceeds the maximum length there is a
+	 * problem.
+	 */
+	if ((truncation == KEY_TRUNCATED) && (a != NULL &&
+		(a->flags & LDB_ATTR_FLAG_UNIQUE_INDEX ||
+		(el->flags & LDB_FLAG_INTERNAL_FORCE_UNIQUE_INDEX)))) {
+
+		ldb_asprintf_errstring(
+		    ldb,
+		    __location__ ": unique index key on %s in %s, "
+				 "exceeds maximum key length of %u (encoded).",
+		    el->name,
+		    ldb_dn_get_linearized(msg->dn),
+		    ldb_kv->max_key_length);
+		talloc_free(list);
+		return LDB_ERR_CONSTRAINT_VIOLATION;
+	}
+
+	ret = ldb_kv_dn_list_load(module, ldb_kv, dn_key, list,
+				  append ? DN_LIST_APPEND : DN_LIST_MUTABLE);
+	if (ret != LDB_SUCCESS && ret != LDB_ERR_NO_SUCH_OBJECT) {
+		talloc_free(list);
+		return ret;
+	}
+
+	/*
+	 * Check for duplicates in the @IDXDN DN -> GUID record
+	 *
+	 * This is very normal, it just means a duplicate DN creation
+	 * was attempted, so don't set the error string or print scary
+	 * messages.
+	 */
+	if (list->count > 0 &&
+	    ldb_attr_cmp(el->name, LDB_KV_IDXDN) == 0 &&
+	    truncation == KEY_NOT_TRUNCATED) {
+
+		talloc_free(list);
+		return LDB_ERR_CONSTRAINT_VIOLATION;
+
+	} else if (list->count > 0
+		   && ldb_attr_cmp(el->name, LDB_KV_IDXDN) == 0) {
+
+		/*
+		 * At least one existing entry in the DN->GUID index, which
+		 * arises when the DN indexes have been truncated
+		 *
+		 * So need to pull the DN's to check if it's really a duplicate
+		 */
+		unsigned int i;
+		for (i=0; i < list->count; i++) {
+			uint8_t guid_key[LDB_KV_GUID_KEY_SIZE];
+			struct ldb_val key = {
+				.data = guid_key,
+				.length = sizeof(guid_key)
+			};
+			const int flags = LDB_UNPACK_DATA_FLAG_NO_ATTRS;
+			struct ldb_message *rec = ldb_msg_new(ldb);
+			if (rec == NULL) {
+				return LDB_ERR_OPERATIONS_ERROR;
+			}
+
+			ret = ldb_kv_idx_to_key(
+			    module, ldb_kv, ldb, &list->dn[i], &key);
+			if (ret != LDB_SUCCESS) {
+				TALLOC_FREE(list);
+				TALLOC_FREE(rec);
+				return ret;
+			}
+
+			ret =
+			    ldb_kv_search_key(module, ldb_kv, key, rec, flags);
+			if (key.data != guid_key) {
+				TALLOC_FREE(key.data);
+			}
+			if (ret == LDB_ERR_NO_SUCH_OBJECT) {
+				/*
+				 * the record has disappeared?
+				 * yes, this can happen
+				 */
+				talloc_free(rec);
+				continue;
+			}
+
+			if (ret != LDB_SUCCESS) {
+				/* an internal error */
+				TALLOC_FREE(rec);
+				TALLOC_FREE(list);
+				return LDB_ERR_OPERATIONS_ERROR;
+			}
+			/*
+			 * The DN we are trying to add to the DB and index
+			 * is already here, so we must deny the addition
+			 */
+			if (ldb_dn_compare(msg->dn, rec->dn) == 0) {
+				TALLOC_FREE(rec);
+				TALLOC_FREE(list);
+				return LDB_ERR_CONSTRAINT_VIOLATION;
+			}
+		}
+	}
+
+	/*
+	 * Check for duplicates in unique indexes
+	 *
+	 * We don't need to do a loop test like the @IDXDN case
+	 * above as we have a ban on long unique index values
+	 * at the start of this function.
+	 */
+	if (list->count > 0 &&
+	    ((a != NULL
+	      && (a->flags & LDB_ATTR_FLAG_UNIQUE_INDEX ||
+		  (el->flags & LDB_FLAG_INTERNAL_FORCE_UNIQUE_INDEX))))) {
+		/*
+		 * We do not want to print info about a possibly
+		 * confidential DN that the conflict was with in the
+		 * user-visible error string
+		 */
+
+		if (ldb_kv->cache->GUID_index_attribute == NULL) {
+			ldb_debug(ldb, LDB_DEBUG_WARNING,
+				  __location__
+				  ": unique index violation on %s in %s, "
+				  "conflicts with %*.*s in %s",
+				  el->name, ldb_dn_get_linearized(msg->dn),
+				  (int)list->dn[0].length,
+				  (int)list->dn[0].length,
+				  list->dn[0].data,
+				  ldb_dn_get_linearized(dn_key));
+		} else {
+			/* This can't fail, gives a default at worst */
+			const struct ldb_schema_attribute *attr =
+			    ldb_schema_attribute_by_name(
+				ldb, ldb_kv->cache->GUID_index_attribute);
+			struct ldb_val v;
+			ret = attr->syntax->ldif_write_fn(ldb, list,
+							  &list->dn[0], &v);
+			if (ret == LDB_SUCCESS) {
+				ldb_debug(ldb,
+					  LDB_DEBUG_WARNING,
+					  __location__
+					  ": unique index violation on %s in "
+					  "%s, conflicts with %s %*.*s in %s",
+					  el->name,
+					  ldb_dn_get_linearized(msg->dn),
+					  ldb_kv->cache->GUID_index_attribute,
+					  (int)v.length,
+					  (int)v.length,
+					  v.data,
+					  ldb_dn_get_linearized(dn_key));
+			}
+		}
+		ldb_asprintf_errstring(ldb,
+				       __location__ ": unique index violation "
+				       "on %s in %s",
+				       el->name,
+				       ldb_dn_get_linearized(msg->dn));
+		talloc_free(list);
+		return LDB_ERR_CONSTRAINT_VIOLATION;
+	}
+
+	/* overallocate the list a bit, to reduce the number of
+	 * realloc triggered copies */
+	alloc_len = ((list->count+1)+7) & ~7;
+	if (list->borrowed) {
+		ret = ldb_kv_dn_list_unborrow(list, alloc_len);
+		if (ret != LDB_SUCCESS) {
+			talloc_free(list);
+			return ret;
+		}
+	} else {
+		list->dn = talloc_realloc(list, list->dn,
+					  struct ldb_val, alloc_len);
+		if (list->dn == NULL) {
+			talloc_free(list);
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+	}
+
+	if (ldb_kv->cache->GUID_index_attribute == NULL) {
+		const char *dn_str = ldb_dn_get_linearized(msg->dn);
+		list->dn[list->count].data
+			= (uint8_t *)talloc_strdup(list->dn, dn_str);
+		if (list->dn[list->count].data == NULL) {
+			talloc_free(list);
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+		list->dn[list->count].length = strlen(dn_str);
+	} else {
+		const struct ldb_val *key_val;
+		struct ldb_val *exact = NULL, *next = NULL;
+		key_val = ldb_msg_find_ldb_val(
+		    msg, ldb_kv->cache->GUID_index_attribute);
+		if (key_val == NULL) {
+			talloc_free(list);
+			return ldb_module_operr(module);
+		}
+
+		if (key_val->length != LDB_KV_GUID_SIZE) {
+			talloc_free(list);
+			return ldb_module_operr(module);
+		}
+
+		if (append) {
+			/*
+			 * A bulk load appends the GUID rather than moving
+			 * the tail of the list along for every record
+			 * added, and the list is sorted once when it is
+			 * next searched or at commit, when a duplicate
+			 * GUID is reported and dropped.
+			 */
+			if (list->count > 0 &&
+			    ldb_val_equal_exact_for_qsort(
+				    key_val,
+				    &list->dn[list->count - 1]) < 0) {
+				list->unsorted = true;
+			}
+			if (truncation == KEY_NOT_TRUNCATED) {
+				list->check_duplicates = true;
+			}
+		} else {
+			BINARY_ARRAY_SEARCH_GTE(list->dn, list->count,
+						*key_val,
+						ldb_val_equal_exact_ordered,
+						exact, next);
+		}
+
+		/*
+		 * Give a warning rather than fail, this could be a
+		 * duplicate value in the record allowed by a caller
+		 * forcing in the value with
+		 * LDB_FLAG_INTERNAL_DISABLE_SINGLE_VALUE_CHECK
+		 */
+		if (exact != NULL && truncation == KEY_NOT_TRUNCATED) {
+			/* This can't fail, gives a default at worst */
+			const struct ldb_schema_attribute *attr =
+			    ldb_schema_attribute_by_name(
+				ldb, ldb_kv->cache->GUID_index_attribute);
+			struct ldb_val v;
+			ret = attr->syntax->ldif_write_fn(ldb, list,
+							  exact, &v);
+			if (ret == LDB_SUCCESS) {
+				ldb_debug(ldb,
+					  LDB_DEBUG_WARNING,
+					  __location__
+					  ": duplicate attribute value in %s "
+					  "for index on %s, "
+					  "duplicate of %s %*.*s in %s",
+					  ldb_dn_get_linearized(msg->dn),
+					  el->name,
+					  ldb_kv->cache->GUID_index_attribute,
+					  (int)v.length,
+					  (int)v.length,
+					  v.data,
+					  ldb_dn_get_linearized(dn_key));
+			}
+		}
+
+		if (next == NULL) {
+			next = &list->dn[list->count];
+		} else {
+			memmove(&next[1], next,
+				sizeof(*next) * (list->count - (next - list->dn)));
+		}
+		*next = ldb_val_dup(list->dn, key_val);
+		if (next->data == NULL) {
+			talloc_free(list);
+			return ldb_module_operr(module);
+		}
+		ldb_kv_dn_list_chunk_touch(list, key_val);
+	}
+	list->count++;
+
+	ret = ldb_kv_dn_list_store(module, dn_key, list);
+
+	talloc_free(list);
+
+	return ret;
+}
+
+/*
+  add a DN in the index list for the v_idx value of an element
+ */
+static int ldb_kv_index_add1(struct ldb_module *module,
+			     struct ldb_kv_private *ldb_kv,
+			     const struct ldb_message *msg,
+			     struct ldb_message_element *el,
+			     int v_idx)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	struct ldb_dn *dn_key;
+	const struct ldb_schema_attribute *a;
+	enum key_truncation truncation = KEY_TRUNCATED;
+	int ret;
+
+	dn_key = ldb_kv_index_key(ldb,
+				  module,
+				  ldb_kv,
+				  el->name,
+				  &el->values[v_idx],
+				  &a,
+				  &truncation);
+	if (!dn_key) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	ret = ldb_kv_index_add1_key(module,
+				    ldb_kv,
+				    msg,
+				    el,
+				    dn_key,
+				    a,
+				    truncation);
+	talloc_free(dn_key);
+	return ret;
+}
+
+/*
+  add index entries for one elements in a message
+ */
+static int ldb_kv_index_add_el(struct ldb_module *module,
+			       struct ldb_kv_private *ldb_kv,
+			       const struct ldb_message *msg,
+			       struct ldb_message_element *el)
+{
+	unsigned int i;
+	for (i = 0; i < el->num_values; i++) {
+		int ret = ldb_kv_index_add1(module, ldb_kv, msg, el, i);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+	}
+
+	return LDB_SUCCESS;
+}
+
+static int ldb_kv_index_substr_cmp(const struct ldb_val *g1,
+				   const struct ldb_val *g2)
+{
+	return memcmp(g1->data, g2->data, LDB_KV_SUBSTR_GRAM_LEN);
+}
+
+/*
+  add or delete the substring index entries for the v_idx value of
+  an element.
+
+  Each distinct trigram of the value adds the record to the list of
+  that trigram once, so a record with several values sharing a
+  trigram is in the list several times, and deleting one of the
+  values leaves it there for the others.
+ */
+static int ldb_kv_index_substr_value(struct ldb_module *module,
+				     struct ldb_kv_private *ldb_kv,
+				     const struct ldb_message *msg,
+				     struct ldb_message_element *el,
+				     unsigned int v_idx,
+				     bool add)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	const struct ldb_schema_attribute *a = NULL;
+	struct ldb_message_element gram_el = {
+		.name = LDB_KV_IDXSUBSTR,
+		.num_values = 1,
+	};
+	struct ldb_val *grams = NULL;
+	struct ldb_val val, v;
+	TALLOC_CTX *tmp_ctx = NULL;
+	size_t i, num_grams;
+	int ret;
+
+	tmp_ctx = talloc_new(module);
+	if (tmp_ctx == NULL) {
+		return ldb_module_oom(module);
+	}
+
+	/* As in ldb_wildcard_compare() */
+	a = ldb_schema_attribute_by_name(ldb, el->name);
+	ret = a->syntax->canonicalise_fn(ldb, tmp_ctx, &el->values[v_idx], &v);
+	if (ret != LDB_SUCCESS) {
+		TALLOC_FREE(tmp_ctx);
+		return ret;
+	}
+	if (v.length < LDB_KV_SUBSTR_GRAM_LEN) {
+		TALLOC_FREE(tmp_ctx);
+		return LDB_SUCCESS;
+	}
+
+	num_grams = v.length - LDB_KV_SUBSTR_GRAM_LEN + 1;
+	grams = talloc_array(tmp_ctx, struct ldb_val, num_grams);
+	if (grams == NULL) {
+		TALLOC_FREE(tmp_ctx);
+		return ldb_module_oom(module);
+	}
+	for (i = 0; i < num_grams; i++) {
+		grams[i].data = &v.data[i];
+		grams[i].length = LDB_KV_SUBSTR_GRAM_LEN;
+	}
+	TYPESAFE_QSORT(grams, num_grams, ldb_kv_index_substr_cmp);
+
+	ret = ldb_kv_index_substr_val_init(tmp_ctx, el->name, &val);
+	if (ret != LDB_SUCCESS) {
+		TALLOC_FREE(tmp_ctx);
+		return ret;
+	}
+	gram_el.values = &val;
+
+	for (i = 0; i < num_grams; i++) {
+		if (i > 0 &&
+		    ldb_kv_index_substr_cmp(&grams[i - 1], &grams[i]) == 0) {
+			continue;
+		}
+		ldb_kv_index_substr_val(&val, grams[i].data);
+
+		if (add) {
+			enum key_truncation truncation = KEY_NOT_TRUNCATED;
+			struct ldb_dn *dn_key = NULL;
+
+			dn_key = ldb_kv_index_key(ldb,
+						  tmp_ctx,
+						  ldb_kv,
+						  LDB_KV_IDXSUBSTR,
+						  &val,
+						  NULL,
+						  &truncation);
+			if (dn_key == NULL) {
+				TALLOC_FREE(tmp_ctx);
+				return LDB_ERR_OPERATIONS_ERROR;
+			}
+			/*
+			 * Treated as a truncated key, as the record may
+			 * already be in the list for another value.
+			 */
+			ret = ldb_kv_index_add1_key(module,
+						    ldb_kv,
+						    msg,
+						    &gram_el,
+						    dn_key,
+						    NULL,
+						    KEY_TRUNCATED);
+			talloc_free(dn_key);
+		} else {
+			ret = ldb_kv_index_del_value(module,
+						     ldb_kv,
+						     msg,
+						     &gram_el,
+						     0);
+		}
+		if (ret != LDB_SUCCESS) {
+			TALLOC_FREE(tmp_ctx);
+			return ret;
+		}
+	}
+
+	TALLOC_FREE(tmp_ctx);
+	return LDB_SUCCESS;
+}
+
+/*
+  add or delete the substring index entries for an element
+ */
+static int ldb_kv_index_substr_el(struct ldb_module *module,
+				  struct ldb_kv_private *ldb_kv,
+				  const struct ldb_message *msg,
+				  struct ldb_message_element *el,
+				  bool add)
+{
+	unsigned int i;
+
+	if (!ldb_kv_is_substr_indexed(ldb_kv, el->name)) {
+		return LDB_SUCCESS;
+	}
+	for (i = 0; i < el->num_values; i++) {
+		int ret = ldb_kv_index_substr_value(
+			module, ldb_kv, msg, el, i, add);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+	}
+
+	return LDB_SUCCESS;
+}
+
+/*
+  add the substring index entries for all elements in a message
+ */
+static int ldb_kv_index_substr_all(struct ldb_module *module,
+				   struct ldb_kv_private *ldb_kv,
+				   const struct ldb_message *msg)
+{
+	unsigned int i;
+
+	if (!ldb_kv->cache->substring_indexes ||
+	    ldb_dn_is_special(msg->dn)) {
+		return LDB_SUCCESS;
+	}
+
+	for (i = 0; i < msg->num_elements; i++) {
+		int ret = ldb_kv_index_substr_el(
+			module, ldb_kv, msg, &msg->elements[i], true);
+		if (ret != LDB_SUCCESS) {
+			struct ldb_context *ldb = ldb_module_get_ctx(module);
+			ldb_asprintf_errstring(ldb,
+					       __location__ ": Failed to re-index %s in %s - %s",
+					       msg->elements[i].name,
+					       ldb_dn_get_linearized(msg->dn),
+					       ldb_errstring(ldb));
+			return ret;
+		}
+	}
+
+	return LDB_SUCCESS;
+}
+
+/*
+  add or delete the entry for a message in the @IDXPRESENT index
+  record of an element, as ldb_kv_modify_index_dn() does for @IDXONE.
+  This is done once for the element, not for each value.
+ */
+static int ldb_kv_index_presence(struct ldb_module *module,
+				 struct ldb_kv_private *ldb_kv,
+				 const struct ldb_message *msg,
+				 const struct ldb_message_element *el,
+				 bool add)
+{
+	struct ldb_message_element present_el = {
+		.name = LDB_KV_IDXPRESENT,
+		.num_values = 1,
+	};
+	struct ldb_val val;
+	int ret;
+
+	if (!ldb_kv->cache->presence_index) {
+		return LDB_SUCCESS;
+	}
+
+	val.data = (uint8_t *)ldb_attr_casefold(module, el->name);
+	if (val.data == NULL) {
+		return ldb_module_oom(module);
+	}
+	val.length = strlen((char *)val.data);
+	present_el.values = &val;
+
+	if (add) {
+		ret = ldb_kv_index_add1(module, ldb_kv, msg, &present_el, 0);
+	} else {
+		ret = ldb_kv_index_del_value(module, ldb_kv, msg, &present_el, 0);
+	}
+	talloc_free(val.data);
+	return ret;
+}
+
+/*
+  add the @IDXPRESENT index entries for all the indexed elements in a
+  message
+ */
+static int ldb_kv_index_presence_all(struct ldb_module *module,
+				     struct ldb_kv_private *ldb_kv,
+				     const struct ldb_message *msg)
+{
+	unsigned int i;
+
+	if (!ldb_kv->cache->presence_index ||
+	    ldb_dn_is_special(msg->dn)) {
+		return LDB_SUCCESS;
+	}
+
+	for (i = 0; i < msg->num_elements; i++) {
+		const struct ldb_message_element *el = &msg->elements[i];
+		int ret;
+
+		if (!ldb_kv_is_indexed(module, ldb_kv, el->name)) {
+			continue;
+		}
+		ret = ldb_kv_index_presence(module, ldb_kv, msg, el, true);
+		if (ret != LDB_SUCCESS) {
+			struct ldb_context *ldb = ldb_module_get_ctx(module);
+			ldb_asprintf_errstring(ldb,
+					       __location__ ": Failed to re-index %s in %s - %s",
+					       el->name,
+					       ldb_dn_get_linearized(msg->dn),
+					       ldb_errstring(ldb));
+			return ret;
+		}
+	}
+
+	return LDB_SUCCESS;
+}
+
+/*
+  add index entries for all elements in a message
+ */
+static int ldb_kv_index_add_all(struct ldb_module *module,
+				struct ldb_kv_private *ldb_kv,
+				const struct ldb_message *msg)
+{
+	struct ldb_message_element *elements = msg->elements;
+	unsigned int i;
+	const char *dn_str;
+	int ret;
+
+	if (ldb_dn_is_special(msg->dn)) {
+		return LDB_SUCCESS;
+	}
+
+	dn_str = ldb_dn_get_linearized(msg->dn);
+	if (dn_str == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	ret = ldb_kv_write_index_dn_guid(module, msg, 1);
+	if (ret != LDB_SUCCESS) {
+		return ret;
+	}
+
+	if (!ldb_kv->cache->attribute_indexes) {
+		/* no indexed fields */
+		return LDB_SUCCESS;
+	}
+
+	for (i = 0; i < msg->num_elements; i++) {
+		if (!ldb_kv_is_indexed(module, ldb_kv, elements[i].name)) {
+			continue;
+		}
+		ret = ldb_kv_index_add_el(module, ldb_kv, msg, &elements[i]);
+		if (ret != LDB_SUCCESS) {
+			struct ldb_context *ldb = ldb_module_get_ctx(module);
+			ldb_asprintf_errstring(ldb,
+					       __location__ ": Failed to re-index %s in %s - %s",
+					       elements[i].name, dn_str,
+					       ldb_errstring(ldb));
+			return ret;
+		}
+	}
+
+	ret = ldb_kv_index_presence_all(module, ldb_kv, msg);
+	if (ret != LDB_SUCCESS) {
+		return ret;
+	}
+
+	return ldb_kv_index_substr_all(module, ldb_kv, msg);
+}
+
+
+/*
+  insert a DN index for a message
+*/
+static int ldb_kv_modify_index_dn(struct ldb_module *module,
+				  struct ldb_kv_private *ldb_kv,
+				  const struct ldb_message *msg,
+				  struct ldb_dn *dn,
+				  const char *index,
+				  int add)
+{
+	struct ldb_message_element el;
+	struct ldb_val val;
+	int ret;
+
+	val.data = (uint8_t *)((uintptr_t)ldb_dn_get_casefold(dn));
+	if (val.data == NULL) {
+		const char *dn_str = ldb_dn_get_linearized(dn);
+		ldb_asprintf_errstring(ldb_module_get_ctx(module),
+				       __location__ ": Failed to modify %s "
+						    "against %s in %s: failed "
+						    "to get casefold DN",
+				       index,
+				       ldb_kv->cache->GUID_index_attribute,
+				       dn_str);
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	val.length = strlen((char *)val.data);
+	el.name = index;
+	el.values = &val;
+	el.num_values = 1;
+
+	if (add) {
+		ret = ldb_kv_index_add1(module, ldb_kv, msg, &el, 0);
+	} else { /* delete */
+		ret = ldb_kv_index_del_value(module, ldb_kv, msg, &el, 0);
+	}
+
+	if (ret != LDB_SUCCESS) {
+		struct ldb_context *ldb = ldb_module_get_ctx(module);
+		const char *dn_str = ldb_dn_get_linearized(dn);
+		ldb_asprintf_errstring(ldb,
+				       __location__ ": Failed to modify %s "
+						    "against %s in %s - %s",
+				       index,
+				       ldb_kv->cache->GUID_index_attribute,
+				       dn_str,
+				       ldb_errstring(ldb));
+		return ret;
+	}
+	return ret;
+}
+
+/*
+  insert a one level index for a message
+*/
+static int ldb_kv_index_onelevel(struct ldb_module *module,
+				 const struct ldb_message *msg,
+				 int add)
+{
+	struct ldb_kv_private *ldb_kv = talloc_get_type(
+	    ldb_module_get_private(module), struct ldb_kv_private);
+	struct ldb_dn *pdn;
+	int ret;
+
+	/* We index for ONE Level only if requested */
+	if (!ldb_kv->cache->one_level_indexes) {
+		return LDB_SUCCESS;
+	}
+
+	pdn = ldb_dn_get_parent(module, msg->dn);
+	if (pdn == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	ret =
+	    ldb_kv_modify_index_dn(module, ldb_kv, msg, pdn, LDB_KV_IDXONE, add);
+
+	talloc_free(pdn);
+
+	return ret;
+}
+
+/*
+  insert a subtree index for a message, under each of its ancestors
+*/
+static int ldb_kv_index_subtree(struct ldb_module *module,
+				const struct ldb_message *msg,
+				int add)
+{
+	struct ldb_kv_private *ldb_kv = talloc_get_type(
+	    ldb_module_get_private(module), struct ldb_kv_private);
+	struct ldb_dn *pdn;
+	int ret = LDB_SUCCESS;
+
+	if (!ldb_kv->cache->subtree_indexes ||
+	    ldb_dn_is_special(msg->dn)) {
+		return LDB_SUCCESS;
+	}
+
+	pdn = ldb_dn_get_parent(module, msg->dn);
+	if (pdn == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	/* The ancestors of a naming context are not indexed either */
+	while (ldb_kv_subtree_indexed(ldb_kv, pdn)) {
+		ret = ldb_kv_modify_index_dn(
+		    module, ldb_kv, msg, pdn, LDB_KV_IDXSUBTREE, add);
+		if (ret != LDB_SUCCESS) {
+			break;
+		}
+		if (!ldb_dn_remove_child_components(pdn, 1)) {
+			ret = LDB_ERR_OPERATIONS_ERROR;
+			break;
+		}
+	}
+
+	talloc_free(pdn);
+
+	return ret;
+}
+
+/*
+  insert a one level index for a message
+*/
+static int ldb_kv_write_index_dn_guid(struct ldb_module *module,
+				      const struct ldb_message *msg,
+				      int add)
+{
+	int ret;
+	struct ldb_kv_private *ldb_kv = talloc_get_type(
+	    ldb_module_get_private(module), struct ldb_kv_private);
+
+	/* We index for DN only if using a GUID index */
+	if (ldb_kv->cache->GUID_index_attribute == NULL) {
+		return LDB_SUCCESS;
+	}
+
+	ret = ldb_kv_modify_index_dn(
+	    module, ldb_kv, msg, msg->dn, LDB_KV_IDXDN, add);
+
+	if (ret == LDB_ERR_CONSTRAINT_VIOLATION) {
+		ldb_asprintf_errstring(ldb_module_get_ctx(module),
+				       "Entry %s already exists",
+				       ldb_dn_get_linearized(msg->dn));
+		ret = LDB_ERR_ENTRY_ALREADY_EXISTS;
+	}
+	return ret;
+}
+
+/*
+  add the index entries for a new element in a record
+  The caller guarantees that these element values are not yet indexed
+*/
+int ldb_kv_index_add_element(struct ldb_module *module,
+			     struct ldb_kv_private *ldb_kv,
+			     const struct ldb_message *msg,
+			     struct ldb_message_element *el)
+{
+	if (ldb_dn_is_special(msg->dn)) {
+		return LDB_SUCCESS;
+	}
+	if (ldb_kv_is_indexed(module, ldb_kv, el->name)) {
+		const struct ldb_message_element *el2 = NULL;
+		int ret = ldb_kv_index_add_el(module, ldb_kv, msg, el);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+
+		/*
+		 * Values added to an element the record already had
+		 * do not change the @IDXPRESENT index.
+		 */
+		el2 = ldb_msg_find_element(msg, el->name);
+		if (el2 != NULL && el2->num_values == el->num_values) {
+			ret = ldb_kv_index_presence(module, ldb_kv, msg, el,
+						    true);
+			if (ret != LDB_SUCCESS) {
+				return ret;
+			}
+		}
+	}
+	return ldb_kv_index_substr_el(module, ldb_kv, msg, el, true);
+}
+
+/*
+  add the index entries for a new record
+*/
+int ldb_kv_index_add_new(struct ldb_module *module,
+			 struct ldb_kv_private *ldb_kv,
+			 const struct ldb_message *msg)
+{
+	int ret;
+
+	if (ldb_dn_is_special(msg->dn)) {
+		return LDB_SUCCESS;
+	}
+
+	ldb_kv_index_stats_objects(ldb_kv, 1);
+
+	ret = ldb_kv_index_add_all(module, ldb_kv, msg);
+	if (ret != LDB_SUCCESS) {
+		/*
+		 * Because we can't trust the caller to be doing
+		 * transactions properly, clean up any index for this
+		 * entry rather than relying on a transaction
+		 * cleanup
+		 */
+
+		ldb_kv_index_delete(module, msg);
+		return ret;
+	}
+
+	ret = ldb_kv_index_onelevel(module, msg, 1);
+	if (ret == LDB_SUCCESS) {
+		ret = ldb_kv_index_subtree(module, msg, 1);
+	}
+	if (ret != LDB_SUCCESS) {
+		/*
+		 * Because we can't trust the caller to be doing
+		 * transactions properly, clean up any index for this
+		 * entry rather than relying on a transaction
+		 * cleanup
+		 */
+		ldb_kv_index_delete(module, msg);
+		return ret;
+	}
+	return ret;
+}
+
+
+/*
+  delete an index entry for one message element
+*/
+int ldb_kv_index_del_value(struct ldb_module *module,
+			   struct ldb_kv_private *ldb_kv,
+			   const struct ldb_message *msg,
+			   struct ldb_message_element *el,
+			   unsigned int v_idx)
+{
+	struct ldb_context *ldb;
+	struct ldb_dn *dn_key;
+	const char *dn_str;
+	int ret, i;
+	unsigned int j;
+	struct dn_list *list;
+	struct ldb_dn *dn = msg->dn;
+	enum key_truncation truncation = KEY_NOT_TRUNCATED;
+
+	ldb = ldb_module_get_ctx(module);
+
+	dn_str = ldb_dn_get_linearized(dn);
+	if (dn_str == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	if (dn_str[0] == '@') {
+		return LDB_SUCCESS;
+	}
+
+	if (ldb_kv_is_substr_indexed(ldb_kv, el->name)) {
+		ret = ldb_kv_index_substr_value(
+			module, ldb_kv, msg, el, v_idx, false);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+	}
+
+	/*
+	 * ldb is being used as the memory context to ldb_kv_index_key
+	 * as dn_key itself is also used as the TALLOC_CTX for the
+	 * rest of this function.
+	 */
+	dn_key = ldb_kv_index_key(ldb,
+				  ldb,
+				  ldb_kv,
+				  el->name,
+				  &el->values[v_idx],
+				  NULL,
+				  &truncation);
+	/*
+	 * We ignore key truncation in ltdb_index_add1() so
+	 * match that by ignoring it here as well
+	 *
+	 * Multiple values are legitimate and accepted
+	 */
+	if (!dn_key) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	list = talloc_zero(dn_key, struct dn_list);
+	if (list == NULL) {
+		talloc_free(dn_key);
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	ret = ldb_kv_dn_list_load(module, ldb_kv, dn_key, list,
+				  DN_LIST_MUTABLE);
+	if (ret == LDB_ERR_NO_SUCH_OBJECT) {
+		/* it wasn't indexed. Did we have an earlier error? If we did then
+		   its gone now */
+		talloc_free(dn_key);
+		return LDB_SUCCESS;
+	}
+
+	if (ret != LDB_SUCCESS) {
+		talloc_free(dn_key);
+		return ret;
+	}
+
+	/*
+	 * Find one of the values matching this message to remove
+	 */
+	i = ldb_kv_dn_list_find_msg(ldb_kv, list, msg);
+	if (i == -1) {
+		/* nothing to delete */
+		talloc_free(dn_key);
+		return LDB_SUCCESS;
+	}
+
+	ret = ldb_kv_dn_list_unborrow(list, list->count);
+	if (ret != LDB_SUCCESS) {
+		talloc_free(dn_key);
+		return ret;
+	}
+
+	j = (unsigned int) i;
+	ldb_kv_dn_list_chunk_touch(list, &list->dn[j]);
+	ARRAY_DEL_ELEMENT(list->dn, j, list->count);
+	list->count--;
+	if (list->count == 0) {
+		talloc_free(list->dn);
+		list->dn = NULL;
+	} else {
+		list->dn = talloc_realloc(list, list->dn, struct ldb_val, list->count);
+	}
+
+	ret = ldb_kv_dn_list_store(module, dn_key, list);
+
+	talloc_free(dn_key);
+
+	return ret;
+}
+
+/*
+  delete the index entries for a element
+  return -1 on failure
+*/
+int ldb_kv_index_del_element(struct ldb_module *module,
+			     struct ldb_kv_private *ldb_kv,
+			     const struct ldb_message *msg,
+			     struct ldb_message_element *el)
+{
+	const char *dn_str;
+	int ret;
+	unsigned int i;
+
+	if (!ldb_kv->cache->attribute_indexes) {
+		/* no indexed fields */
+		return LDB_SUCCESS;
+	}
+
+	dn_str = ldb_dn_get_linearized(msg->dn);
+	if (dn_str == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	if (dn_str[0] == '@') {
+		return LDB_SUCCESS;
+	}
+
+	if (!ldb_kv_is_indexed(module, ldb_kv, el->name)) {
+		return ldb_kv_index_substr_el(module, ldb_kv, msg, el, false);
+	}
+	for (i = 0; i < el->num_values; i++) {
+		ret = ldb_kv_index_del_value(module, ldb_kv, msg, el, i);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+	}
+
+	return ldb_kv_index_presence(module, ldb_kv, msg, el, false);
+}
+
+/*
+  delete the index entries for a record
+  return -1 on failure
+*/
+int ldb_kv_index_delete(struct ldb_module *module,
+			const struct ldb_message *msg)
+{
+	struct ldb_kv_private *ldb_kv = talloc_get_type(
+	    ldb_module_get_private(module), struct ldb_kv_private);
+	int ret;
+	unsigned int i;
+
+	if (ldb_dn_is_special(msg->dn)) {
+		return LDB_SUCCESS;
+	}
+
+	ldb_kv_index_stats_objects(ldb_kv, -1);
+
+	ret = ldb_kv_index_onelevel(module, msg, 0);
+	if (ret != LDB_SUCCESS) {
+		return ret;
+	}
+
+	ret = ldb_kv_index_subtree(module, msg, 0);
+	if (ret != LDB_SUCCESS) {
+		return ret;
+	}
+
+	ret = ldb_kv_write_index_dn_guid(module, msg, 0);
+	if (ret != LDB_SUCCESS) {
+		return ret;
+	}
+
+	if (!ldb_kv->cache->attribute_indexes) {
+		/* no indexed fields */
+		return LDB_SUCCESS;
+	}
+
+	for (i = 0; i < msg->num_elements; i++) {
+		ret = ldb_kv_index_del_element(
+		    module, ldb_kv, msg, &msg->elements[i]);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+	}
+
+	return LDB_SUCCESS;
+}
+
+
+/*
+  traversal function that deletes all @INDEX records in the in-memory
+  index cache.
+
+  This does not touch the actual DB, that is done at transaction
+  commit, which in turn greatly reduces DB churn as we will likely
+  be able to do a direct update into the old record.
+*/
+static int delete_index(struct ldb_kv_private *ldb_kv,
+			struct ldb_val key,
+			_UNUSED_ struct ldb_val data,
+			void *state)
+{
+	struct ldb_module *module = state;
+	const char *dnstr = "DN=" LDB_KV_INDEX ":";
+	const char *chunkstr = "DN=" LDB_KV_INDEX_CHUNK;
+	const char *orderstr = "DN=" LDB_KV_INDEX_ORDER ":";
+	struct dn_list list;
+	struct ldb_dn *dn;
+	struct ldb_val v;
+	int ret;
+
+	/*
+	 * Chunks are removed along with the index record that refers
+	 * to them, but that record must be checked for chunks when it
+	 * is rewritten, even if chunking has since been disabled.
+	 */
+	if (strncmp((char *)key.data, chunkstr, strlen(chunkstr)) == 0) {
+		ldb_kv->idxptr->chunk_cleanup = true;
+		return 0;
+	}
+
+	/*
+	 * The @INDEXORDER records are written again, if still
+	 * wanted, at commit
+	 */
+	if (strncmp((char *)key.data, orderstr, strlen(orderstr)) == 0) {
+		struct ldb_kv_idxptr *idxptr = ldb_kv->idxptr;
+		struct ldb_dn **stale = NULL;
+
+		stale = talloc_realloc(idxptr,
+				       idxptr->stale_orders,
+				       struct ldb_dn *,
+				       idxptr->num_stale_orders + 1);
+		if (stale == NULL) {
+			return -1;
+		}
+		idxptr->stale_orders = stale;
+
+		v.data = key.data + 3;
+		v.length = strnlen((char *)key.data, key.length) - 3;
+		stale[idxptr->num_stale_orders] = ldb_dn_from_ldb_val(
+		    stale, ldb_module_get_ctx(module), &v);
+		if (stale[idxptr->num_stale_orders] == NULL) {
+			return -1;
+		}
+		idxptr->num_stale_orders++;
+		return 0;
+	}
+
+	if (strncmp((char *)key.data, dnstr, strlen(dnstr)) != 0) {
+		return 0;
+	}
+	/* we need to put a empty list in the index cache for this
+	 * index entry */
+	list.dn = NULL;
+	list.count = 0;
+	list.strict = false;
+	list.stored_count = 0;
+	list.borrowed = false;
+
+	/* the offset of 3 is to remove the DN= prefix. */
+	v.data = key.data + 3;
+	v.length = strnlen((char *)key.data, key.length) - 3;
+
+	dn = ldb_dn_from_ldb_val(ldb_kv, ldb_module_get_ctx(module), &v);
+
+	/*
+	 * This does not actually touch the DB quite yet, just
+         * the in-memory index cache
+	 */
+	ret = ldb_kv_dn_list_store(module, dn, &list);
+	if (ret != LDB_SUCCESS) {
+		ldb_asprintf_errstring(ldb_module_get_ctx(module),
+				       "Unable to store null index for %s\n",
+						ldb_dn_get_linearized(dn));
+		talloc_free(dn);
+		return -1;
+	}
+	talloc_free(dn);
+	return 0;
+}
+
+/*
+  traversal function that adds @INDEX records during a re index TODO wrong comment
+*/
+static int re_key(struct ldb_kv_private *ldb_kv,
+		  struct ldb_val key,
+		  struct ldb_val val,
+		  void *state)
+{
+	struct ldb_context *ldb;
+	struct ldb_kv_reindex_context *ctx =
+	    (struct ldb_kv_reindex_context *)state;
+	struct ldb_module *module = ldb_kv->module;
+	struct ldb_message *msg;
+	int ret;
+	struct ldb_val key2;
+	bool is_record;
+
+	ldb = ldb_module_get_ctx(module);
+
+	is_record = ldb_kv_key_is_normal_record(key);
+	if (is_record == false) {
+		return 0;
+	}
+
+	msg = ldb_msg_new(module);
+	if (msg == NULL) {
+		return -1;
+	}
+
+	ret = ldb_unpack_data(ldb, &val, msg);
+	if (ret != 0) {
+		ldb_debug(ldb, LDB_DEBUG_ERROR, "Invalid data for index %s\n",
+						ldb_dn_get_linearized(msg->dn));
+		ctx->error = ret;
+		talloc_free(msg);
+		return -1;
+	}
+
+	if (msg->dn == NULL) {
+		ldb_debug(ldb, LDB_DEBUG_ERROR,
+			  "Refusing to re-index as GUID "
+			  "key %*.*s with no DN\n",
+			  (int)key.length, (int)key.length,
+			  (char *)key.data);
+		talloc_free(msg);
+		return -1;
+	}
+
+	/* check if the DN key has changed, perhaps due to the case
+	   insensitivity of an element changing, or a change from DN
+	   to GUID keys */
+	key2 = ldb_kv_key_msg(module, msg, msg);
+	if (key2.data == NULL) {
+		/* probably a corrupt record ... darn */
+		ldb_debug(ldb, LDB_DEBUG_ERROR, "Invalid DN in re_index: %s",
+						ldb_dn_get_linearized(msg->dn));
+		talloc_free(msg);
+		return 0;
+	}
+	if (key.length != key2.length ||
+	    (memcmp(key.data, key2.data, key.length) != 0)) {
+		ldb_kv->kv_ops->update_in_iterate(
+		    ldb_kv, key, key2, val, ctx);
+	}
+	talloc_free(key2.data);
+
+	talloc_free(msg);
+
+	ctx->count++;
+	if (ctx->count % 10000 == 0) {
+		ldb_debug(ldb, LDB_DEBUG_WARNING,
+			  "Reindexing: re-keyed %u records so far",
+			  ctx->count);
+	}
+
+	return 0;
+}
+
+/*
+  count a re-indexed record, logging the progress every 10000 records
+*/
+static void ldb_kv_reindex_progress(struct ldb_context *ldb,
+				    struct ldb_kv_reindex_context *ctx)
+{
+	struct timeval now;
+	struct timeval elapsed;
+	double secs;
+
+	ctx->count++;
+	if (ctx->count % 10000 != 0) {
+		return;
+	}
+
+	now = tevent_timeval_current();
+	elapsed = tevent_timeval_until(&ctx->start, &now);
+	secs = elapsed.tv_sec + elapsed.tv_usec / 1000000.0;
+	if (secs <= 0) {
+		secs = 1;
+	}
+	ldb_debug(ldb, LDB_DEBUG_WARNING,
+		  "Reindexing: re-indexed %u records so far "
+		  "(%.0f records/s)",
+		  ctx->count,
+		  ctx->count / secs);
+}
+
+/*
+  add the @INDEX records for a record during a re index
+*/
+static int re_index_record(struct ldb_kv_private *ldb_kv,
+			   struct ldb_val key,
+			   struct ldb_val val,
+			   void *state)
+{
+	struct ldb_context *ldb;
+	struct ldb_kv_reindex_context *ctx =
+	    (struct ldb_kv_reindex_context *)state;
+	struct ldb_module *module = ldb_kv->module;
+	struct ldb_message *msg;
+	int ret;
+	bool is_record;
+
+	ldb = ldb_module_get_ctx(module);
+
+	is_record = ldb_kv_key_is_normal_record(key);
+	if (is_record == false) {
+		return 0;
+	}
+
+	msg = ldb_msg_new(module);
+	if (msg == NULL) {
+		return -1;
+	}
+
+	ret = ldb_unpack_data(ldb, &val, msg);
+	if (ret != 0) {
+		ldb_debug(ldb, LDB_DEBUG_ERROR, "Invalid data for index %s\n",
+						ldb_dn_get_linearized(msg->dn));
+		ctx->error = ret;
+		talloc_free(msg);
+		return -1;
+	}
+
+	if (msg->dn == NULL) {
+		ldb_debug(ldb, LDB_DEBUG_ERROR,
+			  "Refusing to re-index as GUID "
+			  "key %*.*s with no DN\n",
+			  (int)key.length, (int)key.length,
+			  (char *)key.data);
+		talloc_free(msg);
+		return -1;
+	}
+
+	ret = ldb_kv_index_onelevel(module, msg, 1);
+	if (ret != LDB_SUCCESS) {
+		ldb_debug(ldb, LDB_DEBUG_ERROR,
+			  "Adding special ONE LEVEL index failed (%s)!",
+						ldb_dn_get_linearized(msg->dn));
+		talloc_free(msg);
+		return -1;
+	}
+
+	ret = ldb_kv_index_subtree(module, msg, 1);
+	if (ret != LDB_SUCCESS) {
+		ldb_debug(ldb, LDB_DEBUG_ERROR,
+			  "Adding special SUBTREE index failed (%s)!",
+			  ldb_dn_get_linearized(msg->dn));
+		talloc_free(msg);
+		return -1;
+	}
+
+	ret = ldb_kv_index_add_all(module, ldb_kv, msg);
+
+	if (ret != LDB_SUCCESS) {
+		ctx->error = ret;
+		talloc_free(msg);
+		return -1;
+	}
+
+	talloc_free(msg);
+
+	ldb_kv_reindex_progress(ldb, ctx);
+
+	return 0;
+}
+
+#define LDB_KV_REINDEX_BATCH_SIZE 4096
+#define LDB_KV_MAX_REINDEX_WORKERS 64
+
+enum ldb_kv_reindex_key_type {
+	LDB_KV_REINDEX_KEY_ONE,
+	LDB_KV_REINDEX_KEY_DN,
+	LDB_KV_REINDEX_KEY_ATTR,
+};
+
+/*
+ * An index key of a record, worked out by a reindex worker
+ */
+struct ldb_kv_reindex_key {
+	enum ldb_kv_reindex_key_type type;
+	struct ldb_message_element *el;
+	/* the DN an @IDXONE or @IDXDN key was made from */
+	struct ldb_dn *dn;
+	struct ldb_dn *dn_key;
+	const struct ldb_schema_attribute *a;
+	enum key_truncation truncation;
+};
+
+struct ldb_kv_reindex_record {
+	struct ldb_val key;
+	struct ldb_val data;
+	/*
+	 * Set by the worker, or left NULL for re_index_record() to
+	 * index the record on the calling thread
+	 */
+	struct ldb_message *msg;
+	struct ldb_kv_reindex_key *keys;
+	unsigned int num_keys;
+};
+
+struct ldb_kv_reindex_worker {
+	struct ldb_kv_reindex_batch *batch;
+	/* this worker takes records n, n + num_workers, ... */
+	unsigned int n;
+	TALLOC_CTX *mem_ctx;
+	pthread_t thread;
+	bool thread_started;
+};
+
+struct ldb_kv_reindex_batch {
+	struct ldb_kv_private *ldb_kv;
+	TALLOC_CTX *data_ctx;
+	struct ldb_kv_reindex_record *records;
+	size_t num_records;
+	unsigned int num_workers;
+	struct ldb_kv_reindex_worker *workers;
+};
+
+/*
+  work out an @IDXONE or @IDXDN index key, as ldb_kv_modify_index_dn()
+  does
+*/
+static int ldb_kv_reindex_dn_key(struct ldb_kv_private *ldb_kv,
+				 TALLOC_CTX *mem_ctx,
+				 struct ldb_dn *dn,
+				 const char *index,
+				 struct ldb_kv_reindex_key *key)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(ldb_kv->module);
+	struct ldb_message_element *el = NULL;
+	const char *casefold = NULL;
+
+	casefold = ldb_dn_get_casefold(dn);
+	if (casefold == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	el = talloc_zero(mem_ctx, struct ldb_message_element);
+	if (el == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	el->values = talloc(el, struct ldb_val);
+	if (el->values == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	el->name = index;
+	el->values[0].data = discard_const_p(uint8_t, casefold);
+	el->values[0].length = strlen(casefold);
+	el->num_values = 1;
+
+	key->el = el;
+	key->dn = dn;
+	key->dn_key = ldb_kv_index_key_internal(ldb,
+						mem_ctx,
+						ldb_kv,
+						index,
+						&el->values[0],
+						&key->a,
+						&key->truncation,
+						false);
+	if (key->dn_key == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	return LDB_SUCCESS;
+}
+
+/*
+  unpack a record and work out its index keys, in the order that
+  re_index_record() would add them.
+
+  This runs on a reindex worker thread.  It allocates only on mem_ctx
+  and does not set the error string; any failure leaves the record to
+  re_index_record(), which will.  The ldb and ldb_kv are only read:
+  ldb_kv_reindex_flush() suspends the DN casefold cache around the
+  workers, and there are no workers if a schema override (which may
+  reload the schema) is set.
+*/
+static int ldb_kv_reindex_keys(struct ldb_kv_private *ldb_kv,
+			       TALLOC_CTX *mem_ctx,
+			       struct ldb_kv_reindex_record *rec)
+{
+	struct ldb_module *module = ldb_kv->module;
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	struct ldb_message *msg = NULL;
+	struct ldb_kv_reindex_key *keys = NULL;
+	unsigned int i, j, n = 0;
+	size_t max_keys = 2;
+	int ret;
+
+	msg = ldb_msg_new(mem_ctx);
+	if (msg == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	ret = ldb_unpack_data(ldb, &rec->data, msg);
+	if (ret != 0 || msg->dn == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
 	}
 
-	ret = ldb_kv_dn_list_load(module, ldb_kv, dn_key, list,
-				  DN_LIST_MUTABLE);
-	if (ret != LDB_SUCCESS && ret != LDB_ERR_NO_SUCH_OBJECT) {
-		talloc_free(list);
-		return ret;
+	for (i = 0; i < msg->num_elements; i++) {
+		max_keys += msg->elements[i].num_values;
+	}
+	keys = talloc_array(msg, struct ldb_kv_reindex_key, max_keys);
+	if (keys == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
 	}
 
-	/*
-	 * Check for duplicates in the @IDXDN DN -> GUID record
-	 *
-	 * This is very normal, it just means a duplicate DN creation
-	 * was attempted, so don't set the error string or print scary
-	 * messages.
-	 */
-	if (list->count > 0 &&
-	    ldb_attr_cmp(el->name, LDB_KV_IDXDN) == 0 &&
-	    truncation == KEY_NOT_TRUNCATED) {
+	/* As in ldb_kv_index_onelevel() */
+	if (ldb_kv->cache->one_level_indexes) {
+		struct ldb_dn *pdn = ldb_dn_get_parent(msg, msg->dn);
+		if (pdn == NULL) {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+		ret = ldb_kv_reindex_dn_key(ldb_kv,
+					    msg,
+					    pdn,
+					    LDB_KV_IDXONE,
+					    &keys[n]);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+		keys[n].type = LDB_KV_REINDEX_KEY_ONE;
+		n++;
+	}
 
-		talloc_free(list);
-		return LDB_ERR_CONSTRAINT_VIOLATION;
+	/* As in ldb_kv_index_add_all() */
+	if (ldb_dn_is_special(msg->dn)) {
+		goto done;
+	}
 
-	} else if (list->count > 0
-		   && ldb_attr_cmp(el->name, LDB_KV_IDXDN) == 0) {
+	if (ldb_kv->cache->GUID_index_attribute != NULL) {
+		ret = ldb_kv_reindex_dn_key(ldb_kv,
+					    msg,
+					    msg->dn,
+					    LDB_KV_IDXDN,
+					    &keys[n]);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+		keys[n].type = LDB_KV_REINDEX_KEY_DN;
+		n++;
+	}
 
-		/*
-		 * At least one existing entry in the DN->GUID index, which
-		 * arises when the DN indexes have been truncated
-		 *
-		 * So need to pull the DN's to check if it's really a duplicate
-		 */
-		unsigned int i;
-		for (i=0; i < list->count; i++) {
-			uint8_t guid_key[LDB_KV_GUID_KEY_SIZE];
-			struct ldb_val key = {
-				.data = guid_key,
-				.length = sizeof(guid_key)
-			};
-			const int flags = LDB_UNPACK_DATA_FLAG_NO_ATTRS;
-			struct ldb_message *rec = ldb_msg_new(ldb);
-			if (rec == NULL) {
-				return LDB_ERR_OPERATIONS_ERROR;
-			}
+	if (!ldb_kv->cache->attribute_indexes) {
+		goto done;
+	}
 
-			ret = ldb_kv_idx_to_key(
-			    module, ldb_kv, ldb, &list->dn[i], &key);
-			if (ret != LDB_SUCCESS) {
-				TALLOC_FREE(list);
-				TALLOC_FREE(rec);
-				return ret;
-			}
+	for (i = 0; i < msg->num_elements; i++) {
+		struct ldb_message_element *el = &msg->elements[i];
 
-			ret =
-			    ldb_kv_search_key(module, ldb_kv, key, rec, flags);
-			if (key.data != guid_key) {
-				TALLOC_FREE(key.data);
-			}
-			if (ret == LDB_ERR_NO_SUCH_OBJECT) {
-				/*
-				 * the record has disappeared?
-				 * yes, this can happen
-				 */
-				talloc_free(rec);
-				continue;
-			}
+		if (!ldb_kv_is_indexed(module, ldb_kv, el->name)) {
+			continue;
+		}
+		for (j = 0; j < el->num_values; j++) {
+			struct ldb_kv_reindex_key *key = &keys[n];
 
-			if (ret != LDB_SUCCESS) {
-				/* an internal error */
-				TALLOC_FREE(rec);
-				TALLOC_FREE(list);
+			*key = (struct ldb_kv_reindex_key) {
+				.type = LDB_KV_REINDEX_KEY_ATTR,
+				.el = el,
+				.truncation = KEY_TRUNCATED,
+			};
+			key->dn_key = ldb_kv_index_key_internal(
+				ldb,
+				msg,
+				ldb_kv,
+				el->name,
+				&el->values[j],
+				&key->a,
+				&key->truncation,
+				false);
+			if (key->dn_key == NULL) {
 				return LDB_ERR_OPERATIONS_ERROR;
 			}
-			/*
-			 * The DN we are trying to add to the DB and index
-			 * is already here, so we must deny the addition
-			 */
-			if (ldb_dn_compare(msg->dn, rec->dn) == 0) {
-				TALLOC_FREE(rec);
-				TALLOC_FREE(list);
-				return LDB_ERR_CONSTRAINT_VIOLATION;
-			}
+			n++;
 		}
 	}
 
-	/*
-	 * Check for duplicates in unique indexes
-	 *
-	 * We don't need to do a loop test like the @IDXDN case
-	 * above as we have a ban on long unique index values
-	 * at the start of this function.
-	 */
-	if (list->count > 0 &&
-	    ((a != NULL
-	      && (a->flags & LDB_ATTR_FLAG_UNIQUE_INDEX ||
-		  (el->flags & LDB_FLAG_INTERNAL_FORCE_UNIQUE_INDEX))))) {
-		/*
-		 * We do not want to print info about a possibly
-		 * confidential DN that the conflict was with in the
-		 * user-visible error string
-		 */
+done:
+	rec->keys = keys;
+	rec->num_keys = n;
+	rec->msg = msg;
+	return LDB_SUCCESS;
+}
 
-		if (ldb_kv->cache->GUID_index_attribute == NULL) {
-			ldb_debug(ldb, LDB_DEBUG_WARNING,
-				  __location__
-				  ": unique index violation on %s in %s, "
-				  "conflicts with %*.*s in %s",
-				  el->name, ldb_dn_get_linearized(msg->dn),
-				  (int)list->dn[0].length,
-				  (int)list->dn[0].length,
-				  list->dn[0].data,
-				  ldb_dn_get_linearized(dn_key));
-		} else {
-			/* This can't fail, gives a default at worst */
-			const struct ldb_schema_attribute *attr =
-			    ldb_schema_attribute_by_name(
-				ldb, ldb_kv->cache->GUID_index_attribute);
-			struct ldb_val v;
-			ret = attr->syntax->ldif_write_fn(ldb, list,
-							  &list->dn[0], &v);
-			if (ret == LDB_SUCCESS) {
-				ldb_debug(ldb,
-					  LDB_DEBUG_WARNING,
-					  __location__
-					  ": unique index violation on %s in "
-					  "%s, conflicts with %s %*.*s in %s",
-					  el->name,
-					  ldb_dn_get_linearized(msg->dn),
-					  ldb_kv->cache->GUID_index_attribute,
-					  (int)v.length,
-					  (int)v.length,
-					  v.data,
-					  ldb_dn_get_linearized(dn_key));
-			}
+static void *ldb_kv_reindex_worker(void *private_data)
+{
+	struct ldb_kv_reindex_worker *worker = private_data;
+	struct ldb_kv_reindex_batch *batch = worker->batch;
+	size_t i;
+
+	for (i = worker->n; i < batch->num_records; i += batch->num_workers) {
+		struct ldb_kv_reindex_record *rec = &batch->records[i];
+		int ret;
+
+		ret = ldb_kv_reindex_keys(batch->ldb_kv, worker->mem_ctx, rec);
+		if (ret != LDB_SUCCESS) {
+			rec->msg = NULL;
+			rec->num_keys = 0;
 		}
-		ldb_asprintf_errstring(ldb,
-				       __location__ ": unique index violation "
-				       "on %s in %s",
-				       el->name,
-				       ldb_dn_get_linearized(msg->dn));
-		talloc_free(list);
-		return LDB_ERR_CONSTRAINT_VIOLATION;
 	}
+	return NULL;
+}
 
-	/* overallocate the list a bit, to reduce the number of
-	 * realloc triggered copies */
-	alloc_len = ((list->count+1)+7) & ~7;
-	list->dn = talloc_realloc(list, list->dn, struct ldb_val, alloc_len);
-	if (list->dn == NULL) {
-		talloc_free(list);
-		return LDB_ERR_OPERATIONS_ERROR;
-	}
+/*
+  add the index keys a worker found for a record, reporting errors
+  as re_index_record() would
+*/
+static int ldb_kv_reindex_add_keys(struct ldb_kv_private *ldb_kv,
+				   struct ldb_kv_reindex_context *ctx,
+				   struct ldb_kv_reindex_record *rec)
+{
+	struct ldb_module *module = ldb_kv->module;
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	unsigned int i;
+	int ret;
 
-	if (ldb_kv->cache->GUID_index_attribute == NULL) {
-		const char *dn_str = ldb_dn_get_linearized(msg->dn);
-		list->dn[list->count].data
-			= (uint8_t *)talloc_strdup(list->dn, dn_str);
-		if (list->dn[list->count].data == NULL) {
-			talloc_free(list);
-			return LDB_ERR_OPERATIONS_ERROR;
-		}
-		list->dn[list->count].length = strlen(dn_str);
-	} else {
-		const struct ldb_val *key_val;
-		struct ldb_val *exact = NULL, *next = NULL;
-		key_val = ldb_msg_find_ldb_val(
-		    msg, ldb_kv->cache->GUID_index_attribute);
-		if (key_val == NULL) {
-			talloc_free(list);
-			return ldb_module_operr(module);
+	for (i = 0; i < rec->num_keys; i++) {
+		struct ldb_kv_reindex_key *key = &rec->keys[i];
+
+		ret = ldb_kv_index_add1_key(module,
+					    ldb_kv,
+					    rec->msg,
+					    key->el,
+					    key->dn_key,
+					    key->a,
+					    key->truncation);
+		if (ret == LDB_SUCCESS) {
+			continue;
 		}
 
-		if (key_val->length != LDB_KV_GUID_SIZE) {
-			talloc_free(list);
-			return ldb_module_operr(module);
+		if (key->type == LDB_KV_REINDEX_KEY_ATTR) {
+			ldb_asprintf_errstring(ldb,
+					       __location__ ": Failed to re-index %s in %s - %s",
+					       key->el->name,
+					       ldb_dn_get_linearized(rec->msg->dn),
+					       ldb_errstring(ldb));
+			ctx->error = ret;
+			return -1;
 		}
 
-		BINARY_ARRAY_SEARCH_GTE(list->dn, list->count,
-					*key_val, ldb_val_equal_exact_ordered,
-					exact, next);
+		ldb_asprintf_errstring(ldb,
+				       __location__ ": Failed to modify %s "
+						    "against %s in %s - %s",
+				       key->el->name,
+				       ldb_kv->cache->GUID_index_attribute,
+				       ldb_dn_get_linearized(key->dn),
+				       ldb_errstring(ldb));
 
-		/*
-		 * Give a warning rather than fail, this could be a
-		 * duplicate value in the record allowed by a caller
-		 * forcing in the value with
-		 * LDB_FLAG_INTERNAL_DISABLE_SINGLE_VALUE_CHECK
-		 */
-		if (exact != NULL && truncation == KEY_NOT_TRUNCATED) {
-			/* This can't fail, gives a default at worst */
-			const struct ldb_schema_attribute *attr =
-			    ldb_schema_attribute_by_name(
-				ldb, ldb_kv->cache->GUID_index_attribute);
-			struct ldb_val v;
-			ret = attr->syntax->ldif_write_fn(ldb, list,
-							  exact, &v);
-			if (ret == LDB_SUCCESS) {
-				ldb_debug(ldb,
-					  LDB_DEBUG_WARNING,
-					  __location__
-					  ": duplicate attribute value in %s "
-					  "for index on %s, "
-					  "duplicate of %s %*.*s in %s",
-					  ldb_dn_get_linearized(msg->dn),
-					  el->name,
-					  ldb_kv->cache->GUID_index_attribute,
-					  (int)v.length,
-					  (int)v.length,
-					  v.data,
-					  ldb_dn_get_linearized(dn_key));
-			}
+		if (key->type == LDB_KV_REINDEX_KEY_ONE) {
+			ldb_debug(ldb, LDB_DEBUG_ERROR,
+				  "Adding special ONE LEVEL index failed (%s)!",
+				  ldb_dn_get_linearized(rec->msg->dn));
+			return -1;
 		}
 
-		if (next == NULL) {
-			next = &list->dn[list->count];
-		} else {
-			memmove(&next[1], next,
-				sizeof(*next) * (list->count - (next - list->dn)));
-		}
-		*next = ldb_val_dup(list->dn, key_val);
-		if (next->data == NULL) {
-			talloc_free(list);
-			return ldb_module_operr(module);
+		if (ret == LDB_ERR_CONSTRAINT_VIOLATION) {
+			ldb_asprintf_errstring(ldb,
+					       "Entry %s already exists",
+					       ldb_dn_get_linearized(rec->msg->dn));
+			ret = LDB_ERR_ENTRY_ALREADY_EXISTS;
 		}
+		ctx->error = ret;
+		return -1;
+	}
+
+	/*
+	 * The subtree, presence and substring index keys are left to
+	 * this thread
+	 */
+	ret = ldb_kv_index_subtree(module, rec->msg, 1);
+	if (ret == LDB_SUCCESS) {
+		ret = ldb_kv_index_presence_all(module, ldb_kv, rec->msg);
+	}
+	if (ret == LDB_SUCCESS) {
+		ret = ldb_kv_index_substr_all(module, ldb_kv, rec->msg);
+	}
+	if (ret != LDB_SUCCESS) {
+		ctx->error = ret;
+		return -1;
 	}
-	list->count++;
-
-	ret = ldb_kv_dn_list_store(module, dn_key, list);
 
-	talloc_free(list);
-
-	return ret;
+	ldb_kv_reindex_progress(ldb, ctx);
+	return 0;
 }
 
 /*
-  add index entries for one elements in a message
- */
-static int ldb_kv_index_add_el(struct ldb_module *module,
-			       struct ldb_kv_private *ldb_kv,
-			       const struct ldb_message *msg,
-			       struct ldb_message_element *el)
+  unpack the queued records and work out their index keys on the
+  reindex workers, then add the keys to the index cache in record
+  order on this thread
+*/
+static int ldb_kv_reindex_flush(struct ldb_kv_private *ldb_kv,
+				struct ldb_kv_reindex_context *ctx)
 {
+	struct ldb_kv_reindex_batch *batch = ctx->batch;
 	unsigned int i;
-	for (i = 0; i < el->num_values; i++) {
-		int ret = ldb_kv_index_add1(module, ldb_kv, msg, el, i);
-		if (ret != LDB_SUCCESS) {
-			return ret;
+	size_t r;
+	int ret = 0;
+
+	ldb_dn_casefold_cache_suspend(ldb_module_get_ctx(ldb_kv->module));
+	for (i = 0; i < batch->num_workers; i++) {
+		struct ldb_kv_reindex_worker *worker = &batch->workers[i];
+
+		worker->mem_ctx = talloc_new(NULL);
+		if (worker->mem_ctx == NULL) {
+			break;
 		}
+		if (pthread_create(&worker->thread,
+				   NULL,
+				   ldb_kv_reindex_worker,
+				   worker) != 0) {
+			break;
+		}
+		worker->thread_started = true;
 	}
+	for (i = 0; i < batch->num_workers; i++) {
+		struct ldb_kv_reindex_worker *worker = &batch->workers[i];
 
-	return LDB_SUCCESS;
-}
+		if (worker->thread_started) {
+			pthread_join(worker->thread, NULL);
+			worker->thread_started = false;
+		}
+	}
+	ldb_dn_casefold_cache_resume(ldb_module_get_ctx(ldb_kv->module));
 
-/*
-  add index entries for all elements in a message
- */
-static int ldb_kv_index_add_all(struct ldb_module *module,
-				struct ldb_kv_private *ldb_kv,
-				const struct ldb_message *msg)
-{
-	struct ldb_message_element *elements = msg->elements;
-	unsigned int i;
-	const char *dn_str;
-	int ret;
+	/*
+	 * Any records a worker did not get to, or failed on, are
+	 * indexed here as they would be without the workers.
+	 */
+	for (r = 0; r < batch->num_records && ret == 0; r++) {
+		struct ldb_kv_reindex_record *rec = &batch->records[r];
 
-	if (ldb_dn_is_special(msg->dn)) {
-		return LDB_SUCCESS;
+		if (rec->msg == NULL) {
+			ret = re_index_record(ldb_kv, rec->key, rec->data, ctx);
+		} else {
+			ret = ldb_kv_reindex_add_keys(ldb_kv, ctx, rec);
+		}
 	}
 
-	dn_str = ldb_dn_get_linearized(msg->dn);
-	if (dn_str == NULL) {
-		return LDB_ERR_OPERATIONS_ERROR;
+	for (i = 0; i < batch->num_workers; i++) {
+		TALLOC_FREE(batch->workers[i].mem_ctx);
 	}
+	TALLOC_FREE(batch->data_ctx);
+	batch->num_records = 0;
+	return ret;
+}
 
-	ret = ldb_kv_write_index_dn_guid(module, msg, 1);
-	if (ret != LDB_SUCCESS) {
-		return ret;
-	}
+/*
+  queue a record for the reindex workers
+*/
+static int ldb_kv_reindex_queue(struct ldb_kv_private *ldb_kv,
+				struct ldb_kv_reindex_context *ctx,
+				struct ldb_val key,
+				struct ldb_val val)
+{
+	struct ldb_kv_reindex_batch *batch = ctx->batch;
+	struct ldb_kv_reindex_record *rec = NULL;
 
-	if (!ldb_kv->cache->attribute_indexes) {
-		/* no indexed fields */
-		return LDB_SUCCESS;
+	if (batch->data_ctx == NULL) {
+		batch->data_ctx = talloc_new(batch);
+		if (batch->data_ctx == NULL) {
+			ctx->error = LDB_ERR_OPERATIONS_ERROR;
+			return -1;
+		}
 	}
 
-	for (i = 0; i < msg->num_elements; i++) {
-		if (!ldb_kv_is_indexed(module, ldb_kv, elements[i].name)) {
-			continue;
-		}
-		ret = ldb_kv_index_add_el(module, ldb_kv, msg, &elements[i]);
-		if (ret != LDB_SUCCESS) {
-			struct ldb_context *ldb = ldb_module_get_ctx(module);
-			ldb_asprintf_errstring(ldb,
-					       __location__ ": Failed to re-index %s in %s - %s",
-					       elements[i].name, dn_str,
-					       ldb_errstring(ldb));
-			return ret;
-		}
+	rec = &batch->records[batch->num_records];
+	*rec = (struct ldb_kv_reindex_record) {
+		.key.length = key.length,
+		.data.length = val.length,
+	};
+	/*
+	 * The key is a string (with the terminating NUL) for a DN
+	 * keyed record, so copy it as it is
+	 */
+	rec->key.data = talloc_memdup(batch->data_ctx, key.data, key.length);
+	rec->data.data = talloc_memdup(batch->data_ctx, val.data, val.length);
+	if ((key.length > 0 && rec->key.data == NULL) ||
+	    (val.length > 0 && rec->data.data == NULL)) {
+		ctx->error = LDB_ERR_OPERATIONS_ERROR;
+		return -1;
 	}
+	batch->num_records++;
 
-	return LDB_SUCCESS;
+	if (batch->num_records == LDB_KV_REINDEX_BATCH_SIZE) {
+		return ldb_kv_reindex_flush(ldb_kv, ctx);
+	}
+	return 0;
 }
 
-
 /*
-  insert a DN index for a message
+  set up the reindex workers, if asked for
 */
-static int ldb_kv_modify_index_dn(struct ldb_module *module,
-				  struct ldb_kv_private *ldb_kv,
-				  const struct ldb_message *msg,
-				  struct ldb_dn *dn,
-				  const char *index,
-				  int add)
+static struct ldb_kv_reindex_batch *ldb_kv_reindex_batch_new(
+	struct ldb_kv_private *ldb_kv)
 {
-	struct ldb_message_element el;
-	struct ldb_val val;
-	int ret;
+	struct ldb_context *ldb = NULL;
+	struct ldb_kv_reindex_batch *batch = NULL;
+	unsigned int i;
 
-	val.data = (uint8_t *)((uintptr_t)ldb_dn_get_casefold(dn));
-	if (val.data == NULL) {
-		const char *dn_str = ldb_dn_get_linearized(dn);
-		ldb_asprintf_errstring(ldb_module_get_ctx(module),
-				       __location__ ": Failed to modify %s "
-						    "against %s in %s: failed "
-						    "to get casefold DN",
-				       index,
-				       ldb_kv->cache->GUID_index_attribute,
-				       dn_str);
-		return LDB_ERR_OPERATIONS_ERROR;
+	if (ldb_kv->reindex_workers < 2) {
+		return NULL;
 	}
 
-	val.length = strlen((char *)val.data);
-	el.name = index;
-	el.values = &val;
-	el.num_values = 1;
-
-	if (add) {
-		ret = ldb_kv_index_add1(module, ldb_kv, msg, &el, 0);
-	} else { /* delete */
-		ret = ldb_kv_index_del_value(module, ldb_kv, msg, &el, 0);
+	/*
+	 * The schema is looked up on the workers, which is only
+	 * read-only without an override
+	 */
+	ldb = ldb_module_get_ctx(ldb_kv->module);
+	if (ldb->schema.attribute_handler_override != NULL) {
+		return NULL;
 	}
 
-	if (ret != LDB_SUCCESS) {
-		struct ldb_context *ldb = ldb_module_get_ctx(module);
-		const char *dn_str = ldb_dn_get_linearized(dn);
-		ldb_asprintf_errstring(ldb,
-				       __location__ ": Failed to modify %s "
-						    "against %s in %s - %s",
-				       index,
-				       ldb_kv->cache->GUID_index_attribute,
-				       dn_str,
-				       ldb_errstring(ldb));
-		return ret;
+	batch = talloc_zero(ldb_kv, struct ldb_kv_reindex_batch);
+	if (batch == NULL) {
+		return NULL;
 	}
-	return ret;
+	batch->ldb_kv = ldb_kv;
+	batch->num_workers = MIN(ldb_kv->reindex_workers,
+				 LDB_KV_MAX_REINDEX_WORKERS);
+	batch->records = talloc_zero_array(batch,
+					   struct ldb_kv_reindex_record,
+					   LDB_KV_REINDEX_BATCH_SIZE);
+	batch->workers = talloc_zero_array(batch,
+					   struct ldb_kv_reindex_worker,
+					   batch->num_workers);
+	if (batch->records == NULL || batch->workers == NULL) {
+		TALLOC_FREE(batch);
+		return NULL;
+	}
+	for (i = 0; i < batch->num_workers; i++) {
+		batch->workers[i].batch = batch;
+		batch->workers[i].n = i;
+	}
+	return batch;
 }
 
 /*
-  insert a one level index for a message
+  traversal function that adds @INDEX records during a re index
 */
-static int ldb_kv_index_onelevel(struct ldb_module *module,
-				 const struct ldb_message *msg,
-				 int add)
+static int re_index(struct ldb_kv_private *ldb_kv,
+		    struct ldb_val key,
+		    struct ldb_val val,
+		    void *state)
 {
-	struct ldb_kv_private *ldb_kv = talloc_get_type(
-	    ldb_module_get_private(module), struct ldb_kv_private);
-	struct ldb_dn *pdn;
-	int ret;
+	struct ldb_kv_reindex_context *ctx =
+	    (struct ldb_kv_reindex_context *)state;
 
-	/* We index for ONE Level only if requested */
-	if (!ldb_kv->cache->one_level_indexes) {
-		return LDB_SUCCESS;
+	if (ctx->batch == NULL) {
+		return re_index_record(ldb_kv, key, val, state);
 	}
 
-	pdn = ldb_dn_get_parent(module, msg->dn);
-	if (pdn == NULL) {
-		return LDB_ERR_OPERATIONS_ERROR;
+	if (ldb_kv_key_is_normal_record(key) == false) {
+		return 0;
 	}
-	ret =
-	    ldb_kv_modify_index_dn(module, ldb_kv, msg, pdn, LDB_KV_IDXONE, add);
-
-	talloc_free(pdn);
 
-	return ret;
+	return ldb_kv_reindex_queue(ldb_kv, ctx, key, val);
 }
 
 /*
-  insert a one level index for a message
-*/
-static int ldb_kv_write_index_dn_guid(struct ldb_module *module,
-				      const struct ldb_message *msg,
-				      int add)
+ * Convert the 4-byte pack format version to a number that's slightly
+ * more intelligible to a user e.g. version 0, 1, 2, etc.
+ */
+static uint32_t displayable_pack_version(uint32_t version) {
+	if (version < LDB_PACKING_FORMAT_NODN) {
+		return version; /* unknown - can't convert */
+	}
+
+	return (version - LDB_PACKING_FORMAT_NODN);
+}
+
+static int re_pack(struct ldb_kv_private *ldb_kv,
+		   _UNUSED_ struct ldb_val key,
+		   struct ldb_val val,
+		   void *state)
 {
+	struct ldb_context *ldb;
+	struct ldb_message *msg;
+	struct ldb_module *module = ldb_kv->module;
+	struct ldb_kv_repack_context *ctx =
+	    (struct ldb_kv_repack_context *)state;
 	int ret;
-	struct ldb_kv_private *ldb_kv = talloc_get_type(
-	    ldb_module_get_private(module), struct ldb_kv_private);
 
-	/* We index for DN only if using a GUID index */
-	if (ldb_kv->cache->GUID_index_attribute == NULL) {
-		return LDB_SUCCESS;
+	ldb = ldb_module_get_ctx(module);
+
+	msg = ldb_msg_new(module);
+	if (msg == NULL) {
+		return -1;
 	}
 
-	ret = ldb_kv_modify_index_dn(
-	    module, ldb_kv, msg, msg->dn, LDB_KV_IDXDN, add);
+	ret = ldb_unpack_data(ldb, &val, msg);
+	if (ret != 0) {
+		ldb_debug(ldb, LDB_DEBUG_ERROR, "Repack: unpack failed: %s\n",
+			  ldb_dn_get_linearized(msg->dn));
+		ctx->error = ret;
+		talloc_free(msg);
+		return -1;
+	}
 
-	if (ret == LDB_ERR_CONSTRAINT_VIOLATION) {
-		ldb_asprintf_errstring(ldb_module_get_ctx(module),
-				       "Entry %s already exists",
-				       ldb_dn_get_linearized(msg->dn));
-		ret = LDB_ERR_ENTRY_ALREADY_EXISTS;
+	ret = ldb_kv_store(module, msg, TDB_MODIFY);
+	if (ret != LDB_SUCCESS) {
+		ldb_debug(ldb, LDB_DEBUG_ERROR, "Repack: store failed: %s\n",
+			  ldb_dn_get_linearized(msg->dn));
+		ctx->error = ret;
+		talloc_free(msg);
+		return -1;
 	}
-	return ret;
-}
 
-/*
-  add the index entries for a new element in a record
-  The caller guarantees that these element values are not yet indexed
-*/
-int ldb_kv_index_add_element(struct ldb_module *module,
-			     struct ldb_kv_private *ldb_kv,
-			     const struct ldb_message *msg,
-			     struct ldb_message_element *el)
-{
-	if (ldb_dn_is_special(msg->dn)) {
-		return LDB_SUCCESS;
+	/*
+	 * Warn the user that we're repacking the first time we see a normal
+	 * record. This means we never warn if we're repacking a database with
+	 * only @ records. This is because during database initialisation,
+	 * we might repack as initial settings are written out, and we don't
+	 * want to spam the log.
+	 */
+	if ((!ctx->normal_record_seen) && (!ldb_dn_is_special(msg->dn))) {
+		ldb_debug(ldb, LDB_DEBUG_ALWAYS_LOG,
+			  "Repacking database from v%u to v%u format "
+			  "(first record %s)",
+			  displayable_pack_version(ctx->old_version),
+			  displayable_pack_version(ldb_kv->pack_format_version),
+			  ldb_dn_get_linearized(msg->dn));
+		ctx->normal_record_seen = true;
 	}
-	if (!ldb_kv_is_indexed(module, ldb_kv, el->name)) {
-		return LDB_SUCCESS;
+
+	ctx->count++;
+	if (ctx->count % 10000 == 0) {
+		ldb_debug(ldb, LDB_DEBUG_WARNING,
+			  "Repack: re-packed %u records so far",
+			  ctx->count);
 	}
-	return ldb_kv_index_add_el(module, ldb_kv, msg, el);
+
+	talloc_free(msg);
+	return 0;
 }
 
-/*
-  add the index entries for a new record
-*/
-int ldb_kv_index_add_new(struct ldb_module *module,
-			 struct ldb_kv_private *ldb_kv,
-			 const struct ldb_message *msg)
+int ldb_kv_repack(struct ldb_module *module)
 {
+	struct ldb_kv_private *ldb_kv = talloc_get_type(
+	    ldb_module_get_private(module), struct ldb_kv_private);
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	struct ldb_kv_repack_context ctx;
 	int ret;
 
-	if (ldb_dn_is_special(msg->dn)) {
-		return LDB_SUCCESS;
-	}
+	ctx.old_version = ldb_kv->pack_format_version;
+	ctx.count = 0;
+	ctx.error = LDB_SUCCESS;
+	ctx.normal_record_seen = false;
 
-	ret = ldb_kv_index_add_all(module, ldb_kv, msg);
-	if (ret != LDB_SUCCESS) {
-		/*
-		 * Because we can't trust the caller to be doing
-		 * transactions properly, clean up any index for this
-		 * entry rather than relying on a transaction
-		 * cleanup
-		 */
+	ldb_kv->pack_format_version = ldb_kv->target_pack_format_version;
 
-		ldb_kv_index_delete(module, msg);
-		return ret;
+	/* Iterate all database records and repack them in the new format */
+	ret = ldb_kv->kv_ops->iterate(ldb_kv, re_pack, &ctx);
+	if (ret < 0) {
+		ldb_debug(ldb, LDB_DEBUG_ERROR, "Repack traverse failed: %s",
+			  ldb_errstring(ldb));
+		return LDB_ERR_OPERATIONS_ERROR;
 	}
 
-	ret = ldb_kv_index_onelevel(module, msg, 1);
-	if (ret != LDB_SUCCESS) {
-		/*
-		 * Because we can't trust the caller to be doing
-		 * transactions properly, clean up any index for this
-		 * entry rather than relying on a transaction
-		 * cleanup
-		 */
-		ldb_kv_index_delete(module, msg);
-		return ret;
+	if (ctx.error != LDB_SUCCESS) {
+		ldb_debug(ldb, LDB_DEBUG_ERROR, "Repack failed: %s",
+			  ldb_errstring(ldb));
+		return ctx.error;
 	}
-	return ret;
-}
 
+	return LDB_SUCCESS;
+}
 
 /*
-  delete an index entry for one message element
+  force a complete reindex of the database
 */
-int ldb_kv_index_del_value(struct ldb_module *module,
-			   struct ldb_kv_private *ldb_kv,
-			   const struct ldb_message *msg,
-			   struct ldb_message_element *el,
-			   unsigned int v_idx)
+int ldb_kv_reindex(struct ldb_module *module)
 {
-	struct ldb_context *ldb;
-	struct ldb_dn *dn_key;
-	const char *dn_str;
-	int ret, i;
-	unsigned int j;
-	struct dn_list *list;
-	struct ldb_dn *dn = msg->dn;
-	enum key_truncation truncation = KEY_NOT_TRUNCATED;
+	struct ldb_kv_private *ldb_kv = talloc_get_type(
+	    ldb_module_get_private(module), struct ldb_kv_private);
+	int ret;
+	struct ldb_kv_reindex_context ctx;
+	size_t index_cache_size = 0;
 
-	ldb = ldb_module_get_ctx(module);
+	/*
+	 * Only triggered after a modification, but make clear we do
+	 * not re-index a read-only DB
+	 */
+	if (ldb_kv->read_only) {
+		return LDB_ERR_UNWILLING_TO_PERFORM;
+	}
 
-	dn_str = ldb_dn_get_linearized(dn);
-	if (dn_str == NULL) {
+	if (ldb_kv_cache_reload(module) != 0) {
 		return LDB_ERR_OPERATIONS_ERROR;
 	}
 
-	if (dn_str[0] == '@') {
-		return LDB_SUCCESS;
+	/*
+	 * Ensure we read (and so remove) the entries from the real
+	 * DB, no values stored so far are any use as we want to do a
+	 * re-index
+	 */
+	ldb_kv_index_transaction_cancel(module);
+	if (ldb_kv->nested_idx_ptr != NULL) {
+		ldb_kv_index_sub_transaction_cancel(ldb_kv);
 	}
 
 	/*
-	 * ldb is being used as the memory context to ldb_kv_index_key
-	 * as dn_key itself is also used as the TALLOC_CTX for the
-	 * rest of this function.
+	 * Calculate the size of the index cache needed for
+	 * the re-index. If specified always use the
+	 * ldb_kv->index_transaction_cache_size otherwise use the maximum
+	 * of the size estimate or the DEFAULT_INDEX_CACHE_SIZE
 	 */
-	dn_key = ldb_kv_index_key(ldb,
-				  ldb,
-				  ldb_kv,
-				  el->name,
-				  &el->values[v_idx],
-				  NULL,
-				  &truncation);
+	if (ldb_kv->index_transaction_cache_size > 0) {
+		index_cache_size = ldb_kv->index_transaction_cache_size;
+	} else {
+		index_cache_size = ldb_kv->kv_ops->get_size(ldb_kv);
+		if (index_cache_size < DEFAULT_INDEX_CACHE_SIZE) {
+			index_cache_size = DEFAULT_INDEX_CACHE_SIZE;
+		}
+	}
+
 	/*
-	 * We ignore key truncation in ltdb_index_add1() so
-	 * match that by ignoring it here as well
-	 *
-	 * Multiple values are legitimate and accepted
+	 * Note that we don't start an index sub transaction for re-indexing
 	 */
-	if (!dn_key) {
-		return LDB_ERR_OPERATIONS_ERROR;
+	ret = ldb_kv_index_transaction_start(module, index_cache_size);
+	if (ret != LDB_SUCCESS) {
+		return ret;
 	}
 
-	list = talloc_zero(dn_key, struct dn_list);
-	if (list == NULL) {
-		talloc_free(dn_key);
+	/*
+	 * Every index record is rewritten, so the statistics are
+	 * rebuilt from scratch in the transaction commit
+	 */
+	ldb_kv->idxptr->stats_reset = true;
+
+	/*
+	 * Every record is added to the index lists, so append to
+	 * them and sort each list once, rather than keeping them in
+	 * order as each record is added
+	 */
+	ldb_kv->idxptr->append = true;
+
+	/* first traverse the database deleting any @INDEX records by
+	 * putting NULL entries in the in-memory index cache
+	 */
+	ret = ldb_kv->kv_ops->iterate(ldb_kv, delete_index, module);
+	if (ret < 0) {
+		struct ldb_context *ldb = ldb_module_get_ctx(module);
+		ldb_asprintf_errstring(ldb, "index deletion traverse failed: %s",
+				       ldb_errstring(ldb));
 		return LDB_ERR_OPERATIONS_ERROR;
 	}
 
-	ret = ldb_kv_dn_list_load(module, ldb_kv, dn_key, list,
-				  DN_LIST_MUTABLE);
-	if (ret == LDB_ERR_NO_SUCH_OBJECT) {
-		/* it wasn't indexed. Did we have an earlier error? If we did then
-		   its gone now */
-		talloc_free(dn_key);
-		return LDB_SUCCESS;
+	ctx.error = 0;
+	ctx.count = 0;
+	ctx.batch = NULL;
+
+	ret = ldb_kv->kv_ops->iterate(ldb_kv, re_key, &ctx);
+	if (ret < 0) {
+		struct ldb_context *ldb = ldb_module_get_ctx(module);
+		ldb_asprintf_errstring(ldb, "key correction traverse failed: %s",
+				       ldb_errstring(ldb));
+		return LDB_ERR_OPERATIONS_ERROR;
 	}
 
-	if (ret != LDB_SUCCESS) {
-		talloc_free(dn_key);
-		return ret;
+	if (ctx.error != LDB_SUCCESS) {
+		struct ldb_context *ldb = ldb_module_get_ctx(module);
+		ldb_asprintf_errstring(ldb, "reindexing failed: %s", ldb_errstring(ldb));
+		return ctx.error;
 	}
 
+	ctx.error = 0;
+	ctx.count = 0;
+	ctx.start = tevent_timeval_current();
+
 	/*
-	 * Find one of the values matching this message to remove
+	 * If asked for, records are unpacked and their index keys
+	 * worked out on worker threads, in batches.  The keys are
+	 * still added on this thread, in the order the records are
+	 * traversed.
 	 */
-	i = ldb_kv_dn_list_find_msg(ldb_kv, list, msg);
-	if (i == -1) {
-		/* nothing to delete */
-		talloc_free(dn_key);
-		return LDB_SUCCESS;
+	ctx.batch = ldb_kv_reindex_batch_new(ldb_kv);
+
+	/* now traverse adding any indexes for normal LDB records */
+	ret = ldb_kv->kv_ops->iterate(ldb_kv, re_index, &ctx);
+	if (ret >= 0 && ctx.batch != NULL && ctx.error == LDB_SUCCESS) {
+		if (ldb_kv_reindex_flush(ldb_kv, &ctx) != 0) {
+			ret = -1;
+		}
+	}
+	TALLOC_FREE(ctx.batch);
+	if (ret < 0) {
+		struct ldb_context *ldb = ldb_module_get_ctx(module);
+		ldb_asprintf_errstring(ldb, "reindexing traverse failed: %s",
+				       ldb_errstring(ldb));
+		return LDB_ERR_OPERATIONS_ERROR;
 	}
 
-	j = (unsigned int) i;
-	ARRAY_DEL_ELEMENT(list->dn, j, list->count);
-	list->count--;
-	if (list->count == 0) {
-		talloc_free(list->dn);
-		list->dn = NULL;
-	} else {
-		list->dn = talloc_realloc(list, list->dn, struct ldb_val, list->count);
+	if (ctx.error != LDB_SUCCESS) {
+		struct ldb_context *ldb = ldb_module_get_ctx(module);
+		ldb_asprintf_errstring(ldb, "reindexing failed: %s", ldb_errstring(ldb));
+		return ctx.error;
 	}
 
-	ret = ldb_kv_dn_list_store(module, dn_key, list);
+	ldb_kv->idxptr->objects_delta = ctx.count;
 
-	talloc_free(dn_key);
+	if (ctx.count > 10000) {
+		ldb_debug(ldb_module_get_ctx(module),
+			  LDB_DEBUG_WARNING,
+			  "Reindexing: re_index successful on %s, "
+			  "final index write-out will be in transaction commit",
+			  ldb_kv->kv_ops->name(ldb_kv));
+	}
+	return LDB_SUCCESS;
+}
 
-	return ret;
+/*
+ * The attributes added to or removed from @IDXATTR by a change to
+ * @INDEXLIST
+ */
+struct ldb_kv_reindex_delta {
+	struct ldb_module *module;
+	/* as given in @IDXATTR */
+	const char **added;
+	unsigned int num_added;
+	/* casefolded, as in the index keys */
+	const char **removed;
+	unsigned int num_removed;
+	struct ldb_kv_reindex_context ctx;
+};
+
+static bool ldb_kv_idxattr_has(const struct ldb_message_element *el,
+			       const char *attr)
+{
+	unsigned int i;
+
+	if (el == NULL) {
+		return false;
+	}
+	for (i = 0; i < el->num_values; i++) {
+		if (ldb_attr_cmp((const char *)el->values[i].data, attr) == 0) {
+			return true;
+		}
+	}
+	return false;
 }
 
 /*
-  delete the index entries for a element
-  return -1 on failure
+  work out which attributes were added to or removed from @IDXATTR.
+
+  Returns false if anything else in @INDEXLIST changed, or nothing
+  did, when only a full re-index will do.  So does removing an
+  attribute while @IDX_PRESENCE is set, as its @IDXPRESENT record is
+  not found by ldb_kv_reindex_delta_removed().
 */
-int ldb_kv_index_del_element(struct ldb_module *module,
-			     struct ldb_kv_private *ldb_kv,
-			     const struct ldb_message *msg,
-			     struct ldb_message_element *el)
+static bool ldb_kv_reindex_delta_init(TALLOC_CTX *mem_ctx,
+				      const struct ldb_message *old_list,
+				      const struct ldb_message *new_list,
+				      struct ldb_kv_reindex_delta *delta)
 {
-	const char *dn_str;
-	int ret;
+	const struct ldb_message_element *old_attrs = NULL;
+	const struct ldb_message_element *new_attrs = NULL;
 	unsigned int i;
 
-	if (!ldb_kv->cache->attribute_indexes) {
-		/* no indexed fields */
-		return LDB_SUCCESS;
+	if (old_list->num_elements != new_list->num_elements) {
+		return false;
 	}
+	for (i = 0; i < old_list->num_elements; i++) {
+		const struct ldb_message_element *el = &old_list->elements[i];
+		const struct ldb_message_element *el2 = NULL;
 
-	dn_str = ldb_dn_get_linearized(msg->dn);
-	if (dn_str == NULL) {
-		return LDB_ERR_OPERATIONS_ERROR;
+		el2 = ldb_msg_find_element(new_list, el->name);
+		if (el2 == NULL) {
+			return false;
+		}
+		if (ldb_attr_cmp(el->name, LDB_KV_IDXATTR) == 0) {
+			old_attrs = el;
+			new_attrs = el2;
+			continue;
+		}
+		if (!ldb_msg_element_equal_ordered(el, el2)) {
+			return false;
+		}
+	}
+	if (old_attrs == NULL) {
+		return false;
+	}
+
+	delta->added = talloc_array(mem_ctx, const char *,
+				    new_attrs->num_values);
+	delta->removed = talloc_array(mem_ctx, const char *,
+				      old_attrs->num_values);
+	if (delta->added == NULL || delta->removed == NULL) {
+		return false;
 	}
 
-	if (dn_str[0] == '@') {
-		return LDB_SUCCESS;
-	}
+	for (i = 0; i < new_attrs->num_values; i++) {
+		const char *attr = (const char *)new_attrs->values[i].data;
 
-	if (!ldb_kv_is_indexed(module, ldb_kv, el->name)) {
-		return LDB_SUCCESS;
+		if (!ldb_kv_idxattr_has(old_attrs, attr)) {
+			delta->added[delta->num_added++] = attr;
+		}
 	}
-	for (i = 0; i < el->num_values; i++) {
-		ret = ldb_kv_index_del_value(module, ldb_kv, msg, el, i);
-		if (ret != LDB_SUCCESS) {
-			return ret;
+	for (i = 0; i < old_attrs->num_values; i++) {
+		const char *attr = (const char *)old_attrs->values[i].data;
+		char *folded = NULL;
+
+		if (ldb_kv_idxattr_has(new_attrs, attr)) {
+			continue;
 		}
+		folded = ldb_attr_casefold(delta->removed, attr);
+		if (folded == NULL) {
+			return false;
+		}
+		delta->removed[delta->num_removed++] = folded;
 	}
 
-	return LDB_SUCCESS;
+	if (delta->num_removed != 0 &&
+	    ldb_msg_find_attr_as_bool(new_list, LDB_KV_IDX_PRESENCE, false)) {
+		return false;
+	}
+
+	return delta->num_added != 0 || delta->num_removed != 0;
 }
 
 /*
-  delete the index entries for a record
-  return -1 on failure
+  is key (with its DN= prefix) @INDEX:ATTR:value, @INDEX#ATTR#value
+  or a chunk of one of these (when prefix is @INDEXCHUNK), for an
+  attribute no longer indexed?
 */
-int ldb_kv_index_delete(struct ldb_module *module,
-			const struct ldb_message *msg)
+static bool ldb_kv_reindex_delta_removed(struct ldb_kv_reindex_delta *delta,
+					 struct ldb_val key,
+					 const char *prefix)
 {
-	struct ldb_kv_private *ldb_kv = talloc_get_type(
-	    ldb_module_get_private(module), struct ldb_kv_private);
-	int ret;
+	size_t key_len = strnlen((const char *)key.data, key.length);
+	size_t prefix_len = strlen(prefix);
+	const char *attr = NULL;
 	unsigned int i;
+	char sep;
 
-	if (ldb_dn_is_special(msg->dn)) {
-		return LDB_SUCCESS;
-	}
-
-	ret = ldb_kv_index_onelevel(module, msg, 0);
-	if (ret != LDB_SUCCESS) {
-		return ret;
+	if (key_len <= prefix_len + 1 ||
+	    strncmp((const char *)key.data, prefix, prefix_len) != 0) {
+		return false;
 	}
-
-	ret = ldb_kv_write_index_dn_guid(module, msg, 0);
-	if (ret != LDB_SUCCESS) {
-		return ret;
+	sep = key.data[prefix_len];
+	if (sep != ':' && sep != '#') {
+		return false;
 	}
+	attr = (const char *)key.data + prefix_len + 1;
+	key_len -= prefix_len + 1;
 
-	if (!ldb_kv->cache->attribute_indexes) {
-		/* no indexed fields */
-		return LDB_SUCCESS;
-	}
+	for (i = 0; i < delta->num_removed; i++) {
+		size_t attr_len = strlen(delta->removed[i]);
 
-	for (i = 0; i < msg->num_elements; i++) {
-		ret = ldb_kv_index_del_element(
-		    module, ldb_kv, msg, &msg->elements[i]);
-		if (ret != LDB_SUCCESS) {
-			return ret;
+		if (key_len > attr_len &&
+		    attr[attr_len] == sep &&
+		    strncmp(attr, delta->removed[i], attr_len) == 0) {
+			return true;
 		}
 	}
-
-	return LDB_SUCCESS;
+	return false;
 }
 
-
 /*
-  traversal function that deletes all @INDEX records in the in-memory
-  TDB.
-
-  This does not touch the actual DB, that is done at transaction
-  commit, which in turn greatly reduces DB churn as we will likely
-  be able to do a direct update into the old record.
+  put an empty list in the index cache for the index record key (with
+  its DN= prefix), loading it first so that the statistics account for
+  the entries removed
 */
-static int delete_index(struct ldb_kv_private *ldb_kv,
-			struct ldb_val key,
-			_UNUSED_ struct ldb_val data,
-			void *state)
+static int ldb_kv_reindex_delta_drop(struct ldb_module *module,
+				     struct ldb_kv_private *ldb_kv,
+				     struct ldb_val key)
 {
-	struct ldb_module *module = state;
-	const char *dnstr = "DN=" LDB_KV_INDEX ":";
-	struct dn_list list;
-	struct ldb_dn *dn;
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	struct dn_list *list = NULL;
+	struct ldb_dn *dn = NULL;
 	struct ldb_val v;
 	int ret;
 
-	if (strncmp((char *)key.data, dnstr, strlen(dnstr)) != 0) {
-		return 0;
-	}
-	/* we need to put a empty list in the internal tdb for this
-	 * index entry */
-	list.dn = NULL;
-	list.count = 0;
-	list.strict = false;
-
 	/* the offset of 3 is to remove the DN= prefix. */
 	v.data = key.data + 3;
 	v.length = strnlen((char *)key.data, key.length) - 3;
 
-	dn = ldb_dn_from_ldb_val(ldb_kv, ldb_module_get_ctx(module), &v);
+	list = talloc_zero(ldb_kv, struct dn_list);
+	if (list == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	dn = ldb_dn_from_ldb_val(list, ldb, &v);
+	if (dn == NULL) {
+		TALLOC_FREE(list);
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
 
-	/*
-	 * This does not actually touch the DB quite yet, just
-         * the in-memory index cache
-	 */
-	ret = ldb_kv_dn_list_store(module, dn, &list);
+	ret = ldb_kv_dn_list_load(module, ldb_kv, dn, list, DN_LIST_MUTABLE);
+	if (ret != LDB_SUCCESS && ret != LDB_ERR_NO_SUCH_OBJECT) {
+		TALLOC_FREE(list);
+		return ret;
+	}
+
+	list->dn = NULL;
+	list->count = 0;
+	list->unsorted = false;
+	list->check_duplicates = false;
+	ret = ldb_kv_dn_list_store(module, dn, list);
 	if (ret != LDB_SUCCESS) {
-		ldb_asprintf_errstring(ldb_module_get_ctx(module),
+		ldb_asprintf_errstring(ldb,
 				       "Unable to store null index for %s\n",
-						ldb_dn_get_linearized(dn));
-		talloc_free(dn);
-		return -1;
+				       ldb_dn_get_linearized(dn));
 	}
-	talloc_free(dn);
-	return 0;
+	TALLOC_FREE(list);
+	return ret;
 }
 
 /*
-  traversal function that adds @INDEX records during a re index TODO wrong comment
+  traversal function that removes the @INDEX records of attributes no
+  longer indexed
 */
-static int re_key(struct ldb_kv_private *ldb_kv,
-		  struct ldb_val key,
-		  struct ldb_val val,
-		  void *state)
+static int delete_index_delta(struct ldb_kv_private *ldb_kv,
+			      struct ldb_val key,
+			      _UNUSED_ struct ldb_val data,
+			      void *state)
 {
-	struct ldb_context *ldb;
-	struct ldb_kv_reindex_context *ctx =
-	    (struct ldb_kv_reindex_context *)state;
-	struct ldb_module *module = ldb_kv->module;
-	struct ldb_message *msg;
+	struct ldb_kv_reindex_delta *delta = state;
 	int ret;
-	struct ldb_val key2;
-	bool is_record;
 
-	ldb = ldb_module_get_ctx(module);
-
-	is_record = ldb_kv_key_is_normal_record(key);
-	if (is_record == false) {
+	/*
+	 * As in delete_index(), the chunks go with the index record,
+	 * which is checked for them when it is rewritten
+	 */
+	if (ldb_kv_reindex_delta_removed(delta,
+					 key,
+					 "DN=" LDB_KV_INDEX_CHUNK)) {
+		ldb_kv->idxptr->chunk_cleanup = true;
 		return 0;
 	}
 
-	msg = ldb_msg_new(module);
-	if (msg == NULL) {
-		return -1;
-	}
-
-	ret = ldb_unpack_data(ldb, &val, msg);
-	if (ret != 0) {
-		ldb_debug(ldb, LDB_DEBUG_ERROR, "Invalid data for index %s\n",
-						ldb_dn_get_linearized(msg->dn));
-		ctx->error = ret;
-		talloc_free(msg);
-		return -1;
-	}
-
-	if (msg->dn == NULL) {
-		ldb_debug(ldb, LDB_DEBUG_ERROR,
-			  "Refusing to re-index as GUID "
-			  "key %*.*s with no DN\n",
-			  (int)key.length, (int)key.length,
-			  (char *)key.data);
-		talloc_free(msg);
-		return -1;
-	}
-
-	/* check if the DN key has changed, perhaps due to the case
-	   insensitivity of an element changing, or a change from DN
-	   to GUID keys */
-	key2 = ldb_kv_key_msg(module, msg, msg);
-	if (key2.data == NULL) {
-		/* probably a corrupt record ... darn */
-		ldb_debug(ldb, LDB_DEBUG_ERROR, "Invalid DN in re_index: %s",
-						ldb_dn_get_linearized(msg->dn));
-		talloc_free(msg);
+	if (!ldb_kv_reindex_delta_removed(delta, key, "DN=" LDB_KV_INDEX)) {
 		return 0;
 	}
-	if (key.length != key2.length ||
-	    (memcmp(key.data, key2.data, key.length) != 0)) {
-		ldb_kv->kv_ops->update_in_iterate(
-		    ldb_kv, key, key2, val, ctx);
-	}
-	talloc_free(key2.data);
-
-	talloc_free(msg);
 
-	ctx->count++;
-	if (ctx->count % 10000 == 0) {
-		ldb_debug(ldb, LDB_DEBUG_WARNING,
-			  "Reindexing: re-keyed %u records so far",
-			  ctx->count);
+	ret = ldb_kv_reindex_delta_drop(delta->module, ldb_kv, key);
+	if (ret != LDB_SUCCESS) {
+		delta->ctx.error = ret;
+		return -1;
 	}
-
 	return 0;
 }
 
 /*
-  traversal function that adds @INDEX records during a re index
+  remove the index records of attributes no longer indexed that are so
+  far only in the index cache
 */
-static int re_index(struct ldb_kv_private *ldb_kv,
-		    struct ldb_val key,
-		    struct ldb_val val,
-		    void *state)
+static int ldb_kv_reindex_delta_cache(struct ldb_kv_private *ldb_kv,
+				      struct ldb_kv_idxptr *idxptr,
+				      struct ldb_kv_reindex_delta *delta)
 {
-	struct ldb_context *ldb;
-	struct ldb_kv_reindex_context *ctx =
-	    (struct ldb_kv_reindex_context *)state;
-	struct ldb_module *module = ldb_kv->module;
-	struct ldb_message *msg;
-	int ret;
-	bool is_record;
-
-	ldb = ldb_module_get_ctx(module);
-
-	is_record = ldb_kv_key_is_normal_record(key);
-	if (is_record == false) {
-		return 0;
-	}
-
-	msg = ldb_msg_new(module);
-	if (msg == NULL) {
-		return -1;
-	}
-
-	ret = ldb_unpack_data(ldb, &val, msg);
-	if (ret != 0) {
-		ldb_debug(ldb, LDB_DEBUG_ERROR, "Invalid data for index %s\n",
-						ldb_dn_get_linearized(msg->dn));
-		ctx->error = ret;
-		talloc_free(msg);
-		return -1;
-	}
-
-	if (msg->dn == NULL) {
-		ldb_debug(ldb, LDB_DEBUG_ERROR,
-			  "Refusing to re-index as GUID "
-			  "key %*.*s with no DN\n",
-			  (int)key.length, (int)key.length,
-			  (char *)key.data);
-		talloc_free(msg);
-		return -1;
-	}
-
-	ret = ldb_kv_index_onelevel(module, msg, 1);
-	if (ret != LDB_SUCCESS) {
-		ldb_debug(ldb, LDB_DEBUG_ERROR,
-			  "Adding special ONE LEVEL index failed (%s)!",
-						ldb_dn_get_linearized(msg->dn));
-		talloc_free(msg);
-		return -1;
-	}
-
-	ret = ldb_kv_index_add_all(module, ldb_kv, msg);
-
-	if (ret != LDB_SUCCESS) {
-		ctx->error = ret;
-		talloc_free(msg);
-		return -1;
-	}
-
-	talloc_free(msg);
+	size_t i;
 
-	ctx->count++;
-	if (ctx->count % 10000 == 0) {
-		ldb_debug(ldb, LDB_DEBUG_WARNING,
-			  "Reindexing: re-indexed %u records so far",
-			  ctx->count);
+	if (idxptr == NULL) {
+		return LDB_SUCCESS;
 	}
 
-	return 0;
-}
+	/*
+	 * Dropping an entry of the top level cache may add it to the
+	 * nested cache, but an entry of the cache being walked is
+	 * always found there, so it is not resized under us.
+	 */
+	for (i = 0; i < idxptr->num_slots; i++) {
+		struct ldb_kv_idxptr_entry *entry = idxptr->entries[i];
+		struct ldb_val key;
+		int ret;
 
-/*
- * Convert the 4-byte pack format version to a number that's slightly
- * more intelligible to a user e.g. version 0, 1, 2, etc.
- */
-static uint32_t displayable_pack_version(uint32_t version) {
-	if (version < LDB_PACKING_FORMAT_NODN) {
-		return version; /* unknown - can't convert */
+		if (entry == NULL || entry->list->count == 0) {
+			continue;
+		}
+		key.data = (uint8_t *)talloc_asprintf(delta->removed,
+						      "DN=%s",
+						      (char *)entry->key.data);
+		if (key.data == NULL) {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+		key.length = entry->key.length + 3;
+
+		if (ldb_kv_reindex_delta_removed(delta,
+						 key,
+						 "DN=" LDB_KV_INDEX)) {
+			ret = ldb_kv_reindex_delta_drop(delta->module,
+							ldb_kv,
+							key);
+			if (ret != LDB_SUCCESS) {
+				return ret;
+			}
+		}
+		TALLOC_FREE(key.data);
 	}
-
-	return (version - LDB_PACKING_FORMAT_NODN);
+	return LDB_SUCCESS;
 }
 
-static int re_pack(struct ldb_kv_private *ldb_kv,
-		   _UNUSED_ struct ldb_val key,
-		   struct ldb_val val,
-		   void *state)
+/*
+  traversal function that adds the @INDEX records of newly indexed
+  attributes
+*/
+static int re_index_delta(struct ldb_kv_private *ldb_kv,
+			  struct ldb_val key,
+			  struct ldb_val val,
+			  void *state)
 {
-	struct ldb_context *ldb;
-	struct ldb_message *msg;
-	struct ldb_module *module = ldb_kv->module;
-	struct ldb_kv_repack_context *ctx =
-	    (struct ldb_kv_repack_context *)state;
+	struct ldb_kv_reindex_delta *delta = state;
+	struct ldb_module *module = delta->module;
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	struct ldb_message *msg = NULL;
+	unsigned int i;
 	int ret;
 
-	ldb = ldb_module_get_ctx(module);
+	if (ldb_kv_key_is_normal_record(key) == false) {
+		return 0;
+	}
 
 	msg = ldb_msg_new(module);
 	if (msg == NULL) {
@@ -3681,192 +8304,167 @@ static int re_pack(struct ldb_kv_private *ldb_kv,
 	}
 
 	ret = ldb_unpack_data(ldb, &val, msg);
-	if (ret != 0) {
-		ldb_debug(ldb, LDB_DEBUG_ERROR, "Repack: unpack failed: %s\n",
+	if (ret != 0 || msg->dn == NULL) {
+		ldb_debug(ldb, LDB_DEBUG_ERROR, "Invalid data for index %s\n",
 			  ldb_dn_get_linearized(msg->dn));
-		ctx->error = ret;
+		delta->ctx.error = LDB_ERR_OPERATIONS_ERROR;
 		talloc_free(msg);
 		return -1;
 	}
 
-	ret = ldb_kv_store(module, msg, TDB_MODIFY);
-	if (ret != LDB_SUCCESS) {
-		ldb_debug(ldb, LDB_DEBUG_ERROR, "Repack: store failed: %s\n",
-			  ldb_dn_get_linearized(msg->dn));
-		ctx->error = ret;
+	if (ldb_dn_is_special(msg->dn)) {
 		talloc_free(msg);
-		return -1;
+		return 0;
 	}
 
-	/*
-	 * Warn the user that we're repacking the first time we see a normal
-	 * record. This means we never warn if we're repacking a database with
-	 * only @ records. This is because during database initialisation,
-	 * we might repack as initial settings are written out, and we don't
-	 * want to spam the log.
-	 */
-	if ((!ctx->normal_record_seen) && (!ldb_dn_is_special(msg->dn))) {
-		ldb_debug(ldb, LDB_DEBUG_ALWAYS_LOG,
-			  "Repacking database from v%u to v%u format "
-			  "(first record %s)",
-			  displayable_pack_version(ctx->old_version),
-			  displayable_pack_version(ldb_kv->pack_format_version),
-			  ldb_dn_get_linearized(msg->dn));
-		ctx->normal_record_seen = true;
-	}
+	for (i = 0; i < msg->num_elements; i++) {
+		struct ldb_message_element *el = &msg->elements[i];
+		unsigned int j;
 
-	ctx->count++;
-	if (ctx->count % 10000 == 0) {
-		ldb_debug(ldb, LDB_DEBUG_WARNING,
-			  "Repack: re-packed %u records so far",
-			  ctx->count);
+		for (j = 0; j < delta->num_added; j++) {
+			if (ldb_attr_cmp(el->name, delta->added[j]) == 0) {
+				break;
+			}
+		}
+		if (j == delta->num_added ||
+		    !ldb_kv_is_indexed(module, ldb_kv, el->name)) {
+			continue;
+		}
+
+		ret = ldb_kv_index_add_el(module, ldb_kv, msg, el);
+		if (ret == LDB_SUCCESS) {
+			ret = ldb_kv_index_presence(module, ldb_kv, msg, el,
+						    true);
+		}
+		if (ret != LDB_SUCCESS) {
+			ldb_asprintf_errstring(ldb,
+					       __location__ ": Failed to re-index %s in %s - %s",
+					       el->name,
+					       ldb_dn_get_linearized(msg->dn),
+					       ldb_errstring(ldb));
+			delta->ctx.error = ret;
+			talloc_free(msg);
+			return -1;
+		}
 	}
 
 	talloc_free(msg);
-	return 0;
-}
-
-int ldb_kv_repack(struct ldb_module *module)
-{
-	struct ldb_kv_private *ldb_kv = talloc_get_type(
-	    ldb_module_get_private(module), struct ldb_kv_private);
-	struct ldb_context *ldb = ldb_module_get_ctx(module);
-	struct ldb_kv_repack_context ctx;
-	int ret;
-
-	ctx.old_version = ldb_kv->pack_format_version;
-	ctx.count = 0;
-	ctx.error = LDB_SUCCESS;
-	ctx.normal_record_seen = false;
-
-	ldb_kv->pack_format_version = ldb_kv->target_pack_format_version;
-
-	/* Iterate all database records and repack them in the new format */
-	ret = ldb_kv->kv_ops->iterate(ldb_kv, re_pack, &ctx);
-	if (ret < 0) {
-		ldb_debug(ldb, LDB_DEBUG_ERROR, "Repack traverse failed: %s",
-			  ldb_errstring(ldb));
-		return LDB_ERR_OPERATIONS_ERROR;
-	}
 
-	if (ctx.error != LDB_SUCCESS) {
-		ldb_debug(ldb, LDB_DEBUG_ERROR, "Repack failed: %s",
-			  ldb_errstring(ldb));
-		return ctx.error;
-	}
+	ldb_kv_reindex_progress(ldb, &delta->ctx);
 
-	return LDB_SUCCESS;
+	return 0;
 }
 
 /*
-  force a complete reindex of the database
+  re-index after a change to @INDEXLIST.
+
+  When only the attributes listed in @IDXATTR have changed, just the
+  index records of those attributes are built or removed, leaving the
+  others as they are.  Otherwise this is a full ldb_kv_reindex().
 */
-int ldb_kv_reindex(struct ldb_module *module)
+int ldb_kv_reindex_indexlist(struct ldb_module *module)
 {
 	struct ldb_kv_private *ldb_kv = talloc_get_type(
 	    ldb_module_get_private(module), struct ldb_kv_private);
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	struct ldb_kv_reindex_delta delta = {
+		.module = module,
+	};
+	struct ldb_message *old = NULL;
+	TALLOC_CTX *tmp_ctx = NULL;
+	bool append;
 	int ret;
-	struct ldb_kv_reindex_context ctx;
-	size_t index_cache_size = 0;
 
-	/*
-	 * Only triggered after a modification, but make clear we do
-	 * not re-index a read-only DB
-	 */
 	if (ldb_kv->read_only) {
 		return LDB_ERR_UNWILLING_TO_PERFORM;
 	}
 
-	if (ldb_kv_cache_reload(module) != 0) {
-		return LDB_ERR_OPERATIONS_ERROR;
+	if (ldb->schema.index_handler_override ||
+	    ldb_kv->idxptr == NULL ||
+	    ldb_kv->cache->indexlist == NULL) {
+		return ldb_kv_reindex(module);
 	}
 
-	/*
-	 * Ensure we read (and so remove) the entries from the real
-	 * DB, no values stored so far are any use as we want to do a
-	 * re-index
-	 */
-	ldb_kv_index_transaction_cancel(module);
-	if (ldb_kv->nested_idx_ptr != NULL) {
-		ldb_kv_index_sub_transaction_cancel(ldb_kv);
+	tmp_ctx = talloc_new(ldb_kv);
+	if (tmp_ctx == NULL) {
+		return ldb_module_oom(module);
 	}
 
-	/*
-	 * Calculate the size of the index cache needed for
-	 * the re-index. If specified always use the
-	 * ldb_kv->index_transaction_cache_size otherwise use the maximum
-	 * of the size estimate or the DEFAULT_INDEX_CACHE_SIZE
-	 */
-	if (ldb_kv->index_transaction_cache_size > 0) {
-		index_cache_size = ldb_kv->index_transaction_cache_size;
-	} else {
-		index_cache_size = ldb_kv->kv_ops->get_size(ldb_kv);
-		if (index_cache_size < DEFAULT_INDEX_CACHE_SIZE) {
-			index_cache_size = DEFAULT_INDEX_CACHE_SIZE;
-		}
-	}
+	/* The cache was loaded before @INDEXLIST was changed */
+	old = talloc_steal(tmp_ctx, ldb_kv->cache->indexlist);
+	ldb_kv->cache->indexlist = NULL;
 
-	/*
-	 * Note that we don't start an index sub transaction for re-indexing
-	 */
-	ret = ldb_kv_index_transaction_start(module, index_cache_size);
-	if (ret != LDB_SUCCESS) {
-		return ret;
+	if (ldb_kv_cache_reload(module) != 0) {
+		TALLOC_FREE(tmp_ctx);
+		return LDB_ERR_OPERATIONS_ERROR;
 	}
 
-	/* first traverse the database deleting any @INDEX records by
-	 * putting NULL entries in the in-memory tdb
-	 */
-	ret = ldb_kv->kv_ops->iterate(ldb_kv, delete_index, module);
-	if (ret < 0) {
-		struct ldb_context *ldb = ldb_module_get_ctx(module);
-		ldb_asprintf_errstring(ldb, "index deletion traverse failed: %s",
-				       ldb_errstring(ldb));
-		return LDB_ERR_OPERATIONS_ERROR;
+	if (!ldb_kv_reindex_delta_init(tmp_ctx,
+				       old,
+				       ldb_kv->cache->indexlist,
+				       &delta)) {
+		TALLOC_FREE(tmp_ctx);
+		return ldb_kv_reindex(module);
 	}
 
-	ctx.error = 0;
-	ctx.count = 0;
+	if (delta.num_removed != 0) {
+		ret = ldb_kv->kv_ops->iterate(ldb_kv,
+					      delete_index_delta,
+					      &delta);
+		if (ret < 0 || delta.ctx.error != LDB_SUCCESS) {
+			ldb_asprintf_errstring(ldb,
+					       "index deletion traverse failed: %s",
+					       ldb_errstring(ldb));
+			TALLOC_FREE(tmp_ctx);
+			if (delta.ctx.error != LDB_SUCCESS) {
+				return delta.ctx.error;
+			}
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
 
-	ret = ldb_kv->kv_ops->iterate(ldb_kv, re_key, &ctx);
-	if (ret < 0) {
-		struct ldb_context *ldb = ldb_module_get_ctx(module);
-		ldb_asprintf_errstring(ldb, "key correction traverse failed: %s",
-				       ldb_errstring(ldb));
-		return LDB_ERR_OPERATIONS_ERROR;
+		/*
+		 * Index records not yet written out, the top level
+		 * cache first as that may add to the nested one
+		 */
+		ret = ldb_kv_reindex_delta_cache(ldb_kv,
+						 ldb_kv->idxptr,
+						 &delta);
+		if (ret == LDB_SUCCESS &&
+		    ldb_kv->nested_idx_ptr != NULL) {
+			ret = ldb_kv_reindex_delta_cache(
+			    ldb_kv, ldb_kv->nested_idx_ptr, &delta);
+		}
+		if (ret != LDB_SUCCESS) {
+			TALLOC_FREE(tmp_ctx);
+			return ret;
+		}
 	}
 
-	if (ctx.error != LDB_SUCCESS) {
-		struct ldb_context *ldb = ldb_module_get_ctx(module);
-		ldb_asprintf_errstring(ldb, "reindexing failed: %s", ldb_errstring(ldb));
-		return ctx.error;
+	if (delta.num_added == 0) {
+		TALLOC_FREE(tmp_ctx);
+		return LDB_SUCCESS;
 	}
 
-	ctx.error = 0;
-	ctx.count = 0;
+	delta.ctx.start = tevent_timeval_current();
 
-	/* now traverse adding any indexes for normal LDB records */
-	ret = ldb_kv->kv_ops->iterate(ldb_kv, re_index, &ctx);
+	/*
+	 * As for a re-index, the new index lists are appended to and
+	 * sorted once
+	 */
+	append = ldb_kv->idxptr->append;
+	ldb_kv->idxptr->append = true;
+	ret = ldb_kv->kv_ops->iterate(ldb_kv, re_index_delta, &delta);
+	ldb_kv->idxptr->append = append;
+	TALLOC_FREE(tmp_ctx);
 	if (ret < 0) {
-		struct ldb_context *ldb = ldb_module_get_ctx(module);
 		ldb_asprintf_errstring(ldb, "reindexing traverse failed: %s",
 				       ldb_errstring(ldb));
+		if (delta.ctx.error != LDB_SUCCESS) {
+			return delta.ctx.error;
+		}
 		return LDB_ERR_OPERATIONS_ERROR;
 	}
 
-	if (ctx.error != LDB_SUCCESS) {
-		struct ldb_context *ldb = ldb_module_get_ctx(module);
-		ldb_asprintf_errstring(ldb, "reindexing failed: %s", ldb_errstring(ldb));
-		return ctx.error;
-	}
-
-	if (ctx.count > 10000) {
-		ldb_debug(ldb_module_get_ctx(module),
-			  LDB_DEBUG_WARNING,
-			  "Reindexing: re_index successful on %s, "
-			  "final index write-out will be in transaction commit",
-			  ldb_kv->kv_ops->name(ldb_kv));
-	}
 	return LDB_SUCCESS;
 }
 
@@ -3876,50 +8474,22 @@ int ldb_kv_reindex(struct ldb_module *module)
  *
  * This is a 'commit' of the subtransaction to the main transaction cache.
  */
-static int ldb_kv_sub_transaction_traverse(
-	struct tdb_context *tdb,
-	TDB_DATA key,
-	TDB_DATA data,
-	void *state)
+static int ldb_kv_sub_transaction_move(
+	struct ldb_kv_private *ldb_kv,
+	struct ldb_kv_idxptr_entry *entry)
 {
-	struct ldb_module *module = state;
-	struct ldb_kv_private *ldb_kv = talloc_get_type(
-	    ldb_module_get_private(module), struct ldb_kv_private);
-	TDB_DATA rec = {0};
-	struct dn_list *index_in_subtransaction = NULL;
+	struct dn_list *index_in_subtransaction = entry->list;
 	struct dn_list *index_in_top_level = NULL;
-	struct ldb_dn_list_state sub_state = {
-		.module = module,
-	};
-	int ret = 0;
-
-	/*
-	 * This unwraps the pointer in the DB into a pointer in
-	 * memory, we are abusing TDB as a hash map, not a linearised
-	 * database store
-	 */
-	index_in_subtransaction = ldb_kv_index_idxptr(module, data);
-	if (index_in_subtransaction == NULL) {
-		ldb_kv->idxptr->error = LDB_ERR_OPERATIONS_ERROR;
-		return -1;
-	}
+	struct ldb_kv_idxptr_entry *top = NULL;
+	int ret;
 
 	/*
 	 * Do we already have an entry in the primary transaction cache
 	 * If so replace dn_list with the one from the subtransaction.
-	 *
-	 * The TDB and so the fetched rec contains NO DATA, just a
-	 * pointer to data held in memory.
-	 */
-	ret = tdb_parse_record(ldb_kv->idxptr->itdb,
-			       key,
-			       ldb_kv_index_idxptr_wrapper,
-			       &sub_state);
-	if (ret == 0) {
-		index_in_top_level = sub_state.list;
-		if (index_in_top_level == NULL) {
-			abort();
-		}
+	 */
+	top = ldb_kv_idxptr_find(ldb_kv->idxptr, &entry->key, entry->hash);
+	if (top != NULL) {
+		index_in_top_level = top->list;
 		/*
 		 * We had this key at the top level, and made a copy
 		 * of the dn list for this sub-transaction level that
@@ -3951,37 +8521,29 @@ static int ldb_kv_sub_transaction_traverse(
 			= talloc_steal(index_in_top_level,
 				       index_in_subtransaction->dn);
 		index_in_top_level->count = index_in_subtransaction->count;
-		return 0;
-	}
-	/*
-	 * We found no top level index in the cache, so we put one in.
-	 */
-	index_in_top_level = talloc(ldb_kv->idxptr, struct dn_list);
-	if (index_in_top_level == NULL) {
-		ldb_kv->idxptr->error = LDB_ERR_OPERATIONS_ERROR;
-		return -1;
+		index_in_top_level->unsorted =
+			index_in_subtransaction->unsorted;
+		index_in_top_level->check_duplicates =
+			index_in_subtransaction->check_duplicates;
+		ldb_kv_index_chunk_dir_merge(
+		    index_in_top_level->chunk_dir,
+		    index_in_subtransaction->chunk_dir);
+		return LDB_SUCCESS;
 	}
-	index_in_top_level->dn
-		= talloc_steal(index_in_top_level,
-			       index_in_subtransaction->dn);
-	index_in_top_level->count = index_in_subtransaction->count;
-	index_in_top_level->strict = false;
-
-	rec.dptr = (uint8_t *)&index_in_top_level;
-	rec.dsize = sizeof(void *);
-
 
 	/*
+	 * We found no top level index in the cache, so the entry
+	 * moves there as it is.
+	 *
 	 * This is not a store into the main DB, but into an in-memory
-	 * TDB, so we don't need a guard on ltdb->read_only
+	 * hash table, so we don't need a guard on ltdb->read_only
 	 */
-	ret = tdb_store(ldb_kv->idxptr->itdb, key, rec, TDB_INSERT);
-	if (ret != 0) {
-		ldb_kv->idxptr->error = ltdb_err_map(
-		    tdb_error(ldb_kv->idxptr->itdb));
-		return -1;
+	ret = ldb_kv_idxptr_insert(ldb_kv->idxptr, entry);
+	if (ret != LDB_SUCCESS) {
+		return ret;
 	}
-	return 0;
+	talloc_steal(ldb_kv->idxptr, entry);
+	return LDB_SUCCESS;
 }
 
 /*
@@ -3989,24 +8551,22 @@ static int ldb_kv_sub_transaction_traverse(
  */
 int ldb_kv_index_sub_transaction_start(struct ldb_kv_private *ldb_kv)
 {
+	int ret;
+
 	ldb_kv->nested_idx_ptr = talloc_zero(ldb_kv, struct ldb_kv_idxptr);
 	if (ldb_kv->nested_idx_ptr == NULL) {
 		return LDB_ERR_OPERATIONS_ERROR;
 	}
 
 	/*
-	 * We use a tiny hash size for the sub-database (11).
-	 *
-	 * The sub-transaction is only for one record at a time, we
-	 * would use a linked list but that would make the code even
-	 * more complex when manipulating the index, as it would have
-	 * to know if we were in a nested transaction (normal
-	 * operations) or the top one (a reindex).
+	 * We use a tiny hash table for the sub-transaction, it is only
+	 * for one record at a time, and grows if that record has many
+	 * indexed values.
 	 */
-	ldb_kv->nested_idx_ptr->itdb =
-		tdb_open(NULL, 11, TDB_INTERNAL, O_RDWR, 0);
-	if (ldb_kv->nested_idx_ptr->itdb == NULL) {
-		return LDB_ERR_OPERATIONS_ERROR;
+	ret = ldb_kv_idxptr_init(ldb_kv->nested_idx_ptr, 0);
+	if (ret != LDB_SUCCESS) {
+		TALLOC_FREE(ldb_kv->nested_idx_ptr);
+		return ret;
 	}
 	return LDB_SUCCESS;
 }
@@ -4017,12 +8577,7 @@ int ldb_kv_index_sub_transaction_start(struct ldb_kv_private *ldb_kv)
  */
 int ldb_kv_index_sub_transaction_cancel(struct ldb_kv_private *ldb_kv)
 {
-	if (ldb_kv->nested_idx_ptr != NULL) {
-		if (ldb_kv->nested_idx_ptr->itdb != NULL) {
-			tdb_close(ldb_kv->nested_idx_ptr->itdb);
-		}
-		TALLOC_FREE(ldb_kv->nested_idx_ptr);
-	}
+	TALLOC_FREE(ldb_kv->nested_idx_ptr);
 	return LDB_SUCCESS;
 }
 
@@ -4033,22 +8588,25 @@ int ldb_kv_index_sub_transaction_cancel(struct ldb_kv_private *ldb_kv)
  */
 int ldb_kv_index_sub_transaction_commit(struct ldb_kv_private *ldb_kv)
 {
+	struct ldb_kv_idxptr *nested = ldb_kv->nested_idx_ptr;
+	size_t i;
 	int ret = 0;
 
-	if (ldb_kv->nested_idx_ptr == NULL) {
+	if (nested == NULL) {
 		return LDB_SUCCESS;
 	}
-	if (ldb_kv->nested_idx_ptr->itdb == NULL) {
-		return LDB_SUCCESS;
+
+	ret = nested->error;
+	for (i = 0; ret == LDB_SUCCESS && i < nested->num_slots; i++) {
+		if (nested->entries[i] == NULL) {
+			continue;
+		}
+		ret = ldb_kv_sub_transaction_move(ldb_kv, nested->entries[i]);
 	}
-	tdb_traverse_read(
-	    ldb_kv->nested_idx_ptr->itdb,
-	    ldb_kv_sub_transaction_traverse,
-	    ldb_kv->module);
-	tdb_close(ldb_kv->nested_idx_ptr->itdb);
-	ldb_kv->nested_idx_ptr->itdb = NULL;
 
-	ret = ldb_kv->nested_idx_ptr->error;
+	if (ret == LDB_SUCCESS) {
+		ldb_kv->idxptr->objects_delta += nested->objects_delta;
+	}
 	if (ret != LDB_SUCCESS) {
 		struct ldb_context *ldb = ldb_module_get_ctx(ldb_kv->module);
 		if (!ldb_errstring(ldb)) {
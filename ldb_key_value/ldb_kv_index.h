@@ -0,0 +1,273 @@
+/*
+   ldb database library
+
+   Copyright (C) Andrew Tridgell  2004-2009
+
+     ** NOTE! The following LGPL license applies to the ldb
+     ** library. This does NOT imply that all of Samba is released
+     ** under the LGPL
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ * Definitions shared by the ldb_kv_index*.c files, which together
+ * make up the indexing of the key value backend.  The index design
+ * is described at the top of ldb_kv_index.c.
+ */
+
+#ifndef __LDB_KV_INDEX_H__
+#define __LDB_KV_INDEX_H__
+
+#include "ldb_kv.h"
+
+/* we put a @IDXVERSION attribute on index entries. This
+   allows us to tell if it was written by an older version
+*/
+#define LDB_KV_INDEXING_VERSION 2
+
+#define LDB_KV_GUID_INDEXING_VERSION 3
+
+/*
+ * Large GUID index records written with @IDX_CHUNK_SIZE set in
+ * @INDEXLIST are split into chunks, and the record under the index
+ * key becomes a directory of those chunks tagged with this version.
+ */
+#define LDB_KV_GUID_CHUNKED_INDEXING_VERSION 4
+
+struct ldb_kv_index_chunk_dir;
+struct ldb_kv_idxptr;
+
+struct dn_list {
+	unsigned int count;
+	struct ldb_val *dn;
+	/*
+	 * Do not optimise the intersection of this list,
+	 * we must never return an entry not in this
+	 * list.  This allows the index for
+	 * SCOPE_ONELEVEL to be trusted.
+	 */
+	bool strict;
+	/*
+	 * The number of entries in the index record when it was
+	 * read from the database, to maintain @INDEXSTATS
+	 */
+	unsigned int stored_count;
+	/*
+	 * The dn array belongs to the transaction index cache, and
+	 * must be copied before it is changed (see
+	 * ldb_kv_dn_list_load())
+	 */
+	bool borrowed;
+	/*
+	 * GUIDs have been appended to the dn array by a bulk load
+	 * without keeping it in order, it is sorted before it is
+	 * next searched or written to disk (see ldb_kv_dn_list_order())
+	 */
+	bool unsorted;
+	/*
+	 * The bulk load appended GUIDs under a key that was not
+	 * truncated, so the same GUID twice is a value repeated in a
+	 * record, which ldb_kv_dn_list_order() reports and drops
+	 * (even if the GUIDs arrived in order)
+	 */
+	bool check_duplicates;
+	/*
+	 * Every entry matches the expression the list was built
+	 * for, so need not be checked against it (see
+	 * ldb_kv_index_attr_exact())
+	 */
+	bool exact;
+	/*
+	 * The chunks of a chunked index record as stored, and which
+	 * of them have had GUIDs added or removed since (see
+	 * ldb_kv_dn_list_chunk_touch())
+	 */
+	struct ldb_kv_index_chunk_dir *chunk_dir;
+};
+
+enum key_truncation {
+	KEY_NOT_TRUNCATED,
+	KEY_TRUNCATED,
+};
+
+/*
+ * An entry in the index cache of a transaction
+ */
+struct ldb_kv_idxptr_entry {
+	/* the linearized index DN, and its hash */
+	struct ldb_val key;
+	uint32_t hash;
+	/* the index DN, kept so it need not be parsed again at commit */
+	struct ldb_dn *dn;
+	struct dn_list *list;
+};
+
+/*
+ * Index statistics, kept in @INDEXSTATS for the search planner
+ */
+struct ldb_kv_index_stat {
+	const char *attr;
+	uint64_t records;
+	uint64_t entries;
+};
+
+struct ldb_kv_index_stats {
+	uint64_t objects;
+	unsigned int num_attrs;
+	struct ldb_kv_index_stat *attrs;
+	/* the statistics have been changed by this transaction */
+	bool changed;
+};
+
+/* An @IDXCHUNK value of a chunk directory, see ldb_kv_index.c */
+struct ldb_kv_index_chunk {
+	uint8_t first[LDB_KV_GUID_SIZE];
+	uint32_t id;
+	uint32_t count;
+};
+
+/*
+ * The following definitions come from lib/ldb/ldb_key_value/ldb_kv_index.c
+ */
+
+int ldb_kv_guid_index_values(const struct ldb_message_element *el,
+			     struct ldb_val *guids);
+int ldb_kv_index_chunk_dir_parse(TALLOC_CTX *mem_ctx,
+				 const struct ldb_message *msg,
+				 struct ldb_kv_index_chunk **chunks,
+				 unsigned int *num_chunks);
+int ldb_kv_index_chunk_read(struct ldb_module *module,
+			    const char *dir_str,
+			    const struct ldb_kv_index_chunk *chunk,
+			    TALLOC_CTX *mem_ctx,
+			    struct ldb_message **_msg,
+			    struct ldb_val *guids);
+bool ldb_kv_is_indexed(struct ldb_module *module,
+		       struct ldb_kv_private *ldb_kv,
+		       const char *attr);
+bool ldb_kv_index_attr_exact(struct ldb_context *ldb,
+			     const char *attr,
+			     enum key_truncation truncation);
+bool ldb_kv_index_unique(struct ldb_context *ldb,
+			 struct ldb_kv_private *ldb_kv,
+			 const char *attr);
+int ldb_kv_index_dn(struct ldb_module *module,
+		    struct ldb_kv_private *ldb_kv,
+		    const struct ldb_parse_tree *tree,
+		    struct dn_list *list);
+int ldb_kv_index_filter_key(struct ldb_kv_private *ldb_kv,
+			    struct ldb_kv_context *ac,
+			    struct ldb_val key,
+			    unsigned int idx,
+			    uint32_t *match_count,
+			    enum key_truncation scope_one_truncation);
+struct ldb_kv_idxptr_entry *ldb_kv_idxptr_find_dn(
+	const struct ldb_kv_idxptr *idxptr,
+	struct ldb_dn *dn);
+
+/*
+ * The following definitions come from lib/ldb/ldb_key_value/ldb_kv_index_key.c
+ */
+
+unsigned ldb_kv_max_key_length(struct ldb_kv_private *ldb_kv);
+struct ldb_dn *ldb_kv_index_key_internal(
+	struct ldb_context *ldb,
+	TALLOC_CTX *mem_ctx,
+	struct ldb_kv_private *ldb_kv,
+	const char *attr,
+	const struct ldb_val *value,
+	const struct ldb_schema_attribute **ap,
+	enum key_truncation *truncation,
+	bool set_errstring);
+struct ldb_dn *ldb_kv_index_key(struct ldb_context *ldb,
+				TALLOC_CTX *mem_ctx,
+				struct ldb_kv_private *ldb_kv,
+				const char *attr,
+				const struct ldb_val *value,
+				const struct ldb_schema_attribute **ap,
+				enum key_truncation *truncation);
+
+/*
+ * The following definitions come from lib/ldb/ldb_key_value/ldb_kv_index_list.c
+ */
+
+int ldb_val_equal_exact_for_qsort(const struct ldb_val *v1,
+				  const struct ldb_val *v2);
+int ldb_val_equal_exact_ordered(const struct ldb_val v1,
+				const struct ldb_val *v2);
+int ldb_kv_dn_list_find_msg(struct ldb_kv_private *ldb_kv,
+			    struct dn_list *list,
+			    const struct ldb_message *msg);
+void ldb_kv_dn_list_order(struct ldb_module *module,
+			  struct ldb_kv_private *ldb_kv,
+			  struct ldb_kv_idxptr_entry *entry);
+bool ldb_kv_dn_list_intersect(struct ldb_kv_private *ldb_kv,
+			      struct dn_list *list,
+			      const struct dn_list *list2);
+bool ldb_kv_dn_list_union(struct ldb_context *ldb,
+			  struct ldb_kv_private *ldb_kv,
+			  struct dn_list *list,
+			  struct dn_list *list2);
+
+/*
+ * The following definitions come from lib/ldb/ldb_key_value/ldb_kv_index_plan.c
+ */
+
+struct ldb_kv_index_stat *ldb_kv_index_stats_find(
+	const struct ldb_kv_index_stats *stats,
+	const char *attr,
+	size_t attr_len);
+int ldb_kv_index_stats_read(struct ldb_module *module,
+			    TALLOC_CTX *mem_ctx,
+			    struct ldb_kv_index_stats **_stats);
+
+/* an estimate that could not be made */
+#define LDB_KV_PLAN_UNKNOWN UINT64_MAX
+
+/* relative cost of reading and filtering a candidate over loading it */
+#define LDB_KV_PLAN_FETCH_COST 16
+
+struct ldb_kv_index_plan_term {
+	unsigned int idx;
+	uint64_t cost;
+};
+
+uint64_t ldb_kv_index_plan_estimate(struct ldb_module *module,
+				    struct ldb_kv_private *ldb_kv,
+				    const struct ldb_parse_tree *tree,
+				    bool value_counts);
+struct ldb_kv_index_plan_term *ldb_kv_index_plan_and(
+	TALLOC_CTX *mem_ctx,
+	struct ldb_module *module,
+	struct ldb_kv_private *ldb_kv,
+	const struct ldb_parse_tree *tree);
+char *ldb_kv_index_plan_describe(TALLOC_CTX *mem_ctx,
+				 struct ldb_module *module,
+				 struct ldb_kv_private *ldb_kv,
+				 const struct ldb_parse_tree *tree);
+bool ldb_kv_index_plan_full_scan(struct ldb_module *module,
+				 struct ldb_kv_private *ldb_kv,
+				 const struct ldb_parse_tree *tree,
+				 uint64_t *_est);
+
+/*
+ * The following definitions come from lib/ldb/ldb_key_value/ldb_kv_index_cursor.c
+ */
+
+int ldb_kv_index_search_cursor(struct ldb_kv_context *ac,
+			       struct ldb_kv_private *ldb_kv,
+			       uint32_t *match_count);
+
+#endif /* __LDB_KV_INDEX_H__ */
@@ -0,0 +1,763 @@
+/*
+   ldb database library
+
+   Copyright (C) Andrew Tridgell  2004-2009
+
+     ** NOTE! The following LGPL license applies to the ldb
+     ** library. This does NOT imply that all of Samba is released
+     ** under the LGPL
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ *  Name: ldb
+ *
+ *  Component: ldb key value backend - streaming index cursors
+ *
+ *  Description: walk the candidates of an indexed search in GUID
+ *  order.
+ *
+ *  In the GUID index mode every index record is a sorted array of
+ *  GUIDs, so rather than building the full candidate dn_list for a
+ *  search (which for an AND of two large indexes means loading both
+ *  and intersecting them in memory) the candidates can be walked in
+ *  GUID order and handed to ldb_kv_index_filter_key() as they are
+ *  found.
+ *
+ *  A cursor sits on one GUID (valid while eof is false) and can be
+ *  moved to the next GUID, or seeked to the first GUID at or after a
+ *  target.  An AND is a leapfrog join of its children, an OR is a
+ *  merge, and a chunked index record is read one chunk at a time,
+ *  using the chunk directory to skip the chunks a seek passes over.
+ *  Anything else is evaluated by ldb_kv_index_dn() into a dn_list.
+ *
+ *  This is only used outside a transaction, where index records are
+ *  read from the database and are private to the search, rather than
+ *  shared with the in-memory index cache.
+ */
+
+#include "ldb_kv.h"
+#include "ldb_kv_index.h"
+#include "ldb_private.h"
+
+enum ldb_kv_index_cursor_type {
+	LDB_KV_INDEX_CURSOR_LIST,
+	LDB_KV_INDEX_CURSOR_CHUNKS,
+	LDB_KV_INDEX_CURSOR_AND,
+	LDB_KV_INDEX_CURSOR_OR,
+};
+
+struct ldb_kv_index_cursor {
+	enum ldb_kv_index_cursor_type type;
+	bool eof;
+	/* as for struct dn_list */
+	bool exact;
+	uint8_t guid[LDB_KV_GUID_SIZE];
+
+	/* LIST and CHUNKS: a dn_list, or else a flat array of GUIDs */
+	const struct dn_list *list;
+	struct ldb_val guids;
+	size_t count;
+	size_t pos;
+
+	/* CHUNKS: the directory, the current chunk is held in guids */
+	struct ldb_module *module;
+	const char *dir_str;
+	struct ldb_kv_index_chunk *chunks;
+	unsigned int num_chunks;
+	unsigned int chunk;
+	struct ldb_message *chunk_msg;
+
+	/* AND and OR */
+	struct ldb_kv_index_cursor **children;
+	unsigned int num_children;
+};
+
+static int ldb_kv_index_cursor_next(struct ldb_kv_index_cursor *c);
+static int ldb_kv_index_cursor_seek(struct ldb_kv_index_cursor *c,
+				    const uint8_t *target);
+
+static const uint8_t *ldb_kv_index_cursor_at(
+	const struct ldb_kv_index_cursor *c,
+	size_t i)
+{
+	if (c->list != NULL) {
+		return c->list->dn[i].data;
+	}
+	return &c->guids.data[i * LDB_KV_GUID_SIZE];
+}
+
+/*
+  move pos forward to the first GUID >= target in the current array
+ */
+static void ldb_kv_index_cursor_array_seek(struct ldb_kv_index_cursor *c,
+					   const uint8_t *target)
+{
+	size_t lo = c->pos;
+	size_t hi = c->count;
+
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (memcmp(ldb_kv_index_cursor_at(c, mid),
+			   target,
+			   LDB_KV_GUID_SIZE) < 0) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+	c->pos = lo;
+}
+
+static void ldb_kv_index_cursor_array_settle(struct ldb_kv_index_cursor *c)
+{
+	if (c->pos >= c->count) {
+		c->eof = true;
+		return;
+	}
+	memcpy(c->guid, ldb_kv_index_cursor_at(c, c->pos), LDB_KV_GUID_SIZE);
+	c->eof = false;
+}
+
+static int ldb_kv_index_cursor_chunk_load(struct ldb_kv_index_cursor *c,
+					  unsigned int chunk)
+{
+	struct ldb_kv_private *ldb_kv = talloc_get_type(
+	    ldb_module_get_private(c->module), struct ldb_kv_private);
+	int ret;
+
+	TALLOC_FREE(c->chunk_msg);
+	c->guids = (struct ldb_val){};
+	c->count = 0;
+	c->pos = 0;
+	c->chunk = chunk;
+
+	if (chunk >= c->num_chunks) {
+		return LDB_SUCCESS;
+	}
+
+	/*
+	 * A callback must not have started a transaction, which
+	 * could rewrite the chunks under us.
+	 */
+	if (ldb_kv->idxptr != NULL) {
+		ldb_asprintf_errstring(ldb_module_get_ctx(c->module),
+				       __location__
+				       ": Index %s changed during search",
+				       c->dir_str);
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	ret = ldb_kv_index_chunk_read(c->module,
+				      c->dir_str,
+				      &c->chunks[chunk],
+				      c,
+				      &c->chunk_msg,
+				      &c->guids);
+	if (ret != LDB_SUCCESS) {
+		return ret;
+	}
+	c->count = c->chunks[chunk].count;
+	return LDB_SUCCESS;
+}
+
+/*
+  settle a chunk cursor on the GUID at pos, moving on to later chunks
+  once the current one is exhausted
+ */
+static int ldb_kv_index_cursor_chunks_settle(struct ldb_kv_index_cursor *c)
+{
+	while (c->pos >= c->count) {
+		int ret;
+
+		if (c->chunk + 1 >= c->num_chunks) {
+			c->eof = true;
+			return LDB_SUCCESS;
+		}
+		ret = ldb_kv_index_cursor_chunk_load(c, c->chunk + 1);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+	}
+	ldb_kv_index_cursor_array_settle(c);
+	return LDB_SUCCESS;
+}
+
+static int ldb_kv_index_cursor_chunks_seek(struct ldb_kv_index_cursor *c,
+					   const uint8_t *target)
+{
+	ldb_kv_index_cursor_array_seek(c, target);
+
+	if (c->pos >= c->count) {
+		/*
+		 * Find the last chunk starting at or before the
+		 * target, the chunks between are skipped unread.
+		 */
+		unsigned int lo = c->chunk + 1;
+		unsigned int hi = c->num_chunks;
+
+		while (lo < hi) {
+			unsigned int mid = lo + (hi - lo) / 2;
+
+			if (memcmp(c->chunks[mid].first,
+				   target,
+				   LDB_KV_GUID_SIZE) <= 0) {
+				lo = mid + 1;
+			} else {
+				hi = mid;
+			}
+		}
+		if (lo - 1 > c->chunk) {
+			int ret = ldb_kv_index_cursor_chunk_load(c, lo - 1);
+			if (ret != LDB_SUCCESS) {
+				return ret;
+			}
+			ldb_kv_index_cursor_array_seek(c, target);
+		}
+	}
+
+	return ldb_kv_index_cursor_chunks_settle(c);
+}
+
+/*
+  leapfrog the children of an AND until they all agree on a GUID
+ */
+static int ldb_kv_index_cursor_and_settle(struct ldb_kv_index_cursor *c)
+{
+	uint8_t target[LDB_KV_GUID_SIZE];
+	unsigned int agreed = 1;
+	unsigned int i = 1;
+
+	if (c->children[0]->eof) {
+		c->eof = true;
+		return LDB_SUCCESS;
+	}
+	memcpy(target, c->children[0]->guid, sizeof(target));
+
+	while (agreed < c->num_children) {
+		struct ldb_kv_index_cursor *child = c->children[i];
+		int ret;
+
+		ret = ldb_kv_index_cursor_seek(child, target);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+		if (child->eof) {
+			c->eof = true;
+			return LDB_SUCCESS;
+		}
+		if (memcmp(child->guid, target, sizeof(target)) != 0) {
+			memcpy(target, child->guid, sizeof(target));
+			agreed = 1;
+		} else {
+			agreed++;
+		}
+		i = (i + 1) % c->num_children;
+	}
+
+	memcpy(c->guid, target, sizeof(target));
+	c->eof = false;
+	return LDB_SUCCESS;
+}
+
+/*
+  an OR sits on the lowest GUID of any of its children
+ */
+static void ldb_kv_index_cursor_or_settle(struct ldb_kv_index_cursor *c)
+{
+	unsigned int i;
+
+	c->eof = true;
+	for (i = 0; i < c->num_children; i++) {
+		const struct ldb_kv_index_cursor *child = c->children[i];
+
+		if (child->eof) {
+			continue;
+		}
+		if (c->eof ||
+		    memcmp(child->guid, c->guid, LDB_KV_GUID_SIZE) < 0) {
+			memcpy(c->guid, child->guid, LDB_KV_GUID_SIZE);
+			c->eof = false;
+		}
+	}
+}
+
+static int ldb_kv_index_cursor_next(struct ldb_kv_index_cursor *c)
+{
+	unsigned int i;
+	int ret;
+
+	if (c->eof) {
+		return LDB_SUCCESS;
+	}
+
+	switch (c->type) {
+	case LDB_KV_INDEX_CURSOR_LIST:
+		c->pos++;
+		ldb_kv_index_cursor_array_settle(c);
+		return LDB_SUCCESS;
+
+	case LDB_KV_INDEX_CURSOR_CHUNKS:
+		c->pos++;
+		return ldb_kv_index_cursor_chunks_settle(c);
+
+	case LDB_KV_INDEX_CURSOR_AND:
+		ret = ldb_kv_index_cursor_next(c->children[0]);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+		return ldb_kv_index_cursor_and_settle(c);
+
+	case LDB_KV_INDEX_CURSOR_OR:
+		for (i = 0; i < c->num_children; i++) {
+			struct ldb_kv_index_cursor *child = c->children[i];
+
+			if (child->eof ||
+			    memcmp(child->guid,
+				   c->guid,
+				   LDB_KV_GUID_SIZE) != 0) {
+				continue;
+			}
+			ret = ldb_kv_index_cursor_next(child);
+			if (ret != LDB_SUCCESS) {
+				return ret;
+			}
+		}
+		ldb_kv_index_cursor_or_settle(c);
+		return LDB_SUCCESS;
+	}
+
+	return LDB_ERR_OPERATIONS_ERROR;
+}
+
+static int ldb_kv_index_cursor_seek(struct ldb_kv_index_cursor *c,
+				    const uint8_t *target)
+{
+	unsigned int i;
+	int ret;
+
+	if (c->eof || memcmp(c->guid, target, LDB_KV_GUID_SIZE) >= 0) {
+		return LDB_SUCCESS;
+	}
+
+	switch (c->type) {
+	case LDB_KV_INDEX_CURSOR_LIST:
+		ldb_kv_index_cursor_array_seek(c, target);
+		ldb_kv_index_cursor_array_settle(c);
+		return LDB_SUCCESS;
+
+	case LDB_KV_INDEX_CURSOR_CHUNKS:
+		return ldb_kv_index_cursor_chunks_seek(c, target);
+
+	case LDB_KV_INDEX_CURSOR_AND:
+		ret = ldb_kv_index_cursor_seek(c->children[0], target);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+		return ldb_kv_index_cursor_and_settle(c);
+
+	case LDB_KV_INDEX_CURSOR_OR:
+		for (i = 0; i < c->num_children; i++) {
+			ret = ldb_kv_index_cursor_seek(c->children[i], target);
+			if (ret != LDB_SUCCESS) {
+				return ret;
+			}
+		}
+		ldb_kv_index_cursor_or_settle(c);
+		return LDB_SUCCESS;
+	}
+
+	return LDB_ERR_OPERATIONS_ERROR;
+}
+
+/*
+  can this equality test be read straight from its index record?
+ */
+static bool ldb_kv_index_cursor_simple_leaf(struct ldb_module *module,
+					    struct ldb_kv_private *ldb_kv,
+					    const struct ldb_parse_tree *tree)
+{
+	const char *attr = tree->u.equality.attr;
+
+	if (ldb_kv->disallow_dn_filter && ldb_attr_cmp(attr, "dn") == 0) {
+		return false;
+	}
+	if (attr[0] == '@' || ldb_attr_dn(attr) == 0) {
+		return false;
+	}
+	if (ldb_attr_cmp(attr, ldb_kv->cache->GUID_index_attribute) == 0) {
+		return false;
+	}
+	return ldb_kv_is_indexed(module, ldb_kv, attr);
+}
+
+/*
+  set up a cursor over the index record for a simple equality test
+ */
+static int ldb_kv_index_cursor_leaf(struct ldb_module *module,
+				    struct ldb_kv_private *ldb_kv,
+				    const struct ldb_parse_tree *tree,
+				    struct ldb_kv_index_cursor *c)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	struct ldb_message *msg = NULL;
+	struct ldb_message_element *el = NULL;
+	struct ldb_dn *dn = NULL;
+	enum key_truncation truncation = KEY_NOT_TRUNCATED;
+	int version;
+	int ret;
+
+	/*
+	 * As in ldb_kv_index_dn_simple() we ignore truncation, the
+	 * candidates are all checked by ldb_kv_index_filter_key().
+	 */
+	dn = ldb_kv_index_key(ldb,
+			      c,
+			      ldb_kv,
+			      tree->u.equality.attr,
+			      &tree->u.equality.value,
+			      NULL,
+			      &truncation);
+	if (dn == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	msg = ldb_msg_new(c);
+	if (msg == NULL) {
+		return ldb_module_oom(module);
+	}
+	ret = ldb_kv_search_dn1(module,
+				dn,
+				msg,
+				LDB_UNPACK_DATA_FLAG_NO_DN |
+				LDB_UNPACK_DATA_FLAG_READ_LOCKED);
+	if (ret != LDB_SUCCESS) {
+		return ret;
+	}
+
+	version = ldb_msg_find_attr_as_int(msg, LDB_KV_IDXVERSION, 0);
+	if (version == LDB_KV_GUID_CHUNKED_INDEXING_VERSION) {
+		c->type = LDB_KV_INDEX_CURSOR_CHUNKS;
+		c->module = module;
+		c->dir_str = ldb_dn_get_linearized(dn);
+		ret = ldb_kv_index_chunk_dir_parse(c,
+						   msg,
+						   &c->chunks,
+						   &c->num_chunks);
+		if (ret != LDB_SUCCESS) {
+			ldb_asprintf_errstring(ldb,
+					       __location__
+					       ": Invalid chunk directory %s",
+					       c->dir_str);
+			return ret;
+		}
+		ret = ldb_kv_index_cursor_chunk_load(c, 0);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+		c->exact = ldb_kv_index_attr_exact(
+		    ldb, tree->u.equality.attr, truncation);
+		return ldb_kv_index_cursor_chunks_settle(c);
+	}
+
+	el = ldb_msg_find_element(msg, LDB_KV_IDX);
+	if (el == NULL) {
+		return LDB_ERR_NO_SUCH_OBJECT;
+	}
+	if (version != LDB_KV_GUID_INDEXING_VERSION) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	ret = ldb_kv_guid_index_values(el, &c->guids);
+	if (ret != LDB_SUCCESS) {
+		return ret;
+	}
+
+	c->type = LDB_KV_INDEX_CURSOR_LIST;
+	c->count = c->guids.length / LDB_KV_GUID_SIZE;
+	c->exact = ldb_kv_index_attr_exact(
+	    ldb, tree->u.equality.attr, truncation);
+	ldb_kv_index_cursor_array_settle(c);
+	return LDB_SUCCESS;
+}
+
+/*
+  build the cursor for a parse tree.  As with ldb_kv_index_dn(),
+  LDB_ERR_NO_SUCH_OBJECT means nothing can match and any other error
+  that the index cannot be used.
+ */
+static int ldb_kv_index_cursor_build(struct ldb_module *module,
+				     struct ldb_kv_private *ldb_kv,
+				     const struct ldb_parse_tree *tree,
+				     TALLOC_CTX *mem_ctx,
+				     struct ldb_kv_index_cursor **_c)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	struct ldb_kv_index_plan_term *terms = NULL;
+	struct ldb_kv_index_cursor *c = NULL;
+	struct dn_list *list = NULL;
+	uint64_t first_cost = LDB_KV_PLAN_UNKNOWN;
+	bool exact = true;
+	unsigned int i;
+	int ret;
+
+	c = talloc_zero(mem_ctx, struct ldb_kv_index_cursor);
+	if (c == NULL) {
+		return ldb_module_oom(module);
+	}
+
+	switch (tree->operation) {
+	case LDB_OP_AND:
+	case LDB_OP_OR:
+		c->type = tree->operation == LDB_OP_AND ?
+			LDB_KV_INDEX_CURSOR_AND : LDB_KV_INDEX_CURSOR_OR;
+		c->children = talloc_array(c,
+					   struct ldb_kv_index_cursor *,
+					   tree->u.list.num_elements);
+		if (c->children == NULL) {
+			TALLOC_FREE(c);
+			return ldb_module_oom(module);
+		}
+		if (c->type == LDB_KV_INDEX_CURSOR_AND) {
+			terms = ldb_kv_index_plan_and(c, module, ldb_kv, tree);
+			if (terms == NULL) {
+				TALLOC_FREE(c);
+				return ldb_module_oom(module);
+			}
+		}
+
+		for (i = 0; i < tree->u.list.num_elements; i++) {
+			unsigned int idx = terms != NULL ? terms[i].idx : i;
+			const struct ldb_parse_tree *subtree
+				= tree->u.list.elements[idx];
+			struct ldb_kv_index_cursor *child = NULL;
+
+			/*
+			 * Leave terms far less selective than the
+			 * best one already chosen to the filter.
+			 */
+			if (terms != NULL &&
+			    c->num_children != 0 &&
+			    first_cost != LDB_KV_PLAN_UNKNOWN &&
+			    terms[i].cost != LDB_KV_PLAN_UNKNOWN &&
+			    terms[i].cost / LDB_KV_PLAN_FETCH_COST
+			    > first_cost) {
+				exact = false;
+				continue;
+			}
+
+			ret = ldb_kv_index_cursor_build(module,
+							ldb_kv,
+							subtree,
+							c,
+							&child);
+			if (ret == LDB_ERR_NO_SUCH_OBJECT) {
+				if (c->type == LDB_KV_INDEX_CURSOR_AND) {
+					/* X && 0 == 0 */
+					TALLOC_FREE(c);
+					return ret;
+				}
+				/* X || 0 == X */
+				continue;
+			}
+			if (ret != LDB_SUCCESS) {
+				if (c->type == LDB_KV_INDEX_CURSOR_AND) {
+					/* this doesn't narrow the AND */
+					exact = false;
+					continue;
+				}
+				/* X || * == * */
+				TALLOC_FREE(c);
+				return ret;
+			}
+
+			/*
+			 * As in ldb_kv_index_dn_and(), a unique index
+			 * match is all we need.
+			 */
+			if (c->type == LDB_KV_INDEX_CURSOR_AND &&
+			    subtree->operation == LDB_OP_EQUALITY &&
+			    ldb_kv_index_unique(ldb,
+						ldb_kv,
+						subtree->u.equality.attr)) {
+				child->exact = child->exact &&
+					tree->u.list.num_elements == 1;
+				*_c = talloc_steal(mem_ctx, child);
+				TALLOC_FREE(c);
+				return LDB_SUCCESS;
+			}
+			if (terms != NULL && c->num_children == 0) {
+				first_cost = terms[i].cost;
+			}
+			exact = exact && child->exact;
+			c->children[c->num_children++] = child;
+		}
+		TALLOC_FREE(terms);
+
+		if (c->num_children == 0) {
+			TALLOC_FREE(c);
+			if (tree->operation == LDB_OP_AND) {
+				/* none of the attributes were indexed */
+				return LDB_ERR_OPERATIONS_ERROR;
+			}
+			return LDB_ERR_NO_SUCH_OBJECT;
+		}
+		if (c->num_children == 1) {
+			c->children[0]->exact = exact;
+			*_c = talloc_steal(mem_ctx, c->children[0]);
+			TALLOC_FREE(c);
+			return LDB_SUCCESS;
+		}
+		c->exact = exact;
+
+		if (c->type == LDB_KV_INDEX_CURSOR_AND) {
+			ret = ldb_kv_index_cursor_and_settle(c);
+			if (ret != LDB_SUCCESS) {
+				TALLOC_FREE(c);
+				return ret;
+			}
+		} else {
+			ldb_kv_index_cursor_or_settle(c);
+		}
+		*_c = c;
+		return LDB_SUCCESS;
+
+	case LDB_OP_EQUALITY:
+		if (ldb_kv_index_cursor_simple_leaf(module, ldb_kv, tree)) {
+			ret = ldb_kv_index_cursor_leaf(module, ldb_kv, tree, c);
+			if (ret != LDB_SUCCESS) {
+				TALLOC_FREE(c);
+				return ret;
+			}
+			*_c = c;
+			return LDB_SUCCESS;
+		}
+		break;
+
+	default:
+		break;
+	}
+
+	list = talloc_zero(c, struct dn_list);
+	if (list == NULL) {
+		TALLOC_FREE(c);
+		return ldb_module_oom(module);
+	}
+	ret = ldb_kv_index_dn(module, ldb_kv, tree, list);
+	if (ret != LDB_SUCCESS) {
+		TALLOC_FREE(c);
+		return ret;
+	}
+	for (i = 0; i < list->count; i++) {
+		if (list->dn[i].length != LDB_KV_GUID_SIZE) {
+			TALLOC_FREE(c);
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+	}
+
+	c->type = LDB_KV_INDEX_CURSOR_LIST;
+	c->list = list;
+	c->count = list->count;
+	c->exact = list->exact;
+	ldb_kv_index_cursor_array_settle(c);
+	*_c = c;
+	return LDB_SUCCESS;
+}
+
+/*
+  filter the candidates produced by a cursor into a set of results,
+  reading and sending each record as it is reached
+ */
+static int ldb_kv_index_filter_cursor(struct ldb_kv_private *ldb_kv,
+				      struct ldb_kv_index_cursor *cursor,
+				      struct ldb_kv_context *ac,
+				      uint32_t *match_count)
+{
+	uint8_t previous_guid[LDB_KV_GUID_SIZE];
+	uint8_t key_buf[LDB_KV_GUID_KEY_SIZE];
+	struct ldb_val key = {
+		.data = key_buf,
+		.length = sizeof(key_buf),
+	};
+	unsigned int i = 0;
+	int ret;
+
+	while (!cursor->eof) {
+		struct ldb_val guid = {
+			.data = cursor->guid,
+			.length = LDB_KV_GUID_SIZE,
+		};
+
+		/*
+		 * Skip duplicates, as ldb_kv_index_filter() does, so
+		 * that the same entry is not sent back more than once.
+		 */
+		if (i == 0 ||
+		    memcmp(previous_guid, guid.data, sizeof(previous_guid))
+		    != 0) {
+			memcpy(previous_guid, guid.data, sizeof(previous_guid));
+
+			ret = ldb_kv_guid_to_key(&guid, &key);
+			if (ret != LDB_SUCCESS) {
+				return ret;
+			}
+			ret = ldb_kv_index_filter_key(ldb_kv,
+						      ac,
+						      key,
+						      i,
+						      match_count,
+						      KEY_NOT_TRUNCATED);
+			if (ret != LDB_SUCCESS) {
+				return ret;
+			}
+			i++;
+		}
+
+		ret = ldb_kv_index_cursor_next(cursor);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+	}
+
+	return LDB_SUCCESS;
+}
+
+/*
+  search the database through a cursor for the search tree, in the
+  GUID index mode and outside a transaction
+ */
+int ldb_kv_index_search_cursor(struct ldb_kv_context *ac,
+			       struct ldb_kv_private *ldb_kv,
+			       uint32_t *match_count)
+{
+	struct ldb_kv_index_cursor *cursor = NULL;
+	int ret;
+
+	ret = ldb_kv_index_cursor_build(ac->module,
+					ldb_kv,
+					ac->tree,
+					ac,
+					&cursor);
+	if (ret != LDB_SUCCESS) {
+		return ret;
+	}
+	ac->index_exact = cursor->exact;
+	ret = ldb_kv_index_filter_cursor(ldb_kv,
+					 cursor,
+					 ac,
+					 match_count);
+	talloc_free(cursor);
+	return ret;
+}
@@ -0,0 +1,376 @@
+/*
+   ldb database library
+
+   Copyright (C) Andrew Tridgell  2004-2009
+
+     ** NOTE! The following LGPL license applies to the ldb
+     ** library. This does NOT imply that all of Samba is released
+     ** under the LGPL
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ *  Name: ldb
+ *
+ *  Component: ldb key value backend - index keys
+ *
+ *  Description: building the @INDEX DN that an attribute value is
+ *  indexed under, in the base64 or @IDX_BINARY_KEYS encoding, and
+ *  truncating it to fit the longest key the backend will store.
+ */
+
+#include "ldb_kv.h"
+#include "ldb_kv_index.h"
+#include "ldb_private.h"
+
+/*
+  the longest key the backend will store
+*/
+unsigned ldb_kv_max_key_length(struct ldb_kv_private *ldb_kv)
+{
+	if (ldb_kv->max_key_length == 0) {
+		return UINT_MAX;
+	}
+	return ldb_kv->max_key_length;
+}
+
+/*
+  escape a value for an index key in @IDX_BINARY_KEYS mode.  The
+  bytes are kept as they are, except that 0x00 and 0x01 become 0x01
+  0x01 and 0x01 0x02, so the key is still a string and the keys keep
+  the memcmp() order of the values.
+*/
+static struct ldb_val ldb_kv_index_key_escape(TALLOC_CTX *mem_ctx,
+					      const struct ldb_val *v)
+{
+	struct ldb_val bin = { .data = NULL, .length = 0 };
+	size_t i, j, len = v->length;
+
+	for (i = 0; i < v->length; i++) {
+		if (v->data[i] <= 0x01) {
+			len++;
+		}
+	}
+	if (len < v->length || len + 1 < len) {
+		return bin;
+	}
+
+	bin.data = talloc_array(mem_ctx, uint8_t, len + 1);
+	if (bin.data == NULL) {
+		return bin;
+	}
+	for (i = 0, j = 0; i < v->length; i++) {
+		if (v->data[i] <= 0x01) {
+			bin.data[j++] = 0x01;
+			bin.data[j++] = v->data[i] + 1;
+		} else {
+			bin.data[j++] = v->data[i];
+		}
+	}
+	bin.data[j] = '\0';
+	bin.length = len;
+	return bin;
+}
+
+/*
+  the length of the longest start of an escaped value, no longer than
+  max, that does not split an escaped byte
+*/
+static size_t ldb_kv_index_key_escaped_prefix(const struct ldb_val *bin,
+					      size_t max)
+{
+	size_t i = 0;
+
+	while (i < max) {
+		size_t step = (bin->data[i] == 0x01) ? 2 : 1;
+		if (i + step > max) {
+			break;
+		}
+		i += step;
+	}
+	return i;
+}
+
+/*
+  return the dn key to be used for an index
+  the caller is responsible for freeing
+
+  Only mem_ctx is allocated on, and if set_errstring is false the
+  ldb error string is left alone, so that this can be called on a
+  reindex worker thread.
+*/
+struct ldb_dn *ldb_kv_index_key_internal(
+	struct ldb_context *ldb,
+	TALLOC_CTX *mem_ctx,
+	struct ldb_kv_private *ldb_kv,
+	const char *attr,
+	const struct ldb_val *value,
+	const struct ldb_schema_attribute **ap,
+	enum key_truncation *truncation,
+	bool set_errstring)
+{
+	struct ldb_dn *ret;
+	struct ldb_val v;
+	const struct ldb_schema_attribute *a = NULL;
+	char *attr_folded = NULL;
+	const char *attr_for_dn = NULL;
+	int r;
+	bool should_b64_encode;
+
+	unsigned int max_key_length = ldb_kv_max_key_length(ldb_kv);
+	size_t key_len = 0;
+	size_t attr_len = 0;
+	const size_t indx_len = sizeof(LDB_KV_INDEX) - 1;
+	unsigned frmt_len = 0;
+	const size_t additional_key_length = 4;
+	unsigned int num_separators = 3; /* Estimate for overflow check */
+	const size_t min_data = 1;
+	const size_t min_key_length = additional_key_length
+		+ indx_len + num_separators + min_data;
+	struct ldb_val empty;
+
+	/*
+	 * Accept a NULL value as a request for a key with no value.  This is
+	 * different from passing an empty value, which might be given
+	 * significance by some canonicalise functions.
+	 */
+	bool empty_val = value == NULL;
+	if (empty_val) {
+		empty.length = 0;
+		empty.data = discard_const_p(unsigned char, "");
+		value = &empty;
+	}
+
+	if (attr[0] == '@') {
+		attr_for_dn = attr;
+		v = *value;
+		if (ap != NULL) {
+			*ap = NULL;
+		}
+	} else {
+		attr_folded = ldb_attr_casefold(mem_ctx, attr);
+		if (!attr_folded) {
+			return NULL;
+		}
+
+		attr_for_dn = attr_folded;
+
+		a = ldb_schema_attribute_by_name(ldb, attr);
+		if (ap) {
+			*ap = a;
+		}
+
+		if (empty_val) {
+			v = *value;
+		} else {
+			ldb_attr_handler_t fn;
+			if (a->syntax->index_format_fn &&
+			    ldb_kv->cache->GUID_index_attribute != NULL) {
+				fn = a->syntax->index_format_fn;
+			} else {
+				fn = a->syntax->canonicalise_fn;
+			}
+			r = fn(ldb, mem_ctx, value, &v);
+			if (r != LDB_SUCCESS) {
+				const char *errstr = NULL;
+				talloc_free(attr_folded);
+				if (!set_errstring) {
+					return NULL;
+				}
+				errstr = ldb_errstring(ldb);
+				/* canonicalisation can be refused. For
+				   example, a attribute that takes wildcards
+				   will refuse to canonicalise if the value
+				   contains a wildcard */
+				ldb_asprintf_errstring(ldb,
+						       "Failed to create "
+						       "index key for "
+						       "attribute '%s':%s%s%s",
+						       attr, ldb_strerror(r),
+						       (errstr?":":""),
+						       (errstr?errstr:""));
+				return NULL;
+			}
+		}
+	}
+	attr_len = strlen(attr_for_dn);
+
+	/*
+	 * Check if there is any hope this will fit into the DB.
+	 * Overflow here is not actually critical the code below
+	 * checks again to make the printf and the DB does another
+	 * check for too long keys
+	 */
+	if (max_key_length - attr_len < min_key_length) {
+		if (set_errstring) {
+			ldb_asprintf_errstring(
+				ldb,
+				__location__ ": max_key_length "
+				"is too small (%u) < (%u)",
+				max_key_length,
+				(unsigned)(min_key_length + attr_len));
+		}
+		talloc_free(attr_folded);
+		return NULL;
+	}
+
+	/*
+	 * ltdb_key_dn() makes something 4 bytes longer, it adds a leading
+	 * "DN=" and a trailing string terminator
+	 */
+	max_key_length -= additional_key_length;
+
+	/*
+	 * We do not base 64 encode a DN in a key, it has already been
+	 * casefolded and linearized, that is good enough.  That already
+	 * avoids embedded NUL etc.
+	 */
+	if (ldb_kv->cache->GUID_index_attribute != NULL) {
+		if (strcmp(attr, LDB_KV_IDXDN) == 0) {
+			should_b64_encode = false;
+		} else if (strcmp(attr, LDB_KV_IDXONE) == 0) {
+			/*
+			 * We can only change the behaviour for IDXONE
+			 * when the GUID index is enabled
+			 */
+			should_b64_encode = false;
+		} else if (strcmp(attr, LDB_KV_IDXSUBTREE) == 0) {
+			should_b64_encode = false;
+		} else {
+			should_b64_encode
+				= ldb_should_b64_encode(ldb, &v);
+		}
+	} else {
+		should_b64_encode = ldb_should_b64_encode(ldb, &v);
+	}
+
+	if (should_b64_encode && ldb_kv->cache->binary_index_keys) {
+		struct ldb_val bin = ldb_kv_index_key_escape(mem_ctx, &v);
+		if (bin.data == NULL) {
+			talloc_free(attr_folded);
+			return NULL;
+		}
+		/* Only need two separators */
+		num_separators = 2;
+
+		key_len = num_separators + indx_len + attr_len + bin.length;
+		if (key_len > max_key_length) {
+			size_t excess = key_len - max_key_length;
+			frmt_len = ldb_kv_index_key_escaped_prefix(
+				&bin, bin.length - excess);
+			*truncation = KEY_TRUNCATED;
+			ret = ldb_dn_new_fmt(mem_ctx, ldb, "%s#%s#%.*s",
+					     LDB_KV_INDEX, attr_for_dn,
+					     frmt_len, (char *)bin.data);
+		} else {
+			frmt_len = bin.length;
+			*truncation = KEY_NOT_TRUNCATED;
+			ret = ldb_dn_new_fmt(mem_ctx, ldb, "%s:%s:%.*s",
+					     LDB_KV_INDEX, attr_for_dn,
+					     frmt_len, (char *)bin.data);
+		}
+		talloc_free(bin.data);
+	} else if (should_b64_encode) {
+		size_t vstr_len = 0;
+		char *vstr = ldb_base64_encode(mem_ctx, (char *)v.data, v.length);
+		if (!vstr) {
+			talloc_free(attr_folded);
+			return NULL;
+		}
+		vstr_len = strlen(vstr);
+		/*
+		 * Overflow here is not critical as we only use this
+		 * to choose the printf truncation
+		 */
+		key_len = num_separators + indx_len + attr_len + vstr_len;
+		if (key_len > max_key_length) {
+			size_t excess = key_len - max_key_length;
+			frmt_len = vstr_len - excess;
+			*truncation = KEY_TRUNCATED;
+			/*
+			* Truncated keys are placed in a separate key space
+			* from the non truncated keys
+			* Note: the double hash "##" is not a typo and
+			* indicates that the following value is base64 encoded
+			*/
+			ret = ldb_dn_new_fmt(mem_ctx, ldb, "%s#%s##%.*s",
+					     LDB_KV_INDEX, attr_for_dn,
+					     frmt_len, vstr);
+		} else {
+			frmt_len = vstr_len;
+			*truncation = KEY_NOT_TRUNCATED;
+			/*
+			 * Note: the double colon "::" is not a typo and
+			 * indicates that the following value is base64 encoded
+			 */
+			ret = ldb_dn_new_fmt(mem_ctx, ldb, "%s:%s::%.*s",
+					     LDB_KV_INDEX, attr_for_dn,
+					     frmt_len, vstr);
+		}
+		talloc_free(vstr);
+	} else {
+		/* Only need two separators */
+		num_separators = 2;
+
+		/*
+		 * Overflow here is not critical as we only use this
+		 * to choose the printf truncation
+		 */
+		key_len = num_separators + indx_len + attr_len + (int)v.length;
+		if (key_len > max_key_length) {
+			size_t excess = key_len - max_key_length;
+			frmt_len = v.length - excess;
+			*truncation = KEY_TRUNCATED;
+			/*
+			 * Truncated keys are placed in a separate key space
+			 * from the non truncated keys
+			 */
+			ret = ldb_dn_new_fmt(mem_ctx, ldb, "%s#%s#%.*s",
+					     LDB_KV_INDEX, attr_for_dn,
+					     frmt_len, (char *)v.data);
+		} else {
+			frmt_len = v.length;
+			*truncation = KEY_NOT_TRUNCATED;
+			ret = ldb_dn_new_fmt(mem_ctx, ldb, "%s:%s:%.*s",
+					     LDB_KV_INDEX, attr_for_dn,
+					     frmt_len, (char *)v.data);
+		}
+	}
+
+	if (value != NULL && v.data != value->data && !empty_val) {
+		talloc_free(v.data);
+	}
+	talloc_free(attr_folded);
+
+	return ret;
+}
+
+struct ldb_dn *ldb_kv_index_key(struct ldb_context *ldb,
+				TALLOC_CTX *mem_ctx,
+				struct ldb_kv_private *ldb_kv,
+				const char *attr,
+				const struct ldb_val *value,
+				const struct ldb_schema_attribute **ap,
+				enum key_truncation *truncation)
+{
+	return ldb_kv_index_key_internal(ldb,
+					 mem_ctx,
+					 ldb_kv,
+					 attr,
+					 value,
+					 ap,
+					 truncation,
+					 true);
+}
@@ -0,0 +1,462 @@
+/*
+   ldb database library
+
+   Copyright (C) Andrew Tridgell  2004-2009
+
+     ** NOTE! The following LGPL license applies to the ldb
+     ** library. This does NOT imply that all of Samba is released
+     ** under the LGPL
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ *  Name: ldb
+ *
+ *  Component: ldb key value backend - index lists
+ *
+ *  Description: searching, intersecting and merging the lists of
+ *  DNs or GUIDs held in index records.  In the GUID index case the
+ *  lists are kept sorted, so the set operations are a merge.
+ */
+
+#include "ldb_kv.h"
+#include "ldb_kv_index.h"
+#include "ldb_private.h"
+#include "lib/util/binsearch.h"
+
+/*
+  see if two ldb_val structures contain exactly the same data
+  return -1 or 1 for a mismatch, 0 for match
+*/
+int ldb_val_equal_exact_for_qsort(const struct ldb_val *v1,
+				  const struct ldb_val *v2)
+{
+	if (v1->length > v2->length) {
+		return -1;
+	}
+	if (v1->length < v2->length) {
+		return 1;
+	}
+	return memcmp(v1->data, v2->data, v1->length);
+}
+
+/*
+  see if two ldb_val structures contain exactly the same data
+  return -1 or 1 for a mismatch, 0 for match
+*/
+int ldb_val_equal_exact_ordered(const struct ldb_val v1,
+				const struct ldb_val *v2)
+{
+	if (v1.length > v2->length) {
+		return -1;
+	}
+	if (v1.length < v2->length) {
+		return 1;
+	}
+	return memcmp(v1.data, v2->data, v1.length);
+}
+
+/*
+  compare two entries of a dn_list, in the same order as
+  ldb_val_equal_exact_for_qsort().  GUIDs, which are nearly always
+  what is being compared, take a fixed size memcmp() the compiler
+  can inline.
+*/
+static inline int ldb_kv_dn_list_cmp(const struct ldb_val *v1,
+				     const struct ldb_val *v2)
+{
+	if (likely(v1->length == LDB_KV_GUID_SIZE &&
+		   v2->length == LDB_KV_GUID_SIZE)) {
+		return memcmp(v1->data, v2->data, LDB_KV_GUID_SIZE);
+	}
+	return ldb_val_equal_exact_for_qsort(v1, v2);
+}
+
+/*
+  find a entry in a dn_list, using a ldb_val. Uses a case sensitive
+  binary-safe comparison for the 'dn' returns -1 if not found
+
+  This is therefore safe when the value is a GUID in the future
+ */
+static int ldb_kv_dn_list_find_val(struct ldb_kv_private *ldb_kv,
+				   const struct dn_list *list,
+				   const struct ldb_val *v)
+{
+	unsigned int i;
+	struct ldb_val *exact = NULL, *next = NULL;
+
+	if (unlikely(list->count > INT_MAX)) {
+		return -1;
+	}
+
+	if (ldb_kv->cache->GUID_index_attribute == NULL) {
+		for (i=0; i<list->count; i++) {
+			if (ldb_val_equal_exact(&list->dn[i], v) == 1) {
+				return i;
+			}
+		}
+		return -1;
+	}
+
+	BINARY_ARRAY_SEARCH_GTE(list->dn, list->count,
+				*v, ldb_val_equal_exact_ordered,
+				exact, next);
+	if (exact == NULL) {
+		return -1;
+	}
+	/* Not required, but keeps the compiler quiet */
+	if (next != NULL) {
+		return -1;
+	}
+
+	i = exact - list->dn;
+	return i;
+}
+
+/*
+  find a entry in a dn_list. Uses a case sensitive comparison with the dn
+  returns -1 if not found
+ */
+int ldb_kv_dn_list_find_msg(struct ldb_kv_private *ldb_kv,
+			    struct dn_list *list,
+			    const struct ldb_message *msg)
+{
+	struct ldb_val v;
+	const struct ldb_val *key_val;
+	if (ldb_kv->cache->GUID_index_attribute == NULL) {
+		const char *dn_str = ldb_dn_get_linearized(msg->dn);
+		v.data = discard_const_p(unsigned char, dn_str);
+		v.length = strlen(dn_str);
+	} else {
+		key_val = ldb_msg_find_ldb_val(
+		    msg, ldb_kv->cache->GUID_index_attribute);
+		if (key_val == NULL) {
+			return -1;
+		}
+		v = *key_val;
+	}
+	return ldb_kv_dn_list_find_val(ldb_kv, list, &v);
+}
+
+/*
+  sort a DN list
+ */
+static void ldb_kv_dn_list_sort(struct ldb_kv_private *ltdb,
+				struct dn_list *list)
+{
+	if (list->count < 2) {
+		return;
+	}
+
+	/* We know the list is sorted when using the GUID index */
+	if (ltdb->cache->GUID_index_attribute != NULL) {
+		return;
+	}
+
+	TYPESAFE_QSORT(list->dn, list->count,
+		       ldb_val_equal_exact_for_qsort);
+}
+
+/*
+  put the GUIDs appended to a dn_list by a bulk load back in order
+
+  A duplicate GUID can not be seen as it is appended, so it is
+  reported here, with the warning ldb_kv_index_add1() gives, and
+  only the first copy is kept.
+ */
+void ldb_kv_dn_list_order(struct ldb_module *module,
+			  struct ldb_kv_private *ldb_kv,
+			  struct ldb_kv_idxptr_entry *entry)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	struct dn_list *list = entry->list;
+	const struct ldb_schema_attribute *attr = NULL;
+	unsigned int i, n;
+
+	TYPESAFE_QSORT(list->dn, list->count,
+		       ldb_val_equal_exact_for_qsort);
+	list->unsorted = false;
+
+	if (!list->check_duplicates) {
+		return;
+	}
+	list->check_duplicates = false;
+
+	for (i = 1, n = 1; i < list->count; i++) {
+		struct ldb_val v;
+		int ret;
+
+		if (ldb_kv_dn_list_cmp(&list->dn[n - 1],
+				       &list->dn[i]) != 0) {
+			list->dn[n++] = list->dn[i];
+			continue;
+		}
+
+		if (attr == NULL) {
+			/* This can't fail, gives a default at worst */
+			attr = ldb_schema_attribute_by_name(
+			    ldb, ldb_kv->cache->GUID_index_attribute);
+		}
+		ret = attr->syntax->ldif_write_fn(ldb, list,
+						  &list->dn[i], &v);
+		if (ret == LDB_SUCCESS) {
+			ldb_debug(ldb,
+				  LDB_DEBUG_WARNING,
+				  __location__
+				  ": duplicate attribute value in bulk load "
+				  "for index %s, "
+				  "duplicate of %s %*.*s",
+				  (const char *)entry->key.data,
+				  ldb_kv->cache->GUID_index_attribute,
+				  (int)v.length,
+				  (int)v.length,
+				  v.data);
+			talloc_free(v.data);
+		}
+	}
+	if (list->count > 0) {
+		list->count = n;
+	}
+}
+
+/*
+  intersect the sorted GUID lists a and b into out, which has room
+  for na entries, returning the number of entries of a that are in b.
+
+  Each entry of a is looked for in b from where the one before it
+  was, at steps of 1, 2, 4, ... entries and then by a binary search
+  between the last two steps.  So a list is intersected with a much
+  longer one in O(na log(nb / na)) comparisons, and with one of about
+  the same length in a single pass over both, rather than in a
+  binary search of all of b for each entry.
+*/
+static unsigned int ldb_kv_guid_list_intersect(const struct ldb_val *a,
+					       unsigned int na,
+					       const struct ldb_val *b,
+					       unsigned int nb,
+					       struct ldb_val *out)
+{
+	unsigned int i, k = 0;
+	size_t j = 0;
+
+	for (i = 0; i < na && j < nb; i++) {
+		if (ldb_kv_dn_list_cmp(&b[j], &a[i]) < 0) {
+			/* b[lo] < a[i], find a hi with a[i] <= b[hi] */
+			size_t lo = j, hi = j + 1, step = 1;
+
+			while (hi < nb && ldb_kv_dn_list_cmp(&b[hi], &a[i]) < 0) {
+				lo = hi;
+				step *= 2;
+				hi = MIN(lo + step, nb);
+			}
+
+			/* the first of b[lo + 1] ... b[hi] not below a[i] */
+			lo++;
+			while (lo < hi) {
+				size_t mid = lo + (hi - lo) / 2;
+				if (ldb_kv_dn_list_cmp(&b[mid], &a[i]) < 0) {
+					lo = mid + 1;
+				} else {
+					hi = mid;
+				}
+			}
+			j = lo;
+			if (j == nb) {
+				break;
+			}
+		}
+		if (ldb_kv_dn_list_cmp(&b[j], &a[i]) == 0) {
+			out[k++] = a[i];
+		}
+	}
+	return k;
+}
+
+/*
+  list intersection
+  list = list & list2
+*/
+bool ldb_kv_dn_list_intersect(struct ldb_kv_private *ldb_kv,
+			      struct dn_list *list,
+			      const struct dn_list *list2)
+{
+	const struct dn_list *short_list, *long_list;
+	struct dn_list *list3;
+	unsigned int i;
+
+	if (list->count == 0) {
+		/* 0 & X == 0 */
+		return true;
+	}
+	if (list2->count == 0) {
+		/* X & 0 == 0 */
+		list->count = 0;
+		list->dn = NULL;
+		return true;
+	}
+
+	/*
+	 * In both of the below we check for strict and in that
+	 * case do not optimise the intersection of this list,
+	 * we must never return an entry not in this
+	 * list.  This allows the index for
+	 * SCOPE_ONELEVEL to be trusted.
+	 */
+
+	/* the indexing code is allowed to return a longer list than
+	   what really matches, as all results are filtered by the
+	   full expression at the end - this shortcut avoids a lot of
+	   work in some cases */
+	if (list->count < 2 && list2->count > 10 && list2->strict == false) {
+		list->exact = false;
+		return true;
+	}
+	if (list2->count < 2 && list->count > 10 && list->strict == false) {
+		list->exact = false;
+		list->count = list2->count;
+		list->dn = list2->dn;
+		/* note that list2 may not be the parent of list2->dn,
+		   as list2->dn may be owned by ltdb->idxptr. In that
+		   case we expect this reparent call to fail, which is
+		   OK */
+		talloc_reparent(list2, list, list2->dn);
+		return true;
+	}
+
+	if (list->count > list2->count) {
+		short_list = list2;
+		long_list = list;
+	} else {
+		short_list = list;
+		long_list = list2;
+	}
+
+	list3 = talloc_zero(list, struct dn_list);
+	if (list3 == NULL) {
+		return false;
+	}
+
+	list3->dn = talloc_array(list3, struct ldb_val, short_list->count);
+	if (!list3->dn) {
+		talloc_free(list3);
+		return false;
+	}
+	list3->count = 0;
+
+	if (ldb_kv->cache->GUID_index_attribute != NULL) {
+		/* Both lists are sorted in the GUID index case */
+		list3->count = ldb_kv_guid_list_intersect(short_list->dn,
+							  short_list->count,
+							  long_list->dn,
+							  long_list->count,
+							  list3->dn);
+	} else {
+		for (i=0;i<short_list->count;i++) {
+			if (ldb_kv_dn_list_find_val(
+				ldb_kv, long_list, &short_list->dn[i]) != -1) {
+				list3->dn[list3->count] = short_list->dn[i];
+				list3->count++;
+			}
+		}
+	}
+
+	list->strict |= list2->strict;
+	list->dn = talloc_steal(list, list3->dn);
+	list->count = list3->count;
+	talloc_free(list3);
+
+	return true;
+}
+
+/*
+  list union
+  list = list | list2
+*/
+bool ldb_kv_dn_list_union(struct ldb_context *ldb,
+			  struct ldb_kv_private *ldb_kv,
+			  struct dn_list *list,
+			  struct dn_list *list2)
+{
+	struct ldb_val *dn3;
+	unsigned int i = 0, j = 0, k = 0;
+
+	if (list2->count == 0) {
+		/* X | 0 == X */
+		return true;
+	}
+
+	if (list->count == 0) {
+		/* 0 | X == X */
+		list->count = list2->count;
+		list->dn = list2->dn;
+		/* note that list2 may not be the parent of list2->dn,
+		   as list2->dn may be owned by ltdb->idxptr. In that
+		   case we expect this reparent call to fail, which is
+		   OK */
+		talloc_reparent(list2, list, list2->dn);
+		return true;
+	}
+
+	/*
+	 * Sort the lists (if not in GUID DN mode) so we can do
+	 * the de-duplication during the merge
+	 *
+	 * NOTE: This can sort the in-memory index values, as list or
+	 * list2 might not be a copy!
+	 */
+	ldb_kv_dn_list_sort(ldb_kv, list);
+	ldb_kv_dn_list_sort(ldb_kv, list2);
+
+	dn3 = talloc_array(list, struct ldb_val, list->count + list2->count);
+	if (!dn3) {
+		ldb_oom(ldb);
+		return false;
+	}
+
+	while (i < list->count || j < list2->count) {
+		int cmp;
+		if (i >= list->count) {
+			cmp = 1;
+		} else if (j >= list2->count) {
+			cmp = -1;
+		} else {
+			cmp = ldb_kv_dn_list_cmp(&list->dn[i],
+						 &list2->dn[j]);
+		}
+
+		if (cmp < 0) {
+			/* Take list */
+			dn3[k] = list->dn[i];
+			i++;
+			k++;
+		} else if (cmp > 0) {
+			/* Take list2 */
+			dn3[k] = list2->dn[j];
+			j++;
+			k++;
+		} else {
+			/* Equal, take list */
+			dn3[k] = list->dn[i];
+			i++;
+			j++;
+			k++;
+		}
+	}
+
+	list->dn = dn3;
+	list->count = k;
+
+	return true;
+}
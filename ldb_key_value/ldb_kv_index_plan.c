@@ -0,0 +1,508 @@
+/*
+   ldb database library
+
+   Copyright (C) Andrew Tridgell  2004-2009
+
+     ** NOTE! The following LGPL license applies to the ldb
+     ** library. This does NOT imply that all of Samba is released
+     ** under the LGPL
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ *  Name: ldb
+ *
+ *  Component: ldb key value backend - index search planner
+ *
+ *  Description: the planner uses the @INDEXSTATS statistics to
+ *  estimate how many candidates each part of an indexed search will
+ *  produce, so that the most selective index records are read first
+ *  and, when the index would return most of the database anyway, a
+ *  full scan can be used instead.
+ *
+ *  The statistics are kept up to date by the index transaction
+ *  commit in ldb_kv_index.c.
+ */
+
+#include "ldb_kv.h"
+#include "ldb_kv_index.h"
+#include "ldb_private.h"
+
+/* full scans are only chosen over the index for databases this large */
+#define LDB_KV_PLAN_FULL_SCAN_MIN_OBJECTS 256
+
+/* and then only if the index would return this percentage of it */
+#define LDB_KV_PLAN_FULL_SCAN_PERCENT 75
+
+/*
+  find the statistics of the index of an attribute
+ */
+struct ldb_kv_index_stat *ldb_kv_index_stats_find(
+	const struct ldb_kv_index_stats *stats,
+	const char *attr,
+	size_t attr_len)
+{
+	unsigned int i;
+
+	for (i = 0; i < stats->num_attrs; i++) {
+		struct ldb_kv_index_stat *st = &stats->attrs[i];
+
+		if (strlen(st->attr) == attr_len &&
+		    strncasecmp(st->attr, attr, attr_len) == 0) {
+			return st;
+		}
+	}
+	return NULL;
+}
+
+/*
+  read the @INDEXSTATS record, returning LDB_ERR_NO_SUCH_OBJECT if
+  there is none
+ */
+int ldb_kv_index_stats_read(struct ldb_module *module,
+			    TALLOC_CTX *mem_ctx,
+			    struct ldb_kv_index_stats **_stats)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	struct ldb_kv_index_stats *stats = NULL;
+	struct ldb_message_element *el = NULL;
+	struct ldb_message *msg = NULL;
+	struct ldb_dn *dn = NULL;
+	unsigned int i;
+	int ret;
+
+	stats = talloc_zero(mem_ctx, struct ldb_kv_index_stats);
+	if (stats == NULL) {
+		return ldb_module_oom(module);
+	}
+	msg = ldb_msg_new(stats);
+	if (msg == NULL) {
+		TALLOC_FREE(stats);
+		return ldb_module_oom(module);
+	}
+	dn = ldb_dn_new(msg, ldb, LDB_KV_INDEXSTATS);
+	if (dn == NULL) {
+		TALLOC_FREE(stats);
+		return ldb_module_oom(module);
+	}
+
+	ret = ldb_kv_search_dn1(module, dn, msg, LDB_UNPACK_DATA_FLAG_NO_DN);
+	if (ret != LDB_SUCCESS) {
+		TALLOC_FREE(stats);
+		return ret;
+	}
+
+	stats->objects = ldb_msg_find_attr_as_uint64(msg,
+						     LDB_KV_IDXOBJECTS,
+						     0);
+
+	el = ldb_msg_find_element(msg, LDB_KV_IDXSTAT);
+	if (el != NULL) {
+		stats->attrs = talloc_array(stats,
+					    struct ldb_kv_index_stat,
+					    el->num_values);
+		if (stats->attrs == NULL) {
+			TALLOC_FREE(stats);
+			return ldb_module_oom(module);
+		}
+	}
+
+	for (i = 0; el != NULL && i < el->num_values; i++) {
+		struct ldb_kv_index_stat *st = &stats->attrs[stats->num_attrs];
+		unsigned long long records, entries;
+		char *str = NULL;
+		char *p = NULL;
+
+		str = talloc_strndup(stats->attrs,
+				     (const char *)el->values[i].data,
+				     el->values[i].length);
+		if (str == NULL) {
+			TALLOC_FREE(stats);
+			return ldb_module_oom(module);
+		}
+
+		/* "ATTR records entries", ignore anything else */
+		p = strchr(str, ' ');
+		if (p == NULL ||
+		    sscanf(p, " %llu %llu", &records, &entries) != 2) {
+			TALLOC_FREE(str);
+			continue;
+		}
+		*p = '\0';
+
+		st->attr = str;
+		st->records = records;
+		st->entries = entries;
+		stats->num_attrs++;
+	}
+
+	TALLOC_FREE(msg);
+	*_stats = stats;
+	return LDB_SUCCESS;
+}
+
+/*
+  load the index statistics into the cache
+ */
+int ldb_kv_index_stats_load(struct ldb_module *module,
+			    struct ldb_kv_private *ldb_kv)
+{
+	int ret;
+
+	TALLOC_FREE(ldb_kv->cache->index_stats);
+
+	ret = ldb_kv_index_stats_read(module,
+				      ldb_kv->cache,
+				      &ldb_kv->cache->index_stats);
+	if (ret == LDB_ERR_NO_SUCH_OBJECT) {
+		return LDB_SUCCESS;
+	}
+	return ret;
+}
+
+/*
+  count the GUIDs in the index record for an equality term, with one
+  lookup of the index record (the chunks of a chunked record are not
+  read).  A truncated key may count other values as well.
+ */
+static uint64_t ldb_kv_index_plan_value_count(
+	struct ldb_module *module,
+	struct ldb_kv_private *ldb_kv,
+	const struct ldb_parse_tree *tree)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	enum key_truncation truncation = KEY_NOT_TRUNCATED;
+	struct ldb_kv_idxptr_entry *entry = NULL;
+	struct ldb_message_element *el = NULL;
+	struct ldb_message *msg = NULL;
+	struct ldb_dn *dn = NULL;
+	uint64_t count = LDB_KV_PLAN_UNKNOWN;
+	int ret;
+
+	msg = ldb_msg_new(module);
+	if (msg == NULL) {
+		return LDB_KV_PLAN_UNKNOWN;
+	}
+	dn = ldb_kv_index_key(ldb,
+			      msg,
+			      ldb_kv,
+			      tree->u.equality.attr,
+			      &tree->u.equality.value,
+			      NULL,
+			      &truncation);
+	if (dn == NULL) {
+		TALLOC_FREE(msg);
+		return LDB_KV_PLAN_UNKNOWN;
+	}
+
+	if (ldb_kv->idxptr != NULL) {
+		if (ldb_kv->nested_idx_ptr != NULL) {
+			entry = ldb_kv_idxptr_find_dn(ldb_kv->nested_idx_ptr,
+						      dn);
+		}
+		if (entry == NULL) {
+			entry = ldb_kv_idxptr_find_dn(ldb_kv->idxptr, dn);
+		}
+		if (entry != NULL) {
+			count = entry->list->count;
+			TALLOC_FREE(msg);
+			return count;
+		}
+	}
+
+	ret = ldb_kv_search_dn1(module,
+				dn,
+				msg,
+				LDB_UNPACK_DATA_FLAG_NO_DN |
+				LDB_UNPACK_DATA_FLAG_READ_LOCKED);
+	if (ret == LDB_ERR_NO_SUCH_OBJECT) {
+		TALLOC_FREE(msg);
+		return 0;
+	}
+	if (ret != LDB_SUCCESS) {
+		TALLOC_FREE(msg);
+		return LDB_KV_PLAN_UNKNOWN;
+	}
+
+	el = ldb_msg_find_element(msg, LDB_KV_IDX);
+	if (ldb_kv->cache->GUID_index_attribute == NULL) {
+		count = el != NULL ? el->num_values : 0;
+	} else if (el != NULL) {
+		count = el->num_values > 0 ?
+			el->values[0].length / LDB_KV_GUID_SIZE : 0;
+	} else if (ldb_msg_find_attr_as_int(msg, LDB_KV_IDXVERSION, 0) ==
+		   LDB_KV_GUID_CHUNKED_INDEXING_VERSION) {
+		struct ldb_kv_index_chunk *chunks = NULL;
+		unsigned int num_chunks = 0;
+		unsigned int i;
+
+		ret = ldb_kv_index_chunk_dir_parse(msg,
+						   msg,
+						   &chunks,
+						   &num_chunks);
+		if (ret == LDB_SUCCESS) {
+			count = 0;
+			for (i = 0; i < num_chunks; i++) {
+				count += chunks[i].count;
+			}
+		}
+	}
+
+	TALLOC_FREE(msg);
+	return count;
+}
+
+/*
+  estimate the number of candidates the index will return for tree.
+
+  Equality terms are estimated from the average over all the values of
+  the attribute, unless value_counts is set, when the index record of
+  the value is read to count them.
+ */
+uint64_t ldb_kv_index_plan_estimate(struct ldb_module *module,
+				    struct ldb_kv_private *ldb_kv,
+				    const struct ldb_parse_tree *tree,
+				    bool value_counts)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(module);
+	const struct ldb_kv_index_stats *stats = ldb_kv->cache->index_stats;
+	const struct ldb_kv_index_stat *st = NULL;
+	const char *attr = NULL;
+	uint64_t est = LDB_KV_PLAN_UNKNOWN;
+	unsigned int i;
+
+	if (stats == NULL) {
+		return LDB_KV_PLAN_UNKNOWN;
+	}
+
+	switch (tree->operation) {
+	case LDB_OP_AND:
+		for (i = 0; i < tree->u.list.num_elements; i++) {
+			uint64_t e = ldb_kv_index_plan_estimate(
+				module,
+				ldb_kv,
+				tree->u.list.elements[i],
+				value_counts);
+			est = MIN(est, e);
+		}
+		return est;
+
+	case LDB_OP_OR:
+		est = 0;
+		for (i = 0; i < tree->u.list.num_elements; i++) {
+			uint64_t e = ldb_kv_index_plan_estimate(
+				module,
+				ldb_kv,
+				tree->u.list.elements[i],
+				value_counts);
+			if (e == LDB_KV_PLAN_UNKNOWN) {
+				return LDB_KV_PLAN_UNKNOWN;
+			}
+			est += e;
+		}
+		return est;
+
+	case LDB_OP_EQUALITY:
+		attr = tree->u.equality.attr;
+		break;
+
+	case LDB_OP_PRESENT:
+		attr = tree->u.present.attr;
+		if (attr[0] == '@') {
+			return 0;
+		}
+		if (!ldb_kv->cache->presence_index ||
+		    !ldb_kv_is_indexed(module, ldb_kv, attr)) {
+			return LDB_KV_PLAN_UNKNOWN;
+		}
+		st = ldb_kv_index_stats_find(stats, attr, strlen(attr));
+		if (st == NULL) {
+			return 0;
+		}
+		/* at most one entry for each object with the attribute */
+		return st->entries;
+
+	default:
+		return LDB_KV_PLAN_UNKNOWN;
+	}
+
+	/* These match ldb_kv_index_dn_leaf() */
+	if (attr[0] == '@' ||
+	    (ldb_kv->disallow_dn_filter && ldb_attr_cmp(attr, "dn") == 0)) {
+		return 0;
+	}
+	if (ldb_attr_dn(attr) == 0 ||
+	    (ldb_kv->cache->GUID_index_attribute != NULL &&
+	     ldb_attr_cmp(attr, ldb_kv->cache->GUID_index_attribute) == 0)) {
+		return 1;
+	}
+	if (!ldb_kv_is_indexed(module, ldb_kv, attr)) {
+		return LDB_KV_PLAN_UNKNOWN;
+	}
+	if (ldb_kv_index_unique(ldb, ldb_kv, attr)) {
+		return 1;
+	}
+
+	st = ldb_kv_index_stats_find(stats, attr, strlen(attr));
+	if (st == NULL || st->records == 0) {
+		/* no object has this attribute */
+		return 0;
+	}
+
+	if (value_counts) {
+		return ldb_kv_index_plan_value_count(module, ldb_kv, tree);
+	}
+
+	/*
+	 * The average is good enough to order terms, but a rare value
+	 * of a skewed attribute may be far below it.
+	 */
+	return (st->entries + st->records - 1) / st->records;
+}
+
+/*
+  order the terms of an AND by their estimated cost, cheapest first.
+  Terms of equal cost stay in the order given in the filter.
+ */
+struct ldb_kv_index_plan_term *ldb_kv_index_plan_and(
+	TALLOC_CTX *mem_ctx,
+	struct ldb_module *module,
+	struct ldb_kv_private *ldb_kv,
+	const struct ldb_parse_tree *tree)
+{
+	struct ldb_kv_index_plan_term *terms = NULL;
+	unsigned int i, j;
+
+	terms = talloc_array(mem_ctx,
+			     struct ldb_kv_index_plan_term,
+			     tree->u.list.num_elements);
+	if (terms == NULL) {
+		return NULL;
+	}
+
+	for (i = 0; i < tree->u.list.num_elements; i++) {
+		struct ldb_kv_index_plan_term t = {
+			.idx = i,
+			.cost = ldb_kv_index_plan_estimate(
+				module,
+				ldb_kv,
+				tree->u.list.elements[i],
+				false),
+		};
+
+		for (j = i; j > 0 && terms[j - 1].cost > t.cost; j--) {
+			terms[j] = terms[j - 1];
+		}
+		terms[j] = t;
+	}
+
+	return terms;
+}
+
+/*
+  describe the plan for tree, for the index_plan control
+ */
+char *ldb_kv_index_plan_describe(TALLOC_CTX *mem_ctx,
+				 struct ldb_module *module,
+				 struct ldb_kv_private *ldb_kv,
+				 const struct ldb_parse_tree *tree)
+{
+	struct ldb_kv_index_plan_term *terms = NULL;
+	uint64_t est;
+	char *s = NULL;
+	unsigned int i;
+
+	switch (tree->operation) {
+	case LDB_OP_AND:
+	case LDB_OP_OR:
+		s = talloc_strdup(mem_ctx,
+				  tree->operation == LDB_OP_AND ? "(&" : "(|");
+		if (s == NULL) {
+			return NULL;
+		}
+		if (tree->operation == LDB_OP_AND) {
+			terms = ldb_kv_index_plan_and(s, module, ldb_kv, tree);
+			if (terms == NULL) {
+				TALLOC_FREE(s);
+				return NULL;
+			}
+		}
+		for (i = 0; i < tree->u.list.num_elements; i++) {
+			unsigned int idx = terms != NULL ? terms[i].idx : i;
+			char *sub = ldb_kv_index_plan_describe(
+				s, module, ldb_kv, tree->u.list.elements[idx]);
+			if (sub == NULL) {
+				TALLOC_FREE(s);
+				return NULL;
+			}
+			s = talloc_strdup_append_buffer(s, sub);
+			if (s == NULL) {
+				return NULL;
+			}
+		}
+		TALLOC_FREE(terms);
+		return talloc_strdup_append_buffer(s, ")");
+
+	default:
+		break;
+	}
+
+	s = ldb_filter_from_tree(mem_ctx, tree);
+	if (s == NULL) {
+		return NULL;
+	}
+	est = ldb_kv_index_plan_estimate(module, ldb_kv, tree, false);
+	if (est == LDB_KV_PLAN_UNKNOWN) {
+		return talloc_strdup_append_buffer(s, "[?]");
+	}
+	return talloc_asprintf_append_buffer(s, "[~%llu]",
+					     (unsigned long long)est);
+}
+
+/*
+  decide if a full scan is expected to be cheaper than the index
+ */
+bool ldb_kv_index_plan_full_scan(struct ldb_module *module,
+				 struct ldb_kv_private *ldb_kv,
+				 const struct ldb_parse_tree *tree,
+				 uint64_t *_est)
+{
+	const struct ldb_kv_index_stats *stats = ldb_kv->cache->index_stats;
+	uint64_t est;
+
+	if (stats == NULL ||
+	    ldb_kv->disable_full_db_scan ||
+	    stats->objects < LDB_KV_PLAN_FULL_SCAN_MIN_OBJECTS) {
+		return false;
+	}
+
+	est = ldb_kv_index_plan_estimate(module, ldb_kv, tree, false);
+	if (est == LDB_KV_PLAN_UNKNOWN ||
+	    est * 100 <= stats->objects * LDB_KV_PLAN_FULL_SCAN_PERCENT) {
+		return false;
+	}
+
+	/*
+	 * Only give up on the index if the values actually searched
+	 * for are as common as the averages suggest
+	 */
+	est = ldb_kv_index_plan_estimate(module, ldb_kv, tree, true);
+	if (est == LDB_KV_PLAN_UNKNOWN) {
+		return false;
+	}
+	*_est = est;
+
+	return est * 100 > stats->objects * LDB_KV_PLAN_FULL_SCAN_PERCENT;
+}
@@ -0,0 +1,1048 @@
+/*
+   ldb database library
+
+   Copyright (C) Andrew Tridgell  2004-2005
+   Copyright (C) Simo Sorce            2005
+
+     ** NOTE! The following LGPL license applies to the ldb
+     ** library. This does NOT imply that all of Samba is released
+     ** under the LGPL
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ *  Name: ldb
+ *
+ *  Component: ldb key value compiled search expressions
+ *
+ *  Description: match records against a search expression that has
+ *  been compiled into a flat program once per search.
+ *
+ *  ldb_match_message() walks the parse tree for every candidate
+ *  record, looking up the schema attribute of each term by name and
+ *  canonicalising constant parts of the expression (substring chunks,
+ *  DN values) again for every value it is compared with.  For a full
+ *  scan or a long list of index candidates that work is repeated many
+ *  thousands of times, so here it is done once per search instead:
+ *
+ *   - AND, OR and NOT become conditional jumps, so evaluation is a
+ *     loop over an array rather than a recursion.
+ *
+ *   - the schema attribute of each term is resolved when compiling.
+ *
+ *   - constants are canonicalised when compiling where this gives the
+ *     same answer as comparing at match time: substring chunks, DN
+ *     values and binary (memcmp) equality.
+ *
+ *   - each attribute named in the expression is looked up in the
+ *     message at most once per record, however many terms name it.
+ *
+ *  The results, including the errors returned, are those of
+ *  ldb_match_message().  Anything the compiler does not understand,
+ *  such as extended matches, is handed to ldb_match_message() as a
+ *  sub-tree.
+ *
+ *  ldb_kv_match_packed() runs a program over the packed form of a
+ *  record, so that records which do not match are never unpacked.
+ *
+ *  A compiled program is not modified while matching, and temporary
+ *  memory is taken from the caller, so one program can be run by
+ *  several threads at once.
+ */
+
+#include "ldb_kv.h"
+#include "ldb_private.h"
+#include "ldb_handlers.h"
+
+/*
+ * The number of attributes whose message element is remembered while
+ * matching a record.  Further attributes are looked up every time.
+ */
+#define LDB_KV_MATCH_SLOTS 32
+
+enum ldb_kv_match_op {
+	/* control flow, these work on the current result */
+	LDB_KV_MATCH_JUMP_IF_FALSE,
+	LDB_KV_MATCH_JUMP_IF_TRUE,
+	LDB_KV_MATCH_NOT,
+
+	/* ldb_match_message() on a sub-tree */
+	LDB_KV_MATCH_TREE,
+
+	/* terms, these set the current result */
+	LDB_KV_MATCH_TRUE,
+	LDB_KV_MATCH_FALSE,
+	LDB_KV_MATCH_ERROR,
+	LDB_KV_MATCH_PRESENT,
+	LDB_KV_MATCH_EQUALITY,
+	LDB_KV_MATCH_EQUALITY_BINARY,
+	LDB_KV_MATCH_EQUALITY_DN,
+	LDB_KV_MATCH_MSG_DN,
+	LDB_KV_MATCH_SUBSTRING,
+	LDB_KV_MATCH_COMPARISON,
+};
+
+struct ldb_kv_match_insn {
+	enum ldb_kv_match_op op;
+
+	/*
+	 * Slot of the attribute the term tests, or -1.  Terms on
+	 * inaccessible attributes never match.
+	 */
+	int slot;
+
+	/* JUMP_IF_FALSE and JUMP_IF_TRUE */
+	unsigned int target;
+
+	/* ERROR */
+	int error;
+
+	/* TREE, and the original term */
+	const struct ldb_parse_tree *tree;
+
+	const struct ldb_schema_attribute *a;
+
+	/* EQUALITY, EQUALITY_BINARY and COMPARISON */
+	enum ldb_parse_op comp_op;
+	struct ldb_val value;
+
+	/* EQUALITY_DN and MSG_DN, validated and casefolded */
+	struct ldb_dn *dn;
+
+	/* SUBSTRING */
+	struct ldb_val *chunks;
+	unsigned int num_chunks;
+	bool chunk_failed;
+	bool canonicalise;
+};
+
+struct ldb_kv_match_program {
+	struct ldb_context *ldb;
+	struct ldb_kv_match_insn *insns;
+	unsigned int num_insns;
+	const char **attrs;
+	unsigned int num_attrs;
+
+	/* the program compares the DN of the message */
+	bool needs_dn;
+	/* the program passes sub-trees to ldb_match_message() */
+	bool needs_message;
+};
+
+/*
+  add an instruction to the end of the program
+ */
+static struct ldb_kv_match_insn *ldb_kv_match_emit(
+	struct ldb_kv_match_program *prog,
+	enum ldb_kv_match_op op)
+{
+	struct ldb_kv_match_insn *insns = NULL;
+	struct ldb_kv_match_insn *insn = NULL;
+
+	insns = talloc_realloc(prog,
+			       prog->insns,
+			       struct ldb_kv_match_insn,
+			       prog->num_insns + 1);
+	if (insns == NULL) {
+		return NULL;
+	}
+	prog->insns = insns;
+
+	insn = &prog->insns[prog->num_insns];
+	prog->num_insns++;
+
+	*insn = (struct ldb_kv_match_insn) {
+		.op = op,
+		.slot = -1,
+	};
+	return insn;
+}
+
+/*
+  find or allocate the slot for an attribute
+ */
+static int ldb_kv_match_slot(struct ldb_kv_match_program *prog,
+			     const char *attr,
+			     int *slot)
+{
+	const char **attrs = NULL;
+	unsigned int i;
+
+	for (i = 0; i < prog->num_attrs; i++) {
+		if (ldb_attr_cmp(prog->attrs[i], attr) == 0) {
+			*slot = i;
+			return LDB_SUCCESS;
+		}
+	}
+
+	attrs = talloc_realloc(prog,
+			       prog->attrs,
+			       const char *,
+			       prog->num_attrs + 1);
+	if (attrs == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	prog->attrs = attrs;
+	prog->attrs[prog->num_attrs] = attr;
+	*slot = prog->num_attrs;
+	prog->num_attrs++;
+	return LDB_SUCCESS;
+}
+
+/*
+  is this the standard DN syntax, whose comparison function parses
+  both values as DNs and compares them?
+ */
+static bool ldb_kv_match_is_dn_syntax(struct ldb_context *ldb,
+				      const struct ldb_schema_attribute *a)
+{
+	const struct ldb_schema_syntax *dn_syntax = NULL;
+
+	if (a->syntax->operator_fn != NULL) {
+		return false;
+	}
+	dn_syntax = ldb_standard_syntax_by_name(ldb, LDB_SYNTAX_DN);
+	if (dn_syntax == NULL) {
+		return false;
+	}
+	return a->syntax->comparison_fn == dn_syntax->comparison_fn;
+}
+
+/*
+  parse a DN in the expression and casefold it now, so it is not
+  changed while being compared on several threads.
+ */
+static struct ldb_dn *ldb_kv_match_dn(struct ldb_kv_match_program *prog,
+				      const struct ldb_val *value)
+{
+	struct ldb_dn *dn = NULL;
+
+	dn = ldb_dn_from_ldb_val(prog, prog->ldb, value);
+	if (dn == NULL) {
+		return NULL;
+	}
+	if (!ldb_dn_validate(dn) || ldb_dn_get_casefold(dn) == NULL) {
+		TALLOC_FREE(dn);
+		return NULL;
+	}
+	return dn;
+}
+
+static int ldb_kv_match_compile_equality(struct ldb_kv_match_program *prog,
+					 const struct ldb_parse_tree *tree,
+					 struct ldb_kv_match_insn *insn)
+{
+	const struct ldb_schema_attribute *a = insn->a;
+
+	insn->value = tree->u.equality.value;
+
+	if (ldb_attr_dn(tree->u.equality.attr) == 0) {
+		struct ldb_dn *dn = NULL;
+
+		dn = ldb_dn_from_ldb_val(prog, prog->ldb,
+					 &tree->u.equality.value);
+		if (dn == NULL) {
+			insn->op = LDB_KV_MATCH_ERROR;
+			insn->error = LDB_ERR_INVALID_DN_SYNTAX;
+			return LDB_SUCCESS;
+		}
+		TALLOC_FREE(dn);
+
+		insn->dn = ldb_kv_match_dn(prog, &tree->u.equality.value);
+		if (insn->dn == NULL) {
+			/*
+			 * Leave DNs that cannot be casefolded to
+			 * ldb_match_message(), which still compares
+			 * the linearized strings.
+			 */
+			insn->op = LDB_KV_MATCH_TREE;
+			insn->slot = -1;
+			prog->needs_message = true;
+			return LDB_SUCCESS;
+		}
+		insn->op = LDB_KV_MATCH_MSG_DN;
+		prog->needs_dn = true;
+		return LDB_SUCCESS;
+	}
+
+	insn->op = LDB_KV_MATCH_EQUALITY;
+	if (a == NULL) {
+		return LDB_SUCCESS;
+	}
+
+	if (a->syntax->operator_fn == NULL &&
+	    a->syntax->comparison_fn == ldb_comparison_binary) {
+		insn->op = LDB_KV_MATCH_EQUALITY_BINARY;
+		return LDB_SUCCESS;
+	}
+
+	if (ldb_kv_match_is_dn_syntax(prog->ldb, a)) {
+		insn->dn = ldb_kv_match_dn(prog, &tree->u.equality.value);
+		if (insn->dn != NULL) {
+			insn->op = LDB_KV_MATCH_EQUALITY_DN;
+		}
+	}
+	return LDB_SUCCESS;
+}
+
+static int ldb_kv_match_compile_substring(struct ldb_kv_match_program *prog,
+					  const struct ldb_parse_tree *tree,
+					  struct ldb_kv_match_insn *insn)
+{
+	const struct ldb_schema_attribute *a = insn->a;
+	struct ldb_val **chunks = tree->u.substring.chunks;
+	unsigned int i;
+
+	insn->op = LDB_KV_MATCH_SUBSTRING;
+	if (a == NULL || chunks == NULL) {
+		return LDB_SUCCESS;
+	}
+
+	while (chunks[insn->num_chunks] != NULL) {
+		insn->num_chunks++;
+	}
+	insn->chunks = talloc_zero_array(prog,
+					  struct ldb_val,
+					  insn->num_chunks);
+	if (insn->chunks == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	/* No need to just copy this value for a binary match */
+	insn->canonicalise = a->syntax->canonicalise_fn != ldb_handler_copy;
+
+	for (i = 0; i < insn->num_chunks; i++) {
+		int ret;
+
+		if (!insn->canonicalise) {
+			insn->chunks[i] = *chunks[i];
+			continue;
+		}
+		ret = a->syntax->canonicalise_fn(prog->ldb, insn->chunks,
+						 chunks[i], &insn->chunks[i]);
+		if (ret != 0) {
+			/*
+			 * The value may still fail to canonicalise,
+			 * which is an error, so check that first.
+			 */
+			insn->chunk_failed = true;
+			break;
+		}
+	}
+	return LDB_SUCCESS;
+}
+
+/*
+  compile a sub-tree onto the end of the program
+ */
+static int ldb_kv_match_compile_tree(struct ldb_kv_match_program *prog,
+				     const struct ldb_parse_tree *tree)
+{
+	struct ldb_kv_match_insn *insn = NULL;
+	const char *attr = NULL;
+	unsigned int *jumps = NULL;
+	unsigned int i, n;
+	int ret;
+
+	switch (tree->operation) {
+	case LDB_OP_AND:
+	case LDB_OP_OR:
+		n = tree->u.list.num_elements;
+		if (n == 0) {
+			insn = ldb_kv_match_emit(
+				prog,
+				tree->operation == LDB_OP_AND ?
+				LDB_KV_MATCH_TRUE : LDB_KV_MATCH_FALSE);
+			if (insn == NULL) {
+				return LDB_ERR_OPERATIONS_ERROR;
+			}
+			return LDB_SUCCESS;
+		}
+
+		jumps = talloc_array(prog, unsigned int, n);
+		if (jumps == NULL) {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+		for (i = 0; i < n; i++) {
+			ret = ldb_kv_match_compile_tree(prog,
+							tree->u.list.elements[i]);
+			if (ret != LDB_SUCCESS) {
+				TALLOC_FREE(jumps);
+				return ret;
+			}
+			if (i == n - 1) {
+				break;
+			}
+			/* stop at the first term deciding the result */
+			insn = ldb_kv_match_emit(
+				prog,
+				tree->operation == LDB_OP_AND ?
+				LDB_KV_MATCH_JUMP_IF_FALSE :
+				LDB_KV_MATCH_JUMP_IF_TRUE);
+			if (insn == NULL) {
+				TALLOC_FREE(jumps);
+				return LDB_ERR_OPERATIONS_ERROR;
+			}
+			jumps[i] = prog->num_insns - 1;
+		}
+		for (i = 0; i < n - 1; i++) {
+			prog->insns[jumps[i]].target = prog->num_insns;
+		}
+		TALLOC_FREE(jumps);
+		return LDB_SUCCESS;
+
+	case LDB_OP_NOT:
+		ret = ldb_kv_match_compile_tree(prog, tree->u.isnot.child);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+		insn = ldb_kv_match_emit(prog, LDB_KV_MATCH_NOT);
+		if (insn == NULL) {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+		return LDB_SUCCESS;
+
+	case LDB_OP_EQUALITY:
+	case LDB_OP_SUBSTRING:
+	case LDB_OP_GREATER:
+	case LDB_OP_LESS:
+	case LDB_OP_PRESENT:
+	case LDB_OP_APPROX:
+		break;
+
+	default:
+		/*
+		 * Extended matches may do anything, including looking
+		 * at other attributes, so leave them to
+		 * ldb_match_message().
+		 */
+		insn = ldb_kv_match_emit(prog, LDB_KV_MATCH_TREE);
+		if (insn == NULL) {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+		insn->tree = tree;
+		prog->needs_message = true;
+		return LDB_SUCCESS;
+	}
+
+	insn = ldb_kv_match_emit(prog, LDB_KV_MATCH_FALSE);
+	if (insn == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	insn->tree = tree;
+
+	/* as in ldb_must_suppress_match() */
+	attr = ldb_parse_tree_get_attr(tree);
+	if (attr != NULL) {
+		ret = ldb_kv_match_slot(prog, attr, &insn->slot);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+	}
+
+	switch (tree->operation) {
+	case LDB_OP_EQUALITY:
+		insn->a = ldb_schema_attribute_by_name(prog->ldb,
+						       tree->u.equality.attr);
+		return ldb_kv_match_compile_equality(prog, tree, insn);
+
+	case LDB_OP_SUBSTRING:
+		insn->a = ldb_schema_attribute_by_name(prog->ldb,
+						       tree->u.substring.attr);
+		return ldb_kv_match_compile_substring(prog, tree, insn);
+
+	case LDB_OP_GREATER:
+	case LDB_OP_LESS:
+		insn->op = LDB_KV_MATCH_COMPARISON;
+		insn->comp_op = tree->operation;
+		insn->value = tree->u.comparison.value;
+		insn->a = ldb_schema_attribute_by_name(
+			prog->ldb, tree->u.comparison.attr);
+		return LDB_SUCCESS;
+
+	case LDB_OP_PRESENT:
+		if (ldb_attr_dn(tree->u.present.attr) == 0) {
+			insn->op = LDB_KV_MATCH_TRUE;
+			return LDB_SUCCESS;
+		}
+		insn->op = LDB_KV_MATCH_PRESENT;
+		insn->a = ldb_schema_attribute_by_name(prog->ldb,
+						       tree->u.present.attr);
+		return LDB_SUCCESS;
+
+	default:
+		/* FIXME: APPROX comparison not handled yet */
+		insn->op = LDB_KV_MATCH_ERROR;
+		insn->error = LDB_ERR_INAPPROPRIATE_MATCHING;
+		return LDB_SUCCESS;
+	}
+}
+
+/*
+  compile a search expression into a program for ldb_kv_match_run()
+
+  The program refers to the tree, which must outlive it.
+ */
+int ldb_kv_match_compile(TALLOC_CTX *mem_ctx,
+			 struct ldb_context *ldb,
+			 const struct ldb_parse_tree *tree,
+			 struct ldb_kv_match_program **_prog)
+{
+	struct ldb_kv_match_program *prog = NULL;
+	int ret;
+
+	prog = talloc_zero(mem_ctx, struct ldb_kv_match_program);
+	if (prog == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	prog->ldb = ldb;
+
+	ret = ldb_kv_match_compile_tree(prog, tree);
+	if (ret != LDB_SUCCESS) {
+		TALLOC_FREE(prog);
+		return ret;
+	}
+
+	*_prog = prog;
+	return LDB_SUCCESS;
+}
+
+/*
+  match a substring term against one value, as ldb_wildcard_compare()
+ */
+static int ldb_kv_match_wildcard(const struct ldb_kv_match_program *prog,
+				 const struct ldb_kv_match_insn *insn,
+				 TALLOC_CTX *mem_ctx,
+				 const struct ldb_val *value,
+				 bool *matched)
+{
+	const struct ldb_parse_tree *tree = insn->tree;
+	const struct ldb_schema_attribute *a = insn->a;
+	struct ldb_val val;
+	uint8_t *save_p = NULL;
+	unsigned int c = 0;
+
+	*matched = false;
+
+	if (a == NULL) {
+		return LDB_ERR_INVALID_ATTRIBUTE_SYNTAX;
+	}
+
+	if (tree->u.substring.chunks == NULL) {
+		return LDB_SUCCESS;
+	}
+
+	if (insn->canonicalise) {
+		if (a->syntax->canonicalise_fn(prog->ldb, mem_ctx,
+					       value, &val) != 0) {
+			return LDB_ERR_INVALID_ATTRIBUTE_SYNTAX;
+		}
+		save_p = val.data;
+	} else {
+		val = *value;
+	}
+
+	if (insn->chunk_failed) {
+		goto done;
+	}
+
+	if (!tree->u.substring.start_with_wildcard) {
+		const struct ldb_val *cnk = &insn->chunks[c];
+
+		/*
+		 * Empty strings are returned as length 0. Ensure
+		 * we can cope with this.
+		 */
+		if (cnk->length > val.length || cnk->length == 0) {
+			goto done;
+		}
+		if (memcmp(val.data, cnk->data, cnk->length) != 0) {
+			goto done;
+		}
+		val.length -= cnk->length;
+		val.data += cnk->length;
+		c++;
+	}
+
+	for (; c < insn->num_chunks; c++) {
+		const struct ldb_val *cnk = &insn->chunks[c];
+		uint8_t *p = NULL;
+
+		if (cnk->length == 0 || cnk->length > val.length) {
+			goto done;
+		}
+
+		if (c == insn->num_chunks - 1 &&
+		    !tree->u.substring.end_with_wildcard) {
+			/*
+			 * The last bit, after all the asterisks, must
+			 * match exactly the last bit of the string.
+			 */
+			p = val.data + val.length - cnk->length;
+			if (memcmp(p, cnk->data, cnk->length) != 0) {
+				goto done;
+			}
+		} else {
+			/*
+			 * Values might be binary blobs. Don't use
+			 * string search, but memory search instead.
+			 */
+			p = memmem(val.data, val.length,
+				   cnk->data, cnk->length);
+			if (p == NULL) {
+				goto done;
+			}
+			/* move val to the end of the match */
+			p += cnk->length;
+			val.length -= (p - val.data);
+			val.data = p;
+		}
+	}
+
+	*matched = true;
+done:
+	talloc_free(save_p);
+	return LDB_SUCCESS;
+}
+
+/*
+  evaluate one term against its message element, which may be NULL
+ */
+static int ldb_kv_match_term(const struct ldb_kv_match_program *prog,
+			     const struct ldb_kv_match_insn *insn,
+			     TALLOC_CTX *mem_ctx,
+			     const struct ldb_message *msg,
+			     const struct ldb_message_element *el,
+			     bool *matched)
+{
+	struct ldb_context *ldb = prog->ldb;
+	const struct ldb_schema_attribute *a = insn->a;
+	unsigned int i;
+	int ret;
+
+	*matched = false;
+
+	switch (insn->op) {
+	case LDB_KV_MATCH_TRUE:
+		*matched = true;
+		return LDB_SUCCESS;
+
+	case LDB_KV_MATCH_FALSE:
+		return LDB_SUCCESS;
+
+	case LDB_KV_MATCH_ERROR:
+		return insn->error;
+
+	case LDB_KV_MATCH_MSG_DN:
+		*matched = ldb_dn_compare(msg->dn, insn->dn) == 0;
+		return LDB_SUCCESS;
+
+	default:
+		break;
+	}
+
+	if (el == NULL) {
+		return LDB_SUCCESS;
+	}
+
+	if (insn->op == LDB_KV_MATCH_SUBSTRING) {
+		for (i = 0; i < el->num_values; i++) {
+			ret = ldb_kv_match_wildcard(prog, insn, mem_ctx,
+						    &el->values[i], matched);
+			if (ret != LDB_SUCCESS) {
+				return ret;
+			}
+			if (*matched) {
+				return LDB_SUCCESS;
+			}
+		}
+		return LDB_SUCCESS;
+	}
+
+	if (a == NULL) {
+		return LDB_ERR_INVALID_ATTRIBUTE_SYNTAX;
+	}
+
+	switch (insn->op) {
+	case LDB_KV_MATCH_PRESENT:
+		if (a->syntax->operator_fn == NULL) {
+			*matched = true;
+			return LDB_SUCCESS;
+		}
+		for (i = 0; i < el->num_values; i++) {
+			ret = a->syntax->operator_fn(ldb, LDB_OP_PRESENT, a,
+						     &el->values[i], NULL,
+						     matched);
+			if (ret != LDB_SUCCESS) {
+				return ret;
+			}
+			if (*matched) {
+				return LDB_SUCCESS;
+			}
+		}
+		return LDB_SUCCESS;
+
+	case LDB_KV_MATCH_EQUALITY_BINARY:
+		for (i = 0; i < el->num_values; i++) {
+			const struct ldb_val *v = &el->values[i];
+
+			if (v->length == insn->value.length &&
+			    memcmp(v->data, insn->value.data, v->length) == 0) {
+				*matched = true;
+				return LDB_SUCCESS;
+			}
+		}
+		return LDB_SUCCESS;
+
+	case LDB_KV_MATCH_EQUALITY_DN:
+		for (i = 0; i < el->num_values; i++) {
+			struct ldb_dn *dn = NULL;
+
+			dn = ldb_dn_from_ldb_val(mem_ctx, ldb, &el->values[i]);
+			if (!ldb_dn_validate(dn)) {
+				TALLOC_FREE(dn);
+				continue;
+			}
+			ret = ldb_dn_compare(insn->dn, dn);
+			TALLOC_FREE(dn);
+			if (ret == 0) {
+				*matched = true;
+				return LDB_SUCCESS;
+			}
+		}
+		return LDB_SUCCESS;
+
+	case LDB_KV_MATCH_EQUALITY:
+		for (i = 0; i < el->num_values; i++) {
+			if (a->syntax->operator_fn != NULL) {
+				ret = a->syntax->operator_fn(ldb,
+							     LDB_OP_EQUALITY,
+							     a,
+							     &insn->value,
+							     &el->values[i],
+							     matched);
+				if (ret != LDB_SUCCESS) {
+					return ret;
+				}
+				if (*matched) {
+					return LDB_SUCCESS;
+				}
+			} else if (a->syntax->comparison_fn(ldb, mem_ctx,
+							    &insn->value,
+							    &el->values[i]) == 0) {
+				*matched = true;
+				return LDB_SUCCESS;
+			}
+		}
+		return LDB_SUCCESS;
+
+	case LDB_KV_MATCH_COMPARISON:
+		for (i = 0; i < el->num_values; i++) {
+			if (a->syntax->operator_fn != NULL) {
+				ret = a->syntax->operator_fn(ldb,
+							     insn->comp_op,
+							     a,
+							     &el->values[i],
+							     &insn->value,
+							     matched);
+				if (ret != LDB_SUCCESS) {
+					return ret;
+				}
+				if (*matched) {
+					return LDB_SUCCESS;
+				}
+				continue;
+			}
+			ret = a->syntax->comparison_fn(ldb, mem_ctx,
+						       &el->values[i],
+						       &insn->value);
+			if (ret == 0 ||
+			    (ret > 0 && insn->comp_op == LDB_OP_GREATER) ||
+			    (ret < 0 && insn->comp_op == LDB_OP_LESS)) {
+				*matched = true;
+				return LDB_SUCCESS;
+			}
+		}
+		return LDB_SUCCESS;
+
+	default:
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+}
+
+/*
+  run the program over a message
+ */
+static int ldb_kv_match_exec(const struct ldb_kv_match_program *prog,
+			     TALLOC_CTX *mem_ctx,
+			     const struct ldb_message *msg,
+			     enum ldb_scope scope,
+			     bool *matched)
+{
+	const struct ldb_message_element *els[LDB_KV_MATCH_SLOTS];
+	bool found[LDB_KV_MATCH_SLOTS] = { false };
+	unsigned int pc = 0;
+	bool result = false;
+	int ret;
+
+	*matched = false;
+
+	while (pc < prog->num_insns) {
+		const struct ldb_kv_match_insn *insn = &prog->insns[pc];
+		const struct ldb_message_element *el = NULL;
+
+		pc++;
+
+		switch (insn->op) {
+		case LDB_KV_MATCH_JUMP_IF_FALSE:
+			if (!result) {
+				pc = insn->target;
+			}
+			continue;
+		case LDB_KV_MATCH_JUMP_IF_TRUE:
+			if (result) {
+				pc = insn->target;
+			}
+			continue;
+		case LDB_KV_MATCH_NOT:
+			result = !result;
+			continue;
+		case LDB_KV_MATCH_TREE:
+			ret = ldb_match_message(prog->ldb, msg, insn->tree,
+						scope, &result);
+			if (ret != LDB_SUCCESS) {
+				return ret;
+			}
+			continue;
+		default:
+			break;
+		}
+
+		if (insn->slot >= LDB_KV_MATCH_SLOTS) {
+			el = ldb_msg_find_element(msg,
+						  prog->attrs[insn->slot]);
+		} else if (insn->slot >= 0) {
+			if (!found[insn->slot]) {
+				els[insn->slot] = ldb_msg_find_element(
+					msg, prog->attrs[insn->slot]);
+				found[insn->slot] = true;
+			}
+			el = els[insn->slot];
+		}
+
+		/*
+		 * Suppress matches on confidential attributes, as
+		 * ldb_match_message() does.
+		 */
+		if (el != NULL && ldb_msg_element_is_inaccessible(el)) {
+			result = false;
+			continue;
+		}
+
+		ret = ldb_kv_match_term(prog, insn, mem_ctx, msg, el, &result);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+	}
+
+	*matched = result;
+	return LDB_SUCCESS;
+}
+
+/*
+  match a message against a compiled search expression, giving the
+  same answer as ldb_match_message() on the tree it was compiled from.
+
+  Temporary memory is allocated on mem_ctx.
+ */
+int ldb_kv_match_run(const struct ldb_kv_match_program *prog,
+		     TALLOC_CTX *mem_ctx,
+		     const struct ldb_message *msg,
+		     enum ldb_scope scope,
+		     bool *matched)
+{
+	*matched = false;
+
+	if (scope != LDB_SCOPE_BASE && ldb_dn_is_special(msg->dn)) {
+		/* don't match special records except on base searches */
+		return LDB_SUCCESS;
+	}
+
+	return ldb_kv_match_exec(prog, mem_ctx, msg, scope, matched);
+}
+
+/*
+  match a message against the expression of a search, using the
+  compiled program if there is one
+ */
+int ldb_kv_match_message(const struct ldb_kv_context *ac,
+			 TALLOC_CTX *mem_ctx,
+			 const struct ldb_message *msg,
+			 bool *matched)
+{
+	if (ac->match_program == NULL) {
+		struct ldb_context *ldb = ldb_module_get_ctx(ac->module);
+		return ldb_match_message(ldb, msg, ac->tree, ac->scope,
+					 matched);
+	}
+	return ldb_kv_match_run(ac->match_program, mem_ctx, msg, ac->scope,
+				matched);
+}
+
+/*
+  match a packed record against the expression of a search without
+  unpacking it.  Only the attributes named in the expression are read
+  from the record, using the packed record view, and in the V3 format
+  they are found through the attribute directory.
+
+  Returns LDB_SUCCESS with the answer in matched.  Any other return
+  means the record could not be matched this way: the search has no
+  compiled program, the program needs the whole message, the record
+  is in an older packing format or damaged, or matching failed.  The
+  caller must then unpack the record and match it as usual, which
+  also gives any error in the same order as before.
+
+  The scope of the search is not checked.
+ */
+int ldb_kv_match_packed(const struct ldb_kv_context *ac,
+			TALLOC_CTX *mem_ctx,
+			const struct ldb_val *data,
+			bool *matched)
+{
+	const struct ldb_kv_match_program *prog = ac->match_program;
+	struct ldb_context *ldb = ldb_module_get_ctx(ac->module);
+	struct ldb_kv_packed_element pels[LDB_KV_MATCH_SLOTS];
+	struct ldb_message_element els[LDB_KV_MATCH_SLOTS];
+	bool found[LDB_KV_MATCH_SLOTS] = { false };
+	struct ldb_kv_packed_record rec;
+	struct ldb_kv_packed_element pel;
+	struct ldb_message msg = {
+		.elements = els,
+	};
+	struct ldb_val *values = NULL;
+	unsigned int num_values = 0;
+	unsigned int i;
+	int ret;
+
+	*matched = false;
+
+	/*
+	 * The redaction callback needs the whole message, and changes
+	 * what matches.
+	 */
+	if (prog == NULL ||
+	    prog->needs_message ||
+	    prog->num_attrs > LDB_KV_MATCH_SLOTS ||
+	    ldb->redact.callback != NULL) {
+		return LDB_ERR_UNWILLING_TO_PERFORM;
+	}
+
+	ret = ldb_kv_packed_record_init(&rec, data);
+	if (ret != LDB_SUCCESS) {
+		return ret;
+	}
+
+	/* as in ldb_match_message(), see ldb_dn_from_ldb_val() */
+	if (ac->scope != LDB_SCOPE_BASE &&
+	    rec.dn.length > 0 && rec.dn.data[0] == '@') {
+		return LDB_SUCCESS;
+	}
+
+	/* with an attribute directory, look up just the attributes used */
+	for (i = 0; i < prog->num_attrs; i++) {
+		ret = ldb_kv_packed_record_find(&rec, prog->attrs[i],
+						&pels[i]);
+		if (ret == LDB_ERR_NO_SUCH_ATTRIBUTE) {
+			continue;
+		}
+		if (ret != LDB_SUCCESS) {
+			break;
+		}
+		found[i] = true;
+		num_values += pels[i].num_values;
+	}
+	if (i < prog->num_attrs) {
+		if (ret != LDB_ERR_UNWILLING_TO_PERFORM) {
+			return ret;
+		}
+
+		/* otherwise walk the attributes */
+		num_values = 0;
+		for (i = 0; i < prog->num_attrs; i++) {
+			found[i] = false;
+		}
+		while ((ret = ldb_kv_packed_record_next(&rec, &pel)) ==
+		       LDB_SUCCESS) {
+			for (i = 0; i < prog->num_attrs; i++) {
+				if (ldb_attr_cmp(pel.name,
+						 prog->attrs[i]) == 0) {
+					break;
+				}
+			}
+			if (i == prog->num_attrs || found[i]) {
+				continue;
+			}
+			/*
+			 * the first of the same name, as
+			 * ldb_msg_find_element()
+			 */
+			pels[i] = pel;
+			found[i] = true;
+			num_values += pel.num_values;
+		}
+		if (ret != LDB_ERR_NO_SUCH_ATTRIBUTE) {
+			return ret;
+		}
+	}
+
+	if (num_values > 0) {
+		values = talloc_array(mem_ctx, struct ldb_val, num_values);
+		if (values == NULL) {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+	}
+
+	num_values = 0;
+	for (i = 0; i < prog->num_attrs; i++) {
+		struct ldb_message_element *el = NULL;
+
+		if (!found[i]) {
+			continue;
+		}
+		el = &msg.elements[msg.num_elements];
+		*el = (struct ldb_message_element) {
+			.name = pels[i].name,
+			.num_values = pels[i].num_values,
+			.values = values + num_values,
+		};
+		ldb_kv_packed_element_values(&pels[i], el->values);
+		num_values += el->num_values;
+		msg.num_elements++;
+	}
+
+	if (prog->needs_dn) {
+		msg.dn = ldb_dn_from_ldb_val(mem_ctx, ldb, &rec.dn);
+		if (msg.dn == NULL) {
+			TALLOC_FREE(values);
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+	}
+
+	ret = ldb_kv_match_exec(prog, mem_ctx, &msg, ac->scope, matched);
+
+	TALLOC_FREE(msg.dn);
+	TALLOC_FREE(values);
+	return ret;
+}
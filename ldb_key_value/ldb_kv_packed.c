@@ -0,0 +1,527 @@
+/*
+   ldb database library
+
+   Copyright (C) Andrew Tridgell  2004
+
+     ** NOTE! The following LGPL license applies to the ldb
+     ** library. This does NOT imply that all of Samba is released
+     ** under the LGPL
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 3 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+/*
+ *  Name: ldb
+ *
+ *  Component: ldb key value packed record view
+ *
+ *  Description: read the DN and attributes of a packed record in
+ *  place, without unpacking it into a struct ldb_message.
+ *
+ *  Most records read by a full scan, or by the filter after an index
+ *  lookup, do not match the search expression.  Unpacking each of
+ *  them allocates and fills an element array for every attribute, so
+ *  instead the view walks the packed buffer and only the attributes
+ *  named in the expression are looked at.  Only records that match
+ *  are unpacked in full.
+ *
+ *  In the V3 format each record also has a directory of its
+ *  attributes, so ldb_kv_packed_record_find() can go straight to one
+ *  attribute, and ldb_kv_packed_unpack_attrs() can unpack just the
+ *  attributes a search asked for.
+ *
+ *  This reads the formats written by ldb_pack_data() in
+ *  common/ldb_pack.c and must be kept in step with it.  The view
+ *  allocates nothing, and the buffer is not modified.
+ */
+
+#include "ldb_kv.h"
+#include "ldb_private.h"
+
+/* As in common/ldb_pack.c */
+#define _DATA_BYTE_CONST(data, pos) \
+	((uint8_t)(((const uint8_t *)(data))[(pos)]))
+#define PULL_LE_U8(data, pos) \
+	(_DATA_BYTE_CONST(data, pos))
+#define PULL_LE_U16(data, pos) \
+	((uint16_t)PULL_LE_U8(data, pos) |\
+	((uint16_t)(PULL_LE_U8(data, (pos) + 1))) << 8)
+#define PULL_LE_U32(data, pos) \
+	((uint32_t)(PULL_LE_U16(data, pos) |\
+	((uint32_t)PULL_LE_U16(data, (pos) + 2)) << 16))
+
+#define U32_LEN 4
+#define U16_LEN 2
+#define U8_LEN 1
+#define NULL_PAD_BYTE_LEN 1
+#define V3_DIR_ENTRY_LEN (U32_LEN * 3)
+
+/*
+  start a view of a packed record.
+
+  Returns LDB_ERR_UNWILLING_TO_PERFORM for packing formats without a
+  view, and LDB_ERR_OPERATIONS_ERROR if the header is damaged.  In
+  both cases the caller should unpack the record instead, which gives
+  the error for a damaged record.
+ */
+int ldb_kv_packed_record_init(struct ldb_kv_packed_record *rec,
+			      const struct ldb_val *data)
+{
+	const uint8_t *p = data->data;
+	const uint8_t *end_p = p + data->length;
+	size_t len;
+
+	*rec = (struct ldb_kv_packed_record) {};
+
+	if (data->length < U32_LEN) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	rec->start = p;
+	rec->format = PULL_LE_U32(p, 0);
+	if (rec->format != LDB_PACKING_FORMAT_V2 &&
+	    rec->format != LDB_PACKING_FORMAT_V3) {
+		return LDB_ERR_UNWILLING_TO_PERFORM;
+	}
+	p += U32_LEN;
+
+	/* num_elements, DN length */
+	if (U32_LEN * 2 > end_p - p) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	rec->num_elements = PULL_LE_U32(p, 0);
+	p += U32_LEN;
+	len = PULL_LE_U32(p, 0);
+	p += U32_LEN;
+
+	if (len + NULL_PAD_BYTE_LEN > end_p - p ||
+	    p[len] != '\0') {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	rec->dn = (struct ldb_val) {
+		.data = discard_const_p(uint8_t, p),
+		.length = len
+	};
+	p += len + NULL_PAD_BYTE_LEN;
+
+	/* the canonical DN */
+	if (U32_LEN > end_p - p) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	len = PULL_LE_U32(p, 0);
+	p += U32_LEN;
+	if (len + NULL_PAD_BYTE_LEN > end_p - p ||
+	    p[len] != '\0') {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	p += len + NULL_PAD_BYTE_LEN;
+
+	rec->end = end_p;
+	if (rec->format == LDB_PACKING_FORMAT_V3) {
+		/* the directory, then the attributes */
+		if (rec->num_elements >
+		    (end_p - p) / V3_DIR_ENTRY_LEN) {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+		rec->dir = p;
+		rec->p = p + V3_DIR_ENTRY_LEN * rec->num_elements;
+		rec->values_start = rec->p;
+		return LDB_SUCCESS;
+	}
+	if (rec->num_elements == 0) {
+		/* ldb_unpack_data() does not look any further */
+		rec->p = p;
+		rec->values_start = p;
+		rec->q = end_p;
+		return LDB_SUCCESS;
+	}
+
+	/* the attribute section length, which includes itself */
+	if (U32_LEN > end_p - p) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	len = PULL_LE_U32(p, 0);
+	if (len < U32_LEN || len > end_p - p) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	rec->values_start = p + len;
+	rec->q = rec->values_start;
+	rec->p = p + U32_LEN;
+
+	return LDB_SUCCESS;
+}
+
+/*
+  read the V3 attribute at p, which holds its own values, setting
+  *next to the end of it
+ */
+static int ldb_kv_packed_element_v3(const struct ldb_kv_packed_record *rec,
+				    const uint8_t *p,
+				    struct ldb_kv_packed_element *el,
+				    const uint8_t **next)
+{
+	const uint8_t *end_p = rec->end;
+	size_t attr_len;
+	unsigned int j;
+
+	/* Sanity check: minimum element size, as ldb_unpack_data() */
+	if ((U32_LEN * 2) + (U8_LEN * 2) + (NULL_PAD_BYTE_LEN * 2) >
+	    end_p - p) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	attr_len = PULL_LE_U32(p, 0);
+	p += U32_LEN;
+	if (attr_len == 0 ||
+	    attr_len + NULL_PAD_BYTE_LEN + U32_LEN + U8_LEN > end_p - p ||
+	    p[attr_len] != '\0') {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	el->name = (const char *)p;
+	p += attr_len + NULL_PAD_BYTE_LEN;
+
+	el->num_values = PULL_LE_U32(p, 0);
+	p += U32_LEN;
+	el->width = *p;
+	p += U8_LEN;
+
+	if (el->width != U8_LEN &&
+	    el->width != U16_LEN &&
+	    el->width != U32_LEN) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	if ((size_t)el->width * el->num_values > end_p - p) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	el->lengths = p;
+	p += el->width * el->num_values;
+
+	/* the values follow their lengths */
+	el->values = p;
+	for (j = 0; j < el->num_values; j++) {
+		size_t len = ldb_kv_packed_element_length(el, j);
+
+		if (len + NULL_PAD_BYTE_LEN > end_p - p) {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+		p += len + NULL_PAD_BYTE_LEN;
+	}
+
+	*next = p;
+	return LDB_SUCCESS;
+}
+
+/*
+  step to the next attribute of a packed record.
+
+  Returns LDB_ERR_NO_SUCH_ATTRIBUTE after the last attribute, once the
+  layout of the whole record has been checked, and
+  LDB_ERR_OPERATIONS_ERROR if the record is damaged.
+ */
+int ldb_kv_packed_record_next(struct ldb_kv_packed_record *rec,
+			      struct ldb_kv_packed_element *el)
+{
+	const uint8_t *p = rec->p;
+	const uint8_t *value_section_p = rec->values_start;
+	size_t attr_len;
+	size_t total = 0;
+	unsigned int j;
+
+	if (rec->format == LDB_PACKING_FORMAT_V3) {
+		int ret;
+
+		if (rec->next_element == rec->num_elements) {
+			if (p != rec->end) {
+				return LDB_ERR_OPERATIONS_ERROR;
+			}
+			return LDB_ERR_NO_SUCH_ATTRIBUTE;
+		}
+		ret = ldb_kv_packed_element_v3(rec, p, el, &rec->p);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+		rec->next_element++;
+		return LDB_SUCCESS;
+	}
+
+	if (rec->next_element == rec->num_elements) {
+		if (p != value_section_p || rec->q != rec->end) {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+		return LDB_ERR_NO_SUCH_ATTRIBUTE;
+	}
+
+	/* Sanity check: minimum element size, as ldb_unpack_data() */
+	if ((U32_LEN * 2) + (U8_LEN * 2) + (NULL_PAD_BYTE_LEN * 2) >
+	    value_section_p - p) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	attr_len = PULL_LE_U32(p, 0);
+	p += U32_LEN;
+	if (attr_len == 0 ||
+	    attr_len + NULL_PAD_BYTE_LEN + U32_LEN + U8_LEN >
+	    value_section_p - p ||
+	    p[attr_len] != '\0') {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	el->name = (const char *)p;
+	p += attr_len + NULL_PAD_BYTE_LEN;
+
+	el->num_values = PULL_LE_U32(p, 0);
+	p += U32_LEN;
+	el->width = *p;
+	p += U8_LEN;
+
+	if (el->width != U8_LEN &&
+	    el->width != U16_LEN &&
+	    el->width != U32_LEN) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	if ((size_t)el->width * el->num_values > value_section_p - p) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	el->lengths = p;
+	p += el->width * el->num_values;
+
+	/* find the values, which follow those of the earlier attributes */
+	for (j = 0; j < el->num_values; j++) {
+		size_t len = ldb_kv_packed_element_length(el, j);
+
+		if (len + NULL_PAD_BYTE_LEN > rec->end - rec->q - total) {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+		total += len + NULL_PAD_BYTE_LEN;
+	}
+	el->values = rec->q;
+
+	rec->q += total;
+	rec->p = p;
+	rec->next_element++;
+	return LDB_SUCCESS;
+}
+
+/*
+  the length of a value of a packed attribute
+ */
+size_t ldb_kv_packed_element_length(const struct ldb_kv_packed_element *el,
+				    unsigned int i)
+{
+	switch (el->width) {
+	case U8_LEN:
+		return PULL_LE_U8(el->lengths, i);
+	case U16_LEN:
+		return PULL_LE_U16(el->lengths, i * U16_LEN);
+	default:
+		return PULL_LE_U32(el->lengths, i * U32_LEN);
+	}
+}
+
+/*
+  fill in the values of a packed attribute, which must have room for
+  el->num_values.  The values point into the packed record.
+ */
+void ldb_kv_packed_element_values(const struct ldb_kv_packed_element *el,
+				  struct ldb_val *values)
+{
+	const uint8_t *q = el->values;
+	unsigned int i;
+
+	for (i = 0; i < el->num_values; i++) {
+		values[i].length = ldb_kv_packed_element_length(el, i);
+		values[i].data = discard_const_p(uint8_t, q);
+		q += values[i].length + NULL_PAD_BYTE_LEN;
+	}
+}
+
+/*
+  find the first attribute of the given name in a V3 packed record,
+  using the attribute directory rather than reading the attributes
+  before it.
+
+  Only the attribute found is checked, so a damaged record may not be
+  noticed.
+
+  Returns LDB_ERR_NO_SUCH_ATTRIBUTE if the record has no attribute of
+  that name, and LDB_ERR_UNWILLING_TO_PERFORM if the record has no
+  directory or the name is not ASCII (see ldb_pack_attr_hash()).
+ */
+int ldb_kv_packed_record_find(const struct ldb_kv_packed_record *rec,
+			      const char *name,
+			      struct ldb_kv_packed_element *el)
+{
+	const uint8_t *dir = rec->dir;
+	size_t len = strlen(name);
+	uint32_t hash;
+	size_t lo = 0;
+	size_t hi = rec->num_elements;
+	size_t i;
+
+	if (rec->format != LDB_PACKING_FORMAT_V3) {
+		return LDB_ERR_UNWILLING_TO_PERFORM;
+	}
+	for (i = 0; i < len; i++) {
+		if ((uint8_t)name[i] >= 0x80) {
+			return LDB_ERR_UNWILLING_TO_PERFORM;
+		}
+	}
+	hash = ldb_pack_attr_hash(name, len);
+
+	/* the first entry with this hash */
+	while (lo < hi) {
+		size_t mid = lo + (hi - lo) / 2;
+
+		if (PULL_LE_U32(dir, mid * V3_DIR_ENTRY_LEN) < hash) {
+			lo = mid + 1;
+		} else {
+			hi = mid;
+		}
+	}
+
+	/* the entries for a hash are in the order of the attributes */
+	for (i = lo; i < rec->num_elements; i++) {
+		const uint8_t *entry = dir + i * V3_DIR_ENTRY_LEN;
+		uint32_t offset = PULL_LE_U32(entry, U32_LEN);
+		const uint8_t *next = NULL;
+		int ret;
+
+		if (PULL_LE_U32(entry, 0) != hash) {
+			break;
+		}
+		if (offset < rec->values_start - rec->start ||
+		    offset >= rec->end - rec->start) {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+
+		ret = ldb_kv_packed_element_v3(rec, rec->start + offset,
+					       el, &next);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+		if (el->num_values != PULL_LE_U32(entry, U32_LEN * 2)) {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+		if (ldb_attr_cmp(el->name, name) == 0) {
+			return LDB_SUCCESS;
+		}
+	}
+
+	return LDB_ERR_NO_SUCH_ATTRIBUTE;
+}
+
+/*
+  unpack only the named attributes of a V3 packed record into msg,
+  giving the same message as ldb_unpack_data_flags() followed by
+  ldb_filter_attrs_in_place(), but without reading the other
+  attributes.  The values point into the packed data.
+
+  Returns LDB_ERR_UNWILLING_TO_PERFORM if the record has no directory
+  or all the attributes are wanted, and the caller should unpack the
+  record as usual.
+ */
+int ldb_kv_packed_unpack_attrs(struct ldb_context *ldb,
+			       const struct ldb_val *data,
+			       struct ldb_message *msg,
+			       const char *const *attrs)
+{
+	struct ldb_kv_packed_record rec;
+	struct ldb_kv_packed_element el;
+	unsigned int num_attrs;
+	unsigned int i, j;
+	int ret;
+
+	if (attrs == NULL) {
+		return LDB_ERR_UNWILLING_TO_PERFORM;
+	}
+	for (num_attrs = 0; attrs[num_attrs] != NULL; num_attrs++) {
+		if (strcmp(attrs[num_attrs], "*") == 0) {
+			return LDB_ERR_UNWILLING_TO_PERFORM;
+		}
+	}
+
+	ret = ldb_kv_packed_record_init(&rec, data);
+	if (ret != LDB_SUCCESS) {
+		return ret;
+	}
+	if (rec.format != LDB_PACKING_FORMAT_V3) {
+		return LDB_ERR_UNWILLING_TO_PERFORM;
+	}
+
+	msg->num_elements = 0;
+	msg->elements = NULL;
+	msg->dn = ldb_dn_from_ldb_val(msg, ldb, &rec.dn);
+	if (msg->dn == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	if (num_attrs == 0) {
+		return LDB_SUCCESS;
+	}
+
+	msg->elements = talloc_array(msg, struct ldb_message_element,
+				     num_attrs);
+	if (msg->elements == NULL) {
+		ret = LDB_ERR_OPERATIONS_ERROR;
+		goto failed;
+	}
+
+	for (i = 0; i < num_attrs; i++) {
+		struct ldb_message_element *mel = NULL;
+
+		ret = ldb_kv_packed_record_find(&rec, attrs[i], &el);
+		if (ret == LDB_ERR_NO_SUCH_ATTRIBUTE) {
+			continue;
+		}
+		if (ret != LDB_SUCCESS) {
+			goto failed;
+		}
+
+		/* the same attribute may be asked for twice */
+		for (j = 0; j < msg->num_elements; j++) {
+			if (msg->elements[j].name == el.name) {
+				break;
+			}
+		}
+		if (j < msg->num_elements) {
+			continue;
+		}
+
+		/* keep the attributes in the order of the record */
+		j = msg->num_elements;
+		while (j > 0 && msg->elements[j - 1].name > el.name) {
+			msg->elements[j] = msg->elements[j - 1];
+			j--;
+		}
+		mel = &msg->elements[j];
+		*mel = (struct ldb_message_element) {
+			.name = el.name,
+			.num_values = el.num_values,
+		};
+		msg->num_elements++;
+
+		mel->values = talloc_array(msg->elements, struct ldb_val,
+					   el.num_values);
+		if (mel->values == NULL) {
+			ret = LDB_ERR_OPERATIONS_ERROR;
+			goto failed;
+		}
+		ldb_kv_packed_element_values(&el, mel->values);
+	}
+
+	return LDB_SUCCESS;
+
+failed:
+	TALLOC_FREE(msg->elements);
+	msg->num_elements = 0;
+	TALLOC_FREE(msg->dn);
+	return ret;
+}
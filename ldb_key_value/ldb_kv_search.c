@@ -102,8 +102,24 @@ struct ldb_kv_parse_data_unpack_ctx {
 	struct ldb_module *module;
 	struct ldb_kv_private *ldb_kv;
 	unsigned int unpack_flags;
+
+	/* match the packed record against this search first */
+	const struct ldb_kv_context *ac;
+	bool checked;
+	bool matched;
 };
 
+/*
+  can an unpacked message point into the database, see below
+*/
+static bool ldb_kv_parse_data_is_stable(struct ldb_kv_private *ldb_kv,
+					unsigned int unpack_flags)
+{
+	return (ldb_kv->kv_ops->options & LDB_KV_OPTION_STABLE_READ_LOCK) &&
+	       (unpack_flags & LDB_UNPACK_DATA_FLAG_READ_LOCKED) &&
+	       !ldb_kv->kv_ops->transaction_active(ldb_kv);
+}
+
 static int ldb_kv_parse_data_unpack(struct ldb_val key,
 				    struct ldb_val data,
 				    void *private_data)
@@ -115,9 +131,38 @@ static int ldb_kv_parse_data_unpack(struct ldb_val key,
 
 	struct ldb_kv_private *ldb_kv = ctx->ldb_kv;
 
-	if ((ldb_kv->kv_ops->options & LDB_KV_OPTION_STABLE_READ_LOCK) &&
-	    (ctx->unpack_flags & LDB_UNPACK_DATA_FLAG_READ_LOCKED) &&
-	    !ldb_kv->kv_ops->transaction_active(ldb_kv)) {
+	/*
+	 * Records that do not match the search are not unpacked, nor
+	 * copied out of the database.
+	 */
+	if (ctx->ac != NULL) {
+		ret = ldb_kv_match_packed(ctx->ac, ctx->msg, &data,
+					  &ctx->matched);
+		ctx->checked = (ret == LDB_SUCCESS);
+		if (ctx->checked && !ctx->matched) {
+			return LDB_SUCCESS;
+		}
+	}
+
+	/*
+	 * Those that do only need the attributes the search asked
+	 * for.  With the V3 format these are unpacked alone, and only
+	 * they are copied.
+	 */
+	if (ctx->checked) {
+		ret = ldb_kv_packed_unpack_attrs(ldb, &data, ctx->msg,
+						 ctx->ac->attrs);
+		if (ret == LDB_SUCCESS &&
+		    !ldb_kv_parse_data_is_stable(ldb_kv, ctx->unpack_flags) &&
+		    ldb_msg_elements_take_ownership(ctx->msg) != LDB_SUCCESS) {
+			ret = LDB_ERR_OPERATIONS_ERROR;
+		}
+		if (ret != LDB_ERR_UNWILLING_TO_PERFORM) {
+			return ret;
+		}
+	}
+
+	if (ldb_kv_parse_data_is_stable(ldb_kv, ctx->unpack_flags)) {
 		/*
 		 * In the case where no transactions are active and
 		 * we're in a read-lock, we can point directly into
@@ -130,6 +175,11 @@ static int ldb_kv_parse_data_unpack(struct ldb_val key,
 		 * - ldb_kv_index_filter
 		 * - ldb_kv_search_and_return_base
 		 */
+	} else if (ctx->unpack_flags & LDB_UNPACK_DATA_FLAG_NO_ATTRS) {
+		/*
+		 * Only the DN is unpacked, and ldb_dn_from_ldb_val()
+		 * takes a copy of it.
+		 */
 	} else {
 		/*
 		 * In every other case, since unpack doesn't memdup, we need
@@ -167,33 +217,21 @@ static int ldb_kv_parse_data_unpack(struct ldb_val key,
 }
 
 /*
-  search the database for a single simple dn, returning all attributes
-  in a single message
-
-  return LDB_ERR_NO_SUCH_OBJECT on record-not-found
-  and LDB_SUCCESS on success
+  fetch a record by key and hand it to ldb_kv_parse_data_unpack()
 */
-int ldb_kv_search_key(struct ldb_module *module,
-		      struct ldb_kv_private *ldb_kv,
-		      const struct ldb_val ldb_key,
-		      struct ldb_message *msg,
-		      unsigned int unpack_flags)
+static int ldb_kv_search_key_parse(struct ldb_kv_private *ldb_kv,
+				   const struct ldb_val ldb_key,
+				   struct ldb_kv_parse_data_unpack_ctx *ctx)
 {
 	int ret;
-	struct ldb_kv_parse_data_unpack_ctx ctx = {
-		.msg = msg,
-		.module = module,
-		.unpack_flags = unpack_flags,
-		.ldb_kv = ldb_kv
-	};
 
-	memset(msg, 0, sizeof(*msg));
+	memset(ctx->msg, 0, sizeof(*ctx->msg));
 
-	msg->num_elements = 0;
-	msg->elements = NULL;
+	ctx->msg->num_elements = 0;
+	ctx->msg->elements = NULL;
 
 	ret = ldb_kv->kv_ops->fetch_and_parse(
-	    ldb_kv, ldb_key, ldb_kv_parse_data_unpack, &ctx);
+	    ldb_kv, ldb_key, ldb_kv_parse_data_unpack, ctx);
 
 	if (ret == -1) {
 		ret = ldb_kv->kv_ops->error(ldb_kv);
@@ -212,6 +250,60 @@ int ldb_kv_search_key(struct ldb_module *module,
 	return LDB_SUCCESS;
 }
 
+/*
+  search the database for a single simple dn, returning all attributes
+  in a single message
+
+  return LDB_ERR_NO_SUCH_OBJECT on record-not-found
+  and LDB_SUCCESS on success
+*/
+int ldb_kv_search_key(struct ldb_module *module,
+		      struct ldb_kv_private *ldb_kv,
+		      const struct ldb_val ldb_key,
+		      struct ldb_message *msg,
+		      unsigned int unpack_flags)
+{
+	struct ldb_kv_parse_data_unpack_ctx ctx = {
+		.msg = msg,
+		.module = module,
+		.unpack_flags = unpack_flags,
+		.ldb_kv = ldb_kv
+	};
+
+	return ldb_kv_search_key_parse(ldb_kv, ldb_key, &ctx);
+}
+
+/*
+  as ldb_kv_search_key(), but match the packed record against the
+  expression of the search before unpacking it.
+
+  If *checked is true on return, *matched is the result of the match,
+  and if that is false the record was not unpacked.  Otherwise the
+  caller must match the message itself.
+*/
+int ldb_kv_search_key_match(struct ldb_kv_context *ac,
+			    struct ldb_kv_private *ldb_kv,
+			    const struct ldb_val ldb_key,
+			    struct ldb_message *msg,
+			    unsigned int unpack_flags,
+			    bool *checked,
+			    bool *matched)
+{
+	struct ldb_kv_parse_data_unpack_ctx ctx = {
+		.msg = msg,
+		.module = ac->module,
+		.unpack_flags = unpack_flags,
+		.ldb_kv = ldb_kv,
+		.ac = ac,
+	};
+	int ret;
+
+	ret = ldb_kv_search_key_parse(ldb_kv, ldb_key, &ctx);
+	*checked = ctx.checked;
+	*matched = ctx.matched;
+	return ret;
+}
+
 /*
   search the database for a single simple dn, returning all attributes
   in a single message
@@ -303,21 +395,22 @@ int ldb_kv_filter_attrs_in_place(struct ldb_message *msg,
 }
 
 /*
-  search function for a non-indexed search
+  check a record for a non-indexed search and return it if it
+  matches.  If prematched, a parallel scan has already checked the
+  scope and the search expression.
  */
-static int search_func(_UNUSED_ struct ldb_kv_private *ldb_kv,
-		       struct ldb_val key,
-		       struct ldb_val val,
-		       void *state)
+static int ldb_kv_search_record(struct ldb_kv_context *ac,
+				struct ldb_val key,
+				struct ldb_val val,
+				bool prematched)
 {
 	struct ldb_context *ldb;
-	struct ldb_kv_context *ac;
 	struct ldb_message *msg;
 	struct timeval now;
 	int ret, timeval_cmp;
-	bool matched;
+	bool matched = prematched;
+	bool checked = false;
 
-	ac = talloc_get_type(state, struct ldb_kv_context);
 	ldb = ldb_module_get_ctx(ac->module);
 
 	/*
@@ -371,16 +464,38 @@ static int search_func(_UNUSED_ struct ldb_kv_private *ldb_kv,
 		}
 	}
 
+	/*
+	 * Most records will not match, so try the search expression
+	 * on the packed record and only unpack those that do.
+	 */
+	if (!prematched) {
+		ret = ldb_kv_match_packed(ac, ac, &val, &matched);
+		if (ret == LDB_SUCCESS && !matched) {
+			return 0;
+		}
+		checked = (ret == LDB_SUCCESS);
+	}
+
 	msg = ldb_msg_new(ac);
 	if (!msg) {
 		ac->error = LDB_ERR_OPERATIONS_ERROR;
 		return -1;
 	}
 
-	/* unpack the record */
-	ret = ldb_unpack_data_flags(ldb, &val, msg,
-				    LDB_UNPACK_DATA_FLAG_NO_VALUES_ALLOC);
-	if (ret == -1) {
+	/*
+	 * Once the record is known to match, only the attributes
+	 * asked for are needed, which the V3 format can unpack alone.
+	 */
+	ret = LDB_ERR_UNWILLING_TO_PERFORM;
+	if (checked) {
+		ret = ldb_kv_packed_unpack_attrs(ldb, &val, msg, ac->attrs);
+	}
+	if (ret == LDB_ERR_UNWILLING_TO_PERFORM) {
+		/* unpack the record */
+		ret = ldb_unpack_data_flags(ldb, &val, msg,
+					    LDB_UNPACK_DATA_FLAG_NO_VALUES_ALLOC);
+	}
+	if (ret != LDB_SUCCESS) {
 		talloc_free(msg);
 		ac->error = LDB_ERR_OPERATIONS_ERROR;
 		return -1;
@@ -401,7 +516,8 @@ static int search_func(_UNUSED_ struct ldb_kv_private *ldb_kv,
 	 * security descriptor. Check the DN early and bail out if it doesn't
 	 * match the base.
 	 */
-	if (!ldb_match_scope(ldb, ac->base, msg->dn, ac->scope)) {
+	if (!prematched &&
+	    !ldb_match_scope(ldb, ac->base, msg->dn, ac->scope)) {
 		talloc_free(msg);
 		return 0;
 	}
@@ -415,12 +531,13 @@ static int search_func(_UNUSED_ struct ldb_kv_private *ldb_kv,
 	}
 
 	/* see if it matches the given expression */
-	ret = ldb_match_message(ldb, msg,
-				ac->tree, ac->scope, &matched);
-	if (ret != LDB_SUCCESS) {
-		talloc_free(msg);
-		ac->error = LDB_ERR_OPERATIONS_ERROR;
-		return -1;
+	if (!prematched && !checked) {
+		ret = ldb_kv_match_message(ac, msg, msg, &matched);
+		if (ret != LDB_SUCCESS) {
+			talloc_free(msg);
+			ac->error = LDB_ERR_OPERATIONS_ERROR;
+			return -1;
+		}
 	}
 	if (!matched) {
 		talloc_free(msg);
@@ -462,6 +579,138 @@ static int search_func(_UNUSED_ struct ldb_kv_private *ldb_kv,
 	return 0;
 }
 
+/*
+  search function for a non-indexed search
+ */
+static int search_func(_UNUSED_ struct ldb_kv_private *ldb_kv,
+		       struct ldb_val key,
+		       struct ldb_val val,
+		       void *state)
+{
+	struct ldb_kv_context *ac =
+		talloc_get_type(state, struct ldb_kv_context);
+
+	return ldb_kv_search_record(ac, key, val, false);
+}
+
+/*
+  return a record matched by a worker of a parallel full scan
+ */
+static int search_func_matched(_UNUSED_ struct ldb_kv_private *ldb_kv,
+			       struct ldb_val key,
+			       struct ldb_val val,
+			       void *state)
+{
+	struct ldb_kv_context *ac =
+		talloc_get_type(state, struct ldb_kv_context);
+
+	return ldb_kv_search_record(ac, key, val, true);
+}
+
+/*
+  match a record for a parallel full scan.
+
+  This runs on a worker thread, so it only reads the search context
+  and allocates on mem_ctx.  Matching records are returned by
+  search_func_matched() on the thread running the search.
+ */
+static int search_filter(_UNUSED_ struct ldb_kv_private *ldb_kv,
+			 TALLOC_CTX *mem_ctx,
+			 size_t count,
+			 struct ldb_val key,
+			 struct ldb_val val,
+			 void *state,
+			 bool *matched)
+{
+	const struct ldb_kv_context *ac = state;
+	struct ldb_context *ldb = ldb_module_get_ctx(ac->module);
+	struct ldb_message *msg = NULL;
+	bool checked = false;
+	int ret;
+
+	*matched = false;
+
+	if (ldb_kv_key_is_normal_record(key) == false) {
+		return LDB_SUCCESS;
+	}
+
+	/* As in ldb_kv_search_record() */
+	if (count % 64 == 0) {
+		struct timeval now = tevent_timeval_current();
+		if (tevent_timeval_compare(&ac->timeout_timeval, &now) <= 0) {
+			return LDB_ERR_TIME_LIMIT_EXCEEDED;
+		}
+	}
+
+	/* As in ldb_kv_search_record() */
+	ret = ldb_kv_match_packed(ac, mem_ctx, &val, matched);
+	if (ret == LDB_SUCCESS && !*matched) {
+		return LDB_SUCCESS;
+	}
+	checked = (ret == LDB_SUCCESS);
+	*matched = false;
+
+	msg = ldb_msg_new(mem_ctx);
+	if (msg == NULL) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	ret = ldb_unpack_data_flags(ldb, &val, msg,
+				    LDB_UNPACK_DATA_FLAG_NO_VALUES_ALLOC);
+	if (ret == -1) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	if (msg->dn == NULL) {
+		msg->dn = ldb_dn_new(msg, ldb, (char *)key.data + 3);
+		if (msg->dn == NULL) {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+	}
+
+	if (!ldb_match_scope(ldb, ac->base, msg->dn, ac->scope)) {
+		return LDB_SUCCESS;
+	}
+
+	if (checked) {
+		*matched = true;
+		return LDB_SUCCESS;
+	}
+
+	ret = ldb_kv_match_message(ac, mem_ctx, msg, matched);
+	if (ret != LDB_SUCCESS) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+	return LDB_SUCCESS;
+}
+
+/*
+  can the search expression be matched on worker threads?  Extended
+  matches may search the database themselves.
+ */
+static bool ldb_kv_tree_parallel_safe(const struct ldb_parse_tree *tree)
+{
+	unsigned int i;
+
+	switch (tree->operation) {
+	case LDB_OP_AND:
+	case LDB_OP_OR:
+		for (i = 0; i < tree->u.list.num_elements; i++) {
+			if (!ldb_kv_tree_parallel_safe(
+				    tree->u.list.elements[i])) {
+				return false;
+			}
+		}
+		return true;
+	case LDB_OP_NOT:
+		return ldb_kv_tree_parallel_safe(tree->u.isnot.child);
+	case LDB_OP_EXTENDED:
+		return false;
+	default:
+		return true;
+	}
+}
+
 /*
  * Key pointing to just before the first GUID indexed record for
  * iterate_range
@@ -486,11 +735,48 @@ static int ldb_kv_search_full(struct ldb_kv_context *ctx)
 	    talloc_get_type(data, struct ldb_kv_private);
 	int ret;
 
+	ctx->error = LDB_SUCCESS;
+
+	/*
+	 * Split the scan across worker threads if asked to.  Records
+	 * are only read on the workers, so this is not possible
+	 * inside a write transaction, and the redaction callback and
+	 * extended matches call back into the other modules.
+	 */
+	if (ldb_kv->full_scan_workers > 1 &&
+	    ldb_kv->kv_ops->iterate_parallel != NULL &&
+	    ldb_kv->cache->GUID_index_attribute != NULL &&
+	    !ldb_kv->kv_ops->transaction_active(ldb_kv) &&
+	    ldb_module_get_ctx(ctx->module)->redact.callback == NULL &&
+	    ldb_kv_tree_parallel_safe(ctx->tree)) {
+		/*
+		 * The workers all compare against the base DN, so
+		 * casefold it here rather than have them do it lazily
+		 * on the shared DN.
+		 */
+		if (ctx->base != NULL &&
+		    ldb_dn_get_casefold(ctx->base) == NULL) {
+			return ldb_module_operr(ctx->module);
+		}
+		ldb_dn_casefold_cache_suspend(ldb_module_get_ctx(ctx->module));
+		ret = ldb_kv->kv_ops->iterate_parallel(ldb_kv,
+						       ldb_kv->full_scan_workers,
+						       search_filter,
+						       search_func_matched,
+						       ctx);
+		ldb_dn_casefold_cache_resume(ldb_module_get_ctx(ctx->module));
+		if (ret != LDB_ERR_UNWILLING_TO_PERFORM) {
+			if (ret != LDB_SUCCESS) {
+				return ret;
+			}
+			return ctx->error;
+		}
+	}
+
 	/*
 	 * If the backend has an iterate_range op, use it to start the search
 	 * at the first GUID indexed record, skipping the indexes section.
 	 */
-	ctx->error = LDB_SUCCESS;
 	ret = ldb_kv->kv_ops->iterate_range(ldb_kv,
 					    start_of_db_key,
 					    end_of_db_key,
@@ -645,6 +931,7 @@ int ldb_kv_search(struct ldb_kv_context *ctx)
 	void *data = ldb_module_get_private(module);
 	struct ldb_kv_private *ldb_kv =
 	    talloc_get_type(data, struct ldb_kv_private);
+	struct ldb_control *sort_control = NULL;
 	int ret;
 
 	ldb = ldb_module_get_ctx(module);
@@ -669,6 +956,38 @@ int ldb_kv_search(struct ldb_kv_context *ctx)
 	ctx->scope = req->op.search.scope;
 	ctx->base = req->op.search.base;
 	ctx->attrs = req->op.search.attrs;
+	ctx->want_index_plan =
+	    ldb_request_get_control(req, LDB_CONTROL_INDEX_PLAN_OID) != NULL;
+
+	/*
+	 * Only send the entries in order if this request came
+	 * straight from the server_sort module, as a module in
+	 * between might send several searches on to us.
+	 */
+	sort_control = ldb_request_get_control(req, LDB_CONTROL_INDEX_SORT_OID);
+	if (sort_control != NULL) {
+		const struct ldb_index_sort_control *sort =
+			talloc_get_type(sort_control->data,
+					struct ldb_index_sort_control);
+		if (sort != NULL && sort->req == req) {
+			ctx->sort = sort;
+		}
+	}
+
+	/*
+	 * Searches other than base searches may match the expression
+	 * against many records, so compile it once.  If that fails
+	 * ldb_match_message() is used instead.
+	 */
+	if (ctx->scope != LDB_SCOPE_BASE) {
+		ret = ldb_kv_match_compile(ctx,
+					   ldb,
+					   ctx->tree,
+					   &ctx->match_program);
+		if (ret != LDB_SUCCESS) {
+			ctx->match_program = NULL;
+		}
+	}
 
 	if ((req->op.search.base == NULL) || (ldb_dn_is_null(req->op.search.base) == true)) {
 
@@ -698,6 +1017,9 @@ int ldb_kv_search(struct ldb_kv_context *ctx)
 		 * will try to look up an index record for a special
 		 * record (which doesn't exist).
 		 */
+		if (ctx->want_index_plan) {
+			ctx->index_plan = talloc_strdup(ctx, "base");
+		}
 		ret = ldb_kv_search_and_return_base(ldb_kv, ctx);
 
 		ldb_kv->kv_ops->unlock_read(module);
@@ -747,8 +1069,14 @@ int ldb_kv_search(struct ldb_kv_context *ctx)
 		 * callback error */
 		if (!ctx->request_terminated && ret != LDB_SUCCESS) {
 			/* Not indexed, so we need to do a full scan */
-			if (ldb_kv->warn_unindexed ||
-			    ldb_kv->disable_full_db_scan) {
+			if (ctx->want_index_plan && !ctx->planned_full_scan) {
+				TALLOC_FREE(ctx->index_plan);
+				ctx->index_plan = talloc_strdup(
+					ctx, "full scan: unindexed");
+			}
+			if ((ldb_kv->warn_unindexed ||
+			     ldb_kv->disable_full_db_scan) &&
+			    !ctx->planned_full_scan) {
 				/* useful for debugging when slow performance
 				 * is caused by unindexed searches */
 				char *expression = ldb_filter_from_tree(ctx, ctx->tree);
@@ -1135,6 +1135,7 @@ int ldb_map_search(struct ldb_module *module, struct ldb_request *req)
 	struct ldb_parse_tree *remote_tree;
 	struct ldb_parse_tree *local_tree;
 	struct ldb_request *remote_req;
+	struct ldb_control *sort_control;
 	struct ldb_context *ldb;
 	struct map_context *ac;
 	int ret;
@@ -1231,6 +1232,15 @@ int ldb_map_search(struct ldb_module *module, struct ldb_request *req)
 		return LDB_ERR_OPERATIONS_ERROR;
 	}
 
+	/* The index sort control is only for a local backend */
+	sort_control = ldb_request_get_control(remote_req,
+					       LDB_CONTROL_INDEX_SORT_OID);
+	if (sort_control != NULL &&
+	    !ldb_save_controls(sort_control, remote_req, NULL)) {
+		map_oom(ac->module);
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
 	return ldb_next_remote_request(module, remote_req);
 }
 
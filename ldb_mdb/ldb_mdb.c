@@ -25,6 +25,7 @@
 #include "ldb_mdb.h"
 #include "../ldb_key_value/ldb_kv.h"
 #include "include/dlinklist.h"
+#include <pthread.h>
 
 #define MDB_URL_PREFIX		"mdb://"
 #define MDB_URL_PREFIX_SIZE	(sizeof(MDB_URL_PREFIX)-1)
@@ -567,6 +568,487 @@ done:
 	return ldb_mdb_err_map(lmdb->error);
 }
 
+/*
+ * Parallel iterate, used for unindexed searches.
+ *
+ * The "GUID=" keyed records are split into ranges by the first byte
+ * of the GUID, each scanned by a worker thread in its own read
+ * transaction.  The workers only filter the records, the keys of the
+ * matching records are queued and the records are passed to fn() on
+ * the calling thread, in key order, from the read transaction of the
+ * caller.
+ *
+ * The workers must see the same snapshot as the caller, so if a
+ * write has been committed since the caller's read transaction began
+ * the scan is abandoned before any record is returned.
+ *
+ * Each worker holds a slot in the reader table, so a scan uses at
+ * most a quarter of it.  A worker that is more than
+ * LMDB_SCAN_MAX_QUEUED keys ahead of the caller waits for it to catch
+ * up, and the caller takes up to LMDB_SCAN_BATCH keys at a time.
+ */
+#define LMDB_MAX_SCAN_WORKERS 32
+#define LMDB_SCAN_MAX_QUEUED 4096
+#define LMDB_SCAN_BATCH 256
+
+struct lmdb_scan_range {
+	struct lmdb_scan *scan;
+	pthread_t thread;
+	bool thread_started;
+
+	uint8_t start[LDB_KV_GUID_KEY_SIZE];
+	size_t start_len;
+	/* the next range's start, or NULL for the last range */
+	uint8_t *end;
+
+	/* Protected by scan->mutex */
+	size_t txnid;
+	bool ready;
+	bool done;
+	int error;
+	uint8_t (*keys)[LDB_KV_GUID_KEY_SIZE];
+	size_t num_keys;
+	size_t max_keys;
+	size_t next_key;
+};
+
+struct lmdb_scan {
+	struct ldb_kv_private *ldb_kv;
+	MDB_env *env;
+	ldb_kv_parallel_filter_fn filter;
+	void *ctx;
+
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+
+	/* Protected by mutex */
+	bool go;
+	bool stop;
+
+	unsigned int num_ranges;
+	struct lmdb_scan_range *ranges;
+};
+
+static bool lmdb_scan_key_in_range(const struct lmdb_scan_range *range,
+				   const MDB_val *key)
+{
+	const size_t prefix_len = strlen(LDB_KV_GUID_KEY_PREFIX);
+
+	if (key->mv_size < prefix_len ||
+	    memcmp(key->mv_data, LDB_KV_GUID_KEY_PREFIX, prefix_len) != 0) {
+		return false;
+	}
+	if (range->end == NULL) {
+		return true;
+	}
+	/* ranges end at the start of the next one, all the same length */
+	return memcmp(key->mv_data,
+		      range->end,
+		      MIN(key->mv_size, range->start_len)) < 0;
+}
+
+/*
+  queue a matched key, called with scan->mutex held.  *go is set to
+  false if the scan was stopped while waiting for room.
+ */
+static int lmdb_scan_add_key(struct lmdb_scan_range *range,
+			     const MDB_val *key,
+			     bool *go)
+{
+	struct lmdb_scan *scan = range->scan;
+
+	if (key->mv_size != LDB_KV_GUID_KEY_SIZE) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	while (range->num_keys - range->next_key >= LMDB_SCAN_MAX_QUEUED &&
+	       !scan->stop) {
+		pthread_cond_wait(&scan->cond, &scan->mutex);
+	}
+	*go = !scan->stop;
+	if (!*go) {
+		return LDB_SUCCESS;
+	}
+
+	/* Reuse the space of the keys already taken */
+	if (range->next_key > 0) {
+		memmove(range->keys,
+			range->keys[range->next_key],
+			(range->num_keys - range->next_key) *
+			LDB_KV_GUID_KEY_SIZE);
+		range->num_keys -= range->next_key;
+		range->next_key = 0;
+	}
+
+	if (range->num_keys == range->max_keys) {
+		size_t max_keys = MAX(range->max_keys * 2, 64);
+		void *keys = realloc(range->keys,
+				     max_keys * LDB_KV_GUID_KEY_SIZE);
+		if (keys == NULL) {
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+		range->keys = keys;
+		range->max_keys = max_keys;
+	}
+	memcpy(range->keys[range->num_keys], key->mv_data, key->mv_size);
+	range->num_keys++;
+	return LDB_SUCCESS;
+}
+
+static void *lmdb_scan_worker(void *private_data)
+{
+	struct lmdb_scan_range *range = private_data;
+	struct lmdb_scan *scan = range->scan;
+	TALLOC_CTX *mem_ctx = NULL;
+	MDB_txn *txn = NULL;
+	MDB_cursor *cursor = NULL;
+	MDB_dbi dbi = 0;
+	MDB_val mdb_key;
+	MDB_val mdb_data;
+	MDB_cursor_op op = MDB_SET_RANGE;
+	size_t count = 0;
+	bool go;
+	int ret;
+
+	/*
+	 * A talloc hierarchy of our own, nothing allocated on it
+	 * leaves this thread
+	 */
+	mem_ctx = talloc_new(NULL);
+	if (mem_ctx == NULL) {
+		ret = LDB_ERR_OPERATIONS_ERROR;
+		goto done;
+	}
+
+	ret = mdb_txn_begin(scan->env, NULL, MDB_RDONLY, &txn);
+	if (ret != MDB_SUCCESS) {
+		txn = NULL;
+		ret = ldb_mdb_err_map(ret);
+		goto done;
+	}
+
+	/* Wait for the caller to check we have the same snapshot */
+	pthread_mutex_lock(&scan->mutex);
+	range->txnid = mdb_txn_id(txn);
+	range->ready = true;
+	pthread_cond_broadcast(&scan->cond);
+	while (!scan->go && !scan->stop) {
+		pthread_cond_wait(&scan->cond, &scan->mutex);
+	}
+	go = !scan->stop;
+	pthread_mutex_unlock(&scan->mutex);
+	if (!go) {
+		ret = LDB_SUCCESS;
+		goto done;
+	}
+
+	ret = mdb_dbi_open(txn, NULL, 0, &dbi);
+	if (ret == MDB_SUCCESS) {
+		ret = mdb_cursor_open(txn, dbi, &cursor);
+	}
+	if (ret != MDB_SUCCESS) {
+		cursor = NULL;
+		ret = ldb_mdb_err_map(ret);
+		goto done;
+	}
+
+	mdb_key.mv_size = range->start_len;
+	mdb_key.mv_data = range->start;
+
+	while ((ret = mdb_cursor_get(cursor, &mdb_key, &mdb_data, op))
+	       == MDB_SUCCESS) {
+		struct ldb_val key = {
+			.length = mdb_key.mv_size,
+			.data = mdb_key.mv_data,
+		};
+		struct ldb_val data = {
+			.length = mdb_data.mv_size,
+			.data = mdb_data.mv_data,
+		};
+		bool matched = false;
+
+		op = MDB_NEXT;
+
+		if (!lmdb_scan_key_in_range(range, &mdb_key)) {
+			break;
+		}
+
+		if (count % 64 == 0) {
+			pthread_mutex_lock(&scan->mutex);
+			go = !scan->stop;
+			pthread_mutex_unlock(&scan->mutex);
+			if (!go) {
+				break;
+			}
+		}
+
+		ret = scan->filter(scan->ldb_kv,
+				   mem_ctx,
+				   count,
+				   key,
+				   data,
+				   scan->ctx,
+				   &matched);
+		talloc_free_children(mem_ctx);
+		count++;
+		if (ret != LDB_SUCCESS) {
+			goto done;
+		}
+		if (!matched) {
+			continue;
+		}
+
+		pthread_mutex_lock(&scan->mutex);
+		ret = lmdb_scan_add_key(range, &mdb_key, &go);
+		pthread_cond_broadcast(&scan->cond);
+		pthread_mutex_unlock(&scan->mutex);
+		if (ret != LDB_SUCCESS) {
+			goto done;
+		}
+		if (!go) {
+			break;
+		}
+	}
+	if (ret == MDB_NOTFOUND || ret == MDB_SUCCESS) {
+		ret = LDB_SUCCESS;
+	} else {
+		ret = ldb_mdb_err_map(ret);
+	}
+
+done:
+	if (cursor != NULL) {
+		mdb_cursor_close(cursor);
+	}
+	if (txn != NULL) {
+		mdb_txn_abort(txn);
+	}
+	TALLOC_FREE(mem_ctx);
+
+	pthread_mutex_lock(&scan->mutex);
+	range->error = ret;
+	range->ready = true;
+	range->done = true;
+	pthread_cond_broadcast(&scan->cond);
+	pthread_mutex_unlock(&scan->mutex);
+	return NULL;
+}
+
+static int lmdb_scan_destructor(struct lmdb_scan *scan)
+{
+	unsigned int i;
+
+	pthread_mutex_lock(&scan->mutex);
+	scan->stop = true;
+	pthread_cond_broadcast(&scan->cond);
+	pthread_mutex_unlock(&scan->mutex);
+
+	for (i = 0; i < scan->num_ranges; i++) {
+		struct lmdb_scan_range *range = &scan->ranges[i];
+
+		if (range->thread_started) {
+			pthread_join(range->thread, NULL);
+		}
+		free(range->keys);
+	}
+
+	pthread_cond_destroy(&scan->cond);
+	pthread_mutex_destroy(&scan->mutex);
+	return 0;
+}
+
+/*
+  wait for the next keys matched in range, taking up to
+  LMDB_SCAN_BATCH of them.  Returns 0 once the range is finished.
+ */
+static size_t lmdb_scan_next_keys(
+	struct lmdb_scan *scan,
+	struct lmdb_scan_range *range,
+	uint8_t keys[LMDB_SCAN_BATCH][LDB_KV_GUID_KEY_SIZE],
+	int *error)
+{
+	size_t n;
+
+	pthread_mutex_lock(&scan->mutex);
+	while (range->next_key == range->num_keys && !range->done) {
+		pthread_cond_wait(&scan->cond, &scan->mutex);
+	}
+	n = MIN(range->num_keys - range->next_key, LMDB_SCAN_BATCH);
+	if (n > 0) {
+		memcpy(keys,
+		       range->keys[range->next_key],
+		       n * LDB_KV_GUID_KEY_SIZE);
+		range->next_key += n;
+		/* wake the worker if it was waiting for room */
+		pthread_cond_broadcast(&scan->cond);
+	}
+	*error = range->error;
+	pthread_mutex_unlock(&scan->mutex);
+	return n;
+}
+
+static int lmdb_iterate_parallel(struct ldb_kv_private *ldb_kv,
+				 unsigned int workers,
+				 ldb_kv_parallel_filter_fn filter,
+				 ldb_kv_traverse_fn fn,
+				 void *ctx)
+{
+	struct lmdb_private *lmdb = ldb_kv->lmdb_private;
+	const size_t prefix_len = strlen(LDB_KV_GUID_KEY_PREFIX);
+	struct lmdb_scan *scan = NULL;
+	uint8_t keys[LMDB_SCAN_BATCH][LDB_KV_GUID_KEY_SIZE];
+	MDB_txn *txn = NULL;
+	MDB_dbi dbi = 0;
+	size_t txnid;
+	bool same_snapshot = true;
+	unsigned int max_readers = 0;
+	unsigned int i;
+	int ret;
+
+	txn = get_current_txn(lmdb);
+	if (txn == NULL || lmdb_transaction_active(ldb_kv)) {
+		return LDB_ERR_UNWILLING_TO_PERFORM;
+	}
+	txnid = mdb_txn_id(txn);
+
+	/* Leave most of the reader table to the other readers */
+	if (mdb_env_get_maxreaders(lmdb->env, &max_readers) != MDB_SUCCESS) {
+		return LDB_ERR_UNWILLING_TO_PERFORM;
+	}
+	workers = MIN(workers, LMDB_MAX_SCAN_WORKERS);
+	workers = MIN(workers, max_readers / 4);
+	if (workers < 2) {
+		return LDB_ERR_UNWILLING_TO_PERFORM;
+	}
+
+	lmdb->error = mdb_dbi_open(txn, NULL, 0, &dbi);
+	if (lmdb->error != MDB_SUCCESS) {
+		return ldb_mdb_error(lmdb->ldb, lmdb->error);
+	}
+
+	scan = talloc_zero(ldb_kv, struct lmdb_scan);
+	if (scan == NULL) {
+		return ldb_oom(lmdb->ldb);
+	}
+	scan->ldb_kv = ldb_kv;
+	scan->env = lmdb->env;
+	scan->filter = filter;
+	scan->ctx = ctx;
+	scan->num_ranges = workers;
+	scan->ranges = talloc_zero_array(scan,
+					 struct lmdb_scan_range,
+					 scan->num_ranges);
+	if (scan->ranges == NULL) {
+		TALLOC_FREE(scan);
+		return ldb_oom(lmdb->ldb);
+	}
+	if (pthread_mutex_init(&scan->mutex, NULL) != 0) {
+		TALLOC_FREE(scan);
+		return LDB_ERR_UNWILLING_TO_PERFORM;
+	}
+	if (pthread_cond_init(&scan->cond, NULL) != 0) {
+		pthread_mutex_destroy(&scan->mutex);
+		TALLOC_FREE(scan);
+		return LDB_ERR_UNWILLING_TO_PERFORM;
+	}
+	talloc_set_destructor(scan, lmdb_scan_destructor);
+
+	for (i = 0; i < scan->num_ranges; i++) {
+		struct lmdb_scan_range *range = &scan->ranges[i];
+
+		range->scan = scan;
+		memcpy(range->start, LDB_KV_GUID_KEY_PREFIX, prefix_len);
+		range->start[prefix_len] = (256 * i) / scan->num_ranges;
+		range->start_len = prefix_len + 1;
+		if (i > 0) {
+			scan->ranges[i - 1].end = range->start;
+		}
+	}
+
+	for (i = 0; i < scan->num_ranges; i++) {
+		struct lmdb_scan_range *range = &scan->ranges[i];
+
+		ret = pthread_create(&range->thread,
+				     NULL,
+				     lmdb_scan_worker,
+				     range);
+		if (ret != 0) {
+			TALLOC_FREE(scan);
+			return LDB_ERR_UNWILLING_TO_PERFORM;
+		}
+		range->thread_started = true;
+	}
+
+	/* Check every worker can see exactly what we can */
+	pthread_mutex_lock(&scan->mutex);
+	for (i = 0; i < scan->num_ranges; i++) {
+		struct lmdb_scan_range *range = &scan->ranges[i];
+
+		while (!range->ready) {
+			pthread_cond_wait(&scan->cond, &scan->mutex);
+		}
+		if (range->done || range->txnid != txnid) {
+			same_snapshot = false;
+		}
+	}
+	if (same_snapshot) {
+		scan->go = true;
+	} else {
+		scan->stop = true;
+	}
+	pthread_cond_broadcast(&scan->cond);
+	pthread_mutex_unlock(&scan->mutex);
+
+	if (!same_snapshot) {
+		TALLOC_FREE(scan);
+		return LDB_ERR_UNWILLING_TO_PERFORM;
+	}
+
+	ret = LDB_SUCCESS;
+	for (i = 0; i < scan->num_ranges && ret == LDB_SUCCESS; i++) {
+		struct lmdb_scan_range *range = &scan->ranges[i];
+		size_t n, k;
+
+		while ((n = lmdb_scan_next_keys(scan, range, keys, &ret)) > 0) {
+			for (k = 0; k < n; k++) {
+				MDB_val mdb_key = {
+					.mv_size = LDB_KV_GUID_KEY_SIZE,
+					.mv_data = keys[k],
+				};
+				MDB_val mdb_data;
+				struct ldb_val key = {
+					.length = LDB_KV_GUID_KEY_SIZE,
+					.data = keys[k],
+				};
+				struct ldb_val data;
+
+				lmdb->error = mdb_get(txn,
+						      dbi,
+						      &mdb_key,
+						      &mdb_data);
+				if (lmdb->error != MDB_SUCCESS) {
+					TALLOC_FREE(scan);
+					return ldb_mdb_error(lmdb->ldb,
+							     lmdb->error);
+				}
+				data.length = mdb_data.mv_size;
+				data.data = mdb_data.mv_data;
+
+				if (fn(ldb_kv, key, data, ctx) != 0) {
+					/*
+					 * As for iterate, the callback
+					 * stores its own error.
+					 */
+					TALLOC_FREE(scan);
+					return LDB_SUCCESS;
+				}
+			}
+		}
+	}
+
+	TALLOC_FREE(scan);
+	return ret;
+}
+
 static int lmdb_lock_read(struct ldb_module *module)
 {
 	void *data = ldb_module_get_private(module);
@@ -734,14 +1216,37 @@ static const char *lmdb_name(struct ldb_kv_private *ldb_kv)
 
 static bool lmdb_changed(struct ldb_kv_private *ldb_kv)
 {
+	struct lmdb_private *lmdb = ldb_kv->lmdb_private;
+	MDB_txn *txn = NULL;
+	size_t txnid;
+	bool has_changed;
+
 	/*
-	 * lmdb does no provide a quick way to determine if the database
-	 * has changed.  This function always returns true.
+	 * Every committed write transaction advances the LMDB
+	 * transaction ID, so the ID of the snapshot we are reading
+	 * plays the part of the tdb sequence number.  A (nested)
+	 * write transaction sees the ID it will commit as, so our own
+	 * changes are not reported once committed, and a cancelled
+	 * transaction is reported as a change.
 	 *
-	 * Note that tdb uses a sequence number that allows this function
-	 * to be implemented efficiently.
+	 * Without a transaction we can not tell, so report a change.
 	 */
-	return true;
+	txn = lmdb_trans_get_tx(lmdb_private_trans_head(lmdb));
+	if (txn == NULL) {
+		txn = lmdb->read_txn;
+	}
+	if (txn == NULL) {
+		lmdb->have_txnid = false;
+		return true;
+	}
+
+	txnid = mdb_txn_id(txn);
+	has_changed = !lmdb->have_txnid || txnid != lmdb->txnid;
+
+	lmdb->txnid = txnid;
+	lmdb->have_txnid = true;
+
+	return has_changed;
 }
 
 /*
@@ -818,6 +1323,7 @@ static struct kv_db_ops lmdb_key_value_ops = {
 	.begin_nested_write = lmdb_nested_transaction_start,
 	.finish_nested_write = lmdb_nested_transaction_commit,
 	.abort_nested_write = lmdb_nested_transaction_cancel,
+	.iterate_parallel   = lmdb_iterate_parallel,
 };
 
 static const char *lmdb_get_path(const char *url)
@@ -41,6 +41,10 @@ struct lmdb_private {
 	int error;
 	MDB_txn *read_txn;
 
+	/* the transaction ID last seen by lmdb_changed() */
+	size_t txnid;
+	bool have_txnid;
+
 	pid_t pid;
 
 };
@@ -35,6 +35,7 @@
 #include "system/filesys.h"
 #include "system/time.h"
 #include "ldb_module.h"
+#include "ldb_handlers.h"
 
 struct opaque {
 	struct ldb_context *ldb;
@@ -44,6 +45,62 @@ struct opaque {
 	int result;
 };
 
+struct sort_private {
+	/*
+	 * Once the buffered messages use more than this many bytes,
+	 * later messages are packed into a temporary file and only
+	 * their sort keys are kept in memory.  0 means no limit.
+	 */
+	size_t memory_limit;
+
+	/*
+	 * The directory holding the database, where the temporary
+	 * file is created, as the messages may contain secret
+	 * attributes.
+	 */
+	const char *spill_dir;
+};
+
+/*
+ * Where the sort attribute is missing or has no values, the message
+ * sorts at the end (regardless of the reverse flag), with missing
+ * elements after empty ones.
+ */
+enum sort_key_rank {
+	SORT_KEY_VALUE = 0,
+	SORT_KEY_EMPTY,
+	SORT_KEY_MISSING
+};
+
+/*
+ * How the sort keys are compared.  Where the syntax allows, the keys
+ * are made so that their byte order is the sort order, and
+ * sort_compare() need not call the comparison function.
+ */
+enum sort_key_format {
+	/* canonical values, compared by the comparison_fn */
+	SORT_KEY_COMPARE = 0,
+	/* canonical values, shorter first, then by memcmp() */
+	SORT_KEY_BINARY,
+	/* index_format_fn values, by memcmp() then shorter first */
+	SORT_KEY_ORDERED
+};
+
+struct sort_msg {
+	/* NULL if the message has been spilled to the temporary file */
+	struct ldb_message *msg;
+
+	/* the first value of the sort attribute, see sort_key_format */
+	struct ldb_val key;
+	enum sort_key_rank rank;
+
+	/* the order the message arrived in, to break ties */
+	unsigned int seq;
+
+	off_t offset;
+	size_t length;
+};
+
 struct sort_context {
 	struct ldb_module *module;
 
@@ -52,13 +109,40 @@ struct sort_context {
 	int reverse;
 
 	struct ldb_request *req;
-	struct ldb_message **msgs;
+	struct sort_msg *msgs;
 	char **referrals;
 	unsigned int num_msgs;
 	unsigned int num_refs;
 	const char *extra_sort_key;
 
+	size_t memory_limit;
+	size_t memory_used;
+	const char *spill_dir;
+	FILE *spill;
+	off_t spill_length;
+
+	/*
+	 * The backend sends the entries in order (see
+	 * LDB_CONTROL_INDEX_SORT_OID), so they are passed on as
+	 * they arrive.  This is known from the first entry.
+	 */
+	bool entry_seen;
+	bool presorted;
+
+	/*
+	 * The request asked for a page of the results (see
+	 * LDB_CONTROL_PAGED_RESULTS_OID), so only the first
+	 * offset + page_size entries are kept, in a heap with the
+	 * entry that sorts last at the top.  0 if not paged.
+	 */
+	unsigned int offset;
+	unsigned int page_size;
+	unsigned int limit;
+	unsigned int num_seen;
+
 	const struct ldb_schema_attribute *a;
+	enum sort_key_format key_format;
+	ldb_attr_handler_t key_fn;
 	int sort_result;
 };
 
@@ -104,13 +188,37 @@ static int build_response(void *mem_ctx, struct ldb_control ***ctrls, int result
 	return LDB_SUCCESS;
 }
 
-static int sort_compare(struct ldb_message **msg1, struct ldb_message **msg2, void *opaque)
+static int sort_key_compare(struct sort_context *ac,
+			    const struct ldb_val *v1,
+			    const struct ldb_val *v2)
 {
-	struct sort_context *ac = talloc_get_type(opaque, struct sort_context);
-	struct ldb_message_element *el1, *el2;
-	struct ldb_context *ldb;
+	int ret;
 
-	ldb = ldb_module_get_ctx(ac->module);
+	switch (ac->key_format) {
+	case SORT_KEY_BINARY:
+		if (v1->length != v2->length) {
+			return NUMERIC_CMP(v1->length, v2->length);
+		}
+		return memcmp(v1->data, v2->data, v1->length);
+	case SORT_KEY_ORDERED:
+		ret = memcmp(v1->data, v2->data,
+			     MIN(v1->length, v2->length));
+		if (ret != 0) {
+			return ret;
+		}
+		return NUMERIC_CMP(v1->length, v2->length);
+	case SORT_KEY_COMPARE:
+		break;
+	}
+
+	return ac->a->syntax->comparison_fn(ldb_module_get_ctx(ac->module),
+					    ac, v1, v2);
+}
+
+static int sort_compare(struct sort_msg *msg1, struct sort_msg *msg2, void *opaque)
+{
+	struct sort_context *ac = talloc_get_type(opaque, struct sort_context);
+	int ret = 0;
 
 	if (ac->sort_result != 0) {
 		/* an error occurred previously,
@@ -118,36 +226,248 @@ static int sort_compare(struct ldb_message **msg1, struct ldb_message **msg2, vo
 		return 0;
 	}
 
-	el1 = ldb_msg_find_element(*msg1, ac->attributeName);
-	el2 = ldb_msg_find_element(*msg2, ac->attributeName);
+	if (msg1->rank != msg2->rank) {
+		return NUMERIC_CMP(msg1->rank, msg2->rank);
+	}
+
+	if (msg1->rank == SORT_KEY_VALUE) {
+		if (ac->reverse) {
+			ret = sort_key_compare(ac, &msg2->key, &msg1->key);
+		} else {
+			ret = sort_key_compare(ac, &msg1->key, &msg2->key);
+		}
+	}
+	if (ret != 0) {
+		return ret;
+	}
 
 	/*
-	 * NULL and empty elements sort at the end (regardless of ac->reverse flag).
-	 * NULL elements come after empty ones.
+	 * Equal entries stay in the order they arrived in, so each
+	 * page of a paged search is cut from the same order.
 	 */
-	if (el1 == el2) {
-		return 0;
+	return NUMERIC_CMP(msg1->seq, msg2->seq);
+}
+
+/*
+ * Choose how the sort keys are made and compared, see
+ * sort_key_format.
+ *
+ * The comparison function of a directory string depends on the
+ * casecmp function given by ldb_set_utf8_functions(), so only the
+ * syntaxes whose order is known here get a byte ordered key.
+ */
+static void sort_key_format_init(struct sort_context *ac)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(ac->module);
+	const struct ldb_schema_syntax *s = ac->a->syntax;
+	const struct ldb_schema_syntax *ordered = NULL;
+
+	ac->key_format = SORT_KEY_COMPARE;
+	ac->key_fn = s->canonicalise_fn;
+
+	if (s->comparison_fn == ldb_comparison_binary) {
+		ac->key_format = SORT_KEY_BINARY;
+		return;
 	}
-	if (el1 == NULL) {
-		return 1;
+
+	if (s->index_format_fn != NULL) {
+		ac->key_format = SORT_KEY_ORDERED;
+		ac->key_fn = s->index_format_fn;
+		return;
 	}
-	if (el2 == NULL) {
-		return -1;
+
+	/*
+	 * An INTEGER compares as an ORDERED_INTEGER does, and can
+	 * use its index format
+	 */
+	ordered = ldb_standard_syntax_by_name(ldb,
+					      LDB_SYNTAX_ORDERED_INTEGER);
+	if (ordered != NULL && ordered->index_format_fn != NULL &&
+	    s->comparison_fn == ordered->comparison_fn) {
+		ac->key_format = SORT_KEY_ORDERED;
+		ac->key_fn = ordered->index_format_fn;
 	}
-	if (unlikely(el1->num_values == 0 && el2->num_values == 0)) {
-		return 0;
+}
+
+/*
+ * Work out the sort key of a message as it arrives, so the sort
+ * itself does not need to find the element and canonicalise the
+ * value again for every comparison.
+ */
+static int sort_msg_set_key(struct sort_context *ac,
+			    struct sort_msg *sm,
+			    const struct ldb_message *msg)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(ac->module);
+	struct ldb_message_element *el;
+	TALLOC_CTX *tmp_ctx;
+	struct ldb_val v;
+	int ret;
+
+	el = ldb_msg_find_element(msg, ac->attributeName);
+	if (el == NULL) {
+		sm->rank = SORT_KEY_MISSING;
+		return LDB_SUCCESS;
+	}
+	if (el->num_values == 0) {
+		sm->rank = SORT_KEY_EMPTY;
+		return LDB_SUCCESS;
+	}
+
+	sm->rank = SORT_KEY_VALUE;
+
+	tmp_ctx = talloc_new(ac);
+	if (tmp_ctx == NULL) {
+		return ldb_oom(ldb);
+	}
+
+	/*
+	 * Values that cannot be canonicalised are compared as they
+	 * are, just as the comparison function would do with them.
+	 *
+	 * The key is copied as the canonical value may point into
+	 * the message, which could be spilled.
+	 */
+	ret = ac->key_fn(ldb, tmp_ctx, &el->values[0], &v);
+	if (ret != LDB_SUCCESS) {
+		v = el->values[0];
+	}
+
+	sm->key = ldb_val_dup(ac, &v);
+	talloc_free(tmp_ctx);
+	if (sm->key.data == NULL && v.length != 0) {
+		return ldb_oom(ldb);
+	}
+	return LDB_SUCCESS;
+}
+
+static int sort_context_destructor(struct sort_context *ac)
+{
+	if (ac->spill != NULL) {
+		fclose(ac->spill);
+		ac->spill = NULL;
+	}
+	return 0;
+}
+
+/*
+ * Pack a message into the temporary file, keeping only its sort key
+ * and location in memory.
+ */
+static int sort_msg_spill(struct sort_context *ac,
+			  struct sort_msg *sm,
+			  const struct ldb_message *msg)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(ac->module);
+	struct ldb_val data;
+	size_t written;
+	int ret;
+
+	if (ac->spill == NULL) {
+		char *path = NULL;
+		int fd;
+
+		path = talloc_asprintf(ac, "%s/.sort_spill.XXXXXX",
+				       ac->spill_dir);
+		if (path == NULL) {
+			return ldb_oom(ldb);
+		}
+
+		/*
+		 * mkstemp() creates the file readable only by us, and
+		 * it is unlinked at once so nothing is left behind.
+		 */
+		fd = mkstemp(path);
+		if (fd != -1) {
+			unlink(path);
+			ac->spill = fdopen(fd, "w+");
+			if (ac->spill == NULL) {
+				close(fd);
+			}
+		}
+		if (ac->spill == NULL) {
+			ldb_asprintf_errstring(ldb,
+					       "server_sort: unable to create "
+					       "temporary file in %s: %s",
+					       ac->spill_dir,
+					       strerror(errno));
+			talloc_free(path);
+			return LDB_ERR_OPERATIONS_ERROR;
+		}
+		talloc_free(path);
+		ac->spill_length = 0;
+	}
+
+	ret = ldb_pack_data(ldb, msg, &data, LDB_PACKING_FORMAT_V2);
+	if (ret != 0) {
+		return ldb_oom(ldb);
+	}
+
+	written = fwrite(data.data, 1, data.length, ac->spill);
+	talloc_free(data.data);
+	if (written != data.length) {
+		ldb_asprintf_errstring(ldb,
+				       "server_sort: unable to write "
+				       "temporary file: %s",
+				       strerror(errno));
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	sm->msg = NULL;
+	sm->offset = ac->spill_length;
+	sm->length = data.length;
+	ac->spill_length += data.length;
+
+	return LDB_SUCCESS;
+}
+
+/*
+ * Read a spilled message back from the temporary file.
+ */
+static int sort_msg_unspill(struct sort_context *ac,
+			    TALLOC_CTX *mem_ctx,
+			    const struct sort_msg *sm,
+			    struct ldb_message **_msg)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(ac->module);
+	struct ldb_message *msg;
+	struct ldb_val data;
+	int ret;
+
+	msg = ldb_msg_new(mem_ctx);
+	if (msg == NULL) {
+		return ldb_oom(ldb);
 	}
-	if (unlikely(el1->num_values == 0)) {
-		return 1;
+
+	/* the unpacked message points into this buffer */
+	data.length = sm->length;
+	data.data = talloc_size(msg, data.length);
+	if (data.data == NULL) {
+		talloc_free(msg);
+		return ldb_oom(ldb);
 	}
-	if (unlikely(el2->num_values == 0)) {
-		return -1;
+
+	if (fseeko(ac->spill, sm->offset, SEEK_SET) != 0 ||
+	    fread(data.data, 1, data.length, ac->spill) != data.length) {
+		ldb_asprintf_errstring(ldb,
+				       "server_sort: unable to read "
+				       "temporary file: %s",
+				       strerror(errno));
+		talloc_free(msg);
+		return LDB_ERR_OPERATIONS_ERROR;
 	}
 
-	if (ac->reverse)
-		return ac->a->syntax->comparison_fn(ldb, ac, &el2->values[0], &el1->values[0]);
+	ret = ldb_unpack_data(ldb, &data, msg);
+	if (ret != 0) {
+		ldb_set_errstring(ldb,
+				  "server_sort: corrupt message in "
+				  "temporary file");
+		talloc_free(msg);
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
 
-	return ac->a->syntax->comparison_fn(ldb, ac, &el1->values[0], &el2->values[0]);
+	*_msg = msg;
+	return LDB_SUCCESS;
 }
 
 static int server_sort_results(struct sort_context *ac)
@@ -159,7 +479,6 @@ static int server_sort_results(struct sort_context *ac)
 
 	ldb = ldb_module_get_ctx(ac->module);
 
-	ac->a = ldb_schema_attribute_by_name(ldb, ac->attributeName);
 	ac->sort_result = 0;
 
 	LDB_TYPESAFE_QSORT(ac->msgs, ac->num_msgs, ac, sort_compare);
@@ -168,14 +487,31 @@ static int server_sort_results(struct sort_context *ac)
 		return ac->sort_result;
 	}
 
-	for (i = 0; i < ac->num_msgs; i++) {
+	if (ac->spill != NULL && fflush(ac->spill) != 0) {
+		ldb_asprintf_errstring(ldb,
+				       "server_sort: unable to write "
+				       "temporary file: %s",
+				       strerror(errno));
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	/* the entries of the earlier pages were only kept to be sorted */
+	for (i = ac->offset; i < ac->num_msgs; i++) {
 		ares = talloc_zero(ac, struct ldb_reply);
 		if (!ares) {
 			return LDB_ERR_OPERATIONS_ERROR;
 		}
 
 		ares->type = LDB_REPLY_ENTRY;
-		ares->message = talloc_move(ares, &ac->msgs[i]);
+		if (ac->msgs[i].msg == NULL) {
+			ret = sort_msg_unspill(ac, ares, &ac->msgs[i],
+					       &ares->message);
+			if (ret != LDB_SUCCESS) {
+				return ret;
+			}
+		} else {
+			ares->message = talloc_move(ares, &ac->msgs[i].msg);
+		}
 		if (ac->extra_sort_key) {
 			ldb_msg_remove_attr(ares->message, ac->extra_sort_key);
 		}
@@ -185,7 +521,7 @@ static int server_sort_results(struct sort_context *ac)
 		}
 	}
 
-	for (i = 0; i < ac->num_refs; i++) {
+	for (i = 0; ac->offset == 0 && i < ac->num_refs; i++) {
 		ares = talloc_zero(ac, struct ldb_reply);
 		if (!ares) {
 			return LDB_ERR_OPERATIONS_ERROR;
@@ -203,6 +539,91 @@ static int server_sort_results(struct sort_context *ac)
 	return LDB_SUCCESS;
 }
 
+/*
+ * Add the paged results response to the done reply.  The cookie is
+ * the number of entries on this and the earlier pages, and is empty
+ * once the last page has been sent.
+ */
+static int sort_paged_response(struct sort_context *ac,
+			       struct ldb_reply *ares)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(ac->module);
+	struct ldb_paged_control *paged;
+
+	paged = talloc_zero(ares, struct ldb_paged_control);
+	if (paged == NULL) {
+		return ldb_oom(ldb);
+	}
+	paged->size = MIN(ac->num_seen, INT_MAX);
+
+	if (ac->num_seen > ac->limit) {
+		paged->cookie = talloc_asprintf(paged, "%u", ac->limit);
+		if (paged->cookie == NULL) {
+			return ldb_oom(ldb);
+		}
+		paged->cookie_len = strlen(paged->cookie);
+	}
+
+	return ldb_reply_add_control(ares, LDB_CONTROL_PAGED_RESULTS_OID,
+				     false, paged);
+}
+
+/*
+ * Free a message that sorts after the page asked for.
+ */
+static void sort_msg_drop(struct sort_context *ac, struct sort_msg *sm)
+{
+	if (sm->msg != NULL) {
+		ac->memory_used -= MIN(ac->memory_used,
+				       talloc_total_size(sm->msg));
+		TALLOC_FREE(sm->msg);
+	}
+	TALLOC_FREE(sm->key.data);
+}
+
+/*
+ * Restore the heap order of ac->msgs, after the entry at i has been
+ * added at the bottom (sift up) or replaced the top (sift down).
+ */
+static void sort_heap_up(struct sort_context *ac, unsigned int i)
+{
+	while (i > 0) {
+		unsigned int parent = (i - 1) / 2;
+		struct sort_msg tmp;
+
+		if (sort_compare(&ac->msgs[parent], &ac->msgs[i], ac) >= 0) {
+			break;
+		}
+		tmp = ac->msgs[parent];
+		ac->msgs[parent] = ac->msgs[i];
+		ac->msgs[i] = tmp;
+		i = parent;
+	}
+}
+
+static void sort_heap_down(struct sort_context *ac, unsigned int i)
+{
+	while (true) {
+		unsigned int c = 2 * i + 1;
+		struct sort_msg tmp;
+
+		if (c >= ac->num_msgs) {
+			break;
+		}
+		if (c + 1 < ac->num_msgs &&
+		    sort_compare(&ac->msgs[c + 1], &ac->msgs[c], ac) > 0) {
+			c++;
+		}
+		if (sort_compare(&ac->msgs[i], &ac->msgs[c], ac) >= 0) {
+			break;
+		}
+		tmp = ac->msgs[c];
+		ac->msgs[c] = ac->msgs[i];
+		ac->msgs[i] = tmp;
+		i = c;
+	}
+}
+
 static int server_sort_search_callback(struct ldb_request *req, struct ldb_reply *ares)
 {
 	struct sort_context *ac;
@@ -222,20 +643,87 @@ static int server_sort_search_callback(struct ldb_request *req, struct ldb_reply
 	}
 
 	switch (ares->type) {
-	case LDB_REPLY_ENTRY:
-		ac->msgs = talloc_realloc(ac, ac->msgs, struct ldb_message *, ac->num_msgs + 2);
+	case LDB_REPLY_ENTRY: {
+		struct sort_msg sm = { .msg = NULL };
+		size_t size;
+
+		if (!ac->entry_seen) {
+			ac->entry_seen = true;
+			ac->presorted = ac->limit == 0 &&
+				ldb_reply_get_control(
+				    ares, LDB_CONTROL_INDEX_SORT_OID) != NULL;
+		}
+		if (ac->presorted) {
+			if (ac->extra_sort_key) {
+				ldb_msg_remove_attr(ares->message,
+						    ac->extra_sort_key);
+			}
+			ret = ldb_module_send_entry(ac->req, ares->message,
+						    NULL);
+			talloc_free(ares);
+			if (ret != LDB_SUCCESS) {
+				return ldb_module_done(ac->req, NULL, NULL,
+						       ret);
+			}
+			return LDB_SUCCESS;
+		}
+
+		sm.seq = ac->num_seen++;
+		ret = sort_msg_set_key(ac, &sm, ares->message);
+		if (ret != LDB_SUCCESS) {
+			talloc_free(ares);
+			return ldb_module_done(ac->req, NULL, NULL, ret);
+		}
+
+		/*
+		 * Once the heap holds as many entries as the pages up
+		 * to this one, an entry is only kept if it sorts
+		 * before the one at the top, which is then dropped.
+		 */
+		if (ac->limit != 0 && ac->num_msgs == ac->limit) {
+			if (sort_compare(&sm, &ac->msgs[0], ac) > 0) {
+				TALLOC_FREE(sm.key.data);
+				break;
+			}
+			sort_msg_drop(ac, &ac->msgs[0]);
+		}
+
+		size = talloc_total_size(ares->message);
+		if (ac->memory_limit != 0 &&
+		    (ac->spill != NULL ||
+		     ac->memory_used + size > ac->memory_limit)) {
+			ret = sort_msg_spill(ac, &sm, ares->message);
+			if (ret != LDB_SUCCESS) {
+				talloc_free(ares);
+				return ldb_module_done(ac->req, NULL, NULL,
+						       ret);
+			}
+		} else {
+			sm.msg = talloc_steal(ac, ares->message);
+			ac->memory_used += size;
+		}
+
+		if (ac->limit != 0 && ac->num_msgs == ac->limit) {
+			ac->msgs[0] = sm;
+			sort_heap_down(ac, 0);
+			break;
+		}
+
+		ac->msgs = talloc_realloc(ac, ac->msgs, struct sort_msg, ac->num_msgs + 1);
 		if (! ac->msgs) {
 			talloc_free(ares);
 			ldb_oom(ldb);
 			return ldb_module_done(ac->req, NULL, NULL,
 						LDB_ERR_OPERATIONS_ERROR);
 		}
-
-		ac->msgs[ac->num_msgs] = talloc_steal(ac->msgs, ares->message);
+		ac->msgs[ac->num_msgs] = sm;
 		ac->num_msgs++;
-		ac->msgs[ac->num_msgs] = NULL;
+		if (ac->limit != 0) {
+			sort_heap_up(ac, ac->num_msgs - 1);
+		}
 
 		break;
+	}
 
 	case LDB_REPLY_REFERRAL:
 		ac->referrals = talloc_realloc(ac, ac->referrals, char *, ac->num_refs + 2);
@@ -255,6 +743,9 @@ static int server_sort_search_callback(struct ldb_request *req, struct ldb_reply
 	case LDB_REPLY_DONE:
 
 		ret = server_sort_results(ac);
+		if (ret == LDB_SUCCESS && ac->limit != 0) {
+			ret = sort_paged_response(ac, ares);
+		}
 		return ldb_module_done(ac->req, ares->controls,
 					ares->response, ret);
 	}
@@ -263,10 +754,80 @@ static int server_sort_search_callback(struct ldb_request *req, struct ldb_reply
 	return LDB_SUCCESS;
 }
 
+/*
+ * A paged search is sorted here, from the start, for every page, and
+ * the cookie is the number of entries on the pages already sent (see
+ * sort_paged_response()).
+ */
+static int sort_paged_init(struct sort_context *ac,
+			   const struct ldb_control *control)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(ac->module);
+	struct ldb_paged_control *paged;
+	unsigned long offset = 0;
+	int i;
+
+	paged = talloc_get_type(control->data, struct ldb_paged_control);
+	if (paged == NULL) {
+		return LDB_ERR_PROTOCOL_ERROR;
+	}
+
+	if (paged->cookie_len < 0 || paged->cookie_len > 10) {
+		goto bad_cookie;
+	}
+	for (i = 0; i < paged->cookie_len; i++) {
+		if (!isdigit((unsigned char)paged->cookie[i])) {
+			goto bad_cookie;
+		}
+		offset = offset * 10 + (paged->cookie[i] - '0');
+	}
+	if (paged->size <= 0 || offset > UINT_MAX - paged->size) {
+		goto bad_cookie;
+	}
+
+	ac->offset = offset;
+	ac->page_size = paged->size;
+	ac->limit = ac->offset + ac->page_size;
+	return LDB_SUCCESS;
+
+bad_cookie:
+	ldb_set_errstring(ldb, "server_sort: invalid paged results cookie");
+	return LDB_ERR_UNWILLING_TO_PERFORM;
+}
+
+/*
+ * Only a key value backend can send the entries in index order, and
+ * only for a search that may return many of them.
+ */
+static bool sort_use_index(struct sort_context *ac,
+			   const struct ldb_request *down_req)
+{
+	struct ldb_context *ldb = ldb_module_get_ctx(ac->module);
+	const struct ldb_index_sort_backend *backend = NULL;
+
+	if (ac->limit != 0 ||
+	    down_req->op.search.scope == LDB_SCOPE_BASE) {
+		return false;
+	}
+
+	backend = ldb_get_opaque(ldb, LDB_INDEX_SORT_BACKEND_OPAQUE);
+	if (backend == NULL) {
+		return false;
+	}
+	if (backend->module == NULL) {
+		/* the backend that answers checks for itself */
+		return true;
+	}
+	return backend->can_sort(backend->module, ac->attributeName);
+}
+
 static int server_sort_search(struct ldb_module *module, struct ldb_request *req)
 {
+	struct sort_private *data;
 	struct ldb_control *control;
+	struct ldb_control *paged_control;
 	struct ldb_server_sort_control **sort_ctrls;
+	struct ldb_index_sort_control *index_sort;
 	struct ldb_control **saved_controls;
 	struct ldb_request *down_req;
 	struct sort_context *ac;
@@ -293,6 +854,14 @@ static int server_sort_search(struct ldb_module *module, struct ldb_request *req
 
 	ac->module = module;
 	ac->req = req;
+	talloc_set_destructor(ac, sort_context_destructor);
+
+	data = talloc_get_type(ldb_module_get_private(module),
+			       struct sort_private);
+	if (data != NULL) {
+		ac->memory_limit = data->memory_limit;
+		ac->spill_dir = data->spill_dir;
+	}
 
 	sort_ctrls = talloc_get_type(control->data, struct ldb_server_sort_control *);
 	if (!sort_ctrls) {
@@ -361,6 +930,29 @@ static int server_sort_search(struct ldb_module *module, struct ldb_request *req
 	ac->attributeName = sort_ctrls[0]->attributeName;
 	ac->orderingRule = sort_ctrls[0]->orderingRule;
 	ac->reverse = sort_ctrls[0]->reverse;
+	ac->a = ldb_schema_attribute_by_name(ldb, ac->attributeName);
+	sort_key_format_init(ac);
+
+	/*
+	 * A request for the first page of 0 entries only ends a
+	 * paged search, and is passed on as it is.
+	 */
+	paged_control = ldb_request_get_control(req,
+						LDB_CONTROL_PAGED_RESULTS_OID);
+	if (paged_control != NULL) {
+		struct ldb_paged_control *paged =
+			talloc_get_type(paged_control->data,
+					struct ldb_paged_control);
+		if (paged != NULL && paged->size == 0) {
+			paged_control = NULL;
+		}
+	}
+	if (paged_control != NULL) {
+		ret = sort_paged_init(ac, paged_control);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+	}
 
 	ret = ldb_build_search_req_ex(&down_req, ldb, ac,
 					req->op.search.base,
@@ -381,17 +973,112 @@ static int server_sort_search(struct ldb_module *module, struct ldb_request *req
 	if (!ldb_save_controls(control, down_req, &saved_controls)) {
 		return LDB_ERR_OPERATIONS_ERROR;
 	}
+	if (paged_control != NULL &&
+	    !ldb_save_controls(paged_control, down_req, &saved_controls)) {
+		return LDB_ERR_OPERATIONS_ERROR;
+	}
+
+	/*
+	 * Ask the backend to send the entries in order, if it has
+	 * an ordered index of the attribute.  A paged search keeps
+	 * only the first pages in its heap instead.  The control is
+	 * not critical, a backend is free to ignore it.
+	 */
+	if (sort_use_index(ac, down_req) &&
+	    ldb_request_get_control(down_req,
+				    LDB_CONTROL_INDEX_SORT_OID) == NULL) {
+		index_sort = talloc(down_req, struct ldb_index_sort_control);
+		if (index_sort == NULL) {
+			return ldb_oom(ldb);
+		}
+		index_sort->attributeName = ac->attributeName;
+		index_sort->reverse = ac->reverse;
+		index_sort->req = down_req;
+
+		ret = ldb_request_add_control(down_req,
+					      LDB_CONTROL_INDEX_SORT_OID,
+					      false,
+					      index_sort);
+		if (ret != LDB_SUCCESS) {
+			return ret;
+		}
+	}
 
 	return ldb_next_request(module, down_req);
 }
 
+/*
+ * The directory of the database file, from the URL given to
+ * ldb_connect(), or NULL if it is not a local file.
+ */
+static const char *sort_spill_dir(TALLOC_CTX *mem_ctx,
+				  struct ldb_context *ldb)
+{
+	const char *url = ldb_get_opaque(ldb, "ldb_url");
+	const char *p = NULL;
+
+	if (url == NULL) {
+		return NULL;
+	}
+	if (strncmp(url, "tdb://", 6) == 0 ||
+	    strncmp(url, "mdb://", 6) == 0) {
+		url += 6;
+	} else if (strstr(url, "://") != NULL) {
+		return NULL;
+	}
+
+	p = strrchr(url, '/');
+	if (p == NULL) {
+		return talloc_strdup(mem_ctx, ".");
+	}
+	if (p == url) {
+		return talloc_strdup(mem_ctx, "/");
+	}
+	return talloc_strndup(mem_ctx, url, p - url);
+}
+
 static int server_sort_init(struct ldb_module *module)
 {
 	struct ldb_context *ldb;
+	struct sort_private *data;
+	const char *limit = NULL;
 	int ret;
 
 	ldb = ldb_module_get_ctx(module);
 
+	data = talloc_zero(module, struct sort_private);
+	if (data == NULL) {
+		return ldb_oom(ldb);
+	}
+	ldb_module_set_private(module, data);
+
+	limit = ldb_options_find(ldb, ldb_options_get(ldb),
+				 "sort_memory_limit");
+	if (limit != NULL) {
+		char *end = NULL;
+		unsigned long long value;
+
+		errno = 0;
+		value = strtoull(limit, &end, 10);
+		if (errno != 0 || end == limit || *end != '\0') {
+			ldb_debug(ldb, LDB_DEBUG_WARNING,
+				  "server_sort: "
+				  "invalid sort_memory_limit '%s'", limit);
+		} else {
+			data->memory_limit = value;
+		}
+	}
+
+	if (data->memory_limit != 0) {
+		data->spill_dir = sort_spill_dir(data, ldb);
+		if (data->spill_dir == NULL) {
+			ldb_debug(ldb, LDB_DEBUG_WARNING,
+				  "server_sort: the database is not a local "
+				  "file, ignoring sort_memory_limit");
+			data->memory_limit = 0;
+		}
+	}
+
 	ret = ldb_mod_register_control(module, LDB_CONTROL_SERVER_SORT_OID);
 	if (ret != LDB_SUCCESS) {
 		ldb_debug(ldb, LDB_DEBUG_WARNING,
@@ -51,10 +51,17 @@
 #include <ctype.h>
 
 #include <sys/wait.h>
+#include <time.h>
 
 #include "ldb_key_value/ldb_kv.c"
 #include "ldb_key_value/ldb_kv_index.c"
+#include "ldb_key_value/ldb_kv_index_cursor.c"
+#include "ldb_key_value/ldb_kv_index_plan.c"
+#include "ldb_key_value/ldb_kv_index_list.c"
+#include "ldb_key_value/ldb_kv_index_key.c"
 #include "ldb_key_value/ldb_kv_search.c"
+#include "ldb_key_value/ldb_kv_match.c"
+#include "ldb_key_value/ldb_kv_packed.c"
 
 #define DEFAULT_BE  "tdb"
 
@@ -117,8 +124,76 @@ static void test_index_cache_init(void **state)
 	assert_int_equal(LDB_SUCCESS, ret);
 
 	assert_non_null(ldb_kv->idxptr);
-	assert_non_null(ldb_kv->idxptr->itdb);
-	assert_int_equal(191, tdb_hash_size(ldb_kv->idxptr->itdb));
+	assert_non_null(ldb_kv->idxptr->entries);
+	assert_int_equal(0, ldb_kv->idxptr->num_entries);
+	assert_int_equal(ldb_kv_idxptr_slots_for(191),
+			 ldb_kv->idxptr->num_slots);
+	assert_true(ldb_kv->idxptr->num_slots >= 2 * 191);
+
+	TALLOC_FREE(ldb_kv);
+	TALLOC_FREE(module);
+}
+
+/*
+ * Test that the index cache grows as entries are added, and that every
+ * entry can still be found.
+ */
+static void test_index_cache_grow(void **state)
+{
+	struct test_ctx *test_ctx = talloc_get_type_abort(
+		*state,
+		struct test_ctx);
+	struct ldb_module *module = NULL;
+	struct ldb_kv_private *ldb_kv = NULL;
+	struct ldb_kv_idxptr *idxptr = NULL;
+	unsigned int i;
+	int ret = LDB_SUCCESS;
+
+	module = talloc_zero(test_ctx, struct ldb_module);
+	ldb_kv = talloc_zero(test_ctx, struct ldb_kv_private);
+	ldb_module_set_private(module, ldb_kv);
+
+	ret = ldb_kv_index_transaction_start(module, 4);
+	assert_int_equal(LDB_SUCCESS, ret);
+	idxptr = ldb_kv->idxptr;
+
+	for (i = 0; i < NUM_RECS; i++) {
+		struct ldb_kv_idxptr_entry *entry = NULL;
+		char *key = NULL;
+
+		entry = talloc_zero(idxptr, struct ldb_kv_idxptr_entry);
+		assert_non_null(entry);
+		key = talloc_asprintf(entry, "@INDEX:CN:%u", i);
+		assert_non_null(key);
+		entry->key.data = (uint8_t *)key;
+		entry->key.length = strlen(key);
+		entry->hash = ldb_kv_idxptr_hash(&entry->key);
+
+		assert_null(ldb_kv_idxptr_find(idxptr,
+					       &entry->key,
+					       entry->hash));
+		ret = ldb_kv_idxptr_insert(idxptr, entry);
+		assert_int_equal(LDB_SUCCESS, ret);
+	}
+
+	assert_int_equal(NUM_RECS, idxptr->num_entries);
+	assert_true(idxptr->num_slots >= 2 * NUM_RECS);
+
+	for (i = 0; i < NUM_RECS; i++) {
+		struct ldb_kv_idxptr_entry *entry = NULL;
+		struct ldb_val key;
+		char buf[32];
+
+		snprintf(buf, sizeof(buf), "@INDEX:CN:%u", i);
+		key.data = (uint8_t *)buf;
+		key.length = strlen(buf);
+
+		entry = ldb_kv_idxptr_find(idxptr,
+					   &key,
+					   ldb_kv_idxptr_hash(&key));
+		assert_non_null(entry);
+		assert_memory_equal(entry->key.data, buf, key.length);
+	}
 
 	TALLOC_FREE(ldb_kv);
 	TALLOC_FREE(module);
@@ -159,8 +234,8 @@ static void test_default_index_cache_size(void **state)
 	assert_int_equal(LDB_SUCCESS, ret);
 
 	assert_int_equal(
-		DEFAULT_INDEX_CACHE_SIZE,
-		tdb_hash_size(ldb_kv->idxptr->itdb));
+		ldb_kv_idxptr_slots_for(DEFAULT_INDEX_CACHE_SIZE),
+		ldb_kv->idxptr->num_slots);
 
 	ret = ldb_kv_del_trans(module);
 	assert_int_equal(LDB_SUCCESS, ret);
@@ -211,18 +286,24 @@ static void test_reindex_cache_size(void **state)
 	assert_int_equal(LDB_SUCCESS, ret);
 
 	assert_int_equal(
-		DEFAULT_INDEX_CACHE_SIZE,
-		tdb_hash_size(ldb_kv->idxptr->itdb));
+		ldb_kv_idxptr_slots_for(DEFAULT_INDEX_CACHE_SIZE),
+		ldb_kv->idxptr->num_slots);
 
 	/*
 	 * Use a value greater than the DEFAULT_INDEX_CACHE_SIZE
-	 * Should get the value specified.
+	 * Should get the value specified.  (The hash table is a
+	 * power of two in size, so use a value large enough to need
+	 * a bigger one.)
 	 */
-	db_size = DEFAULT_INDEX_CACHE_SIZE + 1;
+	db_size = DEFAULT_INDEX_CACHE_SIZE * 4;
 	ret = ldb_kv_reindex(module);
 	assert_int_equal(LDB_SUCCESS, ret);
 
-	assert_int_equal(db_size, tdb_hash_size(ldb_kv->idxptr->itdb));
+	assert_int_equal(
+		ldb_kv_idxptr_slots_for(db_size),
+		ldb_kv->idxptr->num_slots);
+	assert_true(ldb_kv_idxptr_slots_for(db_size) >
+		    ldb_kv_idxptr_slots_for(DEFAULT_INDEX_CACHE_SIZE));
 
 	TALLOC_FREE(ldb_kv);
 	TALLOC_FREE(module);
@@ -351,6 +432,196 @@ static void test_init_store_set_index_cache_size_range(void **state)
 	TALLOC_FREE(ldb);
 }
 
+/*
+ * A sorted list of count GUIDs, packed as in an index record, with
+ * the values first, first + step, ...
+ */
+static struct ldb_val *guid_list(TALLOC_CTX *mem_ctx,
+				 unsigned int count,
+				 uint64_t first,
+				 uint64_t step)
+{
+	struct ldb_val *list = talloc_array(mem_ctx, struct ldb_val, count);
+	uint8_t *guids = talloc_zero_array(list,
+					   uint8_t,
+					   count * LDB_KV_GUID_SIZE);
+	unsigned int i;
+
+	assert_non_null(list);
+	assert_non_null(guids);
+	for (i = 0; i < count; i++) {
+		uint8_t *guid = &guids[i * LDB_KV_GUID_SIZE];
+		uint64_t v = first + i * step;
+		int b;
+
+		for (b = LDB_KV_GUID_SIZE - 1; b >= 8; b--) {
+			guid[b] = v & 0xff;
+			v >>= 8;
+		}
+		list[i].data = guid;
+		list[i].length = LDB_KV_GUID_SIZE;
+	}
+	return list;
+}
+
+/*
+ * The intersection as ldb_kv_dn_list_intersect() found it before,
+ * with a binary search of the long list for each entry of the short
+ * one
+ */
+static unsigned int guid_list_intersect_search(struct ldb_kv_private *ldb_kv,
+					       const struct ldb_val *a,
+					       unsigned int na,
+					       struct ldb_val *b,
+					       unsigned int nb,
+					       struct ldb_val *out)
+{
+	struct dn_list long_list = { .dn = b, .count = nb };
+	unsigned int i, k = 0;
+
+	for (i = 0; i < na; i++) {
+		if (ldb_kv_dn_list_find_val(ldb_kv, &long_list, &a[i]) != -1) {
+			out[k++] = a[i];
+		}
+	}
+	return k;
+}
+
+static struct ldb_kv_private *guid_index_ldb_kv(TALLOC_CTX *mem_ctx)
+{
+	struct ldb_kv_private *ldb_kv = talloc_zero(mem_ctx,
+						    struct ldb_kv_private);
+	assert_non_null(ldb_kv);
+	ldb_kv->cache = talloc_zero(ldb_kv, struct ldb_kv_cache);
+	assert_non_null(ldb_kv->cache);
+	ldb_kv->cache->GUID_index_attribute = "objectGUID";
+	return ldb_kv;
+}
+
+static void check_guid_list_intersect(struct ldb_kv_private *ldb_kv,
+				      unsigned int na,
+				      uint64_t first_a,
+				      uint64_t step_a,
+				      unsigned int nb,
+				      uint64_t first_b,
+				      uint64_t step_b)
+{
+	TALLOC_CTX *tmp_ctx = talloc_new(ldb_kv);
+	struct ldb_val *a = guid_list(tmp_ctx, na, first_a, step_a);
+	struct ldb_val *b = guid_list(tmp_ctx, nb, first_b, step_b);
+	struct ldb_val *out1 = talloc_array(tmp_ctx, struct ldb_val, na + 1);
+	struct ldb_val *out2 = talloc_array(tmp_ctx, struct ldb_val, na + 1);
+	unsigned int n1, n2, i;
+
+	n1 = guid_list_intersect_search(ldb_kv, a, na, b, nb, out1);
+	n2 = ldb_kv_guid_list_intersect(a, na, b, nb, out2);
+	assert_int_equal(n1, n2);
+	for (i = 0; i < n1; i++) {
+		assert_ptr_equal(out1[i].data, out2[i].data);
+	}
+	TALLOC_FREE(tmp_ctx);
+}
+
+/*
+ * Test that ldb_kv_guid_list_intersect() finds the same entries as
+ * a binary search for each one, for lists of similar and very
+ * different lengths
+ */
+static void test_guid_list_intersect(void **state)
+{
+	struct test_ctx *test_ctx = talloc_get_type_abort(
+		*state,
+		struct test_ctx);
+	struct ldb_kv_private *ldb_kv = guid_index_ldb_kv(test_ctx);
+
+	check_guid_list_intersect(ldb_kv, 0, 0, 1, 10, 0, 1);
+	check_guid_list_intersect(ldb_kv, 10, 0, 1, 0, 0, 1);
+	check_guid_list_intersect(ldb_kv, 1000, 0, 3, 1000, 0, 7);
+	check_guid_list_intersect(ldb_kv, 1000, 0, 7, 1000, 0, 3);
+	check_guid_list_intersect(ldb_kv, 10, 5, 1000, 100000, 0, 1);
+	check_guid_list_intersect(ldb_kv, 10, 5, 1000, 100000, 0, 2);
+	check_guid_list_intersect(ldb_kv, 100, 0, 1, 100, 100, 1);
+	check_guid_list_intersect(ldb_kv, 100, 100, 1, 100, 0, 1);
+	check_guid_list_intersect(ldb_kv, 1, 99999, 1, 100000, 0, 1);
+	check_guid_list_intersect(ldb_kv, 1, 100000, 1, 100000, 0, 1);
+	/* GUIDs whose low bytes are all the same */
+	check_guid_list_intersect(ldb_kv, 500, 0, 1ULL << 50, 500, 0, 1ULL << 51);
+
+	TALLOC_FREE(ldb_kv);
+}
+
+static double guid_list_intersect_time(struct ldb_kv_private *ldb_kv,
+				       bool search,
+				       const struct ldb_val *a,
+				       unsigned int na,
+				       struct ldb_val *b,
+				       unsigned int nb,
+				       struct ldb_val *out,
+				       unsigned int *n)
+{
+	struct timespec start, end;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	if (search) {
+		*n = guid_list_intersect_search(ldb_kv, a, na, b, nb, out);
+	} else {
+		*n = ldb_kv_guid_list_intersect(a, na, b, nb, out);
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	return (end.tv_sec - start.tv_sec) +
+		(end.tv_nsec - start.tv_nsec) / 1e9;
+}
+
+/*
+ * Compare the time ldb_kv_guid_list_intersect() takes with that of a
+ * binary search for each entry.  This only runs when
+ * LDB_KV_INDEX_BENCH is set in the environment.
+ */
+static void test_guid_list_intersect_bench(void **state)
+{
+	struct test_ctx *test_ctx = talloc_get_type_abort(
+		*state,
+		struct test_ctx);
+	struct ldb_kv_private *ldb_kv = NULL;
+	const struct {
+		unsigned int na;
+		unsigned int nb;
+	} sizes[] = {
+		{ 1000, 1500000 },
+		{ 200000, 1500000 },
+		{ 1500000, 1500000 },
+	};
+	unsigned int i;
+
+	if (getenv("LDB_KV_INDEX_BENCH") == NULL) {
+		skip();
+	}
+
+	ldb_kv = guid_index_ldb_kv(test_ctx);
+	for (i = 0; i < ARRAY_SIZE(sizes); i++) {
+		TALLOC_CTX *tmp_ctx = talloc_new(ldb_kv);
+		unsigned int na = sizes[i].na, nb = sizes[i].nb;
+		struct ldb_val *a = guid_list(tmp_ctx, na, 0, nb / na * 2 + 1);
+		struct ldb_val *b = guid_list(tmp_ctx, nb, 0, 2);
+		struct ldb_val *out = talloc_array(tmp_ctx, struct ldb_val, na);
+		double t_search, t_intersect;
+		unsigned int n1, n2;
+
+		t_search = guid_list_intersect_time(ldb_kv, true,
+						    a, na, b, nb, out, &n1);
+		t_intersect = guid_list_intersect_time(ldb_kv, false,
+						       a, na, b, nb, out, &n2);
+		assert_int_equal(n1, n2);
+		print_message("intersect %u with %u GUIDs: "
+			      "binary search %.3fms, "
+			      "ldb_kv_guid_list_intersect %.3fms\n",
+			      na, nb, t_search * 1000, t_intersect * 1000);
+		TALLOC_FREE(tmp_ctx);
+	}
+	TALLOC_FREE(ldb_kv);
+}
+
 int main(int argc, const char **argv)
 {
 	const struct CMUnitTest tests[] = {
@@ -358,6 +629,10 @@ int main(int argc, const char **argv)
 			test_index_cache_init,
 			setup,
 			teardown),
+		cmocka_unit_test_setup_teardown(
+			test_index_cache_grow,
+			setup,
+			teardown),
 		cmocka_unit_test_setup_teardown(
 			test_default_index_cache_size,
 			setup,
@@ -382,6 +657,14 @@ int main(int argc, const char **argv)
 			test_init_store_set_index_cache_size_range,
 			setup,
 			teardown),
+		cmocka_unit_test_setup_teardown(
+			test_guid_list_intersect,
+			setup,
+			teardown),
+		cmocka_unit_test_setup_teardown(
+			test_guid_list_intersect_bench,
+			setup,
+			teardown),
 	};
 
 	cmocka_set_message_output(CM_OUTPUT_SUBUNIT);
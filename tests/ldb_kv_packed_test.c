@@ -0,0 +1,431 @@
+/*
+ * Tests exercising the ldb key value packed record view.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ */
+
+/*
+ * from cmocka.c:
+ * These headers or their equivalents should be included prior to
+ * including
+ * this header file.
+ *
+ * #include <stdarg.h>
+ * #include <stddef.h>
+ * #include <setjmp.h>
+ *
+ * This allows test applications to use custom definitions of C standard
+ * library functions and types.
+ */
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <setjmp.h>
+#include <cmocka.h>
+
+#include "../ldb_key_value/ldb_kv_packed.c"
+
+struct ldbtest_ctx {
+	struct tevent_context *ev;
+	struct ldb_context *ldb;
+};
+
+static int setup(void **state)
+{
+	struct ldbtest_ctx *test_ctx;
+
+	test_ctx = talloc_zero(NULL, struct ldbtest_ctx);
+	assert_non_null(test_ctx);
+
+	test_ctx->ev = tevent_context_init(test_ctx);
+	assert_non_null(test_ctx->ev);
+
+	test_ctx->ldb = ldb_init(test_ctx, test_ctx->ev);
+	assert_non_null(test_ctx->ldb);
+
+	*state = test_ctx;
+	return 0;
+}
+
+static int teardown(void **state)
+{
+	talloc_free(*state);
+	return 0;
+}
+
+static struct ldb_message *test_msg(struct ldbtest_ctx *ctx)
+{
+	struct ldb_message *msg = NULL;
+	uint8_t big[300];
+	struct ldb_val val = {
+		.data = big,
+		.length = sizeof(big)
+	};
+	int ret;
+
+	memset(big, 'x', sizeof(big));
+
+	msg = ldb_msg_new(ctx);
+	assert_non_null(msg);
+	msg->dn = ldb_dn_new(msg, ctx->ldb, "cn=test,dc=samba,dc=org");
+	assert_non_null(msg->dn);
+
+	ret = ldb_msg_add_string(msg, "cn", "test");
+	assert_int_equal(ret, LDB_SUCCESS);
+	ret = ldb_msg_add_string(msg, "colour", "red");
+	assert_int_equal(ret, LDB_SUCCESS);
+	ret = ldb_msg_add_string(msg, "colour", "");
+	assert_int_equal(ret, LDB_SUCCESS);
+	ret = ldb_msg_add_string(msg, "colour", "blue");
+	assert_int_equal(ret, LDB_SUCCESS);
+	/* needs 16 bit value lengths */
+	ret = ldb_msg_add_value(msg, "blob", &val, NULL);
+	assert_int_equal(ret, LDB_SUCCESS);
+	/* not packed */
+	ret = ldb_msg_add_string(msg, "distinguishedName", "x");
+	assert_int_equal(ret, LDB_SUCCESS);
+	ret = ldb_msg_add_empty(msg, "empty", 0, NULL);
+	assert_int_equal(ret, LDB_SUCCESS);
+	ret = ldb_msg_add_string(msg, "size", "42");
+	assert_int_equal(ret, LDB_SUCCESS);
+
+	return msg;
+}
+
+/*
+ * The view must find the same DN, attributes and values as
+ * ldb_unpack_data()
+ */
+static void check_packed_view(void **state, uint32_t format)
+{
+	struct ldbtest_ctx *ctx = *state;
+	struct ldb_message *msg = test_msg(ctx);
+	struct ldb_message *unpacked = NULL;
+	struct ldb_kv_packed_record rec;
+	struct ldb_kv_packed_element el;
+	struct ldb_val data;
+	struct ldb_val values[3];
+	unsigned int i = 0;
+	unsigned int j;
+	int ret;
+
+	ret = ldb_pack_data(ctx->ldb, msg, &data, format);
+	assert_int_equal(ret, 0);
+
+	unpacked = ldb_msg_new(ctx);
+	assert_non_null(unpacked);
+	ret = ldb_unpack_data(ctx->ldb, &data, unpacked);
+	assert_int_equal(ret, 0);
+
+	ret = ldb_kv_packed_record_init(&rec, &data);
+	assert_int_equal(ret, LDB_SUCCESS);
+	assert_int_equal(rec.num_elements, unpacked->num_elements);
+	assert_string_equal((const char *)rec.dn.data,
+			    ldb_dn_get_linearized(unpacked->dn));
+
+	while ((ret = ldb_kv_packed_record_next(&rec, &el)) == LDB_SUCCESS) {
+		struct ldb_message_element *uel = &unpacked->elements[i];
+
+		assert_true(i < unpacked->num_elements);
+		assert_string_equal(el.name, uel->name);
+		assert_int_equal(el.num_values, uel->num_values);
+		assert_true(el.num_values <= ARRAY_SIZE(values));
+
+		ldb_kv_packed_element_values(&el, values);
+		for (j = 0; j < el.num_values; j++) {
+			assert_int_equal(values[j].length,
+					 uel->values[j].length);
+			assert_memory_equal(values[j].data,
+					    uel->values[j].data,
+					    values[j].length);
+			/* the view points into the packed data */
+			assert_ptr_equal(values[j].data,
+					 uel->values[j].data);
+			assert_int_equal(values[j].data[values[j].length], 0);
+		}
+		i++;
+	}
+	assert_int_equal(ret, LDB_ERR_NO_SUCH_ATTRIBUTE);
+	assert_int_equal(i, 4);
+}
+
+static void test_packed_view(void **state)
+{
+	check_packed_view(state, LDB_PACKING_FORMAT_V2);
+}
+
+static void test_packed_view_v3(void **state)
+{
+	check_packed_view(state, LDB_PACKING_FORMAT_V3);
+}
+
+/*
+ * The attribute directory finds the first attribute of a name,
+ * ignoring case
+ */
+static void test_packed_find(void **state)
+{
+	struct ldbtest_ctx *ctx = *state;
+	struct ldb_message *msg = test_msg(ctx);
+	struct ldb_kv_packed_record rec;
+	struct ldb_kv_packed_element el;
+	struct ldb_val data;
+	struct ldb_val values[3];
+	char name[20];
+	unsigned int i;
+	int ret;
+
+	/* enough attributes for the search to matter */
+	for (i = 0; i < 100; i++) {
+		snprintf(name, sizeof(name), "attr%u", i);
+		ret = ldb_msg_add_string(msg, name, "v");
+		assert_int_equal(ret, LDB_SUCCESS);
+	}
+
+	ret = ldb_pack_data(ctx->ldb, msg, &data, LDB_PACKING_FORMAT_V3);
+	assert_int_equal(ret, 0);
+
+	ret = ldb_kv_packed_record_init(&rec, &data);
+	assert_int_equal(ret, LDB_SUCCESS);
+
+	ret = ldb_kv_packed_record_find(&rec, "COLOUR", &el);
+	assert_int_equal(ret, LDB_SUCCESS);
+	assert_string_equal(el.name, "colour");
+	assert_int_equal(el.num_values, 3);
+	ldb_kv_packed_element_values(&el, values);
+	assert_int_equal(values[0].length, 3);
+	assert_memory_equal(values[0].data, "red", 3);
+	assert_int_equal(values[1].length, 0);
+	assert_int_equal(values[2].length, 4);
+	assert_memory_equal(values[2].data, "blue", 4);
+
+	for (i = 0; i < 100; i++) {
+		snprintf(name, sizeof(name), "ATTR%u", i);
+		ret = ldb_kv_packed_record_find(&rec, name, &el);
+		assert_int_equal(ret, LDB_SUCCESS);
+		assert_int_equal(ldb_attr_cmp(el.name, name), 0);
+	}
+
+	/* not stored */
+	ret = ldb_kv_packed_record_find(&rec, "distinguishedName", &el);
+	assert_int_equal(ret, LDB_ERR_NO_SUCH_ATTRIBUTE);
+	ret = ldb_kv_packed_record_find(&rec, "empty", &el);
+	assert_int_equal(ret, LDB_ERR_NO_SUCH_ATTRIBUTE);
+	ret = ldb_kv_packed_record_find(&rec, "missing", &el);
+	assert_int_equal(ret, LDB_ERR_NO_SUCH_ATTRIBUTE);
+
+	/* V2 has no directory */
+	ret = ldb_pack_data(ctx->ldb, msg, &data, LDB_PACKING_FORMAT_V2);
+	assert_int_equal(ret, 0);
+	ret = ldb_kv_packed_record_init(&rec, &data);
+	assert_int_equal(ret, LDB_SUCCESS);
+	ret = ldb_kv_packed_record_find(&rec, "colour", &el);
+	assert_int_equal(ret, LDB_ERR_UNWILLING_TO_PERFORM);
+}
+
+/*
+ * Unpacking some attributes gives the same message as unpacking
+ * them all and filtering
+ */
+static void test_packed_unpack_attrs(void **state)
+{
+	struct ldbtest_ctx *ctx = *state;
+	struct ldb_message *msg = test_msg(ctx);
+	struct ldb_message *unpacked = NULL;
+	struct ldb_message *filtered = NULL;
+	const char *attrs[] = { "size", "missing", "COLOUR", "colour",
+				"distinguishedName", NULL };
+	const char *all[] = { "cn", "*", NULL };
+	struct ldb_val data;
+	unsigned int i, j;
+	int ret;
+
+	ret = ldb_pack_data(ctx->ldb, msg, &data, LDB_PACKING_FORMAT_V3);
+	assert_int_equal(ret, 0);
+
+	unpacked = ldb_msg_new(ctx);
+	assert_non_null(unpacked);
+	ret = ldb_kv_packed_unpack_attrs(ctx->ldb, &data, unpacked, attrs);
+	assert_int_equal(ret, LDB_SUCCESS);
+
+	filtered = ldb_msg_new(ctx);
+	assert_non_null(filtered);
+	ret = ldb_unpack_data(ctx->ldb, &data, filtered);
+	assert_int_equal(ret, 0);
+	ret = ldb_filter_attrs_in_place(filtered, attrs);
+	assert_int_equal(ret, LDB_SUCCESS);
+
+	assert_int_equal(ldb_dn_compare(unpacked->dn, filtered->dn), 0);
+	assert_int_equal(unpacked->num_elements, filtered->num_elements);
+	assert_int_equal(unpacked->num_elements, 2);
+	for (i = 0; i < filtered->num_elements; i++) {
+		struct ldb_message_element *el = &filtered->elements[i];
+		struct ldb_message_element *el2 = &unpacked->elements[i];
+
+		assert_string_equal(el2->name, el->name);
+		assert_int_equal(el2->num_values, el->num_values);
+		for (j = 0; j < el->num_values; j++) {
+			assert_int_equal(ldb_val_equal_exact(&el2->values[j],
+							     &el->values[j]),
+					 1);
+		}
+	}
+
+	/* all the attributes are wanted */
+	ret = ldb_kv_packed_unpack_attrs(ctx->ldb, &data, unpacked, all);
+	assert_int_equal(ret, LDB_ERR_UNWILLING_TO_PERFORM);
+	ret = ldb_kv_packed_unpack_attrs(ctx->ldb, &data, unpacked, NULL);
+	assert_int_equal(ret, LDB_ERR_UNWILLING_TO_PERFORM);
+
+	/* V2 has no directory */
+	ret = ldb_pack_data(ctx->ldb, msg, &data, LDB_PACKING_FORMAT_V2);
+	assert_int_equal(ret, 0);
+	ret = ldb_kv_packed_unpack_attrs(ctx->ldb, &data, unpacked, attrs);
+	assert_int_equal(ret, LDB_ERR_UNWILLING_TO_PERFORM);
+}
+
+/*
+ * A record with no attributes
+ */
+static void test_packed_view_no_attributes(void **state)
+{
+	struct ldbtest_ctx *ctx = *state;
+	struct ldb_message *msg = NULL;
+	struct ldb_kv_packed_record rec;
+	struct ldb_kv_packed_element el;
+	struct ldb_val data;
+	int ret;
+
+	msg = ldb_msg_new(ctx);
+	assert_non_null(msg);
+	msg->dn = ldb_dn_new(msg, ctx->ldb, "@TEST");
+	assert_non_null(msg->dn);
+
+	ret = ldb_pack_data(ctx->ldb, msg, &data, LDB_PACKING_FORMAT_V2);
+	assert_int_equal(ret, 0);
+
+	ret = ldb_kv_packed_record_init(&rec, &data);
+	assert_int_equal(ret, LDB_SUCCESS);
+	assert_string_equal((const char *)rec.dn.data, "@TEST");
+
+	ret = ldb_kv_packed_record_next(&rec, &el);
+	assert_int_equal(ret, LDB_ERR_NO_SUCH_ATTRIBUTE);
+}
+
+/*
+ * Older formats have no view
+ */
+static void test_packed_view_v1(void **state)
+{
+	struct ldbtest_ctx *ctx = *state;
+	struct ldb_message *msg = test_msg(ctx);
+	struct ldb_kv_packed_record rec;
+	struct ldb_val data;
+	int ret;
+
+	ret = ldb_pack_data(ctx->ldb, msg, &data, LDB_PACKING_FORMAT);
+	assert_int_equal(ret, 0);
+
+	ret = ldb_kv_packed_record_init(&rec, &data);
+	assert_int_equal(ret, LDB_ERR_UNWILLING_TO_PERFORM);
+}
+
+/*
+ * Damaged records are never read past their end, and are reported
+ * either by init or by the last call to next
+ */
+static void check_packed_view_truncated(void **state, uint32_t format)
+{
+	struct ldbtest_ctx *ctx = *state;
+	struct ldb_message *msg = test_msg(ctx);
+	struct ldb_kv_packed_record rec;
+	struct ldb_kv_packed_element el;
+	struct ldb_val data;
+	size_t len;
+	int ret;
+
+	ret = ldb_pack_data(ctx->ldb, msg, &data, format);
+	assert_int_equal(ret, 0);
+
+	for (len = data.length - 1; len > 0; len--) {
+		/* copy so that valgrind sees reads past the end */
+		struct ldb_val copy = {
+			.data = talloc_memdup(ctx, data.data, len),
+			.length = len
+		};
+		assert_non_null(copy.data);
+
+		ret = ldb_kv_packed_record_init(&rec, &copy);
+		if (ret == LDB_SUCCESS) {
+			do {
+				ret = ldb_kv_packed_record_next(&rec, &el);
+			} while (ret == LDB_SUCCESS);
+		}
+		assert_int_equal(ret, LDB_ERR_OPERATIONS_ERROR);
+		TALLOC_FREE(copy.data);
+	}
+}
+
+static void test_packed_view_truncated(void **state)
+{
+	check_packed_view_truncated(state, LDB_PACKING_FORMAT_V2);
+}
+
+static void test_packed_view_truncated_v3(void **state)
+{
+	check_packed_view_truncated(state, LDB_PACKING_FORMAT_V3);
+}
+
+int main(int argc, const char **argv)
+{
+	const struct CMUnitTest tests[] = {
+		cmocka_unit_test_setup_teardown(
+			test_packed_view,
+			setup,
+			teardown),
+		cmocka_unit_test_setup_teardown(
+			test_packed_view_v3,
+			setup,
+			teardown),
+		cmocka_unit_test_setup_teardown(
+			test_packed_find,
+			setup,
+			teardown),
+		cmocka_unit_test_setup_teardown(
+			test_packed_unpack_attrs,
+			setup,
+			teardown),
+		cmocka_unit_test_setup_teardown(
+			test_packed_view_no_attributes,
+			setup,
+			teardown),
+		cmocka_unit_test_setup_teardown(
+			test_packed_view_v1,
+			setup,
+			teardown),
+		cmocka_unit_test_setup_teardown(
+			test_packed_view_truncated,
+			setup,
+			teardown),
+		cmocka_unit_test_setup_teardown(
+			test_packed_view_truncated_v3,
+			setup,
+			teardown),
+	};
+
+	cmocka_set_message_output(CM_OUTPUT_SUBUNIT);
+
+	return cmocka_run_group_tests(tests, NULL, NULL);
+}
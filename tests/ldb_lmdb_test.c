@@ -435,6 +435,97 @@ static struct MDB_env *get_mdb_env(struct ldb_context *ldb)
 	return env;
 }
 
+static struct ldb_kv_private *get_ldb_kv(struct ldb_context *ldb)
+{
+	void *data = NULL;
+	struct ldb_kv_private *ldb_kv = NULL;
+
+	data = ldb_module_get_private(ldb->modules);
+	assert_non_null(data);
+
+	ldb_kv = talloc_get_type(data, struct ldb_kv_private);
+	assert_non_null(ldb_kv);
+
+	return ldb_kv;
+}
+
+static bool read_has_changed(struct ldb_context *ldb)
+{
+	struct ldb_kv_private *ldb_kv = get_ldb_kv(ldb);
+	bool changed;
+	int ret;
+
+	ret = ldb_kv->kv_ops->lock_read(ldb_kv->module);
+	assert_int_equal(ret, LDB_SUCCESS);
+	changed = ldb_kv->kv_ops->has_changed(ldb_kv);
+	ret = ldb_kv->kv_ops->unlock_read(ldb_kv->module);
+	assert_int_equal(ret, LDB_SUCCESS);
+
+	return changed;
+}
+
+/*
+ * A commit through another ldb on the same database must be seen as a
+ * change, and the @ATTRIBUTES it wrote loaded by the next search,
+ * while repeated reads with no commit in between must not.
+ */
+static void test_has_changed(void **state)
+{
+	struct ldbtest_ctx *test_ctx = NULL;
+	struct ldb_context *ldb2 = NULL;
+	struct ldb_result *res = NULL;
+	struct ldb_ldif *ldif;
+	struct ldb_dn *dn = NULL;
+	const struct ldb_schema_attribute *a = NULL;
+	const char *attrs_ldif =
+		"dn: @ATTRIBUTES\n"
+		"testAttr: CASE_INSENSITIVE\n"
+		"\n";
+	const char *entry_ldif =
+		"dn: dc=has_changed\n"
+		"objectUUID: 0123456789abcdef\n"
+		"\n";
+	int ret;
+
+	test_ctx = talloc_get_type_abort(*state, struct ldbtest_ctx);
+
+	read_has_changed(test_ctx->ldb);
+	assert_false(read_has_changed(test_ctx->ldb));
+	assert_false(read_has_changed(test_ctx->ldb));
+
+	a = ldb_schema_attribute_by_name(test_ctx->ldb, "testAttr");
+	assert_string_equal(a->syntax->name, LDB_SYNTAX_OCTET_STRING);
+
+	ldb2 = ldb_init(test_ctx, test_ctx->ev);
+	ret = ldb_connect(ldb2, test_ctx->dbpath, 0, NULL);
+	assert_int_equal(ret, 0);
+
+	while ((ldif = ldb_ldif_read_string(ldb2, &attrs_ldif))) {
+		ret = ldb_add(ldb2, ldif->msg);
+		assert_int_equal(ret, LDB_SUCCESS);
+	}
+
+	dn = ldb_dn_new(test_ctx, test_ctx->ldb, "@ATTRIBUTES");
+	assert_non_null(dn);
+	ret = ldb_search(test_ctx->ldb, test_ctx, &res, dn,
+			 LDB_SCOPE_BASE, NULL, NULL);
+	assert_int_equal(ret, LDB_SUCCESS);
+	assert_int_equal(res->count, 1);
+
+	a = ldb_schema_attribute_by_name(test_ctx->ldb, "testAttr");
+	assert_string_equal(a->syntax->name, LDB_SYNTAX_DIRECTORY_STRING);
+
+	assert_false(read_has_changed(test_ctx->ldb));
+
+	while ((ldif = ldb_ldif_read_string(ldb2, &entry_ldif))) {
+		ret = ldb_add(ldb2, ldif->msg);
+		assert_int_equal(ret, LDB_SUCCESS);
+	}
+
+	assert_true(read_has_changed(test_ctx->ldb));
+	assert_false(read_has_changed(test_ctx->ldb));
+}
+
 static void test_multiple_opens(void **state)
 {
 	struct ldb_context *ldb1 = NULL;
@@ -584,6 +675,10 @@ int main(int argc, const char **argv)
 			test_multiple_opens_across_fork,
 			ldbtest_setup,
 			ldbtest_teardown),
+		cmocka_unit_test_setup_teardown(
+			test_has_changed,
+			ldbtest_setup,
+			ldbtest_teardown),
 	};
 
 	cmocka_set_message_output(CM_OUTPUT_SUBUNIT);
@@ -1120,6 +1120,112 @@ static void test_ldb_modify_del_keyval(void **state)
 	assert_null(el);
 }
 
+static void test_ldb_modify_many_keys(void **state)
+{
+	struct ldb_mod_test_ctx *mod_test_ctx = \
+			talloc_get_type_abort(*state,
+					      struct ldb_mod_test_ctx);
+	struct ldbtest_ctx *ldb_test_ctx = mod_test_ctx->ldb_test_ctx;
+	struct ldb_message *mod_msg;
+	struct ldb_message_element *el;
+	struct ldb_result *res;
+	struct ldb_dn *basedn;
+	char name[32];
+	unsigned int i;
+	int ret;
+
+	/*
+	 * Enough attributes that the modify looks them up through a
+	 * hash table rather than a linear walk of the record
+	 */
+	mod_msg = ldb_msg_new(mod_test_ctx);
+	assert_non_null(mod_msg);
+	mod_msg->dn = ldb_dn_new_fmt(mod_msg, ldb_test_ctx->ldb,
+				     "%s", mod_test_ctx->entry_dn);
+	assert_non_null(mod_msg->dn);
+
+	for (i = 0; i < 40; i++) {
+		snprintf(name, sizeof(name), "wideAttr%u", i);
+		ret = ldb_msg_add_empty(mod_msg, name,
+					LDB_FLAG_MOD_ADD, NULL);
+		assert_int_equal(ret, LDB_SUCCESS);
+		ret = ldb_msg_add_fmt(mod_msg, name, "val%u", i);
+		assert_int_equal(ret, LDB_SUCCESS);
+	}
+	ret = ldb_modify(ldb_test_ctx->ldb, mod_msg);
+	assert_int_equal(ret, LDB_SUCCESS);
+	TALLOC_FREE(mod_msg);
+
+	/*
+	 * Delete every third attribute, then replace and extend the
+	 * ones after it, so lookups follow removals in the same modify
+	 */
+	mod_msg = ldb_msg_new(mod_test_ctx);
+	assert_non_null(mod_msg);
+	mod_msg->dn = ldb_dn_new_fmt(mod_msg, ldb_test_ctx->ldb,
+				     "%s", mod_test_ctx->entry_dn);
+	assert_non_null(mod_msg->dn);
+
+	for (i = 0; i < 40; i += 3) {
+		snprintf(name, sizeof(name), "WIDEATTR%u", i);
+		ret = ldb_msg_add_empty(mod_msg, name,
+					LDB_FLAG_MOD_DELETE, NULL);
+		assert_int_equal(ret, LDB_SUCCESS);
+	}
+	for (i = 1; i < 40; i += 3) {
+		snprintf(name, sizeof(name), "wideattr%u", i);
+		ret = ldb_msg_add_empty(mod_msg, name,
+					LDB_FLAG_MOD_REPLACE, NULL);
+		assert_int_equal(ret, LDB_SUCCESS);
+		ret = ldb_msg_add_fmt(mod_msg, name, "new%u", i);
+		assert_int_equal(ret, LDB_SUCCESS);
+	}
+	for (i = 2; i < 40; i += 3) {
+		snprintf(name, sizeof(name), "wideAttr%u", i);
+		ret = ldb_msg_add_empty(mod_msg, name,
+					LDB_FLAG_MOD_ADD, NULL);
+		assert_int_equal(ret, LDB_SUCCESS);
+		ret = ldb_msg_add_fmt(mod_msg, name, "more%u", i);
+		assert_int_equal(ret, LDB_SUCCESS);
+	}
+	ret = ldb_modify(ldb_test_ctx->ldb, mod_msg);
+	assert_int_equal(ret, LDB_SUCCESS);
+	TALLOC_FREE(mod_msg);
+
+	basedn = ldb_dn_new_fmt(mod_test_ctx, ldb_test_ctx->ldb,
+				"%s", mod_test_ctx->entry_dn);
+	assert_non_null(basedn);
+
+	ret = ldb_search(ldb_test_ctx->ldb, mod_test_ctx, &res, basedn,
+			 LDB_SCOPE_BASE, NULL, NULL);
+	assert_int_equal(ret, LDB_SUCCESS);
+	assert_int_equal(res->count, 1);
+
+	el = ldb_msg_find_element(res->msgs[0], "cn");
+	assert_non_null(el);
+	assert_string_equal((const char *)el->values[0].data, "test_mod_cn");
+
+	for (i = 0; i < 40; i++) {
+		snprintf(name, sizeof(name), "wideAttr%u", i);
+		el = ldb_msg_find_element(res->msgs[0], name);
+		switch (i % 3) {
+		case 0:
+			assert_null(el);
+			break;
+		case 1:
+			assert_non_null(el);
+			assert_int_equal(el->num_values, 1);
+			assert_int_equal(strncmp((const char *)el->values[0].data,
+						 "new", 3), 0);
+			break;
+		case 2:
+			assert_non_null(el);
+			assert_int_equal(el->num_values, 2);
+			break;
+		}
+	}
+}
+
 struct search_test_ctx {
 	struct ldbtest_ctx *ldb_test_ctx;
 	const char *base_dn;
@@ -4580,6 +4686,9 @@ int main(int argc, const char **argv)
 		cmocka_unit_test_setup_teardown(test_ldb_modify_del_keyval,
 						ldb_modify_test_setup,
 						ldb_modify_test_teardown),
+		cmocka_unit_test_setup_teardown(test_ldb_modify_many_keys,
+						ldb_modify_test_setup,
+						ldb_modify_test_teardown),
 		cmocka_unit_test_setup_teardown(test_search_match_none,
 						ldb_search_test_setup,
 						ldb_search_test_teardown),
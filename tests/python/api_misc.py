@@ -336,6 +336,95 @@ class BatchModeTests(LdbBaseTest):
             self.assertEqual(enum, ldb.ERR_OPERATIONS_ERROR)
 
 
+class BulkLoadTests(LdbBaseTest):
+
+    def setUp(self):
+        super().setUp()
+        self.testdir = tempdir()
+        self.filename = os.path.join(self.testdir, "test.ldb")
+        self.ldb = ldb.Ldb(self.url(),
+                           flags=self.flags(),
+                           options=["bulk_load:1"])
+        self.ldb.add({"dn": "@INDEXLIST",
+                      "@IDXATTR": [b"x", b"y", b"ou"],
+                      "@IDXGUID": [b"objectUUID"],
+                      "@IDX_DN_GUID": [b"GUID"]})
+        self.ldb.add({"dn": "@ATTRIBUTES",
+                      "x": "UNIQUE_INDEX"})
+
+    def uuid(self, i):
+        return b"%016d" % i
+
+    def test_add_out_of_order(self):
+        n = 200
+        self.ldb.transaction_start()
+        # The GUIDs are added in descending order, so every index
+        # list is out of order until it is sorted.
+        for i in reversed(range(n)):
+            self.ldb.add({"dn": "x=%d,dc=samba,dc=org" % i,
+                          "objectUUID": self.uuid(i),
+                          "x": str(i),
+                          "y": str(i % 3)})
+
+        # Searching in the transaction sorts the lists it uses
+        res = self.ldb.search(expression="(&(y=1)(x=7))",
+                              base="dc=samba,dc=org")
+        self.assertEqual(len(res), 1)
+        self.assertEqual(str(res[0].dn), "x=7,dc=samba,dc=org")
+
+        for i in range(n, n + 10):
+            self.ldb.add({"dn": "x=%d,dc=samba,dc=org" % i,
+                          "objectUUID": self.uuid(n + n - i),
+                          "x": str(i),
+                          "y": str(i % 3)})
+        self.ldb.delete("x=4,dc=samba,dc=org")
+        self.ldb.transaction_commit()
+
+        res = self.ldb.search(expression="(y=1)",
+                              base="dc=samba,dc=org")
+        expected = set("x=%d,dc=samba,dc=org" % i
+                       for i in range(n + 10)
+                       if i % 3 == 1 and i != 4)
+        self.assertEqual(set(str(m.dn) for m in res), expected)
+
+        for i in (0, 5, n - 1, n + 9):
+            res = self.ldb.search(expression="(x=%d)" % i,
+                                  base="dc=samba,dc=org")
+            self.assertEqual(len(res), 1)
+            self.assertEqual(str(res[0].dn), "x=%d,dc=samba,dc=org" % i)
+
+    def test_unique_index(self):
+        self.ldb.transaction_start()
+        self.ldb.add({"dn": "x=1,dc=samba,dc=org",
+                      "objectUUID": self.uuid(2),
+                      "x": "1"})
+        try:
+            self.ldb.add({"dn": "x=2,dc=samba,dc=org",
+                          "objectUUID": self.uuid(1),
+                          "x": "1"})
+            self.fail("Should have failed on a duplicate unique index")
+        except ldb.LdbError as err:
+            enum = err.args[0]
+            self.assertEqual(enum, ldb.ERR_CONSTRAINT_VIOLATION)
+
+        try:
+            self.ldb.transaction_commit()
+            self.fail("Commit should have failed as we were in bulk mode")
+        except ldb.LdbError as err:
+            enum = err.args[0]
+            self.assertEqual(enum, ldb.ERR_OPERATIONS_ERROR)
+
+
+class BulkLoadTestsLmdb(BulkLoadTests):
+
+    def setUp(self):
+        if os.environ.get('HAVE_LMDB', '1') == '0':
+            self.skipTest("No lmdb backend")
+        self.prefix = MDB_PREFIX
+        self.index = MDB_INDEX_OBJ
+        super().setUp()
+
+
 class DnTests(TestCase):
 
     def setUp(self):
@@ -1737,5 +1737,150 @@ class LmdbNestedTransactionTests(NestedTransactionTests):
         db.add(MDB_INDEX_OBJ)
 
 
+class ServerSortTests(LdbBaseTest):
+    """Tests of the server_sort module."""
+
+    def options(self):
+        return ["modules:server_sort"]
+
+    def setUp(self):
+        super().setUp()
+        self.testdir = tempdir()
+        self.addCleanup(shutil.rmtree, self.testdir)
+        self.filename = os.path.join(self.testdir, "sort.ldb")
+        self.l = ldb.Ldb(self.url(), flags=self.flags(),
+                         options=self.options())
+        self.add_index()
+        self.l.add({"dn": "@ATTRIBUTES",
+                    "num": "INTEGER",
+                    "name": "CASE_INSENSITIVE"})
+
+        self.nums = [17, -3, 250, 9, 0, 1000, 42, 100, 8, -40]
+        for i, n in enumerate(self.nums):
+            self.l.add({"dn": "cn=sort{},dc=samba,dc=org".format(i),
+                        "num": str(n).encode(),
+                        "name": "Name {}".format(chr(ord('j') - i)).encode(),
+                        "blob": b"x" * 200,
+                        "objectUUID": b"0123456789ab%04d" % i})
+        self.l.add({"dn": "cn=nonum,dc=samba,dc=org",
+                    "name": b"NAME K",
+                    "objectUUID": b"0123456789abffff"})
+
+    def add_index(self):
+        pass
+
+    def sorted_search(self, attr, reverse=False, attrs=None):
+        control = "server_sort:1:{}:{}".format(int(reverse), attr)
+        res = self.l.search(base="dc=samba,dc=org",
+                            scope=ldb.SCOPE_SUBTREE,
+                            expression="(objectUUID=*)",
+                            attrs=attrs,
+                            controls=[control])
+        return res
+
+    def test_sort_integer(self):
+        res = self.sorted_search("num")
+        self.assertEqual(len(res), len(self.nums) + 1)
+        got = [int(r["num"][0]) for r in res if "num" in r]
+        self.assertEqual(got, sorted(self.nums))
+        # entries without the attribute go last
+        self.assertEqual(str(res[len(self.nums)].dn),
+                         "cn=nonum,dc=samba,dc=org")
+
+    def test_sort_integer_reverse(self):
+        res = self.sorted_search("num", reverse=True)
+        got = [int(r["num"][0]) for r in res if "num" in r]
+        self.assertEqual(got, sorted(self.nums, reverse=True))
+        self.assertEqual(str(res[len(self.nums)].dn),
+                         "cn=nonum,dc=samba,dc=org")
+
+    def test_sort_case_insensitive(self):
+        res = self.sorted_search("name")
+        got = [bytes(r["name"][0]).upper() for r in res]
+        self.assertEqual(got, sorted(got))
+
+    def test_sort_attr_not_requested(self):
+        res = self.sorted_search("num", attrs=["blob"])
+        self.assertEqual(len(res), len(self.nums) + 1)
+        for r in res:
+            self.assertNotIn("num", r)
+            self.assertEqual(r["blob"][0], b"x" * 200)
+        order = [self.nums[int(str(r.dn).split(",")[0][len("cn=sort"):])]
+                 for r in res[:len(self.nums)]]
+        self.assertEqual(order, sorted(self.nums))
+
+    def test_sort_binary(self):
+        res = self.sorted_search("objectUUID", reverse=True)
+        got = [bytes(r["objectUUID"][0]) for r in res]
+        self.assertEqual(got, sorted(got, reverse=True))
+
+    def paged_sorted_search(self, attr, page_size, reverse=False):
+        sort = "server_sort:1:{}:{}".format(int(reverse), attr)
+        cookie = None
+        dns = []
+        while True:
+            paged = "paged_results:1:{}".format(page_size)
+            if cookie is not None:
+                paged += ":" + cookie
+            res = self.l.search(base="dc=samba,dc=org",
+                                scope=ldb.SCOPE_SUBTREE,
+                                expression="(objectUUID=*)",
+                                controls=[sort, paged])
+            self.assertLessEqual(len(res), page_size)
+            dns.extend(str(r.dn) for r in res)
+
+            resp = [str(c) for c in res.controls
+                    if str(c).startswith("paged_results")]
+            self.assertEqual(len(resp), 1)
+            parts = resp[0].split(":")
+            if len(parts) < 3:
+                break
+            cookie = parts[2]
+        return dns
+
+    def test_sort_paged(self):
+        for attr, reverse in (("num", False), ("num", True),
+                              ("name", False)):
+            res = self.sorted_search(attr, reverse=reverse)
+            expected = [str(r.dn) for r in res]
+            for page_size in (1, 3, len(expected), len(expected) + 5):
+                got = self.paged_sorted_search(attr, page_size,
+                                               reverse=reverse)
+                self.assertEqual(got, expected)
+
+    def test_sort_paged_bad_cookie(self):
+        try:
+            self.l.search(base="dc=samba,dc=org",
+                          scope=ldb.SCOPE_SUBTREE,
+                          expression="(objectUUID=*)",
+                          controls=["server_sort:1:0:num",
+                                    "paged_results:1:3:eDE="])
+            self.fail("Should have failed on a bad cookie")
+        except ldb.LdbError as err:
+            enum = err.args[0]
+            self.assertEqual(enum, ldb.ERR_UNWILLING_TO_PERFORM)
+
+
+class ServerSortSpillTests(ServerSortTests):
+    """Force most of the results to be spilled to a temporary file."""
+
+    def options(self):
+        return ["modules:server_sort", "sort_memory_limit:2048"]
+
+    def test_spill_file_removed(self):
+        res = self.sorted_search("num")
+        self.assertEqual(len(res), len(self.nums) + 1)
+        for name in os.listdir(self.testdir):
+            self.assertFalse(name.startswith(".sort_spill"), name)
+
+
+@unittest.skipIf(os.getenv('HAVE_LMDB') == '0', "No lmdb backend")
+class ServerSortTestsLmdb(ServerSortTests):
+    prefix = MDB_PREFIX
+
+    def add_index(self):
+        self.l.add(MDB_INDEX_OBJ)
+
+
 if __name__ == '__main__':
     unittest.TestProgram()
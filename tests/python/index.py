@@ -30,6 +30,7 @@ import sys
 sys.path.insert(0, "bin/python")
 import ldb
 import shutil
+import struct
 
 from api_base import (
     TDB_PREFIX,
@@ -667,6 +668,30 @@ class MaxIndexKeyLengthTests(LdbBaseTest):
             scope=ldb.SCOPE_BASE)
         self.assertEqual(len(res), 0)
 
+    #
+    # A DN only search must not trust an index record with a
+    # truncated key
+    #
+    def test_index_truncated_keys_dn_only(self):
+        gt_max = b"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa"
+        gt_max_b = b"aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaab"
+
+        self.l.add({"dn": "OU=03,OU=SEARCH_NON_UNIQUE,DC=SAMBA,DC=ORG",
+                    "notUnique": gt_max,
+                    "objectUUID": b"0123456789abcde2"})
+        self.l.add({"dn": "OU=23,OU=SEARCH_NON_UNIQUE,DC=SAMBA,DC=ORG",
+                    "notUnique": gt_max_b,
+                    "objectUUID": b"0123456789abcd22"})
+
+        expression = "(notUnique=" + gt_max_b.decode('ascii') + ")"
+        res = self.l.search(base="DC=SAMBA,DC=ORG",
+                            scope=ldb.SCOPE_SUBTREE,
+                            expression=expression,
+                            attrs=["1.1"])
+        self.assertEqual(len(res), 1)
+        self.assertTrue(
+            contains(res, "OU=23,OU=SEARCH_NON_UNIQUE,DC=SAMBA,DC=ORG"))
+
     #
     # Test non unique index searched with truncated keys
     #
@@ -1306,11 +1331,14 @@ class OrderedIntegerRangeTests(LdbBaseTest):
                          options=self.options())
         self.l.add({"dn": "@ATTRIBUTES",
                     "int64attr": "ORDERED_INTEGER"})
-        self.l.add({"dn": "@INDEXLIST",
-                    "@IDXATTR": [b"int64attr"],
-                    "@IDXONE": [b"1"],
-                    "@IDXGUID": [b"objectUUID"],
-                    "@IDX_DN_GUID": [b"GUID"]})
+        self.l.add(self.indexlist())
+
+    def indexlist(self):
+        return {"dn": "@INDEXLIST",
+                "@IDXATTR": [b"int64attr"],
+                "@IDXONE": [b"1"],
+                "@IDXGUID": [b"objectUUID"],
+                "@IDX_DN_GUID": [b"GUID"]}
 
     def options(self):
         if self.prefix == MDB_PREFIX:
@@ -1410,7 +1438,1663 @@ class OrderedIntegerRangeTestsLmdb(OrderedIntegerRangeTests):
         super(OrderedIntegerRangeTestsLmdb, self).tearDown()
 
 
+# Run the ordered integer range tests with an @INDEXORDER record,
+# which also gives an indexed range search on tdb
+class OrderedIntegerRangeTestsIndexOrder(OrderedIntegerRangeTests):
+
+    def indexlist(self):
+        indexlist = super(OrderedIntegerRangeTestsIndexOrder,
+                          self).indexlist()
+        indexlist["@IDX_ORDERED"] = [b"TRUE"]
+        return indexlist
+
+    def options(self):
+        return ['modules:rdn_name',
+                'disable_full_db_scan_for_self_test:1']
+
+    def values(self):
+        try:
+            res = self.l.search(base="@INDEXORDER:INT64ATTR",
+                                scope=ldb.SCOPE_BASE)
+        except ldb.LdbError as e:
+            self.assertEqual(e.args[0], ldb.ERR_NO_SUCH_OBJECT)
+            return None
+        return len(res[0]["@IDXVALUE"])
+
+    def range(self, expression):
+        res = self.l.search(base="DC=SAMBA,DC=ORG",
+                            scope=ldb.SCOPE_SUBTREE,
+                            expression="(int64attr%s)" % expression)
+        return sorted(int(r["int64attr"][0]) for r in res)
+
+    def test_modify_delete(self):
+        for i in range(10):
+            self.l.add({"dn": "OU=ORDER{},DC=SAMBA,DC=ORG".format(i),
+                        "objectUUID": b"0123456789ab%04x" % i,
+                        "int64attr": str(i % 5)})
+        self.assertEqual(self.values(), 5)
+        self.assertEqual(self.range(">=3"), [3, 3, 4, 4])
+
+        # A value is only removed with the last record that has it
+        self.l.modify_ldif("""
+dn: OU=ORDER4,DC=SAMBA,DC=ORG
+changetype: modify
+replace: int64attr
+int64attr: 20
+""")
+        self.assertEqual(self.values(), 6)
+        self.l.delete("OU=ORDER9,DC=SAMBA,DC=ORG")
+        self.assertEqual(self.values(), 5)
+        self.assertEqual(self.range(">=3"), [3, 3, 20])
+        self.assertEqual(self.range("<=1"), [0, 0, 1, 1])
+
+        self.l.modify_ldif("""
+dn: @INDEXLIST
+changetype: modify
+delete: @IDX_ORDERED
+""")
+        self.assertIsNone(self.values())
+
+    def chunks(self):
+        res = self.l.search(base="@INDEXORDER:INT64ATTR",
+                            scope=ldb.SCOPE_BASE)
+        self.assertEqual(len(res), 1)
+        return len(res[0].get("@IDXORDERCHUNK", []))
+
+    def test_split(self):
+        # More values than one record holds
+        self.l.transaction_start()
+        for i in range(1500):
+            self.l.add({"dn": "OU=SPLIT{},DC=SAMBA,DC=ORG".format(i),
+                        "objectUUID": b"0123456789ab%04x" % i,
+                        "int64attr": str(i)})
+        self.l.transaction_commit()
+        self.assertEqual(self.chunks(), 3)
+        self.assertEqual(self.range(">=1497"), [1497, 1498, 1499])
+        self.assertEqual(self.range("<=2"), [0, 1, 2])
+
+        # Only the chunk with the changed value is written
+        self.l.modify_ldif("""
+dn: @INDEXORDER:INT64ATTR#0
+changetype: modify
+add: marker
+marker: untouched
+""")
+        self.l.add({"dn": "OU=SPLIT1500,DC=SAMBA,DC=ORG",
+                    "objectUUID": b"0123456789abffff",
+                    "int64attr": "1500"})
+        self.l.delete("OU=SPLIT1499,DC=SAMBA,DC=ORG")
+        res = self.l.search(base="@INDEXORDER:INT64ATTR#0",
+                            scope=ldb.SCOPE_BASE)
+        self.assertEqual(str(res[0]["marker"][0]), "untouched")
+        self.assertEqual(self.range(">=1497"), [1497, 1498, 1500])
+
+        # Back to a single record once only one chunk is left
+        self.l.transaction_start()
+        for i in list(range(512, 1499)) + [1500]:
+            self.l.delete("OU=SPLIT{},DC=SAMBA,DC=ORG".format(i))
+        self.l.transaction_commit()
+        self.assertEqual(self.chunks(), 0)
+        self.assertEqual(self.values(), 512)
+        self.assertEqual(self.range(">=509"), [509, 510, 511])
+        try:
+            self.l.search(base="@INDEXORDER:INT64ATTR#0",
+                          scope=ldb.SCOPE_BASE)
+            self.fail("Expected the chunk to be removed")
+        except ldb.LdbError as e:
+            self.assertEqual(e.args[0], ldb.ERR_NO_SUCH_OBJECT)
+
+
+class OrderedIntegerRangeTestsIndexOrderLmdb(
+        OrderedIntegerRangeTestsIndexOrder):
+
+    def setUp(self):
+        if os.environ.get('HAVE_LMDB', '1') == '0':
+            self.skipTest("No lmdb backend")
+        self.prefix = MDB_PREFIX
+        super(OrderedIntegerRangeTestsIndexOrderLmdb, self).setUp()
+
+    def tearDown(self):
+        super(OrderedIntegerRangeTestsIndexOrderLmdb, self).tearDown()
+
+
+class BinaryIndexKeysTests(LdbBaseTest):
+
+    def tearDown(self):
+        shutil.rmtree(self.testdir)
+        super(BinaryIndexKeysTests, self).tearDown()
+
+        # Ensure the LDB is closed now, so we close the FD
+        del(self.l)
+
+    def setUp(self):
+        super(BinaryIndexKeysTests, self).setUp()
+        self.testdir = tempdir()
+        self.filename = os.path.join(self.testdir, "binary_keys_test.ldb")
+
+        self.l = ldb.Ldb(self.url(),
+                         options=["modules:rdn_name"])
+        self.l.add({"dn": "@INDEXLIST",
+                    "@IDXATTR": [b"blob"],
+                    "@IDXGUID": [b"objectUUID"],
+                    "@IDX_DN_GUID": [b"GUID"],
+                    "@IDX_BINARY_KEYS": [b"TRUE"]})
+
+        # Values that only differ in the bytes that are escaped
+        self.blobs = [b"\x00", b"\x01", b"\x00\x01", b"\x01\x01",
+                      b"\x01\x02", b"\x02", b" lead", b"x\x00y"]
+        for i, blob in enumerate(self.blobs):
+            self.l.add({"dn": "OU=BINARY{},DC=SAMBA,DC=ORG".format(i),
+                        "objectUUID": b"0123456789ab%04x" % i,
+                        "blob": blob})
+
+    def expression(self, blob):
+        return "(blob={})".format(
+            "".join("\\{:02x}".format(c) for c in blob))
+
+    def index_exists(self, key):
+        try:
+            res = self.l.search(base=key, scope=ldb.SCOPE_BASE)
+        except ldb.LdbError as e:
+            self.assertEqual(e.args[0], ldb.ERR_NO_SUCH_OBJECT)
+            return False
+        return len(res) == 1
+
+    def check_search(self):
+        for i, blob in enumerate(self.blobs):
+            res = self.l.search(base="DC=SAMBA,DC=ORG",
+                                scope=ldb.SCOPE_SUBTREE,
+                                expression=self.expression(blob))
+            self.assertEqual(len(res), 1)
+            self.assertEqual(str(res[0].dn),
+                             "OU=BINARY{},DC=SAMBA,DC=ORG".format(i))
+
+    def test_search(self):
+        self.check_search()
+        self.assertTrue(self.index_exists("@INDEX:BLOB:\x01\x01\x01\x02"))
+        self.assertTrue(self.index_exists("@INDEX:BLOB: lead"))
+        self.assertFalse(self.index_exists("@INDEX:BLOB::AAE="))
+
+    def test_reindex(self):
+        self.l.modify_ldif("""
+dn: @INDEXLIST
+changetype: modify
+delete: @IDX_BINARY_KEYS
+""")
+        self.check_search()
+        self.assertTrue(self.index_exists("@INDEX:BLOB::AAE="))
+        self.assertFalse(self.index_exists("@INDEX:BLOB:\x01\x01\x01\x02"))
+
+
+class BinaryIndexKeysTestsLmdb(BinaryIndexKeysTests):
+
+    def setUp(self):
+        if os.environ.get('HAVE_LMDB', '1') == '0':
+            self.skipTest("No lmdb backend")
+        self.prefix = MDB_PREFIX
+        super(BinaryIndexKeysTestsLmdb, self).setUp()
+
+    def tearDown(self):
+        super(BinaryIndexKeysTestsLmdb, self).tearDown()
+
+
+class SubstringIndexTests(LdbBaseTest):
+
+    def tearDown(self):
+        shutil.rmtree(self.testdir)
+        super(SubstringIndexTests, self).tearDown()
+
+        # Ensure the LDB is closed now, so we close the FD
+        del(self.l)
+
+    def setUp(self):
+        super(SubstringIndexTests, self).setUp()
+        self.testdir = tempdir()
+        self.filename = os.path.join(self.testdir, "substr_idx_test.ldb")
+
+        self.l = ldb.Ldb(self.url(),
+                         options=["modules:rdn_name",
+                                  "disable_full_db_scan_for_self_test:1"])
+        self.l.add({"dn": "@ATTRIBUTES",
+                    "mail": [b"CASE_INSENSITIVE"]})
+        self.l.add({"dn": "@INDEXLIST",
+                    "@IDXATTR": [b"mail"],
+                    "@IDXSUBSTR": [b"mail"],
+                    "@IDXGUID": [b"objectUUID"],
+                    "@IDX_DN_GUID": [b"GUID"]})
+
+        self.add(0, [b"jsmith@example.com"])
+        self.add(1, [b"john.smythe@example.com"])
+        self.add(2, [b"Smith.Jo@Example.org", b"jo.smith@example.org"])
+        self.add(3, [b"aaaa@example.net"])
+
+    def add(self, i, mail):
+        self.l.add({"dn": "OU=SUBSTR{},DC=SAMBA,DC=ORG".format(i),
+                    "objectUUID": b"0123456789ab%04x" % i,
+                    "mail": mail})
+
+    def search(self, expression):
+        res = self.l.search(base="DC=SAMBA,DC=ORG",
+                            scope=ldb.SCOPE_SUBTREE,
+                            expression=expression)
+        return sorted(str(r.dn) for r in res)
+
+    def ous(self, *ous):
+        return sorted("OU=SUBSTR{},DC=SAMBA,DC=ORG".format(i) for i in ous)
+
+    def index_exists(self, key):
+        try:
+            res = self.l.search(base=key, scope=ldb.SCOPE_BASE)
+        except ldb.LdbError as e:
+            self.assertEqual(e.args[0], ldb.ERR_NO_SUCH_OBJECT)
+            return False
+        return len(res) == 1
+
+    def test_search(self):
+        self.assertEqual(self.search("(mail=*smith*)"), self.ous(0, 2))
+        self.assertEqual(self.search("(mail=*JSMITH@*)"), self.ous(0))
+        self.assertEqual(self.search("(mail=john*)"), self.ous(1))
+        self.assertEqual(self.search("(mail=j*smith*example.org)"),
+                         self.ous(2))
+        self.assertEqual(self.search("(mail=*aaa*)"), self.ous(3))
+        self.assertEqual(self.search("(mail=*nosuch*)"), [])
+        # The trigrams are all in OU=SUBSTR2, but split across values
+        self.assertEqual(self.search("(mail=*jo.smith.jo*)"), [])
+        self.assertTrue(self.index_exists("@INDEX:@IDXSUBSTR:MAIL:SMI"))
+
+    def test_short_chunk(self):
+        # There is no trigram to look up, so this needs a full scan
+        try:
+            self.search("(mail=jo*)")
+            self.fail("Expected a full scan")
+        except ldb.LdbError as e:
+            self.assertEqual(e.args[0], ldb.ERR_INAPPROPRIATE_MATCHING)
+
+    def test_modify(self):
+        # Only one of the values goes, the other still has the trigrams
+        self.l.modify_ldif("""
+dn: OU=SUBSTR2,DC=SAMBA,DC=ORG
+changetype: modify
+delete: mail
+mail: jo.smith@example.org
+""")
+        self.assertEqual(self.search("(mail=*smith*)"), self.ous(0, 2))
+        self.assertEqual(self.search("(mail=*.smith*)"), [])
+
+        self.l.modify_ldif("""
+dn: OU=SUBSTR0,DC=SAMBA,DC=ORG
+changetype: modify
+replace: mail
+mail: jdoe@example.com
+""")
+        self.assertEqual(self.search("(mail=*smith*)"), self.ous(2))
+        self.assertEqual(self.search("(mail=*doe*)"), self.ous(0))
+
+        self.l.delete("OU=SUBSTR2,DC=SAMBA,DC=ORG")
+        self.assertEqual(self.search("(mail=*smith*)"), [])
+        self.assertFalse(self.index_exists("@INDEX:@IDXSUBSTR:MAIL:SMI"))
+
+    def test_reindex(self):
+        self.l.modify_ldif("""
+dn: @INDEXLIST
+changetype: modify
+delete: @IDXSUBSTR
+""")
+        self.assertFalse(self.index_exists("@INDEX:@IDXSUBSTR:MAIL:SMI"))
+
+        self.l.modify_ldif("""
+dn: @INDEXLIST
+changetype: modify
+add: @IDXSUBSTR
+@IDXSUBSTR: mail
+""")
+        self.assertTrue(self.index_exists("@INDEX:@IDXSUBSTR:MAIL:SMI"))
+        self.assertEqual(self.search("(mail=*smith*)"), self.ous(0, 2))
+
+
+class SubstringIndexTestsLmdb(SubstringIndexTests):
+
+    def setUp(self):
+        if os.environ.get('HAVE_LMDB', '1') == '0':
+            self.skipTest("No lmdb backend")
+        self.prefix = MDB_PREFIX
+        super(SubstringIndexTestsLmdb, self).setUp()
+
+    def tearDown(self):
+        super(SubstringIndexTestsLmdb, self).tearDown()
+
+
+class PresenceIndexTests(LdbBaseTest):
+
+    def tearDown(self):
+        shutil.rmtree(self.testdir)
+        super(PresenceIndexTests, self).tearDown()
+
+        # Ensure the LDB is closed now, so we close the FD
+        del(self.l)
+
+    def setUp(self):
+        super(PresenceIndexTests, self).setUp()
+        self.testdir = tempdir()
+        self.filename = os.path.join(self.testdir, "presence_idx_test.ldb")
+
+        self.l = ldb.Ldb(self.url(),
+                         options=["modules:rdn_name",
+                                  "disable_full_db_scan_for_self_test:1"])
+        self.l.add({"dn": "@INDEXLIST",
+                    "@IDXATTR": [b"x", b"y"],
+                    "@IDXGUID": [b"objectUUID"],
+                    "@IDX_DN_GUID": [b"GUID"],
+                    "@IDX_PRESENCE": [b"TRUE"]})
+
+        for i in range(10):
+            msg = {"dn": "OU=PRESENT{},DC=SAMBA,DC=ORG".format(i),
+                   "objectUUID": b"0123456789ab%04x" % i}
+            if i % 2 == 0:
+                msg["x"] = [b"a", b"b"]
+            if i % 3 == 0:
+                msg["y"] = b"c"
+            self.l.add(msg)
+
+    def search(self, expression):
+        res = self.l.search(base="DC=SAMBA,DC=ORG",
+                            scope=ldb.SCOPE_SUBTREE,
+                            expression=expression)
+        return sorted(str(r.dn) for r in res)
+
+    def ous(self, *ous):
+        return sorted("OU=PRESENT{},DC=SAMBA,DC=ORG".format(i) for i in ous)
+
+    def test_search(self):
+        self.assertEqual(self.search("(x=*)"), self.ous(0, 2, 4, 6, 8))
+        self.assertEqual(self.search("(&(x=*)(y=*))"), self.ous(0, 6))
+        self.assertEqual(self.search("(|(x=*)(y=*))"),
+                         self.ous(0, 2, 3, 4, 6, 8, 9))
+        self.assertEqual(self.search("(&(x=a)(!(y=*)))"),
+                         self.ous(2, 4, 8))
+
+    def test_unindexed(self):
+        try:
+            self.search("(z=*)")
+            self.fail("Expected a full scan")
+        except ldb.LdbError as e:
+            self.assertEqual(e.args[0], ldb.ERR_INAPPROPRIATE_MATCHING)
+
+    def test_modify(self):
+        # Removing one of the values leaves the attribute
+        self.l.modify_ldif("""
+dn: OU=PRESENT0,DC=SAMBA,DC=ORG
+changetype: modify
+delete: x
+x: a
+""")
+        self.assertEqual(self.search("(x=*)"), self.ous(0, 2, 4, 6, 8))
+
+        self.l.modify_ldif("""
+dn: OU=PRESENT2,DC=SAMBA,DC=ORG
+changetype: modify
+delete: x
+""")
+        self.assertEqual(self.search("(x=*)"), self.ous(0, 4, 6, 8))
+
+        self.l.modify_ldif("""
+dn: OU=PRESENT1,DC=SAMBA,DC=ORG
+changetype: modify
+add: x
+x: a
+""")
+        self.l.modify_ldif("""
+dn: OU=PRESENT1,DC=SAMBA,DC=ORG
+changetype: modify
+add: x
+x: b
+""")
+        self.assertEqual(self.search("(x=*)"), self.ous(0, 1, 4, 6, 8))
+
+        # Only the one value goes, the record still has x
+        self.l.modify_ldif("""
+dn: OU=PRESENT1,DC=SAMBA,DC=ORG
+changetype: modify
+delete: x
+x: b
+""")
+        self.assertEqual(self.search("(x=*)"), self.ous(0, 1, 4, 6, 8))
+
+        self.l.modify_ldif("""
+dn: OU=PRESENT1,DC=SAMBA,DC=ORG
+changetype: modify
+delete: x
+x: a
+""")
+        self.l.delete("OU=PRESENT4,DC=SAMBA,DC=ORG")
+        self.assertEqual(self.search("(x=*)"), self.ous(0, 6, 8))
+
+    def test_reindex(self):
+        self.l.modify_ldif("""
+dn: @INDEXLIST
+changetype: modify
+delete: @IDXATTR
+@IDXATTR: y
+""")
+        try:
+            self.search("(y=*)")
+            self.fail("Expected a full scan")
+        except ldb.LdbError as e:
+            self.assertEqual(e.args[0], ldb.ERR_INAPPROPRIATE_MATCHING)
+
+        self.l.modify_ldif("""
+dn: @INDEXLIST
+changetype: modify
+add: @IDXATTR
+@IDXATTR: y
+""")
+        self.assertEqual(self.search("(y=*)"), self.ous(0, 3, 6, 9))
+        res = self.l.search(base="@INDEX:@IDXPRESENT:Y",
+                            scope=ldb.SCOPE_BASE)
+        self.assertEqual(len(res[0]["@IDX"][0]), 4 * 16)
+
+
+class PresenceIndexTestsLmdb(PresenceIndexTests):
+
+    def setUp(self):
+        if os.environ.get('HAVE_LMDB', '1') == '0':
+            self.skipTest("No lmdb backend")
+        self.prefix = MDB_PREFIX
+        super(PresenceIndexTestsLmdb, self).setUp()
+
+    def tearDown(self):
+        super(PresenceIndexTestsLmdb, self).tearDown()
+
+
+class SubtreeIndexTests(LdbBaseTest):
+
+    def tearDown(self):
+        shutil.rmtree(self.testdir)
+        super(SubtreeIndexTests, self).tearDown()
+
+        # Ensure the LDB is closed now, so we close the FD
+        del(self.l)
+
+    def setUp(self):
+        super(SubtreeIndexTests, self).setUp()
+        self.testdir = tempdir()
+        self.filename = os.path.join(self.testdir, "subtree_idx_test.ldb")
+
+        self.l = ldb.Ldb(self.url(),
+                         options=["modules:rdn_name",
+                                  "disable_full_db_scan_for_self_test:1"])
+        self.l.add({"dn": "@INDEXLIST",
+                    "@IDXATTR": [b"x"],
+                    "@IDXGUID": [b"objectUUID"],
+                    "@IDX_DN_GUID": [b"GUID"],
+                    "@IDXSUBTREE": [b"1"]})
+
+        n = 0
+        for ou in ("A", "B"):
+            self.l.add({"dn": "OU={},DC=SAMBA,DC=ORG".format(ou),
+                        "objectUUID": b"0123456789ab%04x" % n,
+                        "x": b"1"})
+            n += 1
+            for i in range(4):
+                self.l.add({"dn": "CN=U{},OU={},DC=SAMBA,DC=ORG".format(i, ou),
+                            "objectUUID": b"0123456789ab%04x" % n,
+                            "x": str(i % 2).encode(),
+                            "y": b"z"})
+                n += 1
+
+    def search(self, base, expression):
+        res = self.l.search(base=base,
+                            scope=ldb.SCOPE_SUBTREE,
+                            expression=expression)
+        return sorted(str(r.dn) for r in res)
+
+    def entries(self, key):
+        res = self.l.search(base=key, scope=ldb.SCOPE_BASE)
+        self.assertEqual(len(res), 1)
+        return len(res[0]["@IDX"][0]) // 16
+
+    def test_index_records(self):
+        self.assertEqual(
+            self.entries("@INDEX:@IDXSUBTREE:OU=A,DC=SAMBA,DC=ORG"), 4)
+        self.assertEqual(
+            self.entries("@INDEX:@IDXSUBTREE:DC=SAMBA,DC=ORG"), 10)
+
+    def test_search(self):
+        self.assertEqual(self.search("OU=A,DC=SAMBA,DC=ORG", "(x=1)"),
+                         ["CN=U1,OU=A,DC=SAMBA,DC=ORG",
+                          "CN=U3,OU=A,DC=SAMBA,DC=ORG",
+                          "OU=A,DC=SAMBA,DC=ORG"])
+        self.assertEqual(self.search("CN=U1,OU=B,DC=SAMBA,DC=ORG", "(x=1)"),
+                         ["CN=U1,OU=B,DC=SAMBA,DC=ORG"])
+        self.assertEqual(len(self.search("DC=SAMBA,DC=ORG", "(x=1)")), 6)
+
+    def test_unindexed_filter(self):
+        # The subtree index alone avoids a full scan
+        self.assertEqual(len(self.search("OU=B,DC=SAMBA,DC=ORG", "(y=z)")),
+                         4)
+        try:
+            self.l.search(base="", scope=ldb.SCOPE_SUBTREE,
+                          expression="(y=z)")
+            self.fail("Expected a full scan")
+        except ldb.LdbError as e:
+            self.assertEqual(e.args[0], ldb.ERR_INAPPROPRIATE_MATCHING)
+
+    def test_rename_delete(self):
+        self.l.rename("CN=U1,OU=A,DC=SAMBA,DC=ORG",
+                      "CN=U9,OU=B,DC=SAMBA,DC=ORG")
+        self.l.delete("CN=U3,OU=A,DC=SAMBA,DC=ORG")
+        self.assertEqual(self.search("OU=A,DC=SAMBA,DC=ORG", "(x=1)"),
+                         ["OU=A,DC=SAMBA,DC=ORG"])
+        self.assertEqual(len(self.search("OU=B,DC=SAMBA,DC=ORG", "(x=1)")),
+                         4)
+        self.assertEqual(
+            self.entries("@INDEX:@IDXSUBTREE:OU=A,DC=SAMBA,DC=ORG"), 2)
+
+    def test_reindex(self):
+        self.l.modify_ldif("""
+dn: @INDEXLIST
+changetype: modify
+delete: @IDXSUBTREE
+""")
+        try:
+            self.l.search(base="@INDEX:@IDXSUBTREE:OU=A,DC=SAMBA,DC=ORG",
+                          scope=ldb.SCOPE_BASE)
+            self.fail("Expected the index record to be removed")
+        except ldb.LdbError as e:
+            self.assertEqual(e.args[0], ldb.ERR_NO_SUCH_OBJECT)
+
+        self.l.modify_ldif("""
+dn: @INDEXLIST
+changetype: modify
+add: @IDXSUBTREE
+@IDXSUBTREE: 1
+""")
+        self.assertEqual(
+            self.entries("@INDEX:@IDXSUBTREE:OU=A,DC=SAMBA,DC=ORG"), 4)
+        self.assertEqual(len(self.search("OU=A,DC=SAMBA,DC=ORG", "(y=z)")),
+                         4)
+
+    def plan(self, base, expression):
+        res = self.l.search(base=base,
+                            scope=ldb.SCOPE_SUBTREE,
+                            expression=expression,
+                            controls=["index_plan:0"])
+        self.assertEqual(len(res.controls), 1)
+        return str(res.controls[0])
+
+    def test_plan(self):
+        # (x=1) matches 6 objects, fewer than the average subtree
+        self.assertEqual(self.plan("OU=A,DC=SAMBA,DC=ORG", "(x=1)"),
+                         "index_plan:0:index: (x=1)[~5]")
+        self.assertEqual(self.plan("OU=A,DC=SAMBA,DC=ORG", "(y=z)"),
+                         "index_plan:0:subtree index: (y=z)[?]")
+
+    def test_naming_context(self):
+        self.l.modify_ldif("""
+dn: @INDEXLIST
+changetype: modify
+add: @IDX_NAMING_CONTEXT
+@IDX_NAMING_CONTEXT: dc=samba,dc=org
+""")
+        for key in ["@INDEX:@IDXSUBTREE:DC=SAMBA,DC=ORG",
+                    "@INDEX:@IDXSUBTREE:DC=ORG"]:
+            try:
+                self.l.search(base=key, scope=ldb.SCOPE_BASE)
+                self.fail("Expected no index record for %s" % key)
+            except ldb.LdbError as e:
+                self.assertEqual(e.args[0], ldb.ERR_NO_SUCH_OBJECT)
+
+        self.l.add({"dn": "CN=U9,OU=A,DC=SAMBA,DC=ORG",
+                    "objectUUID": b"0123456789abffff",
+                    "x": b"1",
+                    "y": b"z"})
+        self.assertEqual(
+            self.entries("@INDEX:@IDXSUBTREE:OU=A,DC=SAMBA,DC=ORG"), 5)
+        self.assertEqual(len(self.search("OU=A,DC=SAMBA,DC=ORG", "(y=z)")),
+                         5)
+        self.assertEqual(len(self.search("DC=SAMBA,DC=ORG", "(x=1)")), 7)
+
+        # Without the subtree record this needs a full scan
+        try:
+            self.l.search(base="DC=SAMBA,DC=ORG", scope=ldb.SCOPE_SUBTREE,
+                          expression="(y=z)")
+            self.fail("Expected a full scan")
+        except ldb.LdbError as e:
+            self.assertEqual(e.args[0], ldb.ERR_INAPPROPRIATE_MATCHING)
+
+
+class SubtreeIndexTestsLmdb(SubtreeIndexTests):
+
+    def setUp(self):
+        if os.environ.get('HAVE_LMDB', '1') == '0':
+            self.skipTest("No lmdb backend")
+        self.prefix = MDB_PREFIX
+        super(SubtreeIndexTestsLmdb, self).setUp()
+
+    def tearDown(self):
+        super(SubtreeIndexTestsLmdb, self).tearDown()
+
+
+class DNOnlySearchTests(LdbBaseTest):
+
+    def tearDown(self):
+        shutil.rmtree(self.testdir)
+        super(DNOnlySearchTests, self).tearDown()
+
+        # Ensure the LDB is closed now, so we close the FD
+        del(self.l)
+
+    def setUp(self):
+        super(DNOnlySearchTests, self).setUp()
+        self.testdir = tempdir()
+        self.filename = os.path.join(self.testdir, "dn_only_test.ldb")
+
+        self.l = ldb.Ldb(self.url(),
+                         options=["modules:rdn_name"])
+        self.l.add({"dn": "@ATTRIBUTES",
+                    "x": "CASE_INSENSITIVE"})
+        self.l.add({"dn": "@INDEXLIST",
+                    "@IDXATTR": [b"x", b"y"],
+                    "@IDXGUID": [b"objectUUID"],
+                    "@IDX_DN_GUID": [b"GUID"]})
+
+        for i in range(10):
+            self.l.add({"dn": "OU=DNONLY{},DC=SAMBA,DC=ORG".format(i),
+                        "objectUUID": b"0123456789ab%04x" % i,
+                        "x": "a" if i % 2 == 0 else "b",
+                        "y": str(i % 3),
+                        "z": str(i % 5)})
+
+    def search(self, expression, attrs):
+        res = self.l.search(base="DC=SAMBA,DC=ORG",
+                            scope=ldb.SCOPE_SUBTREE,
+                            expression=expression,
+                            attrs=attrs)
+        return res
+
+    def compare(self, expression):
+        full = sorted(str(r.dn) for r in self.search(expression, None))
+
+        res = self.search(expression, ["1.1"])
+        self.assertEqual(sorted(str(r.dn) for r in res), full)
+        for r in res:
+            self.assertEqual(len(r), 0)
+
+        res = self.search(expression, ["distinguishedName"])
+        self.assertEqual(sorted(str(r.dn) for r in res), full)
+        for r in res:
+            self.assertEqual(str(r["distinguishedName"][0]), str(r.dn))
+        return len(full)
+
+    def check_all(self):
+        # Answered by the index alone
+        self.assertEqual(self.compare("(x=A)"), 5)
+        self.assertEqual(self.compare("(&(x=a)(y=0))"), 2)
+        self.assertEqual(self.compare("(|(x=b)(y=0))"), 7)
+        # Candidates still checked against the filter
+        self.assertEqual(self.compare("(&(x=a)(z=4))"), 1)
+        self.assertEqual(self.compare("(&(x=a)(!(y=0)))"), 3)
+
+    def test_dn_only(self):
+        self.check_all()
+
+    def test_dn_only_in_transaction(self):
+        self.l.transaction_start()
+        try:
+            self.check_all()
+        finally:
+            self.l.transaction_cancel()
+
+
+class DNOnlySearchTestsLmdb(DNOnlySearchTests):
+
+    def setUp(self):
+        if os.environ.get('HAVE_LMDB', '1') == '0':
+            self.skipTest("No lmdb backend")
+        self.prefix = MDB_PREFIX
+        super(DNOnlySearchTestsLmdb, self).setUp()
+
+    def tearDown(self):
+        super(DNOnlySearchTestsLmdb, self).tearDown()
+
+
+class ChunkedGUIDIndexTests(LdbBaseTest):
+
+    def tearDown(self):
+        shutil.rmtree(self.testdir)
+        super(ChunkedGUIDIndexTests, self).tearDown()
+
+        # Ensure the LDB is closed now, so we close the FD
+        del(self.l)
+
+    def setUp(self):
+        super(ChunkedGUIDIndexTests, self).setUp()
+        self.testdir = tempdir()
+        self.filename = os.path.join(self.testdir, "chunked_idx_test.ldb")
+
+        self.l = ldb.Ldb(self.url(),
+                         options=["modules:rdn_name"])
+        self.l.add({"dn": "@INDEXLIST",
+                    "@IDXATTR": [b"colour"],
+                    "@IDXONE": [b"1"],
+                    "@IDXGUID": [b"objectUUID"],
+                    "@IDX_DN_GUID": [b"GUID"],
+                    "@IDX_CHUNK_SIZE": [b"8"]})
+
+    def uuid(self, i):
+        return b"0123456789ab%04x" % i
+
+    def index_record(self, key):
+        res = self.l.search(base=key, scope=ldb.SCOPE_BASE)
+        self.assertEqual(len(res), 1)
+        return res[0]
+
+    def chunk_exists(self, key):
+        try:
+            res = self.l.search(base=key, scope=ldb.SCOPE_BASE)
+        except ldb.LdbError as e:
+            self.assertEqual(e.args[0], ldb.ERR_NO_SUCH_OBJECT)
+            return False
+        return len(res) == 1
+
+    def count(self, expression):
+        res = self.l.search(base="DC=SAMBA,DC=ORG",
+                            scope=ldb.SCOPE_SUBTREE,
+                            expression=expression)
+        return len(res)
+
+    def add(self, i, colour="red"):
+        self.l.add({"dn": "OU=CHUNK{},DC=SAMBA,DC=ORG".format(i),
+                    "objectUUID": self.uuid(i),
+                    "colour": colour})
+
+    def test_chunked_add_delete(self):
+        for i in range(50):
+            self.add(i)
+
+        rec = self.index_record("@INDEX:COLOUR:red")
+        self.assertEqual(int(rec["@IDXVERSION"][0]), 4)
+        self.assertGreater(len(rec["@IDXCHUNK"]), 1)
+        self.assertTrue(self.chunk_exists("@INDEXCHUNK:COLOUR:red#1"))
+        self.assertEqual(self.count("(colour=red)"), 50)
+
+        for i in range(0, 50, 3):
+            self.l.delete("OU=CHUNK{},DC=SAMBA,DC=ORG".format(i))
+        self.assertEqual(self.count("(colour=red)"), 33)
+
+        for i in range(50, 80):
+            self.add(i)
+        self.assertEqual(self.count("(colour=red)"), 63)
+        self.assertEqual(self.count("(&(colour=red)(ou=CHUNK51))"), 1)
+        self.assertEqual(self.count("(&(colour=red)(ou=CHUNK3))"), 0)
+
+        # Shrinking below the chunk size removes the chunks again
+        for i in range(1, 80):
+            if (i < 50 and i % 3 == 0) or i in (51, 54, 57):
+                continue
+            self.l.delete("OU=CHUNK{},DC=SAMBA,DC=ORG".format(i))
+        rec = self.index_record("@INDEX:COLOUR:red")
+        self.assertEqual(int(rec["@IDXVERSION"][0]), 3)
+        self.assertFalse(self.chunk_exists("@INDEXCHUNK:COLOUR:red#1"))
+        self.assertEqual(self.count("(colour=red)"), 3)
+
+    def test_only_changed_chunks_written(self):
+        for i in range(50):
+            self.add(i)
+        self.assertTrue(self.chunk_exists("@INDEXCHUNK:COLOUR:red#1"))
+
+        # Mark the first chunk, which a rewrite would remove
+        m = ldb.Message()
+        m.dn = ldb.Dn(self.l, "@INDEXCHUNK:COLOUR:red#1")
+        m["marker"] = ldb.MessageElement([b"1"],
+                                         ldb.FLAG_MOD_ADD,
+                                         "marker")
+        self.l.modify(m)
+
+        # These only change the last chunk
+        self.l.transaction_start()
+        for i in range(50, 55):
+            self.add(i)
+        self.l.delete("OU=CHUNK49,DC=SAMBA,DC=ORG")
+        self.l.transaction_commit()
+        rec = self.index_record("@INDEXCHUNK:COLOUR:red#1")
+        self.assertIn("marker", rec)
+        self.assertEqual(self.count("(colour=red)"), 54)
+
+        # A cancelled change to the first chunk leaves it alone
+        self.l.transaction_start()
+        self.l.delete("OU=CHUNK0,DC=SAMBA,DC=ORG")
+        self.l.transaction_cancel()
+        rec = self.index_record("@INDEXCHUNK:COLOUR:red#1")
+        self.assertIn("marker", rec)
+
+        self.l.delete("OU=CHUNK0,DC=SAMBA,DC=ORG")
+        rec = self.index_record("@INDEXCHUNK:COLOUR:red#1")
+        self.assertNotIn("marker", rec)
+        self.assertEqual(self.count("(colour=red)"), 53)
+        self.assertEqual(self.count("(&(colour=red)(ou=CHUNK0))"), 0)
+        self.assertEqual(self.count("(&(colour=red)(ou=CHUNK1))"), 1)
+
+    def test_and_or_across_chunks(self):
+        m = ldb.Message()
+        m.dn = ldb.Dn(self.l, "@INDEXLIST")
+        m["@IDXATTR"] = ldb.MessageElement([b"colour", b"shape"],
+                                           ldb.FLAG_MOD_REPLACE,
+                                           "@IDXATTR")
+        self.l.modify(m)
+
+        shapes = ["round", "square", "flat"]
+        for i in range(60):
+            self.l.add({"dn": "OU=CHUNK{},DC=SAMBA,DC=ORG".format(i),
+                        "objectUUID": self.uuid(i),
+                        "colour": "red" if i % 2 == 0 else "blue",
+                        "shape": shapes[i % 3]})
+
+        rec = self.index_record("@INDEX:SHAPE:round")
+        self.assertEqual(int(rec["@IDXVERSION"][0]), 4)
+
+        self.assertEqual(self.count("(&(colour=red)(shape=round))"), 10)
+        self.assertEqual(self.count("(|(colour=red)(shape=round))"), 40)
+        self.assertEqual(
+            self.count("(&(colour=red)(|(shape=round)(shape=flat)))"), 20)
+        self.assertEqual(
+            self.count("(&(colour=red)(shape=round)(ou=CHUNK12))"), 1)
+        self.assertEqual(
+            self.count("(&(colour=red)(shape=round)(ou=CHUNK13))"), 0)
+        self.assertEqual(self.count("(&(colour=red)(!(shape=round)))"), 20)
+        self.assertEqual(self.count("(&(colour=red)(shape=hexagonal))"), 0)
+        self.assertEqual(self.count("(|(colour=red)(shape=hexagonal))"), 30)
+
+    def test_reindex_migrates(self):
+        self.l.modify_ldif("""
+dn: @INDEXLIST
+changetype: modify
+delete: @IDX_CHUNK_SIZE
+""")
+        for i in range(30):
+            self.add(i)
+        rec = self.index_record("@INDEX:COLOUR:red")
+        self.assertEqual(int(rec["@IDXVERSION"][0]), 3)
+
+        self.l.modify_ldif("""
+dn: @INDEXLIST
+changetype: modify
+add: @IDX_CHUNK_SIZE
+@IDX_CHUNK_SIZE: 4
+""")
+        rec = self.index_record("@INDEX:COLOUR:red")
+        self.assertEqual(int(rec["@IDXVERSION"][0]), 4)
+        self.assertEqual(self.count("(colour=red)"), 30)
+
+        self.l.modify_ldif("""
+dn: @INDEXLIST
+changetype: modify
+delete: @IDX_CHUNK_SIZE
+""")
+        rec = self.index_record("@INDEX:COLOUR:red")
+        self.assertEqual(int(rec["@IDXVERSION"][0]), 3)
+        self.assertFalse(self.chunk_exists("@INDEXCHUNK:COLOUR:red#1"))
+        self.assertEqual(self.count("(colour=red)"), 30)
+
+
+class ChunkedGUIDIndexTestsLmdb(ChunkedGUIDIndexTests):
+
+    def setUp(self):
+        if os.environ.get('HAVE_LMDB', '1') == '0':
+            self.skipTest("No lmdb backend")
+        self.prefix = MDB_PREFIX
+        super(ChunkedGUIDIndexTestsLmdb, self).setUp()
+
+    def tearDown(self):
+        super(ChunkedGUIDIndexTestsLmdb, self).tearDown()
+
+
+class IndexPlanTests(LdbBaseTest):
+
+    def tearDown(self):
+        shutil.rmtree(self.testdir)
+        super(IndexPlanTests, self).tearDown()
+
+        # Ensure the LDB is closed now, so we close the FD
+        del(self.l)
+
+    def setUp(self):
+        super(IndexPlanTests, self).setUp()
+        self.testdir = tempdir()
+        self.filename = os.path.join(self.testdir, "index_plan_test.ldb")
+
+        self.l = ldb.Ldb(self.url(),
+                         options=["modules:rdn_name"])
+        self.l.add({"dn": "@INDEXLIST",
+                    "@IDXATTR": [b"colour", b"shape", b"kind"],
+                    "@IDXONE": [b"1"],
+                    "@IDXGUID": [b"objectUUID"],
+                    "@IDX_DN_GUID": [b"GUID"]})
+
+        shapes = ["round", "square", "flat"]
+        self.l.transaction_start()
+        for i in range(300):
+            self.l.add({"dn": "OU=PLAN{},DC=SAMBA,DC=ORG".format(i),
+                        "objectUUID": b"0123456789ab%04x" % i,
+                        "colour": "red" if i % 2 == 0 else "blue",
+                        "shape": shapes[i % 3],
+                        "kind": "widget"})
+        self.l.transaction_commit()
+
+    def stats(self):
+        res = self.l.search(base="@INDEXSTATS", scope=ldb.SCOPE_BASE)
+        self.assertEqual(len(res), 1)
+        return res[0]
+
+    def plan(self, expression):
+        res = self.l.search(base="DC=SAMBA,DC=ORG",
+                            scope=ldb.SCOPE_SUBTREE,
+                            expression=expression,
+                            controls=["index_plan:0"])
+        self.assertEqual(len(res.controls), 1)
+        return (len(res), str(res.controls[0]))
+
+    def test_stats(self):
+        stats = self.stats()
+        self.assertEqual(int(stats["@IDXOBJECTS"][0]), 300)
+        self.assertIn(b"COLOUR 2 300", list(stats["@IDXSTAT"]))
+        self.assertIn(b"SHAPE 3 300", list(stats["@IDXSTAT"]))
+
+        for i in range(0, 300, 10):
+            self.l.delete("OU=PLAN{},DC=SAMBA,DC=ORG".format(i))
+
+        stats = self.stats()
+        self.assertEqual(int(stats["@IDXOBJECTS"][0]), 270)
+        self.assertIn(b"COLOUR 2 270", list(stats["@IDXSTAT"]))
+
+        # Dropping an attribute from the index drops its statistics
+        self.l.modify_ldif("""
+dn: @INDEXLIST
+changetype: modify
+delete: @IDXATTR
+@IDXATTR: kind
+""")
+        stats = self.stats()
+        self.assertEqual(int(stats["@IDXOBJECTS"][0]), 270)
+        self.assertIn(b"COLOUR 2 270", list(stats["@IDXSTAT"]))
+        for v in stats["@IDXSTAT"]:
+            self.assertFalse(v.startswith(b"KIND "))
+
+    def test_and_order(self):
+        (count, plan) = self.plan("(&(colour=red)(shape=round))")
+        self.assertEqual(count, 50)
+        self.assertEqual(
+            plan,
+            "index_plan:0:index: (&(shape=round)[~100](colour=red)[~150])")
+
+    def test_unindexed_term(self):
+        (count, plan) = self.plan("(&(colour=red)(ou=PLAN4))")
+        self.assertEqual(count, 1)
+        self.assertEqual(
+            plan, "index_plan:0:index: (&(colour=red)[~150](ou=PLAN4)[?])")
+
+    def test_full_scan(self):
+        (count, plan) = self.plan("(kind=widget)")
+        self.assertEqual(count, 300)
+        self.assertEqual(
+            plan,
+            "index_plan:0:full scan: (kind=widget)[~300] of 300 objects")
+
+        (count, plan) = self.plan("(&(kind=widget)(shape=flat))")
+        self.assertEqual(count, 100)
+        self.assertEqual(
+            plan,
+            "index_plan:0:index: (&(shape=flat)[~100](kind=widget)[~300])")
+
+    def test_rare_value_uses_index(self):
+        # On average a kind value matches every object, but this
+        # value matches none, so the index is still used
+        (count, plan) = self.plan("(kind=sprocket)")
+        self.assertEqual(count, 0)
+        self.assertEqual(plan, "index_plan:0:index: (kind=sprocket)[~300]")
+
+        self.l.add({"dn": "OU=PLANGADGET,DC=SAMBA,DC=ORG",
+                    "objectUUID": b"0123456789abffff",
+                    "kind": "gadget"})
+        (count, plan) = self.plan("(|(kind=gadget)(kind=widget))")
+        self.assertEqual(count, 301)
+        self.assertEqual(
+            plan,
+            "index_plan:0:full scan: "
+            "(|(kind=gadget)(kind=widget))[~301] of 301 objects")
+
+    def test_unindexed(self):
+        (count, plan) = self.plan("(ou=PLAN7)")
+        self.assertEqual(count, 1)
+        self.assertEqual(plan, "index_plan:0:full scan: unindexed")
+
+
+class IndexPlanTestsLmdb(IndexPlanTests):
+
+    def setUp(self):
+        if os.environ.get('HAVE_LMDB', '1') == '0':
+            self.skipTest("No lmdb backend")
+        self.prefix = MDB_PREFIX
+        super(IndexPlanTestsLmdb, self).setUp()
+
+    def tearDown(self):
+        super(IndexPlanTestsLmdb, self).tearDown()
+
+
+# Sorted searches answered by walking an ordered index
+class IndexSortTests(LdbBaseTest):
+    # TDB can only walk the @INDEXORDER records
+    extra_index = {"@IDX_ORDERED": [b"TRUE"]}
+    reverse_walk = True
+
+    def tearDown(self):
+        shutil.rmtree(self.testdir)
+        super(IndexSortTests, self).tearDown()
+
+        # Ensure the LDB is closed now, so we close the FD
+        del(self.l)
+
+    def setUp(self):
+        super(IndexSortTests, self).setUp()
+        self.testdir = tempdir()
+        self.filename = os.path.join(self.testdir, "index_sort_test.ldb")
+
+        self.l = ldb.Ldb(self.url(),
+                         options=["modules:server_sort"])
+        index = {"dn": "@INDEXLIST",
+                 "@IDXATTR": [b"usn", b"colour"],
+                 "@IDXGUID": [b"objectUUID"],
+                 "@IDX_DN_GUID": [b"GUID"]}
+        index.update(self.extra_index)
+        self.l.add(index)
+        self.l.add({"dn": "@ATTRIBUTES",
+                    "usn": "ORDERED_INTEGER"})
+
+        self.usns = {}
+        self.l.transaction_start()
+        for i in range(100):
+            dn = "OU=SORT{},DC=SAMBA,DC=ORG".format(i)
+            msg = {"dn": dn,
+                   "objectUUID": b"0123456789ab%04x" % i,
+                   "colour": "red" if i % 2 == 0 else "blue"}
+            if i % 10 != 9:
+                usn = (i * 37) % 100 - 50
+                msg["usn"] = str(usn).encode()
+                self.usns[dn] = usn
+            self.l.add(msg)
+        self.l.transaction_commit()
+
+    def search(self, expression, reverse=False, attrs=None):
+        control = "server_sort:1:{}:usn".format(int(reverse))
+        res = self.l.search(base="DC=SAMBA,DC=ORG",
+                            scope=ldb.SCOPE_SUBTREE,
+                            expression=expression,
+                            attrs=attrs,
+                            controls=[control, "index_plan:0"])
+        plans = [str(c) for c in res.controls
+                 if str(c).startswith("index_plan:")]
+        self.assertEqual(len(plans), 1)
+        return (res, plans[0])
+
+    def usn_order(self, res):
+        return [self.usns.get(str(r.dn)) for r in res]
+
+    def expected(self, usns, reverse=False):
+        return sorted(usns, reverse=reverse)
+
+    def test_sorted_range(self):
+        (res, plan) = self.search("(usn>=-10)")
+        self.assertEqual(plan, "index_plan:0:sorted index: usn")
+        self.assertEqual(self.usn_order(res),
+                         self.expected(u for u in self.usns.values()
+                                       if u >= -10))
+        for r in res:
+            self.assertEqual(int(r["usn"][0]), self.usns[str(r.dn)])
+
+    def test_sorted_and(self):
+        (res, plan) = self.search("(&(!(colour=blue))(usn=*))")
+        self.assertEqual(plan, "index_plan:0:sorted index: usn")
+        self.assertEqual(len(res), 50)
+        self.assertEqual(self.usn_order(res),
+                         self.expected(self.usn_order(res)))
+        for r in res:
+            self.assertEqual(str(r["colour"][0]), "red")
+
+    def test_filter_index_preferred(self):
+        # (colour=red) has 50 entries, fewer than the 90 of usn, so
+        # is searched and the results sorted by server_sort
+        (res, plan) = self.search("(&(colour=red)(usn=*))")
+        self.assertEqual(plan,
+                         "index_plan:0:index: "
+                         "(&(colour=red)[~50](usn=*)[?])")
+        self.assertEqual(len(res), 50)
+        self.assertEqual(self.usn_order(res),
+                         self.expected(self.usn_order(res)))
+
+    def test_sorted_reverse(self):
+        (res, plan) = self.search("(usn<=20)", reverse=True)
+        if self.reverse_walk:
+            self.assertEqual(plan, "index_plan:0:sorted index: usn")
+        else:
+            self.assertNotEqual(plan, "index_plan:0:sorted index: usn")
+        self.assertEqual(self.usn_order(res),
+                         self.expected((u for u in self.usns.values()
+                                        if u <= 20),
+                                       reverse=True))
+
+    def test_sort_attr_not_requested(self):
+        (res, plan) = self.search("(usn>=0)", attrs=["colour"])
+        self.assertEqual(plan, "index_plan:0:sorted index: usn")
+        self.assertEqual(self.usn_order(res),
+                         self.expected(u for u in self.usns.values()
+                                       if u >= 0))
+        for r in res:
+            self.assertNotIn("usn", r)
+            self.assertIn("colour", r)
+
+    def test_paged_not_walked(self):
+        # server_sort keeps the first page in a heap rather than
+        # asking for the entries in index order
+        res = self.l.search(base="DC=SAMBA,DC=ORG",
+                            scope=ldb.SCOPE_SUBTREE,
+                            expression="(usn>=-10)",
+                            controls=["server_sort:1:0:usn",
+                                      "paged_results:1:5",
+                                      "index_plan:0"])
+        plans = [str(c) for c in res.controls
+                 if str(c).startswith("index_plan:")]
+        self.assertEqual(len(plans), 1)
+        self.assertNotEqual(plans[0], "index_plan:0:sorted index: usn")
+        self.assertEqual(self.usn_order(res),
+                         self.expected(u for u in self.usns.values()
+                                       if u >= -10)[:5])
+
+    def test_missing_values_not_walked(self):
+        # Entries without a usn match, so the index can't be walked
+        (res, plan) = self.search("(colour=blue)")
+        self.assertNotEqual(plan, "index_plan:0:sorted index: usn")
+        self.assertEqual(len(res), 50)
+        order = self.usn_order(res)
+        self.assertEqual(order[:45], self.expected(order[:45]))
+        self.assertEqual(order[45:], [None] * 5)
+
+    def test_multi_valued(self):
+        # Sorted on the first value, and sent only once
+        self.l.add({"dn": "OU=MULTI,DC=SAMBA,DC=ORG",
+                    "objectUUID": b"0123456789abffff",
+                    "colour": "green",
+                    "usn": [b"30", b"-45", b"60"]})
+        self.usns["OU=MULTI,DC=SAMBA,DC=ORG"] = 30
+        (res, plan) = self.search("(usn>=-50)")
+        self.assertEqual(plan, "index_plan:0:sorted index: usn")
+        self.assertEqual(self.usn_order(res),
+                         self.expected(self.usns.values()))
+
+    def test_in_transaction(self):
+        # The index cache of a transaction is not walked
+        self.l.transaction_start()
+        try:
+            (res, plan) = self.search("(usn>=-10)")
+        finally:
+            self.l.transaction_cancel()
+        self.assertNotEqual(plan, "index_plan:0:sorted index: usn")
+        self.assertEqual(self.usn_order(res),
+                         self.expected(u for u in self.usns.values()
+                                       if u >= -10))
+
+
+class IndexSortTestsLmdb(IndexSortTests):
+    extra_index = {}
+    # iterate_range only goes forwards
+    reverse_walk = False
+
+    def setUp(self):
+        if os.environ.get('HAVE_LMDB', '1') == '0':
+            self.skipTest("No lmdb backend")
+        self.prefix = MDB_PREFIX
+        super(IndexSortTestsLmdb, self).setUp()
+
+    def tearDown(self):
+        super(IndexSortTestsLmdb, self).tearDown()
+
+
+# Unindexed searches split across worker threads (lmdb only)
+class ParallelFullScanTests(LdbBaseTest):
+
+    def setUp(self):
+        if os.environ.get('HAVE_LMDB', '1') == '0':
+            self.skipTest("No lmdb backend")
+        self.prefix = MDB_PREFIX
+        super(ParallelFullScanTests, self).setUp()
+        self.testdir = tempdir()
+        self.filename = os.path.join(self.testdir, "parallel_scan_test.ldb")
+
+        self.l = ldb.Ldb(self.url(),
+                         options=["modules:rdn_name",
+                                  "full_scan_workers:4"])
+        self.l.add({"dn": "@INDEXLIST",
+                    "@IDXATTR": [b"colour"],
+                    "@IDXGUID": [b"objectUUID"],
+                    "@IDX_DN_GUID": [b"GUID"]})
+
+        self.l.transaction_start()
+        for i in range(500):
+            self.l.add({"dn": "OU=SCAN{},DC=SAMBA,DC=ORG".format(i),
+                        "objectUUID": struct.pack("B", i % 256)
+                        + b"%015d" % i,
+                        "colour": "red" if i % 2 == 0 else "blue",
+                        "size": str(i % 7)})
+        self.l.transaction_commit()
+
+        self.serial = ldb.Ldb(self.url(),
+                              options=["modules:rdn_name"])
+
+    def tearDown(self):
+        shutil.rmtree(self.testdir)
+        super(ParallelFullScanTests, self).tearDown()
+
+        # Ensure the LDB is closed now, so we close the FD
+        del(self.serial)
+        del(self.l)
+
+    def compare(self, expression, count):
+        res = self.l.search(base="DC=SAMBA,DC=ORG",
+                            scope=ldb.SCOPE_SUBTREE,
+                            expression=expression)
+        expected = self.serial.search(base="DC=SAMBA,DC=ORG",
+                                      scope=ldb.SCOPE_SUBTREE,
+                                      expression=expression)
+        self.assertEqual(len(res), count)
+        self.assertEqual([str(m.dn) for m in res],
+                         [str(m.dn) for m in expected])
+
+    def test_full_scan(self):
+        self.compare("(size=3)", 71)
+        self.compare("(&(size=3)(!(colour=red)))", 36)
+        self.compare("(size=*)", 500)
+        self.compare("(size=9)", 0)
+
+    def test_in_transaction(self):
+        # The workers can't see uncommitted changes, so this is
+        # scanned on the calling thread
+        self.l.transaction_start()
+        self.l.add({"dn": "OU=SCANTXN,DC=SAMBA,DC=ORG",
+                    "objectUUID": b"ffffffffffffffff",
+                    "size": "3"})
+        res = self.l.search(base="DC=SAMBA,DC=ORG",
+                            scope=ldb.SCOPE_SUBTREE,
+                            expression="(size=3)")
+        self.assertEqual(len(res), 72)
+        self.l.transaction_cancel()
+
+
+# Re-index with the records unpacked on worker threads
+class ParallelReindexTests(LdbBaseTest):
+
+    def setUp(self):
+        super(ParallelReindexTests, self).setUp()
+        self.testdir = tempdir()
+        self.filename = os.path.join(self.testdir, "parallel_reindex.ldb")
+        self.l = self.create(self.url(), ["reindex_workers:4"])
+
+        self.serial_filename = os.path.join(self.testdir,
+                                            "serial_reindex.ldb")
+        self.serial = self.create(self.prefix + self.serial_filename, [])
+
+    def tearDown(self):
+        shutil.rmtree(self.testdir)
+        super(ParallelReindexTests, self).tearDown()
+
+        # Ensure the LDB is closed now, so we close the FD
+        del(self.serial)
+        del(self.l)
+
+    def create(self, url, options):
+        l = ldb.Ldb(url,
+                    flags=self.flags(),
+                    options=["modules:rdn_name"] + options)
+        l.add({"dn": "@INDEXLIST",
+               "@IDXATTR": [b"colour"],
+               "@IDXONE": [b"1"],
+               "@IDXGUID": [b"objectUUID"],
+               "@IDX_DN_GUID": [b"GUID"]})
+
+        # More records than the workers are given at once
+        l.transaction_start()
+        for i in range(5000):
+            ou = "OU=REINDEX{},DC=SAMBA,DC=ORG".format(i % 10)
+            if i < 10:
+                dn = ou
+            else:
+                dn = "CN=R{},{}".format(i, ou)
+            l.add({"dn": dn,
+                   "objectUUID": struct.pack("B", (i * 7) % 256)
+                   + b"%015d" % i,
+                   "colour": ["red", "blue", "green"][i % 3],
+                   "size": str(i % 7)})
+        l.transaction_commit()
+        return l
+
+    def index(self, l, key):
+        res = l.search(base=key, scope=ldb.SCOPE_BASE)
+        self.assertEqual(len(res), 1)
+        return list(res[0]["@IDX"])
+
+    def test_reindex(self):
+        for l in (self.l, self.serial):
+            l.modify_ldif("""
+dn: @INDEXLIST
+changetype: modify
+add: @IDXATTR
+@IDXATTR: size
+""")
+            # A change to @IDXATTR alone is re-indexed
+            # incrementally, this re-indexes everything
+            l.add({"dn": "@ATTRIBUTES",
+                   "name": [b"CASE_INSENSITIVE"]})
+
+        for key in ["@INDEX:SIZE:3",
+                    "@INDEX:COLOUR:red",
+                    "@INDEX:@IDXONE:OU=REINDEX4,DC=SAMBA,DC=ORG",
+                    "@INDEX:@IDXDN:CN=R4321,OU=REINDEX1,DC=SAMBA,DC=ORG"]:
+            self.assertEqual(self.index(self.l, key),
+                             self.index(self.serial, key))
+
+        res = self.l.search(base="DC=SAMBA,DC=ORG",
+                            scope=ldb.SCOPE_SUBTREE,
+                            expression="(&(size=3)(colour=red))")
+        self.assertEqual(len(res), 238)
+        res = self.l.search(base="OU=REINDEX4,DC=SAMBA,DC=ORG",
+                            scope=ldb.SCOPE_ONELEVEL,
+                            expression="(colour=*)")
+        self.assertEqual(len(res), 499)
+
+
+class ParallelReindexTestsLmdb(ParallelReindexTests):
+
+    def setUp(self):
+        if os.environ.get('HAVE_LMDB', '1') == '0':
+            self.skipTest("No lmdb backend")
+        self.prefix = MDB_PREFIX
+        super(ParallelReindexTestsLmdb, self).setUp()
+
+
+# The scan and reindex workers casefold DNs with shared parents on the
+# one LDB context, which must not touch the DN casefold cache
+class ParallelCasefoldTests(LdbBaseTest):
+
+    def setUp(self):
+        if os.environ.get('HAVE_LMDB', '1') == '0':
+            self.skipTest("No lmdb backend")
+        self.prefix = MDB_PREFIX
+        super(ParallelCasefoldTests, self).setUp()
+        self.testdir = tempdir()
+        self.filename = os.path.join(self.testdir, "parallel_casefold.ldb")
+        self.l = ldb.Ldb(self.url(),
+                         flags=self.flags(),
+                         options=["modules:rdn_name",
+                                  "full_scan_workers:4",
+                                  "reindex_workers:4"])
+        self.l.add({"dn": "@INDEXLIST",
+                    "@IDXATTR": [b"colour"],
+                    "@IDXONE": [b"1"],
+                    "@IDXGUID": [b"objectUUID"],
+                    "@IDX_DN_GUID": [b"GUID"]})
+
+        self.l.transaction_start()
+        for i in range(2000):
+            ou = "OU=Casefold{},DC=Samba,DC=Org".format(i % 20)
+            if i < 20:
+                dn = ou
+            else:
+                dn = "CN=C{},{}".format(i, ou)
+            self.l.add({"dn": dn,
+                        "objectUUID": struct.pack("B", (i * 7) % 256)
+                        + b"%015d" % i,
+                        "colour": ["red", "blue", "green"][i % 3],
+                        "size": str(i % 7)})
+        self.l.transaction_commit()
+
+    def tearDown(self):
+        shutil.rmtree(self.testdir)
+        super(ParallelCasefoldTests, self).tearDown()
+
+        # Ensure the LDB is closed now, so we close the FD
+        del(self.l)
+
+    def scan(self):
+        for n in range(20):
+            res = self.l.search(base="ou=casefold{},dc=samba,dc=org".format(n),
+                                scope=ldb.SCOPE_SUBTREE,
+                                expression="(size=3)")
+            self.assertEqual(len(res),
+                             len([i for i in range(20, 2000)
+                                  if i % 20 == n and i % 7 == 3]))
+
+    def test_scan_and_reindex(self):
+        self.scan()
+
+        # Re-index everything, with the cache filled by the scans
+        self.l.add({"dn": "@ATTRIBUTES",
+                    "colour": [b"CASE_INSENSITIVE"]})
+
+        res = self.l.search(base="OU=CASEFOLD4,DC=SAMBA,DC=ORG",
+                            scope=ldb.SCOPE_ONELEVEL,
+                            expression="(colour=RED)")
+        self.assertEqual(len([i for i in range(20, 2000)
+                              if i % 20 == 4 and i % 3 == 0]),
+                         len(res))
+        self.scan()
+
+
+class IncrementalReindexTests(LdbBaseTest):
+
+    def setUp(self):
+        super(IncrementalReindexTests, self).setUp()
+        self.testdir = tempdir()
+        self.filename = os.path.join(self.testdir, "incremental.ldb")
+        self.l = ldb.Ldb(self.url(),
+                         flags=self.flags(),
+                         options=["modules:rdn_name"])
+        self.l.add({"dn": "@INDEXLIST",
+                    "@IDXATTR": [b"colour", b"shape"],
+                    "@IDXONE": [b"1"],
+                    "@IDXGUID": [b"objectUUID"],
+                    "@IDX_DN_GUID": [b"GUID"]})
+
+        shapes = ["round", "square", "flat"]
+        self.l.transaction_start()
+        for i in range(60):
+            self.l.add({"dn": "OU=DELTA{},DC=SAMBA,DC=ORG".format(i),
+                        "objectUUID": b"0123456789ab%04x" % i,
+                        "colour": "red" if i % 2 == 0 else "blue",
+                        "shape": shapes[i % 3],
+                        "size": str(i % 4)})
+        self.l.transaction_commit()
+
+    def tearDown(self):
+        shutil.rmtree(self.testdir)
+        super(IncrementalReindexTests, self).tearDown()
+
+        # Ensure the LDB is closed now, so we close the FD
+        del(self.l)
+
+    def index(self, key):
+        try:
+            res = self.l.search(base=key, scope=ldb.SCOPE_BASE)
+        except ldb.LdbError as e:
+            self.assertEqual(e.args[0], ldb.ERR_NO_SUCH_OBJECT)
+            return []
+        if len(res) == 0:
+            return []
+        return list(res[0]["@IDX"])
+
+    def count(self, expression):
+        res = self.l.search(base="DC=SAMBA,DC=ORG",
+                            scope=ldb.SCOPE_SUBTREE,
+                            expression=expression)
+        return len(res)
+
+    def test_add(self):
+        red = self.index("@INDEX:COLOUR:red")
+        self.assertEqual(len(red), 30)
+
+        self.l.modify_ldif("""
+dn: @INDEXLIST
+changetype: modify
+add: @IDXATTR
+@IDXATTR: size
+""")
+        self.assertEqual(len(self.index("@INDEX:SIZE:1")), 15)
+        self.assertEqual(self.index("@INDEX:COLOUR:red"), red)
+        self.assertEqual(self.count("(&(size=1)(colour=blue))"), 15)
+        self.assertEqual(self.count("(&(size=2)(shape=flat))"), 5)
+
+    def test_delete(self):
+        self.l.modify_ldif("""
+dn: @INDEXLIST
+changetype: modify
+delete: @IDXATTR
+@IDXATTR: colour
+""")
+        self.assertEqual(self.index("@INDEX:COLOUR:red"), [])
+        self.assertEqual(len(self.index("@INDEX:SHAPE:round")), 20)
+        self.assertEqual(self.count("(colour=red)"), 30)
+        self.assertEqual(self.count("(&(colour=red)(shape=round))"), 10)
+
+    def test_in_transaction(self):
+        # The index records of a record added in the same
+        # transaction are not yet written out
+        self.l.transaction_start()
+        self.l.add({"dn": "OU=DELTA60,DC=SAMBA,DC=ORG",
+                    "objectUUID": b"0123456789ab%04x" % 60,
+                    "colour": "green",
+                    "shape": "round",
+                    "size": "7"})
+        self.l.modify_ldif("""
+dn: @INDEXLIST
+changetype: modify
+delete: @IDXATTR
+@IDXATTR: colour
+-
+add: @IDXATTR
+@IDXATTR: size
+""")
+        self.l.transaction_commit()
+
+        self.assertEqual(self.index("@INDEX:COLOUR:green"), [])
+        self.assertEqual(self.index("@INDEX:COLOUR:blue"), [])
+        self.assertEqual(len(self.index("@INDEX:SIZE:7")), 1)
+        self.assertEqual(len(self.index("@INDEX:SHAPE:round")), 21)
+        self.assertEqual(self.count("(colour=green)"), 1)
+        self.assertEqual(self.count("(size=7)"), 1)
+
+
+class IncrementalReindexTestsLmdb(IncrementalReindexTests):
+
+    def setUp(self):
+        if os.environ.get('HAVE_LMDB', '1') == '0':
+            self.skipTest("No lmdb backend")
+        self.prefix = MDB_PREFIX
+        super(IncrementalReindexTestsLmdb, self).setUp()
+
+
 # Run the index truncation tests against an lmdb backend
+class CompiledFilterTests(LdbBaseTest):
+    """Searches other than base searches match records against a
+    compiled copy of the expression, while base searches use
+    ldb_match_message(), so both must give the same answer."""
+
+    def tearDown(self):
+        shutil.rmtree(self.testdir)
+        super(CompiledFilterTests, self).tearDown()
+
+        # Ensure the LDB is closed now, so we close the FD
+        del(self.l)
+
+    def setUp(self):
+        super(CompiledFilterTests, self).setUp()
+        self.testdir = tempdir()
+        self.filename = os.path.join(self.testdir, "compiled_filter.ldb")
+
+        self.l = ldb.Ldb(self.url(),
+                         options=["modules:rdn_name"])
+        self.l.add({"dn": "@ATTRIBUTES",
+                    "name": [b"CASE_INSENSITIVE"],
+                    "size": [b"INTEGER"]})
+        self.l.add({"dn": "@INDEXLIST",
+                    "@IDXATTR": [b"colour"],
+                    "@IDXGUID": [b"objectUUID"],
+                    "@IDX_DN_GUID": [b"GUID"]})
+
+        names = ["Alpha Beta", "alpha  gamma", "DELTA", "epsilon"]
+        self.dns = []
+        self.l.transaction_start()
+        for i in range(40):
+            dn = "OU=MATCH{},DC=SAMBA,DC=ORG".format(i)
+            self.dns.append(dn)
+            self.l.add({"dn": dn,
+                        "objectUUID": b"0123456789ab%04x" % i,
+                        "colour": "red" if i % 2 == 0 else "blue",
+                        "name": names[i % 4],
+                        "size": str(i % 9),
+                        "blob": b"\x00\x01" + bytes([i % 5]),
+                        "distinguishedName": dn.lower()})
+        self.l.transaction_commit()
+
+    def compare(self, expression):
+        expected = set()
+        for dn in self.dns:
+            res = self.l.search(base=dn,
+                                scope=ldb.SCOPE_BASE,
+                                expression=expression)
+            if len(res) == 1:
+                expected.add(dn)
+
+        res = self.l.search(base="DC=SAMBA,DC=ORG",
+                            scope=ldb.SCOPE_SUBTREE,
+                            expression=expression)
+        self.assertEqual(set(str(m.dn) for m in res), expected,
+                         expression)
+
+    def test_boolean(self):
+        self.compare("(&(size=3)(!(colour=red)))")
+        self.compare("(|(size=1)(size=2)(!(|(colour=red)(size=4))))")
+        self.compare("(&(|(size=1)(colour=blue))(!(size=3))(name=*))")
+        self.compare("(!(!(size=5)))")
+
+    def test_terms(self):
+        self.compare("(name=alpha beta)")
+        self.compare("(name=alpha*)")
+        self.compare("(name=*a*m*A)")
+        self.compare("(name=*ta)")
+        self.compare("(blob=\\00\\01\\02)")
+        self.compare("(blob=\\00*)")
+        self.compare("(size>=4)")
+        self.compare("(size<=2)")
+        self.compare("(nothere=*)")
+        self.compare("(|(nothere=1)(size=0))")
+
+    def test_dn(self):
+        self.compare("(dn=OU=MATCH7,DC=SAMBA,DC=ORG)")
+        self.compare("(distinguishedName=ou=match7,dc=samba,dc=org)")
+        self.compare("(distinguishedName=OU=MATCH8,DC=samba,DC=org)")
+        self.compare("(|(dn=ou=match1,dc=samba,dc=org)(size=3))")
+        self.compare("(dn=*)")
+
+
+class CompiledFilterTestsLmdb(CompiledFilterTests):
+
+    def setUp(self):
+        if os.environ.get('HAVE_LMDB', '1') == '0':
+            self.skipTest("No lmdb backend")
+        self.prefix = MDB_PREFIX
+        super(CompiledFilterTestsLmdb, self).setUp()
+
+    def tearDown(self):
+        super(CompiledFilterTestsLmdb, self).tearDown()
+
+
 class RejectSubDBIndex(LdbBaseTest):
 
     def setUp(self):
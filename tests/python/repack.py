@@ -192,6 +192,65 @@ class GUIDIndexAndPackFormatTests(TestCase):
 
         self.toggle_guidindex_check_pack()
 
+    def set_attribute_directory(self, enable=True):
+        modmsg = ldb.Message()
+        modmsg.dn = ldb.Dn(self.l, '@OPTIONS')
+        el = [b"TRUE"] if enable else []
+        modmsg["packAttributeDirectory"] = ldb.MessageElement(
+            elements=el, flags=ldb.FLAG_MOD_REPLACE,
+            name="packAttributeDirectory")
+        self.l.modify(modmsg)
+
+    # Check a GUID indexed database is repacked with version 3 format
+    # when packAttributeDirectory is set in @OPTIONS, and back to version
+    # 2 when it is removed.  Without GUID indexing it has no effect.
+    def test_repack_attribute_directory(self):
+        self.setup_newdb()
+
+        self.l.add({"dn": "@OPTIONS"})
+        self.l.add({"dn": "@INDEXLIST",
+                    "@IDXONE": [b"1"],
+                    "@IDXGUID": [b"objectUUID"],
+                    "@IDX_DN_GUID": [b"GUID"]})
+
+        expect_db = {}
+        for i in range(3):
+            rec = self.add_one_rec()
+            expect_db[rec['dn']] = rec
+
+        for enable in [True, False, True]:
+            pf = ldb.PACKING_FORMAT_V3 if enable else ldb.PACKING_FORMAT_V2
+
+            self.set_attribute_directory(enable=enable)
+
+            guid_keys, pack_formats = self.ldbdump_guid_keys_pack_formats()
+            self.assertEqual(len(guid_keys), self.num_recs_added)
+            self.assertEqual(pack_formats, [pf])
+            self.assertEqual(self.get_database(), expect_db)
+
+            rec = self.add_one_rec()
+            expect_db[rec['dn']] = rec
+
+            guid_keys, pack_formats = self.ldbdump_guid_keys_pack_formats()
+            self.assertEqual(pack_formats, [pf])
+            self.assertEqual(self.get_database(), expect_db)
+
+            res = self.l.search(base="DC=SAMBA,DC=ORG",
+                                scope=ldb.SCOPE_SUBTREE,
+                                expression="(objectUUID=%s)" %
+                                rec["objectUUID"],
+                                attrs=["objectUUID", "missing"])
+            self.assertEqual(len(res), 1)
+            self.assertEqual(str(res[0]["objectUUID"]), rec["objectUUID"])
+            self.assertNotIn("distinguishedName", res[0])
+
+        # V3 needs GUID indexing
+        self.set_guid_indexing(enable=False)
+        guid_keys, pack_formats = self.ldbdump_guid_keys_pack_formats()
+        self.assertEqual(len(guid_keys), 0)
+        self.assertEqual(pack_formats, [ldb.PACKING_FORMAT])
+        self.assertEqual(self.get_database(), expect_db)
+
 
 if __name__ == '__main__':
     import unittest
@@ -21,6 +21,8 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <setjmp.h>
+#include <ctype.h>
+#include <pthread.h>
 #include <cmocka.h>
 
 #include <ldb.h>
@@ -219,6 +221,154 @@ static void test_ldb_dn_explode(void **state)
 	}
 }
 
+static char *lower_casefold(void *context, void *mem_ctx,
+			    const char *s, size_t n)
+{
+	size_t i;
+	char *ret = talloc_strndup(mem_ctx, s, n);
+	if (ret == NULL) {
+		return NULL;
+	}
+	for (i = 0; ret[i] != '\0'; i++) {
+		ret[i] = tolower((unsigned char)ret[i]);
+	}
+	return ret;
+}
+
+static void test_ldb_dn_casefold_cache(void **state)
+{
+	struct ldb_context *ldb = ldb_init(NULL, NULL);
+	struct ldb_dn *base = NULL;
+	struct ldb_dn *dn = NULL;
+
+	/* The parent components are cached by the first casefold */
+	dn = ldb_dn_new(ldb, ldb, "cn=a,dc=samba,dc=org");
+	assert_string_equal("CN=A,DC=SAMBA,DC=ORG",
+			    ldb_dn_get_casefold(dn));
+
+	dn = ldb_dn_new(ldb, ldb, "cn=b,dc=samba,dc=org");
+	assert_string_equal("CN=B,DC=SAMBA,DC=ORG",
+			    ldb_dn_get_casefold(dn));
+
+	base = ldb_dn_new(ldb, ldb, "DC=Samba,dc=ORG");
+	assert_int_equal(ldb_dn_compare_base(base, dn), 0);
+
+	dn = ldb_dn_new(ldb, ldb, "cn=b,dc=smb,dc=org");
+	assert_int_not_equal(ldb_dn_compare_base(base, dn), 0);
+
+	/* A new casefold function must not see the old results */
+	ldb_set_utf8_functions(ldb, NULL, lower_casefold, NULL);
+
+	dn = ldb_dn_new(ldb, ldb, "cn=C,dc=Samba,dc=org");
+	assert_string_equal("CN=c,DC=samba,DC=org",
+			    ldb_dn_get_casefold(dn));
+
+	talloc_free(ldb);
+}
+
+static void test_ldb_dn_casefold_cache_schema(void **state)
+{
+	struct ldb_context *ldb = ldb_init(NULL, NULL);
+	struct ldb_dn *dn = NULL;
+	int ret;
+
+	dn = ldb_dn_new(ldb, ldb, "cn=a,ou=Foo,dc=samba,dc=org");
+	assert_string_equal("CN=A,OU=FOO,DC=SAMBA,DC=ORG",
+			    ldb_dn_get_casefold(dn));
+
+	/* A new handler for the attribute must not see the old results */
+	ret = ldb_schema_attribute_add(ldb, "ou", 0,
+				       LDB_SYNTAX_OCTET_STRING);
+	assert_int_equal(ret, LDB_SUCCESS);
+
+	dn = ldb_dn_new(ldb, ldb, "cn=b,ou=Foo,dc=samba,dc=org");
+	assert_string_equal("CN=B,OU=Foo,DC=SAMBA,DC=ORG",
+			    ldb_dn_get_casefold(dn));
+
+	/* The same value under another attribute is a different key */
+	dn = ldb_dn_new(ldb, ldb, "cn=c,dc=Foo,dc=org");
+	assert_string_equal("CN=C,DC=FOO,DC=ORG",
+			    ldb_dn_get_casefold(dn));
+
+	talloc_free(ldb);
+}
+
+struct casefold_thread {
+	struct ldb_context *ldb;
+	unsigned int n;
+	bool ok;
+};
+
+static void *casefold_thread_fn(void *private_data)
+{
+	struct casefold_thread *t = private_data;
+	TALLOC_CTX *mem_ctx = talloc_new(NULL);
+	unsigned int i;
+
+	t->ok = (mem_ctx != NULL);
+	for (i = 0; i < 2000 && t->ok; i++) {
+		struct ldb_dn *dn = NULL;
+		const char *expected = NULL;
+		const char *cf = NULL;
+
+		dn = ldb_dn_new_fmt(mem_ctx, t->ldb,
+				    "cn=t%u-%u,ou=ou%u,dc=samba,dc=org",
+				    t->n, i, i % 17);
+		expected = talloc_asprintf(mem_ctx,
+					   "CN=T%u-%u,OU=OU%u,DC=SAMBA,DC=ORG",
+					   t->n, i, i % 17);
+		cf = ldb_dn_get_casefold(dn);
+		t->ok = (cf != NULL && expected != NULL &&
+			 strcmp(cf, expected) == 0);
+		talloc_free_children(mem_ctx);
+	}
+	talloc_free(mem_ctx);
+	return NULL;
+}
+
+/*
+ * DNs on one LDB context casefolded on several threads at once, as
+ * the ldb_kv scan and reindex workers do
+ */
+static void test_ldb_dn_casefold_cache_threads(void **state)
+{
+	struct ldb_context *ldb = ldb_init(NULL, NULL);
+	struct casefold_thread t[4];
+	pthread_t threads[4];
+	struct ldb_dn *dn = NULL;
+	unsigned int i;
+
+	/* Fill the cache first */
+	dn = ldb_dn_new(ldb, ldb, "cn=a,ou=ou1,dc=samba,dc=org");
+	assert_string_equal("CN=A,OU=OU1,DC=SAMBA,DC=ORG",
+			    ldb_dn_get_casefold(dn));
+
+	ldb_dn_casefold_cache_suspend(ldb);
+	for (i = 0; i < 4; i++) {
+		t[i] = (struct casefold_thread) {
+			.ldb = ldb,
+			.n = i,
+		};
+		assert_int_equal(pthread_create(&threads[i],
+						NULL,
+						casefold_thread_fn,
+						&t[i]),
+				 0);
+	}
+	for (i = 0; i < 4; i++) {
+		assert_int_equal(pthread_join(threads[i], NULL), 0);
+		assert_true(t[i].ok);
+	}
+	ldb_dn_casefold_cache_resume(ldb);
+
+	/* The cache is used again once resumed */
+	dn = ldb_dn_new(ldb, ldb, "cn=b,ou=ou1,dc=samba,dc=org");
+	assert_string_equal("CN=B,OU=OU1,DC=SAMBA,DC=ORG",
+			    ldb_dn_get_casefold(dn));
+
+	talloc_free(ldb);
+}
+
 int main(void) {
 	const struct CMUnitTest tests[] = {
 		cmocka_unit_test(test_ldb_dn_add_child_fmt),
@@ -226,6 +376,9 @@ int main(void) {
 		cmocka_unit_test(test_ldb_dn_add_child_val),
 		cmocka_unit_test(test_ldb_dn_add_child_val2),
 		cmocka_unit_test(test_ldb_dn_explode),
+		cmocka_unit_test(test_ldb_dn_casefold_cache),
+		cmocka_unit_test(test_ldb_dn_casefold_cache_schema),
+		cmocka_unit_test(test_ldb_dn_casefold_cache_threads),
 	};
 
 	cmocka_set_message_output(CM_OUTPUT_SUBUNIT);
@@ -30,7 +30,7 @@
 
 static struct ldb_cmdline options; /* needs to be static for older compilers */
 
-enum ldb_cmdline_options { CMDLINE_RELAX=1 };
+enum ldb_cmdline_options { CMDLINE_RELAX=1, CMDLINE_BULK };
 
 static struct poptOption builtin_popt_options[] = {
 	POPT_AUTOHELP
@@ -241,6 +241,15 @@ static struct poptOption builtin_popt_options[] = {
 		.descrip    = "pass relax control",
 		.argDescrip = NULL
 	},
+	{
+		.longName   = "bulk",
+		.shortName  = 0,
+		.argInfo    = POPT_ARG_NONE,
+		.arg        = NULL,
+		.val        = CMDLINE_BULK,
+		.descrip    = "bulk load, building indexes at commit",
+		.argDescrip = NULL
+	},
 	{
 		.longName   = "cross-ncs",
 		.shortName  = 0,
@@ -377,6 +386,18 @@ static struct ldb_cmdline *ldb_cmdline_process_internal(struct ldb_context *ldb,
 			num_options++;
 			break;
 
+		case CMDLINE_BULK:
+			options.options = talloc_realloc(ret, options.options,
+							 const char *, num_options+3);
+			if (options.options == NULL) {
+				fprintf(stderr, "Out of memory!\n");
+				goto failed;
+			}
+			options.options[num_options] = "bulk_load:1";
+			options.options[num_options+1] = NULL;
+			num_options++;
+			break;
+
 		case 'c': {
 			const char *cs = poptGetOptArg(pc);
 			const char *p;
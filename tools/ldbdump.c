@@ -87,7 +87,9 @@ static int traverse_fn(TDB_CONTEXT *tdb, TDB_DATA key, TDB_DATA _dbuf, void *sta
 
 	if (!show_index && ldb_dn_is_special(msg->dn)) {
 		const char *dn_lin = ldb_dn_get_linearized(msg->dn);
-		if ((strcmp(dn_lin, "@BASEINFO") == 0) || (strncmp(dn_lin, "@INDEX:", strlen("@INDEX:")) == 0)) {
+		if ((strcmp(dn_lin, "@BASEINFO") == 0) ||
+		    (strncmp(dn_lin, "@INDEX:", strlen("@INDEX:")) == 0) ||
+		    (strncmp(dn_lin, "@INDEXCHUNK:", strlen("@INDEXCHUNK:")) == 0)) {
 			/*
 			  the user has asked not to show index
 			  records. Also exclude BASEINFO as it